@@ -11,6 +11,9 @@
 #import <mach/vm_types.h>
 #import "SGIDyldImagesUtil.h"
 #import "SGIAPMAllocRecordReader.h"
+#import "sgi_allocate_event_buffer.h"
+#import "sgi_allocation_records.h"
+#import "sgi_allocate_logging.h"
 
 NS_ASSUME_NONNULL_BEGIN
 
@@ -23,6 +26,56 @@ NS_ASSUME_NONNULL_BEGIN
 
 + (BOOL)isRunning;
 
+/// record allocations through per-thread event buffers and a drainer thread, no shared lock on malloc/free.
+/// only works before `startPlugin`.
++ (void)setAsyncRecording:(BOOL)asyncRecording;
+
+/// store live allocations in a splay tree (default) or an open-addressing hash table.
+/// only works before `startPlugin`.
++ (void)setRecordsBackend:(sgi_allocation_records_backend)backend;
+
+/// record about one allocation per `bytes` allocated (poisson sampling), the reports are scaled back. 0 records every allocation.
+/// only works before `startPlugin`.
++ (void)setSampleInterval:(size_t)bytes;
+
+/// frames walked per allocation, hot frames included. default and at most 199.
+/// only works before `startPlugin`.
++ (void)setMaxStackDepth:(uint32_t)depth;
+
+/// hashing and probing of the backtrace uniquing table, default quadratic probing.
+/// only works before `startPlugin`.
++ (void)setUniquingTableProbing:(sgi_uniquing_table_probing)probing;
+
+/// store frames as offsets into the loaded images, distinct pcs never alias whatever their address.
+/// only works before `startPlugin`.
++ (void)setImageRelativeFrames:(BOOL)imageRelativeFrames;
+
+/// max app frames, system frames kept around them and recursion collapsing of the recorded stacks, default whole stacks.
+/// only works before `startPlugin`.
++ (void)setStackCapturePolicy:(sgi_stack_capture_policy)policy;
+
+/// enqueued/applied/dropped event counters of async recording
++ (sgi_allocate_event_buffer_stats)asyncRecordingStats;
+
+/// lookups/hits of the per-thread stack id caches
++ (sgi_stack_cache_stats)stackCacheStats;
+
+/// frees of untracked pointers rejected without locking, and the false positives of the address filter
++ (sgi_allocation_records_filter_stats)addressFilterStats;
+
+/// stacks shortened and frames saved by the stack capture policy
++ (sgi_stack_capture_stats)stackCaptureStats;
+
+/// load factor, probe lengths and insert failures of the backtrace uniquing table
++ (sgi_uniquing_table_stats)uniquingTableStats;
+
+/// live bytes and allocations by category (class name, vm tag), @{name : @{@"size", @"record_count"}}, uncategorized under @"".
+/// read from running totals, cheap enough to poll. unscaled when sampling.
++ (NSDictionary<NSString *, NSDictionary<NSString *, NSNumber *> *> *)categoryUsage;
+
+/// category names interned, and the ones left uncategorized because the category table is full
++ (sgi_category_table_stats)categoryTableStats;
+
 + (void)clearAllocMonitorMmapFileIfNeeded;
 
 + (SGIAPMAllocRecordReader *)createRecordReader;
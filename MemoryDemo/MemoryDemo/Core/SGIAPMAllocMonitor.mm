@@ -35,28 +35,12 @@ void sgi_set_last_allocation_event_name(void *ptr, const char *classname) {
         return;
     }
 
-    sgi_memory_allocate_logging_lock();
-    // find record and set category.
-    uint32_t idx = 0;
-    if (sgi_recording->malloc_records != nullptr)
-        idx = sgi_splay_tree_search(sgi_recording->malloc_records, (vm_address_t)ptr, false);
-
-    if (idx > 0) {
-        sgi_splay_tree_node *node = &sgi_recording->malloc_records->node[idx];
-        size_t size = SGI_ALLOCATIONS_SIZE(node->category_and_size);
-        node->category_and_size = SGI_ALLOCATIONS_CATEGORY_AND_SIZE((uint64_t)classname, size);
-    } else {
-        uint32_t vm_idx = 0;
-        if (sgi_recording->vm_records != nullptr)
-            vm_idx = sgi_splay_tree_search(sgi_recording->vm_records, (vm_address_t)ptr, false);
-
-        if (vm_idx > 0) {
-            sgi_splay_tree_node *node = &sgi_recording->vm_records->node[vm_idx];
-            size_t size = SGI_ALLOCATIONS_SIZE(node->category_and_size);
-            node->category_and_size = SGI_ALLOCATIONS_CATEGORY_AND_SIZE((uint64_t)classname, size);
-        }
+    if (sgi_allocations_async_recording) {
+        sgi_enqueue_allocation_category((vm_address_t)ptr, classname);
+        return;
     }
-    sgi_memory_allocate_logging_unlock();
+
+    sgi_set_allocation_category((vm_address_t)ptr, classname);
 }
 
 void sgi_cfobject_alloc_set_last_alloc_event_name_function(void *ptr, const char *classname) {
@@ -67,6 +51,16 @@ void sgi_cfobject_alloc_set_last_alloc_event_name_function(void *ptr, const char
     sgi_set_last_allocation_event_name(ptr, classname);
 }
 
+// MARK: category usage
+static void sgi_add_category_usage(const char *name, uint64_t size, uint32_t count, void *context) {
+    NSMutableDictionary *usage = (__bridge NSMutableDictionary *)context;
+    NSString *key = name ? [NSString stringWithUTF8String:name] : @"";
+    if (key == nil) {
+        return;
+    }
+    usage[key] = @{@"size" : @(size), @"record_count" : @(count)};
+}
+
 // MARK: -
 
 @interface SGIAPMAllocMonitor ()
@@ -141,6 +135,111 @@ static SGIAPMAllocMonitor *g_monitor = nil;
     return [g_monitor isLoggingOn];
 }
 
++ (void)setAsyncRecording:(BOOL)asyncRecording
+{
+    if ([self isRunning]) {
+        return;
+    }
+    sgi_allocations_async_recording = asyncRecording;
+}
+
++ (void)setRecordsBackend:(sgi_allocation_records_backend)backend
+{
+    if ([self isRunning]) {
+        return;
+    }
+    sgi_allocations_records_backend = backend;
+}
+
++ (void)setSampleInterval:(size_t)bytes
+{
+    if ([self isRunning]) {
+        return;
+    }
+    sgi_allocations_sample_interval = bytes;
+}
+
++ (void)setMaxStackDepth:(uint32_t)depth
+{
+    if ([self isRunning]) {
+        return;
+    }
+    sgi_allocations_max_stack_depth = depth;
+}
+
++ (void)setUniquingTableProbing:(sgi_uniquing_table_probing)probing
+{
+    if ([self isRunning]) {
+        return;
+    }
+    sgi_allocations_uniquing_table_probing = probing;
+}
+
++ (void)setImageRelativeFrames:(BOOL)imageRelativeFrames
+{
+    if ([self isRunning]) {
+        return;
+    }
+    sgi_allocations_image_relative_frames = imageRelativeFrames;
+}
+
++ (void)setStackCapturePolicy:(sgi_stack_capture_policy)policy
+{
+    if ([self isRunning]) {
+        return;
+    }
+    sgi_allocations_stack_capture_policy = policy;
+}
+
++ (sgi_allocate_event_buffer_stats)asyncRecordingStats
+{
+    sgi_allocate_event_buffer_stats stats;
+    sgi_allocate_event_buffer_get_stats(&stats);
+    return stats;
+}
+
++ (sgi_stack_cache_stats)stackCacheStats
+{
+    sgi_stack_cache_stats stats;
+    sgi_get_stack_cache_stats(&stats);
+    return stats;
+}
+
++ (sgi_allocation_records_filter_stats)addressFilterStats
+{
+    sgi_allocation_records_filter_stats stats;
+    sgi_get_allocations_filter_stats(&stats);
+    return stats;
+}
+
++ (sgi_stack_capture_stats)stackCaptureStats
+{
+    sgi_stack_capture_stats stats;
+    sgi_get_stack_capture_stats(&stats);
+    return stats;
+}
+
++ (sgi_uniquing_table_stats)uniquingTableStats
+{
+    sgi_uniquing_table_stats stats;
+    sgi_get_uniquing_table_stats(&stats);
+    return stats;
+}
+
++ (NSDictionary<NSString *, NSDictionary<NSString *, NSNumber *> *> *)categoryUsage
+{
+    NSMutableDictionary *usage = [NSMutableDictionary dictionary];
+    sgi_enumerate_category_usage(sgi_add_category_usage, (__bridge void *)usage);
+    return usage;
+}
+
++ (sgi_category_table_stats)categoryTableStats
+{
+    sgi_category_table_stats stats;
+    sgi_get_category_table_stats(&stats);
+    return stats;
+}
+
 + (SGIAPMAllocRecordReader *)createRecordReader
 {
 //    if ([self isRunning] == NO) {
@@ -0,0 +1,40 @@
+//
+// sgi_address_filter.h
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+
+#ifndef sgi_address_filter_h
+#define sgi_address_filter_h
+
+#include <mach/mach.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Counting blocked bloom filter of addresses, lock free.
+
+ Each address hashes to one 64-byte block (a cache line) and to 3 byte counters inside it. A counter saturates at 255
+ and then never goes down, so the filter may only answer "maybe" too often, never "no" for an added address.
+ Every `remove` must match an earlier `add` of the same address.
+ */
+typedef struct _sgi_address_filter sgi_address_filter;
+
+sgi_address_filter *sgi_address_filter_create(size_t expected_count);
+void sgi_address_filter_destroy(sgi_address_filter *filter);
+
+void sgi_address_filter_add(sgi_address_filter *filter, vm_address_t addr);
+void sgi_address_filter_remove(sgi_address_filter *filter, vm_address_t addr);
+bool sgi_address_filter_may_contain(sgi_address_filter *filter, vm_address_t addr); /**< false: definitely never added */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* sgi_address_filter_h */
@@ -0,0 +1,103 @@
+//
+// sgi_address_filter.mm
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+
+#import "sgi_address_filter.h"
+#import "sgi_inner_allocate.h"
+#import "SGIAPMCommonDef.h"
+
+#define SGI_ADDRESS_FILTER_BLOCK_SIZE 64          // counters per block, one cache line
+#define SGI_ADDRESS_FILTER_COUNTERS_PER_ADDRESS 8 // counters per expected address, a few percent false positive with 3 hashes
+#define SGI_ADDRESS_FILTER_HASH_COUNT 3
+#define SGI_ADDRESS_FILTER_SATURATED 0xFF
+
+struct _sgi_address_filter {
+    uint64_t block_mask;
+    size_t memory_size;
+    uint8_t *counters;
+};
+
+static inline uint64_t sgi_address_filter_hash(vm_address_t addr) {
+    // murmur3 fmix64, independent from the fibonacci hashing used to pick the records shard.
+    uint64_t h = (uint64_t)addr >> 4;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+// 6 bits of the hash per counter, the rest picks the block.
+static inline void sgi_address_filter_counters(sgi_address_filter *filter, vm_address_t addr, uint8_t *counters[SGI_ADDRESS_FILTER_HASH_COUNT]) {
+    uint64_t hash = sgi_address_filter_hash(addr);
+    uint8_t *block = filter->counters + ((hash >> 18) & filter->block_mask) * SGI_ADDRESS_FILTER_BLOCK_SIZE;
+    for (uint32_t i = 0; i < SGI_ADDRESS_FILTER_HASH_COUNT; i++) {
+        counters[i] = &block[(hash >> (i * 6)) & (SGI_ADDRESS_FILTER_BLOCK_SIZE - 1)];
+    }
+}
+
+sgi_address_filter *sgi_address_filter_create(size_t expected_count) {
+    size_t block_count = 1;
+    while (block_count * SGI_ADDRESS_FILTER_BLOCK_SIZE < expected_count * SGI_ADDRESS_FILTER_COUNTERS_PER_ADDRESS) {
+        block_count <<= 1;
+    }
+
+    size_t memory_size = round_page(sizeof(sgi_address_filter) + block_count * SGI_ADDRESS_FILTER_BLOCK_SIZE + SGI_ADDRESS_FILTER_BLOCK_SIZE);
+    sgi_address_filter *filter = (sgi_address_filter *)sgi_allocate_page(memory_size);
+    if (filter == NULL) {
+        SGIAPMMallocLog("[APM][Alloc] fail to allocate address filter.\n");
+        return NULL;
+    }
+
+    // pages are zero filled, counters start after the header on a cache line.
+    filter->block_mask = block_count - 1;
+    filter->memory_size = memory_size;
+    filter->counters = (uint8_t *)(((uintptr_t)(filter + 1) + SGI_ADDRESS_FILTER_BLOCK_SIZE - 1) & ~(uintptr_t)(SGI_ADDRESS_FILTER_BLOCK_SIZE - 1));
+    return filter;
+}
+
+void sgi_address_filter_destroy(sgi_address_filter *filter) {
+    if (filter) {
+        sgi_deallocate_pages(filter, filter->memory_size);
+    }
+}
+
+void sgi_address_filter_add(sgi_address_filter *filter, vm_address_t addr) {
+    uint8_t *counters[SGI_ADDRESS_FILTER_HASH_COUNT];
+    sgi_address_filter_counters(filter, addr, counters);
+    for (uint32_t i = 0; i < SGI_ADDRESS_FILTER_HASH_COUNT; i++) {
+        uint8_t value = __atomic_load_n(counters[i], __ATOMIC_RELAXED);
+        while (value != SGI_ADDRESS_FILTER_SATURATED &&
+               !__atomic_compare_exchange_n(counters[i], &value, (uint8_t)(value + 1), true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+}
+
+void sgi_address_filter_remove(sgi_address_filter *filter, vm_address_t addr) {
+    uint8_t *counters[SGI_ADDRESS_FILTER_HASH_COUNT];
+    sgi_address_filter_counters(filter, addr, counters);
+    for (uint32_t i = 0; i < SGI_ADDRESS_FILTER_HASH_COUNT; i++) {
+        uint8_t value = __atomic_load_n(counters[i], __ATOMIC_RELAXED);
+        // a saturated counter lost its count, keep it.
+        while (value != SGI_ADDRESS_FILTER_SATURATED && value != 0 &&
+               !__atomic_compare_exchange_n(counters[i], &value, (uint8_t)(value - 1), true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+}
+
+bool sgi_address_filter_may_contain(sgi_address_filter *filter, vm_address_t addr) {
+    uint8_t *counters[SGI_ADDRESS_FILTER_HASH_COUNT];
+    sgi_address_filter_counters(filter, addr, counters);
+    for (uint32_t i = 0; i < SGI_ADDRESS_FILTER_HASH_COUNT; i++) {
+        if (__atomic_load_n(counters[i], __ATOMIC_ACQUIRE) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
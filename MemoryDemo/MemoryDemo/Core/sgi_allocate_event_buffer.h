@@ -0,0 +1,88 @@
+//
+// sgi_allocate_event_buffer.h
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+
+#ifndef sgi_allocate_event_buffer_h
+#define sgi_allocate_event_buffer_h
+
+#include <mach/mach.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SGI_ALLOCATIONS_EVENT_BUFFER_DEFAULT_SIZE (128 * 1024) // bytes of ring buffer per thread
+
+/*
+ Per-thread allocation event buffers.
+
+ Every thread owns a single-producer/single-consumer ring. The hot path appends a compact event (header + trimmed
+ frames) without taking any shared lock, the drainer pulls events from all rings in global sequence order and applies
+ them to the records while holding the logging lock.
+
+ Loss policy: when a ring is full the newest event is dropped and counted, the producer never blocks. A quarter of the
+ ring is kept for deallocations, allocations and categories are dropped before it: a dropped free would leave its record
+ live for the rest of the session, a dropped allocation is only missing from the records.
+ */
+
+// event header, `frames_count` frames (vm_address_t) follow it in the ring.
+typedef struct {
+    uint64_t seq;          /**< global order of the event, 0 is reserved for the ring padding */
+    uint32_t type_flags;   /**< sgi_allocations_type_xxx, sgi_allocations_type_generic for category events */
+    uint32_t frames_count; /**< count of the frames following the header */
+    uint64_t ptr;          /**< allocated / deallocated pointer */
+    uint64_t size;         /**< allocate size, or the category name pointer for category events */
+} sgi_allocate_event;
+
+_Static_assert(sizeof(sgi_allocate_event) == 32, "sgi_allocate_event must be 32 bytes");
+
+typedef struct {
+    uint64_t buffer_count;         /**< rings created so far */
+    uint64_t enqueued_events;      /**< events appended to the rings */
+    uint64_t applied_events;       /**< events applied by the drainer */
+    uint64_t dropped_alloc_events; /**< allocations lost because the ring was full */
+    uint64_t dropped_free_events;  /**< deallocations lost because the ring was full */
+    uint64_t dropped_other_events; /**< category events lost because the ring was full or the thread had no ring */
+} sgi_allocate_event_buffer_stats;
+
+typedef struct _sgi_allocate_event_buffer sgi_allocate_event_buffer;
+
+typedef void (*sgi_allocate_event_apply_fn)(const sgi_allocate_event *event, vm_address_t *frames);
+
+boolean_t sgi_allocate_event_buffer_setup(size_t buffer_size); /**< create the tsd key, reset existing rings */
+
+void sgi_allocate_event_buffer_ignore_current_thread(void); /**< events from the current thread will be dropped silently (the drainer) */
+
+/*
+ Producer side, only for the current thread.
+ `begin` returns NULL if the thread is already producing (reentrant malloc) or has no ring.
+ */
+sgi_allocate_event_buffer *sgi_allocate_event_buffer_begin(void);
+vm_address_t *sgi_allocate_event_buffer_scratch_frames(sgi_allocate_event_buffer *buffer); /**< SGI_ALLOCATIONS_MAX_STACK_SIZE frames */
+bool sgi_allocate_event_buffer_append(sgi_allocate_event_buffer *buffer, uint32_t type_flags, uint64_t ptr, uint64_t size, vm_address_t *frames, uint32_t frames_count);
+void sgi_allocate_event_buffer_end(sgi_allocate_event_buffer *buffer);
+void sgi_allocate_event_buffer_drop_other_event(void); /**< counts a category event not appended because `begin` returned NULL */
+
+/*
+ Consumer side, callers must serialize the draining (the logging lock).
+ Applies up to `max_events` events in global order, returns the count of applied events.
+ */
+size_t sgi_allocate_event_buffer_drain(size_t max_events, sgi_allocate_event_apply_fn apply);
+
+bool sgi_allocate_event_buffer_wait(uint32_t timeout_in_ms); /**< block the drainer until a ring is half full or timeout */
+void sgi_allocate_event_buffer_wakeup(void);
+
+void sgi_allocate_event_buffer_get_stats(sgi_allocate_event_buffer_stats *out_stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* sgi_allocate_event_buffer_h */
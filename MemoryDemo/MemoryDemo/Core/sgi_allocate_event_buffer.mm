@@ -0,0 +1,371 @@
+//
+// sgi_allocate_event_buffer.mm
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+
+#include "sgi_allocate_event_buffer.h"
+
+#include <atomic>
+#include <mach/mach.h>
+#include <pthread.h>
+#include <string.h>
+
+#import "SGIAPMCommonDef.h"
+
+#include "sgi_allocate_logging.h"
+#include "sgi_inner_allocate.h"
+
+// MARK: - Constants/Globals
+
+#define SGI_EVENT_HEADER_WORDS (sizeof(sgi_allocate_event) / sizeof(uint64_t))
+#define SGI_EVENT_FREE_RESERVE_WORDS(capacity) ((capacity) / 4) // only frees are appended past capacity - reserve
+
+// tsd values which are not a ring
+#define SGI_EVENT_BUFFER_IGNORED ((void *)1) // drainer, or the thread is creating its ring right now
+
+struct _sgi_allocate_event_buffer {
+    std::atomic<uint64_t> head;            // words published, only written by the owner thread
+    std::atomic<uint64_t> tail;            // words consumed, only written by the drainer
+    std::atomic<uint64_t> producing_floor; // 0 when idle, otherwise a lower bound of the seq being produced
+    std::atomic<bool> in_use;              // owned by a living thread
+    std::atomic<bool> owner_exited;        // owner thread exited, reusable once drained
+
+    std::atomic<uint64_t> enqueued_events;
+    std::atomic<uint64_t> dropped_alloc_events;
+    std::atomic<uint64_t> dropped_free_events;
+    std::atomic<uint64_t> dropped_other_events;
+
+    struct _sgi_allocate_event_buffer *next;
+    uint64_t capacity; // words, power of 2
+    uint64_t *ring;
+    size_t vm_size;
+    vm_address_t scratch[SGI_ALLOCATIONS_MAX_STACK_SIZE];
+};
+
+static pthread_key_t event_buffer_key;
+static bool event_buffer_key_created = false;
+static uint64_t event_buffer_capacity = SGI_ALLOCATIONS_EVENT_BUFFER_DEFAULT_SIZE / sizeof(uint64_t);
+
+static std::atomic<sgi_allocate_event_buffer *> event_buffers(nullptr); // never freed, reused after owner exited
+static std::atomic<uint64_t> event_seq(1);
+static std::atomic<uint64_t> event_buffer_count(0);
+static std::atomic<uint64_t> applied_events(0);
+static std::atomic<uint64_t> dropped_other_events_without_buffer(0); // `begin` returned NULL, no ring to count them in
+
+static semaphore_t drainer_semaphore = 0;
+
+// MARK: - Ring management
+
+static void sgi_allocate_event_buffer_thread_exit(void *value) {
+    if (value == NULL || value == SGI_EVENT_BUFFER_IGNORED) {
+        return;
+    }
+    sgi_allocate_event_buffer *buffer = (sgi_allocate_event_buffer *)value;
+    buffer->owner_exited.store(true, std::memory_order_release);
+}
+
+static uint64_t sgi_round_up_to_power_of_2(uint64_t value) {
+    uint64_t result = 1;
+    while (result < value) {
+        result <<= 1;
+    }
+    return result;
+}
+
+static void sgi_reset_event_buffer(sgi_allocate_event_buffer *buffer) {
+    buffer->head.store(0, std::memory_order_relaxed);
+    buffer->tail.store(0, std::memory_order_relaxed);
+    buffer->producing_floor.store(0, std::memory_order_relaxed);
+    buffer->enqueued_events.store(0, std::memory_order_relaxed);
+    buffer->dropped_alloc_events.store(0, std::memory_order_relaxed);
+    buffer->dropped_free_events.store(0, std::memory_order_relaxed);
+    buffer->dropped_other_events.store(0, std::memory_order_relaxed);
+}
+
+static sgi_allocate_event_buffer *sgi_reuse_event_buffer(void) {
+    for (sgi_allocate_event_buffer *buffer = event_buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next) {
+        bool expected = false;
+        if (buffer->in_use.compare_exchange_strong(expected, true)) {
+            buffer->owner_exited.store(false, std::memory_order_relaxed);
+            return buffer;
+        }
+    }
+    return NULL;
+}
+
+static sgi_allocate_event_buffer *sgi_create_event_buffer(void) {
+    size_t vm_size = round_page(sizeof(sgi_allocate_event_buffer) + event_buffer_capacity * sizeof(uint64_t));
+    void *ptr = sgi_allocate_page(vm_size);
+    if (ptr == NULL) {
+        return NULL;
+    }
+
+    // vm_allocate returns zero-filled pages, all the atomics start from 0/false.
+    sgi_allocate_event_buffer *buffer = (sgi_allocate_event_buffer *)ptr;
+    buffer->capacity = event_buffer_capacity;
+    buffer->ring = (uint64_t *)((char *)ptr + sizeof(sgi_allocate_event_buffer));
+    buffer->vm_size = vm_size;
+    buffer->in_use.store(true, std::memory_order_relaxed);
+
+    sgi_allocate_event_buffer *head = event_buffers.load(std::memory_order_relaxed);
+    do {
+        buffer->next = head;
+    } while (!event_buffers.compare_exchange_weak(head, buffer, std::memory_order_release, std::memory_order_relaxed));
+
+    event_buffer_count.fetch_add(1, std::memory_order_relaxed);
+    return buffer;
+}
+
+static sgi_allocate_event_buffer *sgi_current_event_buffer(void) {
+    void *value = pthread_getspecific(event_buffer_key);
+    if (value == SGI_EVENT_BUFFER_IGNORED) {
+        return NULL;
+    }
+    if (value != NULL) {
+        return (sgi_allocate_event_buffer *)value;
+    }
+
+    // vm_allocate below calls back into the logger, mark the thread before that.
+    pthread_setspecific(event_buffer_key, SGI_EVENT_BUFFER_IGNORED);
+
+    sgi_allocate_event_buffer *buffer = sgi_reuse_event_buffer();
+    if (buffer == NULL) {
+        buffer = sgi_create_event_buffer();
+    }
+    if (buffer == NULL) {
+        SGIAPMMallocLog("[APM][Alloc] fail to create event buffer.\n");
+        return NULL; // keep ignored, no retry for this thread
+    }
+
+    pthread_setspecific(event_buffer_key, buffer);
+    return buffer;
+}
+
+// MARK: - Public
+
+boolean_t sgi_allocate_event_buffer_setup(size_t buffer_size) {
+    if (!event_buffer_key_created) {
+        if (pthread_key_create(&event_buffer_key, sgi_allocate_event_buffer_thread_exit) != 0) {
+            SGIAPMMallocLog("[APM][Alloc] fail to create event buffer key.\n");
+            return false;
+        }
+        event_buffer_key_created = true;
+    }
+
+    if (drainer_semaphore == 0) {
+        if (semaphore_create(mach_task_self(), &drainer_semaphore, SYNC_POLICY_FIFO, 0) != KERN_SUCCESS) {
+            SGIAPMMallocLog("[APM][Alloc] fail to create drainer semaphore.\n");
+            drainer_semaphore = 0;
+            return false;
+        }
+    }
+
+    // the rings are reused across sessions, the size only takes effect before the first ring is created.
+    if (event_buffers.load(std::memory_order_acquire) == NULL) {
+        uint64_t capacity = sgi_round_up_to_power_of_2(buffer_size / sizeof(uint64_t));
+        if (capacity < 4 * (SGI_EVENT_HEADER_WORDS + SGI_ALLOCATIONS_MAX_STACK_SIZE)) {
+            capacity = sgi_round_up_to_power_of_2(4 * (SGI_EVENT_HEADER_WORDS + SGI_ALLOCATIONS_MAX_STACK_SIZE));
+        }
+        event_buffer_capacity = capacity;
+    }
+
+    // events left by the previous session are meaningless for the new records.
+    for (sgi_allocate_event_buffer *buffer = event_buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next) {
+        sgi_reset_event_buffer(buffer);
+    }
+    applied_events.store(0, std::memory_order_relaxed);
+    dropped_other_events_without_buffer.store(0, std::memory_order_relaxed);
+    return true;
+}
+
+void sgi_allocate_event_buffer_ignore_current_thread(void) {
+    if (event_buffer_key_created) {
+        pthread_setspecific(event_buffer_key, SGI_EVENT_BUFFER_IGNORED);
+    }
+}
+
+sgi_allocate_event_buffer *sgi_allocate_event_buffer_begin(void) {
+    if (!event_buffer_key_created) {
+        return NULL;
+    }
+
+    sgi_allocate_event_buffer *buffer = sgi_current_event_buffer();
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    if (buffer->producing_floor.load(std::memory_order_relaxed) != 0) {
+        return NULL; // malloc inside the logger on this thread
+    }
+
+    // The drainer never applies an event whose seq is not smaller than any floor of the producing threads,
+    // so events are applied in seq order even if a producer is preempted between taking a seq and publishing it.
+    buffer->producing_floor.store(event_seq.load());
+    return buffer;
+}
+
+void sgi_allocate_event_buffer_drop_other_event(void) {
+    dropped_other_events_without_buffer.fetch_add(1, std::memory_order_relaxed);
+}
+
+vm_address_t *sgi_allocate_event_buffer_scratch_frames(sgi_allocate_event_buffer *buffer) {
+    return buffer->scratch;
+}
+
+bool sgi_allocate_event_buffer_append(sgi_allocate_event_buffer *buffer, uint32_t type_flags, uint64_t ptr, uint64_t size, vm_address_t *frames, uint32_t frames_count) {
+    uint64_t capacity = buffer->capacity;
+    uint64_t words = SGI_EVENT_HEADER_WORDS + frames_count;
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    uint64_t tail = buffer->tail.load(std::memory_order_acquire);
+    uint64_t pos = head & (capacity - 1);
+    uint64_t padding = (capacity - pos < words) ? capacity - pos : 0; // an event never wraps around
+
+    // a lost free would leave its record live for good, only frees take the reserved part of the ring.
+    bool is_free = (type_flags & (sgi_allocations_type_dealloc | sgi_allocations_type_vm_deallocate)) != 0;
+    uint64_t limit = is_free ? capacity : capacity - SGI_EVENT_FREE_RESERVE_WORDS(capacity);
+    if (head - tail + padding + words > limit) {
+        if (type_flags & (sgi_allocations_type_alloc | sgi_allocations_type_vm_allocate)) {
+            buffer->dropped_alloc_events.fetch_add(1, std::memory_order_relaxed);
+        } else if (is_free) {
+            buffer->dropped_free_events.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            buffer->dropped_other_events.fetch_add(1, std::memory_order_relaxed);
+        }
+        sgi_allocate_event_buffer_wakeup();
+        return false;
+    }
+
+    uint64_t seq = event_seq.fetch_add(1);
+
+    if (padding > 0) {
+        buffer->ring[pos] = 0; // seq 0, the drainer skips to the beginning of the ring
+        head += padding;
+        pos = 0;
+    }
+
+    sgi_allocate_event *event = (sgi_allocate_event *)(buffer->ring + pos);
+    event->seq = seq;
+    event->type_flags = type_flags;
+    event->frames_count = frames_count;
+    event->ptr = ptr;
+    event->size = size;
+    if (frames_count > 0) {
+        memcpy(buffer->ring + pos + SGI_EVENT_HEADER_WORDS, frames, frames_count * sizeof(vm_address_t));
+    }
+
+    buffer->head.store(head + words, std::memory_order_release);
+    buffer->enqueued_events.fetch_add(1, std::memory_order_relaxed);
+
+    // wake up the drainer once when crossing the half of the ring
+    uint64_t used = head + words - tail;
+    if (used >= capacity / 2 && used - words - padding < capacity / 2) {
+        sgi_allocate_event_buffer_wakeup();
+    }
+    return true;
+}
+
+void sgi_allocate_event_buffer_end(sgi_allocate_event_buffer *buffer) {
+    buffer->producing_floor.store(0, std::memory_order_release);
+}
+
+size_t sgi_allocate_event_buffer_drain(size_t max_events, sgi_allocate_event_apply_fn apply) {
+    // only events taken before this point and not being produced are safe to apply.
+    uint64_t horizon = event_seq.load();
+    for (sgi_allocate_event_buffer *buffer = event_buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next) {
+        uint64_t floor = buffer->producing_floor.load();
+        if (floor != 0 && floor < horizon) {
+            horizon = floor;
+        }
+    }
+
+    size_t applied = 0;
+    while (applied < max_events) {
+        sgi_allocate_event_buffer *best = NULL;
+        sgi_allocate_event *best_event = NULL;
+        uint64_t best_seq = horizon;
+
+        // k-way merge of the rings, the count of threads is small.
+        for (sgi_allocate_event_buffer *buffer = event_buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next) {
+            uint64_t tail = buffer->tail.load(std::memory_order_relaxed);
+            uint64_t head = buffer->head.load(std::memory_order_acquire);
+            if (tail == head) {
+                continue;
+            }
+
+            uint64_t pos = tail & (buffer->capacity - 1);
+            if (buffer->ring[pos] == 0) {
+                // padding, skip to the beginning of the ring
+                tail += buffer->capacity - pos;
+                buffer->tail.store(tail, std::memory_order_release);
+                if (tail == head) {
+                    continue;
+                }
+                pos = 0;
+            }
+
+            sgi_allocate_event *event = (sgi_allocate_event *)(buffer->ring + pos);
+            if (event->seq < best_seq) {
+                best = buffer;
+                best_event = event;
+                best_seq = event->seq;
+            }
+        }
+
+        if (best == NULL) {
+            break;
+        }
+
+        apply(best_event, (vm_address_t *)((uint64_t *)best_event + SGI_EVENT_HEADER_WORDS));
+
+        uint64_t tail = best->tail.load(std::memory_order_relaxed);
+        best->tail.store(tail + SGI_EVENT_HEADER_WORDS + best_event->frames_count, std::memory_order_release);
+        applied++;
+    }
+
+    // recycle the rings of exited threads once they are empty
+    for (sgi_allocate_event_buffer *buffer = event_buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next) {
+        if (buffer->owner_exited.load(std::memory_order_acquire) &&
+            buffer->tail.load(std::memory_order_relaxed) == buffer->head.load(std::memory_order_acquire)) {
+            buffer->owner_exited.store(false, std::memory_order_relaxed);
+            buffer->in_use.store(false, std::memory_order_release);
+        }
+    }
+
+    applied_events.fetch_add(applied, std::memory_order_relaxed);
+    return applied;
+}
+
+bool sgi_allocate_event_buffer_wait(uint32_t timeout_in_ms) {
+    if (drainer_semaphore == 0) {
+        return false;
+    }
+    mach_timespec_t timeout = {(unsigned int)(timeout_in_ms / 1000), (clock_res_t)((timeout_in_ms % 1000) * NSEC_PER_MSEC)};
+    return semaphore_timedwait(drainer_semaphore, timeout) == KERN_SUCCESS;
+}
+
+void sgi_allocate_event_buffer_wakeup(void) {
+    if (drainer_semaphore != 0) {
+        semaphore_signal(drainer_semaphore);
+    }
+}
+
+void sgi_allocate_event_buffer_get_stats(sgi_allocate_event_buffer_stats *out_stats) {
+    if (out_stats == NULL) {
+        return;
+    }
+
+    memset(out_stats, 0, sizeof(sgi_allocate_event_buffer_stats));
+    out_stats->buffer_count = event_buffer_count.load(std::memory_order_relaxed);
+    out_stats->applied_events = applied_events.load(std::memory_order_relaxed);
+    out_stats->dropped_other_events = dropped_other_events_without_buffer.load(std::memory_order_relaxed);
+    for (sgi_allocate_event_buffer *buffer = event_buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next) {
+        out_stats->enqueued_events += buffer->enqueued_events.load(std::memory_order_relaxed);
+        out_stats->dropped_alloc_events += buffer->dropped_alloc_events.load(std::memory_order_relaxed);
+        out_stats->dropped_free_events += buffer->dropped_free_events.load(std::memory_order_relaxed);
+        out_stats->dropped_other_events += buffer->dropped_other_events.load(std::memory_order_relaxed);
+    }
+}
@@ -15,6 +15,8 @@
 #include <stdio.h>
 #include <sys/syslimits.h>
 
+#include "sgi_allocate_event_buffer.h"
+#include "sgi_allocation_records.h"
 #include "sgi_backtrace_uniquing_table.h"
 #include "sgi_splay_tree.h"
 
@@ -22,6 +24,16 @@
 
 
 #define SGI_ALLOCATIONS_MAX_STACK_SIZE 200
+#define SGI_ALLOCATIONS_MAX_RECURSION_PERIOD 16 // longest frame sequence the capture policy collapses
+#define SGI_ALLOCATIONS_MAX_CATEGORY_COUNT 12288 // distinct category names (class names, vm tags) interned, later ones are left uncategorized
+
+// a collapsed recursion: the `period` frames above it (hotter) were repeated `count` times back to back.
+// code is never mapped in the first 4GB (__PAGEZERO), such a frame can't be a pc.
+#define SGI_ALLOCATIONS_RECURSION_FRAME_TAG 0x7ECF0000ull
+#define SGI_ALLOCATIONS_RECURSION_FRAME(period, count) ((vm_address_t)(SGI_ALLOCATIONS_RECURSION_FRAME_TAG | ((period) << 8) | (count)))
+#define SGI_ALLOCATIONS_IS_RECURSION_FRAME(frame) (((frame) & ~(vm_address_t)0xFFFF) == SGI_ALLOCATIONS_RECURSION_FRAME_TAG)
+#define SGI_ALLOCATIONS_RECURSION_FRAME_PERIOD(frame) ((uint32_t)(((frame) >> 8) & 0xFF))
+#define SGI_ALLOCATIONS_RECURSION_FRAME_COUNT(frame) ((uint32_t)((frame) & 0xFF))
 
 #define sgi_allocations_type_free 0
 #define sgi_allocations_type_generic 1        /* anything that is not allocation/deallocation */
@@ -52,6 +64,7 @@ extern char sgi_records_cache_dir[PATH_MAX];    /**< the directory to cache all
 extern const char *sgi_malloc_records_filename; /**< the heap records filename */
 extern const char *sgi_vm_records_filename;     /**< the vm records filename */
 extern const char *sgi_stacks_records_filename; /**< the backtrace records filename */
+extern const char *sgi_category_strings_filename; /**< the category names of the records, by id (sgi_category_strings) */
 
 
 // MARK: - Allocations Logging
@@ -60,18 +73,40 @@ extern boolean_t sgi_memory_allocate_logging_enabled; /* when clear, no logging
 
 extern boolean_t sgi_allocations_need_sys_frame;        /**< record system libraries frames when record backtrace, default false*/
 
-// for storing/looking up allocations that haven't yet be written to disk; consistent size across 32/64-bit processes.
-// It's important that these fields don't change alignment due to the architecture because they may be accessed from an
-// analyzing process with a different arch - hence the pragmas.
-#pragma pack(push, 4)
+extern boolean_t sgi_allocations_async_recording; /**< append events to per-thread buffers and apply them on a drainer thread, default false. should be set before start. */
+
+extern sgi_allocation_records_backend sgi_allocations_records_backend; /**< store of live allocations, default sgi_allocation_records_backend_splay_tree. should be set before start. */
+
+extern size_t sgi_allocations_sample_interval; /**< mean bytes between sampled allocations (poisson), only sampled allocations are recorded. default 0 records every allocation. should be set before start. */
+
+extern uint32_t sgi_allocations_max_stack_depth; /**< frames walked per allocation (hot frames included), at most and default SGI_ALLOCATIONS_MAX_STACK_SIZE - 1 */
+
+extern boolean_t sgi_allocations_stack_cache; /**< per-thread cache of recent stack ids, a repeated stack skips the uniquing table, default true. should be set before start. */
+
+extern sgi_uniquing_table_probing sgi_allocations_uniquing_table_probing; /**< hashing and probing of the backtrace uniquing table, default sgi_uniquing_table_probing_quadratic. should be set before start. */
+
+extern boolean_t sgi_allocations_image_relative_frames; /**< store frames as offsets into the images of `sgi_current_dyld_image_info` instead of truncated addresses, default false. should be set before start. */
+
+typedef struct {
+    uint32_t max_app_frames;            /**< app frames kept, the hottest ones. 0 keeps all */
+    uint32_t max_sys_frames_around_app; /**< system frames kept on either side of the kept app frames, only matters with `sgi_allocations_need_sys_frame`. 0 keeps all */
+    uint32_t max_recursion_period;      /**< frame sequences up to this long (at most SGI_ALLOCATIONS_MAX_RECURSION_PERIOD) repeated back to back are kept once, followed by a SGI_ALLOCATIONS_RECURSION_FRAME. 0 keeps recursion as is */
+} sgi_stack_capture_policy;
+
+extern sgi_stack_capture_policy sgi_allocations_stack_capture_policy; /**< applied to every trimmed stack before it's entered into the uniquing table, default all 0 (whole stacks). should be set before start. */
+
+extern size_t sgi_allocations_event_buffer_size; /**< bytes of the per-thread event buffer in async recording, default SGI_ALLOCATIONS_EVENT_BUFFER_DEFAULT_SIZE */
+
+// for storing/looking up allocations that haven't yet be written to disk. not packed: `backtrace_records` is loaded
+// and stored atomically by the lock free inserters, it must be naturally aligned.
 typedef struct {
-    sgi_splay_tree *malloc_records = NULL;                  /**< store Heap memory allocations info, each item contains ptr,size,stackid */
-    sgi_splay_tree *vm_records = NULL;                      /**< store other vm memory allocations info, each item contains ptr,size,stackid */
+    sgi_allocation_records *malloc_records = NULL;          /**< store Heap memory allocations info, each item contains ptr,size,stackid */
+    sgi_allocation_records *vm_records = NULL;              /**< store other vm memory allocations info, each item contains ptr,size,stackid */
     sgi_backtrace_uniquing_table *backtrace_records = NULL; /**< store the stacks when allocate memory */
+    sgi_category_strings *category_strings = NULL;          /**< store the category names of the malloc/vm records, by id */
 } sgi_allocations_record_raw;
-#pragma pack(pop)
 
-extern sgi_allocations_record_raw *sgi_recording; /**< single-thread access variables */
+extern sgi_allocations_record_raw *sgi_recording; /**< set under the logging lock, load it with `__atomic_load_n(ACQUIRE)` without the lock */
 
 boolean_t sgi_prepare_memory_allocate_logging(void); /**< prepare logging before start */
 
@@ -80,10 +115,77 @@ void sgi_clear_memory_allocate_logging(void);  /**< clear loggin after stop*/
 /*
  when operating `sgi_recording`, you should make sure it's thread safe.
  use locking method below to keep it safe.
+ the allocation records have their own shard locks, freezing them also needs `sgi_allocation_records_lock_all`.
  */
 void sgi_memory_allocate_logging_lock(void);
 void sgi_memory_allocate_logging_unlock(void);
 
+/*
+ async recording only, apply all the pending events of the per-thread buffers to `sgi_recording`.
+ should be called without holding the logging lock.
+ */
+void sgi_drain_memory_allocate_events(void);
+
+/*
+ allocations of the current thread are not recorded until `end`, e.g. a report reading a records snapshot while the
+ logging goes on, or holding the shard locks to take it. not nested, and drains nothing in between.
+ */
+void sgi_memory_allocate_logging_ignore_current_thread_begin(void);
+void sgi_memory_allocate_logging_ignore_current_thread_end(void);
+
+/*
+ attach the category (class name) to the record of `ptr`.
+ `sgi_set_allocation_category` only locks the records shard of `ptr`, `sgi_enqueue_allocation_category` keeps the order
+ with the allocation events of async recording.
+ */
+void sgi_set_allocation_category(vm_address_t ptr, const char *category);
+void sgi_enqueue_allocation_category(vm_address_t ptr, const char *category);
+
+typedef struct {
+    uint64_t lookups; /**< stacks looked up in the per-thread caches */
+    uint64_t hits;    /**< stack ids returned without the uniquing table */
+} sgi_stack_cache_stats;
+
+/*
+ summed up of all threads, a thread adds its counters every few hundred lookups and on exit.
+ */
+void sgi_get_stack_cache_stats(sgi_stack_cache_stats *out_stats);
+
+typedef struct {
+    uint64_t stacks_shortened;       /**< stacks the capture policy removed frames from */
+    uint64_t app_frames_dropped;     /**< beyond `max_app_frames` */
+    uint64_t sys_frames_dropped;     /**< farther than `max_sys_frames_around_app` from an app frame */
+    uint64_t recursion_frames_saved; /**< repeated frames collapsed, net of the recursion frames added */
+} sgi_stack_capture_stats;
+
+/*
+ stacks shortened and frames saved by `sgi_allocations_stack_capture_policy`, not reset by a restart of the logging.
+ summed up of all threads, a thread adds its counters every few hundred shortened stacks and on exit.
+ */
+void sgi_get_stack_capture_stats(sgi_stack_capture_stats *out_stats);
+
+/*
+ live bytes and allocations of every category, malloc and vm records together, `name` is NULL for the uncategorized
+ ones. kept up to date by the records, no walk of them. relaxed reads, not a snapshot, unscaled when sampling.
+ */
+typedef void (*sgi_category_usage_enumerator)(const char *name, uint64_t size, uint32_t count, void *context);
+void sgi_enumerate_category_usage(sgi_category_usage_enumerator enumerator, void *context);
+
+/*
+ names interned and names rejected by the full category table, not reset by a restart of the logging.
+ */
+void sgi_get_category_table_stats(sgi_category_table_stats *out_stats);
+
+/*
+ load factor, probe lengths and insert failures of the backtrace uniquing table, zeroed if not recording.
+ */
+void sgi_get_uniquing_table_stats(sgi_uniquing_table_stats *out_stats);
+
+/*
+ frees rejected by the address filters of the malloc and vm records, and the false positives. summed up of both.
+ */
+void sgi_get_allocations_filter_stats(sgi_allocation_records_filter_stats *out_stats);
+
 
 typedef void(sgi_malloc_logger_t)(uint32_t type_flags, uintptr_t zone_ptr, uintptr_t arg2, uintptr_t arg3, uintptr_t return_val, uint32_t num_hot_to_skip);
 
@@ -11,9 +11,11 @@
 
 #include <assert.h>
 #include <errno.h>
-#include <execinfo.h>
 #include <limits.h>
+#include <mach/mach_time.h>
 #include <malloc/malloc.h>
+#include <math.h>
+#include <sched.h>
 #include <string.h>
 #include <sys/fcntl.h>
 #include <sys/mman.h>
@@ -23,13 +25,22 @@
 #import "SGIDyldImagesUtil.h"
 #import "SGIAPMCommonDef.h"
 
+#include "sgi_allocate_event_buffer.h"
+#include "sgi_allocation_records.h"
 #include "sgi_backtrace_uniquing_table.h"
 #include "sgi_inner_allocate.h"
 #include "sgi_locking.h"
 #include "sgi_splay_tree.h"
+#include "sgi_stack_backtrace.h"
 
 #define __TSD_THREAD_SELF 0
 
+#define SGI_ALLOCATIONS_DRAIN_BATCH_COUNT 4096 // events applied per locking
+#define SGI_ALLOCATIONS_DRAIN_INTERVAL_MS 5
+
+#define SGI_ALLOCATIONS_STACK_CACHE_SIZE 64         // power of 2, direct mapped by fingerprint
+#define SGI_ALLOCATIONS_STACK_CACHE_FLUSH_COUNT 256 // lookups (or shortened stacks) counted per thread before adding to the global stats
+
 // MARK: - Constants/Globals
 
 // vm_statistics.h
@@ -59,29 +70,95 @@ static const char *vm_flags[] = {
 // clang-format on
 
 static _malloc_lock_s stack_logging_lock = _MALLOC_LOCK_INIT;
-static vm_address_t thread_doing_logging = 0;
+
+// threads entering stacks into the uniquing table without stack_logging_lock, the table is destroyed once it drops to 0.
+static uint32_t uniquing_table_inserters = 0;
+
+#if SGI_ALLOCATIONS_DEBUG
+// log2 histogram of the time spent in the hook, in ns. the hooks overlapping an expansion of the uniquing table
+// are tracked apart, growth should not stall the allocating threads.
+#define SGI_ALLOCATIONS_HOOK_LATENCY_BUCKETS 32
+static uint64_t hook_latency_histogram[SGI_ALLOCATIONS_HOOK_LATENCY_BUCKETS];
+static uint64_t hook_latency_worst = 0;
+static uint64_t hook_latency_worst_during_expansion = 0;
+static uint32_t uniquing_table_expansions = 0;
+#endif
+
+// per-thread reentrancy guard. the value of a pthread key lives in the thread's own tsd slot,
+// reading/writing it never touches shared state or allocates.
+static pthread_key_t logging_reentrancy_key = 0;
+static boolean_t logging_reentrancy_key_created = false;
+
+// per-thread state of the sampler, bytes left until the next sampled allocation and the random state.
+static pthread_key_t sample_bytes_key = 0;
+static pthread_key_t sample_random_key = 0;
+static boolean_t sample_keys_created = false;
+
+// per-thread cache of the stack ids the thread entered recently, keyed by a fingerprint of the frames.
+// also holds the capture policy counters of the thread, used with the cache disabled as well.
+typedef struct {
+    uint64_t fingerprint;
+    uint64_t stack_id;
+} sgi_stack_cache_entry;
+
+typedef struct {
+    uint64_t generation; // of the uniquing table the stack ids belong to
+    uint64_t lookups;    // not yet added to stack_cache_lookups
+    uint64_t hits;       // not yet added to stack_cache_hits
+    uint64_t stacks_shortened; // capture policy counters not yet added to the stack_capture_* ones
+    uint64_t app_frames_dropped;
+    uint64_t sys_frames_dropped;
+    uint64_t recursion_frames_saved;
+    sgi_stack_cache_entry entries[SGI_ALLOCATIONS_STACK_CACHE_SIZE];
+} sgi_stack_cache;
+
+static pthread_key_t stack_cache_key = 0;
+static boolean_t stack_cache_key_created = false;
+static uint64_t stack_cache_generation = 0;
+static uint64_t stack_cache_lookups = 0;
+static uint64_t stack_cache_hits = 0;
+
+// category names, interned once and kept across restarts: the names are never freed, only the totals are reset.
+static sgi_category_table *category_table = NULL;
+
+// frames removed by the capture policy, only counted for the stacks it shortened. batched per thread in its stack cache.
+static uint64_t stack_capture_stacks_shortened = 0;
+static uint64_t stack_capture_app_frames_dropped = 0;
+static uint64_t stack_capture_sys_frames_dropped = 0;
+static uint64_t stack_capture_recursion_frames_saved = 0;
 
 boolean_t sgi_memory_allocate_logging_enabled = false;
 
 boolean_t sgi_allocations_need_sys_frame = false;
 
-// single-thread access variables
+boolean_t sgi_allocations_async_recording = false;
+sgi_allocation_records_backend sgi_allocations_records_backend = sgi_allocation_records_backend_splay_tree;
+size_t sgi_allocations_event_buffer_size = SGI_ALLOCATIONS_EVENT_BUFFER_DEFAULT_SIZE;
+size_t sgi_allocations_sample_interval = 0;
+uint32_t sgi_allocations_max_stack_depth = SGI_ALLOCATIONS_MAX_STACK_SIZE - 1;
+boolean_t sgi_allocations_stack_cache = true;
+sgi_uniquing_table_probing sgi_allocations_uniquing_table_probing = sgi_uniquing_table_probing_quadratic;
+boolean_t sgi_allocations_image_relative_frames = false;
+sgi_stack_capture_policy sgi_allocations_stack_capture_policy = {0, 0, 0};
+
+// set under stack_logging_lock, loaded without it by the sync recording paths.
 sgi_allocations_record_raw *sgi_recording;
 
-static vm_address_t *current_stack_origin;
-static vm_address_t current_frames[SGI_ALLOCATIONS_MAX_STACK_SIZE];
-static size_t current_frames_count = 0;
-
 char sgi_records_cache_dir[PATH_MAX];
 const char *sgi_vm_records_filename = "vm_records_raw";
 const char *sgi_malloc_records_filename = "malloc_records_raw";
 const char *sgi_stacks_records_filename = "stacks_records_raw";
+const char *sgi_category_strings_filename = "category_strings_raw";
 
 // single chunk malloc monitor callback
 static sgi_chunk_malloc_block chunk_malloc_detector_block = NULL;
 static boolean_t chunk_malloc_detector_enable = false;
 static size_t chunk_malloc_detector_threshold_in_bytes = 0;
 
+// drainer of async recording
+static pthread_t drainer_thread = NULL;
+static volatile boolean_t drainer_running = false;
+
 
 // MAKR: -
 
@@ -94,13 +171,88 @@ static void sgi_disable_stack_logging(void) {
 
 static malloc_zone_t *stack_id_zone = NULL;
 
+static boolean_t sgi_start_drainer_thread(void);
+static void sgi_stop_drainer_thread(void);
+static void sgi_stack_cache_thread_exit(void *value);
+static void sgi_count_shortened_stack(uint64_t app_dropped, uint64_t sys_dropped, uint64_t recursion_saved);
+
+// returns false if the current thread is already inside the logger
+static inline boolean_t sgi_logging_enter_current_thread(void) {
+    if (_os_tsd_get_direct(logging_reentrancy_key) != NULL) {
+        return false;
+    }
+    _os_tsd_set_direct(logging_reentrancy_key, (void *)1);
+    return true;
+}
+
+static inline void sgi_logging_leave_current_thread(void) {
+    _os_tsd_set_direct(logging_reentrancy_key, NULL);
+}
+
+// MARK: - sampling
+
+// exponentially distributed with mean `sgi_allocations_sample_interval`, at least 1.
+static uintptr_t sgi_next_sample_bytes(void) {
+    uint64_t x = (uint64_t)_os_tsd_get_direct(sample_random_key);
+    if (x == 0) {
+        x = ((uint64_t)_os_tsd_get_direct(__TSD_THREAD_SELF) ^ mach_absolute_time()) | 1;
+    }
+    // xorshift64*
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    _os_tsd_set_direct(sample_random_key, (void *)x);
+
+    double q = (double)(((x * 0x2545F4914F6CDD1Dull) >> 11) + 1) / (double)(1ull << 53); // (0, 1]
+    return (uintptr_t)(-log(q) * (double)sgi_allocations_sample_interval) + 1;
+}
+
+// byte based poisson sampling, as tcmalloc does. an allocation of `size` bytes is sampled with probability
+// 1 - e^(-size/interval), no matter how the allocations before it were sized.
+static inline boolean_t sgi_sample_current_allocation(uintptr_t size) {
+    uintptr_t bytes_left = (uintptr_t)_os_tsd_get_direct(sample_bytes_key); // 0 for the first allocation of the thread
+    if (bytes_left > size) {
+        _os_tsd_set_direct(sample_bytes_key, (void *)(bytes_left - size));
+        return false;
+    }
+    _os_tsd_set_direct(sample_bytes_key, (void *)sgi_next_sample_bytes());
+    return bytes_left != 0;
+}
+
 boolean_t sgi_prepare_memory_allocate_logging(void) {
+    if (!logging_reentrancy_key_created) {
+        if (pthread_key_create(&logging_reentrancy_key, NULL) != 0) {
+            SGIAPMMallocLog("[APM][Alloc] error creating reentrancy key for stack logging.\n");
+            return false;
+        }
+        logging_reentrancy_key_created = true;
+    }
+
+    // created with the cache disabled too, the capture policy counters are kept there.
+    if (!stack_cache_key_created) {
+        if (pthread_key_create(&stack_cache_key, sgi_stack_cache_thread_exit) != 0) {
+            SGIAPMMallocLog("[APM][Alloc] error creating stack cache key, stack cache disabled.\n");
+            sgi_allocations_stack_cache = false;
+        } else {
+            stack_cache_key_created = true;
+        }
+    }
+
+    if (sgi_allocations_sample_interval > 0 && !sample_keys_created) {
+        if (pthread_key_create(&sample_bytes_key, NULL) != 0 || pthread_key_create(&sample_random_key, NULL) != 0) {
+            SGIAPMMallocLog("[APM][Alloc] error creating sampling keys, record every allocation.\n");
+            sgi_allocations_sample_interval = 0;
+        } else {
+            sample_keys_created = true;
+        }
+    }
+
     sgi_memory_allocate_logging_lock();
 
     if (!sgi_recording) {
         size_t full_shared_mem_size = sizeof(sgi_allocations_record_raw);
-        sgi_recording = (sgi_allocations_record_raw *)mmap(0, full_shared_mem_size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, VM_MAKE_TAG(VM_AMKE_TAG_UNIQUING_TABLE), 0);
-        if (MAP_FAILED == sgi_recording) {
+        sgi_allocations_record_raw *recording = (sgi_allocations_record_raw *)mmap(0, full_shared_mem_size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, VM_MAKE_TAG(VM_AMKE_TAG_UNIQUING_TABLE), 0);
+        if (MAP_FAILED == recording) {
             SGIAPMMallocLog("[APM][Alloc] error creating VM region for stack logging output buffers.\n");
             sgi_disable_stack_logging();
             goto fail;
@@ -113,22 +265,18 @@ boolean_t sgi_prepare_memory_allocate_logging(void) {
         strcat(uniquing_table_file_path, sgi_stacks_records_filename);
 
         size_t page_size = sgi_allocations_need_sys_frame ? SGI_VM_DEFAULT_UNIQUING_PAGE_SIZE_WITH_SYS : SGI_VM_DEFAULT_UNIQUING_PAGE_SIZE_WITHOUT_SYS;
-        sgi_recording->backtrace_records = sgi_create_uniquing_table(uniquing_table_file_path, page_size);
-        if (!sgi_recording->backtrace_records) {
+        recording->backtrace_records = sgi_create_uniquing_table(uniquing_table_file_path, page_size, sgi_allocations_uniquing_table_probing, sgi_allocations_image_relative_frames ? sgi_current_dyld_image_info : NULL);
+        if (!recording->backtrace_records) {
             SGIAPMMallocLog("[APM][Alloc] error while allocating stack uniquing table.\n");
+            munmap(recording, full_shared_mem_size);
             sgi_disable_stack_logging();
             goto fail;
         }
 
-        sgi_recording->vm_records = NULL;
+        recording->vm_records = NULL;
 
-        uint64_t stack_buffer_sz = (uint64_t)round_page(sizeof(vm_address_t) * SGI_ALLOCATIONS_MAX_STACK_SIZE);
-        current_stack_origin = (vm_address_t *)sgi_allocate_page(stack_buffer_sz);
-        if (!current_stack_origin) {
-            SGIAPMMallocLog("[APM][Alloc] error while allocating stack trace buffer.\n");
-            sgi_disable_stack_logging();
-            goto fail;
-        }
+        // stack ids cached by the threads refer to the previous table.
+        __atomic_fetch_add(&stack_cache_generation, 1, __ATOMIC_RELEASE);
 
         if (stack_id_zone == NULL) {
             stack_id_zone = malloc_create_zone(0, 0);
@@ -136,7 +284,23 @@ boolean_t sgi_prepare_memory_allocate_logging(void) {
             sgi_setup_alloc_malloc_zone(stack_id_zone);
         }
 
-        if (sgi_recording) {
+        if (category_table == NULL) {
+            category_table = sgi_category_table_create(SGI_ALLOCATIONS_MAX_CATEGORY_COUNT);
+        }
+        sgi_category_table_reset_totals(category_table);
+
+        // the names interned before (kept across restarts) are written again, the ids in the records resolve from the files.
+        char category_strings_path[PATH_MAX];
+        strcpy(category_strings_path, sgi_records_cache_dir);
+        strcat(category_strings_path, "/");
+        strcat(category_strings_path, sgi_category_strings_filename);
+        recording->category_strings = sgi_category_strings_create(category_strings_path);
+        if (recording->category_strings == NULL) {
+            SGIAPMMallocLog("[APM][Alloc] error while creating category strings, category names are not persisted.\n");
+        }
+        sgi_category_table_set_strings(category_table, recording->category_strings);
+
+        {
             char vm_filepath[PATH_MAX], malloc_filepath[PATH_MAX];
             strcpy(vm_filepath, sgi_records_cache_dir);
             strcpy(malloc_filepath, sgi_records_cache_dir);
@@ -144,9 +308,17 @@ boolean_t sgi_prepare_memory_allocate_logging(void) {
             strcat(malloc_filepath, "/");
             strcat(vm_filepath, sgi_vm_records_filename);
             strcat(malloc_filepath, sgi_malloc_records_filename);
-            sgi_recording->vm_records = sgi_splay_tree_create_on_mmapfile(5000, vm_filepath);
-            sgi_recording->malloc_records = sgi_splay_tree_create_on_mmapfile(200000, malloc_filepath);
+            recording->vm_records = sgi_allocation_records_create(5000, vm_filepath, sgi_allocations_records_backend, category_table);
+            recording->malloc_records = sgi_allocation_records_create(200000, malloc_filepath, sgi_allocations_records_backend, category_table);
         }
+
+        // release, the threads recording without the lock load it with acquire and see the tables built above.
+        __atomic_store_n(&sgi_recording, recording, __ATOMIC_RELEASE);
+    }
+
+    if (sgi_allocations_async_recording && !sgi_start_drainer_thread()) {
+        SGIAPMMallocLog("[APM][Alloc] error while starting async recording, fallback to sync recording.\n");
+        sgi_allocations_async_recording = false;
     }
 
     sgi_memory_allocate_logging_unlock();
@@ -158,22 +330,37 @@ fail:
 }
 
 void sgi_clear_memory_allocate_logging(void) {
+    // the drainer needs the lock, stop it first.
+    sgi_stop_drainer_thread();
+
     sgi_memory_allocate_logging_lock();
     
-    if (sgi_recording) {
-        if (sgi_recording->malloc_records) {
-            sgi_splay_tree_close(sgi_recording->malloc_records);
-            sgi_recording->malloc_records = nullptr;
+    sgi_allocations_record_raw *recording = sgi_recording;
+    if (recording) {
+        // seq_cst, the sync recording paths loading it from now on see nullptr and leave the records alone.
+        __atomic_store_n(&sgi_recording, nullptr, __ATOMIC_SEQ_CST);
+        if (recording->malloc_records) {
+            sgi_allocation_records_close(recording->malloc_records);
+            recording->malloc_records = nullptr;
         }
-        if (sgi_recording->vm_records) {
-            sgi_splay_tree_close(sgi_recording->vm_records);
-            sgi_recording->vm_records = nullptr;
+        if (recording->vm_records) {
+            sgi_allocation_records_close(recording->vm_records);
+            recording->vm_records = nullptr;
         }
-        if (sgi_recording->backtrace_records) {
-            sgi_destroy_uniquing_table(sgi_recording->backtrace_records);
-            sgi_recording->backtrace_records = nullptr;
+        if (recording->backtrace_records) {
+            sgi_backtrace_uniquing_table *backtrace_records = recording->backtrace_records;
+            __atomic_store_n(&recording->backtrace_records, nullptr, __ATOMIC_SEQ_CST);
+            // inserters that loaded the table before are still entering stacks, no new one can load it.
+            while (__atomic_load_n(&uniquing_table_inserters, __ATOMIC_SEQ_CST) != 0) {
+                sched_yield();
+            }
+            sgi_destroy_uniquing_table(backtrace_records);
+        }
+        if (recording->category_strings) {
+            sgi_category_table_set_strings(category_table, NULL);
+            sgi_category_strings_close(recording->category_strings);
+            recording->category_strings = nullptr;
         }
-        sgi_recording = nullptr;
     }
     
     sgi_memory_allocate_logging_unlock();
@@ -202,27 +389,162 @@ void sgi_memory_allocate_logging_unlock(void) {
     _malloc_lock_unlock(&stack_logging_lock);
 }
 
+// the hook bails out as if the thread was already logging.
+void sgi_memory_allocate_logging_ignore_current_thread_begin(void) {
+    if (logging_reentrancy_key_created) {
+        sgi_logging_enter_current_thread();
+    }
+}
+
+void sgi_memory_allocate_logging_ignore_current_thread_end(void) {
+    if (logging_reentrancy_key_created) {
+        sgi_logging_leave_current_thread();
+    }
+}
 
-// returns the stack id or invalid_stack_id if any kind of error
-// this needs to be done while stack_logging_lock is locked)
 
 static inline boolean_t isInAppAddress(vm_address_t addr) {
     return !sgi_dyld_check_in_sys_libraries(sgi_current_dyld_image_info, addr);
 }
 
-uint64_t sgi_enter_stack_into_table_while_locked(vm_address_t self_thread, uint32_t num_hot_to_skip, boolean_t add_thread_id, size_t ptr_size) {
-    // gather stack
-    uint32_t count = backtrace((void **)current_stack_origin, SGI_ALLOCATIONS_MAX_STACK_SIZE - 1); // only gather up to STACK_LOGGING_MAX_STACK_SIZE-1 since we append thread id
-    
-    if (add_thread_id) {
-        current_stack_origin[count++] = self_thread + 1; // stuffing thread # in the coldest slot. Add 1 to match what the old stack logging did.
+// MARK: - stack capture policy
+
+#define SGI_STACK_FRAME_SYS 0
+#define SGI_STACK_FRAME_APP 1
+#define SGI_STACK_FRAME_RECURSION 2
+
+// keeps one copy of every frame sequence (up to `max_period` long) repeated back to back, followed by a recursion frame.
+// the period saving the most frames wins at each position. returns the frames count, `kinds` follow the frames.
+static size_t sgi_collapse_recursive_frames(vm_address_t *frames, uint8_t *kinds, size_t count, uint32_t max_period) {
+    size_t out = 0, i = 0;
+    while (i < count) {
+        size_t best_period = 0, best_repeats = 0, best_saved = 0;
+        for (size_t period = 1; period <= max_period && i + period * 2 <= count; period++) {
+            if (frames[i + period] != frames[i]) {
+                continue;
+            }
+            size_t repeats = 1;
+            while (i + (repeats + 1) * period <= count && memcmp(&frames[i + repeats * period], &frames[i], period * sizeof(vm_address_t)) == 0) {
+                repeats++;
+            }
+            size_t saved = period * (repeats - 1) - 1; // the recursion frame takes one
+            if (repeats > 1 && saved > best_saved) {
+                best_period = period;
+                best_repeats = repeats;
+                best_saved = saved;
+            }
+        }
+
+        if (best_saved == 0) {
+            frames[out] = frames[i];
+            kinds[out++] = kinds[i++];
+            continue;
+        }
+        for (size_t k = 0; k < best_period; k++) {
+            frames[out] = frames[i + k];
+            kinds[out++] = kinds[i + k];
+        }
+        frames[out] = SGI_ALLOCATIONS_RECURSION_FRAME(best_period, best_repeats);
+        kinds[out++] = SGI_STACK_FRAME_RECURSION;
+        i += best_period * best_repeats;
     }
+    return out;
+}
 
-    // skip stack frames after the malloc call
-    num_hot_to_skip += 3; // __disk_stack_logging_log_stack | __enter_stack_into_table_while_locked | thread_stack_pcs
+// applies `sgi_allocations_stack_capture_policy` to a trimmed stack in place, returns the frames count.
+// the hottest app frames are kept, the coldest frame always is (thread entry, or the thread id).
+static size_t sgi_apply_stack_capture_policy(vm_address_t *frames, size_t count) {
+    sgi_stack_capture_policy policy = sgi_allocations_stack_capture_policy;
+    if (count < 2 || (policy.max_app_frames == 0 && policy.max_sys_frames_around_app == 0 && policy.max_recursion_period == 0)) {
+        return count;
+    }
+
+    uint8_t kinds[SGI_ALLOCATIONS_MAX_STACK_SIZE];
+    for (size_t i = 0; i < count; i++) {
+        kinds[i] = isInAppAddress(frames[i]) ? SGI_STACK_FRAME_APP : SGI_STACK_FRAME_SYS;
+    }
+
+    size_t n = count;
+    if (policy.max_recursion_period > 0) {
+        uint32_t max_period = policy.max_recursion_period < SGI_ALLOCATIONS_MAX_RECURSION_PERIOD ? policy.max_recursion_period : SGI_ALLOCATIONS_MAX_RECURSION_PERIOD;
+        n = sgi_collapse_recursive_frames(frames, kinds, count, max_period);
+    }
+    uint64_t recursion_saved = count - n;
+
+    bool keep[SGI_ALLOCATIONS_MAX_STACK_SIZE];
+    uint32_t app_frames = 0;
+    for (size_t i = 0; i < n; i++) {
+        keep[i] = kinds[i] != SGI_STACK_FRAME_APP || policy.max_app_frames == 0 || ++app_frames <= policy.max_app_frames;
+    }
+
+    uint32_t max_sys = policy.max_sys_frames_around_app;
+    if (max_sys > 0 && sgi_allocations_need_sys_frame) {
+        // distance of every system frame to the closest kept app frame, hotter then colder. recursion frames don't count.
+        // a stack without app frames keeps its hottest system frames.
+        bool has_app = false;
+        for (size_t i = 0; i < n && !has_app; i++) {
+            has_app = kinds[i] == SGI_STACK_FRAME_APP && keep[i];
+        }
+        uint32_t distance = has_app ? UINT32_MAX : 0;
+        for (size_t i = 0; i < n; i++) {
+            if (kinds[i] == SGI_STACK_FRAME_APP) {
+                distance = keep[i] ? 0 : distance;
+            } else if (kinds[i] == SGI_STACK_FRAME_SYS) {
+                distance = distance == UINT32_MAX ? distance : distance + 1;
+                keep[i] = distance <= max_sys;
+            }
+        }
+        distance = UINT32_MAX;
+        for (size_t i = n; i-- > 0;) {
+            if (kinds[i] == SGI_STACK_FRAME_APP) {
+                distance = keep[i] ? 0 : distance;
+            } else if (kinds[i] == SGI_STACK_FRAME_SYS) {
+                distance = distance == UINT32_MAX ? distance : distance + 1;
+                keep[i] = keep[i] || distance <= max_sys;
+            }
+        }
+    }
+
+    // the coldest frame is the last one but the recursion frames following it, they go with it.
+    size_t coldest = n - 1;
+    while (coldest > 0 && kinds[coldest] == SGI_STACK_FRAME_RECURSION) {
+        coldest--;
+    }
+    keep[coldest] = true;
 
+    uint64_t app_dropped = 0, sys_dropped = 0;
+    size_t out = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (kinds[i] == SGI_STACK_FRAME_RECURSION) {
+            keep[i] = keep[i - 1]; // goes with the frames it counts
+        }
+        if (keep[i]) {
+            frames[out++] = frames[i];
+        } else if (kinds[i] == SGI_STACK_FRAME_APP) {
+            app_dropped++;
+        } else if (kinds[i] == SGI_STACK_FRAME_SYS) {
+            sys_dropped++;
+        }
+    }
+
+    if (out < count) {
+        sgi_count_shortened_stack(app_dropped, sys_dropped, recursion_saved);
+    }
+    return out;
+}
+
+void sgi_get_stack_capture_stats(sgi_stack_capture_stats *out_stats) {
+    out_stats->stacks_shortened = __atomic_load_n(&stack_capture_stacks_shortened, __ATOMIC_RELAXED);
+    out_stats->app_frames_dropped = __atomic_load_n(&stack_capture_app_frames_dropped, __ATOMIC_RELAXED);
+    out_stats->sys_frames_dropped = __atomic_load_n(&stack_capture_sys_frames_dropped, __ATOMIC_RELAXED);
+    out_stats->recursion_frames_saved = __atomic_load_n(&stack_capture_recursion_frames_saved, __ATOMIC_RELAXED);
+}
+
+// trim the gathered stack into `out_frames` (could be the same buffer as `stack`), returns the frames count.
+// returns 0 if the stack should not be recorded.
+static size_t sgi_trim_stack_frames(vm_address_t *stack, uint32_t count, uint32_t num_hot_to_skip, vm_address_t *out_frames) {
     if (count <= num_hot_to_skip) {
-        return sgi_vm_invalid_stack_id;
+        return 0;
     }
 
     bool need_skip_sys_frame = !sgi_allocations_need_sys_frame;
@@ -231,41 +553,52 @@ uint64_t sgi_enter_stack_into_table_while_locked(vm_address_t self_thread, uint3
     vm_address_t last_frame = 0;
     for (; j < count; j++) {
         if (!exist_app_frame) {
-            if (isInAppAddress(current_stack_origin[j])) {
+            if (isInAppAddress(stack[j])) {
                 // exclude main() | dylib start
                 if (j < count - 2) {
                     exist_app_frame = true;
                 }
 
                 if (last_frame != 0) {
-                    current_frames[offset++] = last_frame;
+                    out_frames[offset++] = last_frame;
                 }
-                current_frames[offset++] = current_stack_origin[j];
+                out_frames[offset++] = stack[j];
             } else {
                 if (need_skip_sys_frame) {
-                    last_frame = current_stack_origin[j];
+                    last_frame = stack[j];
                 } else {
-                    current_frames[offset++] = current_stack_origin[j];
+                    out_frames[offset++] = stack[j];
                 }
             }
         } else {
-            if (!need_skip_sys_frame || isInAppAddress(current_stack_origin[j]) || j == count - 1) {
-                current_frames[offset++] = current_stack_origin[j];
+            if (!need_skip_sys_frame || isInAppAddress(stack[j]) || j == count - 1) {
+                out_frames[offset++] = stack[j];
             }
         }
     }
 
-    current_frames_count = offset;
+    if (need_skip_sys_frame && !exist_app_frame) {
+        return 0;
+    }
+    return sgi_apply_stack_capture_policy(out_frames, offset);
+}
 
+// returns the stack id or invalid_stack_id if any kind of error
+// this needs to be done while stack_logging_lock is locked)
+static uint64_t sgi_enter_frames_into_table_while_locked(vm_address_t *frames, size_t frames_count) {
     uint64_t uniqueStackIdentifier = sgi_vm_invalid_stack_id;
-    if (need_skip_sys_frame && !exist_app_frame) {
+    if (frames_count == 0 || sgi_recording == NULL || sgi_recording->backtrace_records == NULL) {
         return uniqueStackIdentifier;
     }
 
-    if (!sgi_enter_frames_in_table(sgi_recording->backtrace_records, &uniqueStackIdentifier, current_frames, (uint32_t)current_frames_count)) {
-        sgi_recording->backtrace_records = sgi_expand_uniquing_table(sgi_recording->backtrace_records);
+    // the table may have been expanded by another thread since a lock free attempt failed, try again first.
+    if (!sgi_enter_frames_in_table(sgi_recording->backtrace_records, &uniqueStackIdentifier, frames, (uint32_t)frames_count)) {
+        __atomic_store_n(&sgi_recording->backtrace_records, sgi_expand_uniquing_table(sgi_recording->backtrace_records), __ATOMIC_RELEASE);
+#if SGI_ALLOCATIONS_DEBUG
+        __atomic_fetch_add(&uniquing_table_expansions, 1, __ATOMIC_RELAXED);
+#endif
         if (sgi_recording->backtrace_records) {
-            if (!sgi_enter_frames_in_table(sgi_recording->backtrace_records, &uniqueStackIdentifier, current_frames, (uint32_t)current_frames_count))
+            if (!sgi_enter_frames_in_table(sgi_recording->backtrace_records, &uniqueStackIdentifier, frames, (uint32_t)frames_count))
                 return sgi_vm_invalid_stack_id;
         } else {
             return sgi_vm_invalid_stack_id;
@@ -275,8 +608,476 @@ uint64_t sgi_enter_stack_into_table_while_locked(vm_address_t self_thread, uint3
     return uniqueStackIdentifier;
 }
 
+// same as `sgi_enter_frames_into_table_while_locked` without stack_logging_lock, the uniquing table takes concurrent
+// inserters. only a full table takes the lock to expand it.
+static uint64_t sgi_enter_frames_into_table_lock_free(vm_address_t *frames, size_t frames_count) {
+    uint64_t uniqueStackIdentifier = sgi_vm_invalid_stack_id;
+    if (frames_count == 0) {
+        return uniqueStackIdentifier;
+    }
+
+    // seq_cst, either the clearing thread sees this inserter or this inserter sees the cleared table.
+    __atomic_fetch_add(&uniquing_table_inserters, 1, __ATOMIC_SEQ_CST);
+    sgi_allocations_record_raw *recording = __atomic_load_n(&sgi_recording, __ATOMIC_SEQ_CST);
+    sgi_backtrace_uniquing_table *backtrace_records = recording ? __atomic_load_n(&recording->backtrace_records, __ATOMIC_SEQ_CST) : NULL;
+    boolean_t entered = backtrace_records == NULL || sgi_enter_frames_in_table(backtrace_records, &uniqueStackIdentifier, frames, (uint32_t)frames_count);
+    __atomic_fetch_sub(&uniquing_table_inserters, 1, __ATOMIC_RELEASE);
+
+    if (!entered) {
+        sgi_memory_allocate_logging_lock();
+        uniqueStackIdentifier = sgi_enter_frames_into_table_while_locked(frames, frames_count);
+        sgi_memory_allocate_logging_unlock();
+    }
+    return uniqueStackIdentifier;
+}
+
+// frames walked per allocation, hot frames included. only gather up to SGI_ALLOCATIONS_MAX_STACK_SIZE-1 since the thread id may be appended.
+static inline uint32_t sgi_max_stack_depth(void) {
+    uint32_t depth = sgi_allocations_max_stack_depth;
+    if (depth == 0 || depth > SGI_ALLOCATIONS_MAX_STACK_SIZE - 1) {
+        depth = SGI_ALLOCATIONS_MAX_STACK_SIZE - 1;
+    }
+    return depth;
+}
+
+// gather and trim the stack into `frames` (SGI_ALLOCATIONS_MAX_STACK_SIZE), no lock needed. returns the frames count.
+// not inlined, the frames to skip below count on its own frame.
+__attribute__((noinline)) static size_t sgi_capture_stack_frames(vm_address_t self_thread, uint32_t num_hot_to_skip, boolean_t add_thread_id, vm_address_t *frames) {
+    uint32_t count = sgi_stack_backtrace_of_current_thread(frames, sgi_max_stack_depth());
+
+    if (add_thread_id) {
+        frames[count++] = self_thread + 1; // stuffing thread # in the coldest slot. Add 1 to match what the old stack logging did.
+    }
+
+    // skip stack frames after the malloc call
+    num_hot_to_skip += 2; // sgi_allocate_logging | the malloc_logger caller
+
+    return sgi_trim_stack_frames(frames, count, num_hot_to_skip, frames);
+}
+
+// MARK: - per-thread stack cache
+
+static uint64_t sgi_stack_fingerprint(const vm_address_t *frames, size_t frames_count) {
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ frames_count;
+    for (size_t i = 0; i < frames_count; i++) {
+        hash = (hash ^ frames[i]) * 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 32;
+    }
+    return hash | 1; // 0 marks an empty entry
+}
+
+// the stack cache of the thread whatever its generation, NULL without the key.
+static sgi_stack_cache *sgi_thread_stack_cache(void) {
+    if (!stack_cache_key_created) {
+        return NULL;
+    }
+    sgi_stack_cache *cache = (sgi_stack_cache *)_os_tsd_get_direct(stack_cache_key);
+    if (cache == NULL) {
+        // inside the logger of the thread, this allocation is not logged.
+        cache = (sgi_stack_cache *)sgi_malloc(sizeof(sgi_stack_cache));
+        if (cache == NULL) {
+            return NULL;
+        }
+        memset(cache, 0, sizeof(sgi_stack_cache));
+        _os_tsd_set_direct(stack_cache_key, cache);
+    }
+    return cache;
+}
+
+static sgi_stack_cache *sgi_current_stack_cache(void) {
+    sgi_stack_cache *cache = sgi_thread_stack_cache();
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    uint64_t generation = __atomic_load_n(&stack_cache_generation, __ATOMIC_ACQUIRE);
+    if (cache->generation != generation) {
+        memset(cache->entries, 0, sizeof(cache->entries));
+        cache->generation = generation;
+    }
+    return cache;
+}
+
+static void sgi_flush_stack_cache_stats(sgi_stack_cache *cache) {
+    __atomic_fetch_add(&stack_cache_lookups, cache->lookups, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stack_cache_hits, cache->hits, __ATOMIC_RELAXED);
+    cache->lookups = 0;
+    cache->hits = 0;
+}
+
+static void sgi_flush_stack_capture_stats(sgi_stack_cache *cache) {
+    __atomic_fetch_add(&stack_capture_stacks_shortened, cache->stacks_shortened, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stack_capture_app_frames_dropped, cache->app_frames_dropped, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stack_capture_sys_frames_dropped, cache->sys_frames_dropped, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stack_capture_recursion_frames_saved, cache->recursion_frames_saved, __ATOMIC_RELAXED);
+    cache->stacks_shortened = 0;
+    cache->app_frames_dropped = 0;
+    cache->sys_frames_dropped = 0;
+    cache->recursion_frames_saved = 0;
+}
+
+static void sgi_stack_cache_thread_exit(void *value) {
+    sgi_stack_cache *cache = (sgi_stack_cache *)value;
+    sgi_flush_stack_cache_stats(cache);
+    sgi_flush_stack_capture_stats(cache);
+    sgi_free(cache);
+}
+
+// adds a stack the capture policy shortened to the counters of the thread, to the global ones without a stack cache.
+static void sgi_count_shortened_stack(uint64_t app_dropped, uint64_t sys_dropped, uint64_t recursion_saved) {
+    sgi_stack_cache *cache = sgi_thread_stack_cache();
+    if (cache == NULL) {
+        __atomic_fetch_add(&stack_capture_stacks_shortened, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stack_capture_app_frames_dropped, app_dropped, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stack_capture_sys_frames_dropped, sys_dropped, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stack_capture_recursion_frames_saved, recursion_saved, __ATOMIC_RELAXED);
+        return;
+    }
+    cache->app_frames_dropped += app_dropped;
+    cache->sys_frames_dropped += sys_dropped;
+    cache->recursion_frames_saved += recursion_saved;
+    if (++cache->stacks_shortened == SGI_ALLOCATIONS_STACK_CACHE_FLUSH_COUNT) {
+        sgi_flush_stack_capture_stats(cache);
+    }
+}
+
+// same as `sgi_enter_frames_into_table_while_locked`, a stack the thread entered recently skips the uniquing table.
+// enters a missed stack without stack_logging_lock if `locked` is false.
+static uint64_t sgi_enter_frames_into_table_cached(vm_address_t *frames, size_t frames_count, boolean_t locked) {
+    if (frames_count == 0) {
+        return sgi_vm_invalid_stack_id;
+    }
+
+    sgi_stack_cache *cache = sgi_allocations_stack_cache ? sgi_current_stack_cache() : NULL;
+    uint64_t fingerprint = 0;
+    sgi_stack_cache_entry *entry = NULL;
+    if (cache) {
+        fingerprint = sgi_stack_fingerprint(frames, frames_count);
+        entry = &cache->entries[fingerprint & (SGI_ALLOCATIONS_STACK_CACHE_SIZE - 1)];
+        if (++cache->lookups == SGI_ALLOCATIONS_STACK_CACHE_FLUSH_COUNT) {
+            sgi_flush_stack_cache_stats(cache);
+        }
+        if (entry->fingerprint == fingerprint) {
+            cache->hits++;
+            return entry->stack_id;
+        }
+    }
+
+    uint64_t uniqueStackIdentifier = locked ? sgi_enter_frames_into_table_while_locked(frames, frames_count) : sgi_enter_frames_into_table_lock_free(frames, frames_count);
+
+    if (entry && uniqueStackIdentifier != sgi_vm_invalid_stack_id) {
+        entry->fingerprint = fingerprint;
+        entry->stack_id = uniqueStackIdentifier;
+    }
+    return uniqueStackIdentifier;
+}
+
+void sgi_get_stack_cache_stats(sgi_stack_cache_stats *out_stats) {
+    out_stats->lookups = __atomic_load_n(&stack_cache_lookups, __ATOMIC_RELAXED);
+    out_stats->hits = __atomic_load_n(&stack_cache_hits, __ATOMIC_RELAXED);
+}
+
+#if SGI_ALLOCATIONS_DEBUG
+// MARK: - hook latency
+
+static void sgi_update_max(uint64_t *max, uint64_t value) {
+    uint64_t current = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (value > current && !__atomic_compare_exchange_n(max, &current, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// `start_expansions` is the expansion count when the hook began.
+static void sgi_record_hook_latency(uint64_t start_time, uint32_t start_expansions) {
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+
+    uint64_t ns = (mach_absolute_time() - start_time) * timebase.numer / timebase.denom;
+    uint32_t bucket = ns > 1 ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= SGI_ALLOCATIONS_HOOK_LATENCY_BUCKETS) {
+        bucket = SGI_ALLOCATIONS_HOOK_LATENCY_BUCKETS - 1;
+    }
+    __atomic_fetch_add(&hook_latency_histogram[bucket], 1, __ATOMIC_RELAXED);
+    sgi_update_max(&hook_latency_worst, ns);
+    if (__atomic_load_n(&uniquing_table_expansions, __ATOMIC_RELAXED) != start_expansions) {
+        sgi_update_max(&hook_latency_worst_during_expansion, ns);
+    }
+}
+
+static void sgi_log_hook_latency(void) {
+    SGIAPMMallocLog("hook latency, worst: %lluns, worst during %u expansions: %lluns\n", hook_latency_worst,
+        uniquing_table_expansions, hook_latency_worst_during_expansion);
+    for (uint32_t i = 0; i < SGI_ALLOCATIONS_HOOK_LATENCY_BUCKETS; i++) {
+        uint64_t count = __atomic_load_n(&hook_latency_histogram[i], __ATOMIC_RELAXED);
+        if (count > 0) {
+            SGIAPMMallocLog("  [%lluns, %lluns): %llu\n", 1ull << i, 2ull << i, count);
+        }
+    }
+}
+#endif
+
+// MARK: - records
+
+static uint64_t sgi_category_and_size_of_allocation(uint32_t type_flags, uintptr_t size) {
+    if (type_flags & sgi_allocations_type_vm_allocate) {
+        uint32_t type = (type_flags & ~sgi_allocations_type_vm_allocate);
+        type = type >> 24;
+        const char *flag = "unknown";
+        if (type <= 99)
+            flag = vm_flags[type];
+        return SGI_ALLOCATIONS_CATEGORY_AND_SIZE(sgi_category_table_intern(category_table, flag), size);
+    } else {
+        return SGI_ALLOCATIONS_CATEGORY_AND_SIZE(0, size);
+    }
+}
+
+// store ptr, size, & stack_id. only the shard of `ptr` is locked, stack_logging_lock is not needed.
+static void sgi_record_allocation(uint32_t type_flags, uintptr_t ptr, uintptr_t size, uint64_t uniqueStackIdentifier) {
+    sgi_allocation_records *records = NULL;
+    sgi_allocations_record_raw *recording = __atomic_load_n(&sgi_recording, __ATOMIC_ACQUIRE);
+    if (recording) {
+        records = (type_flags & sgi_allocations_type_vm_allocate) ? recording->vm_records : recording->malloc_records;
+    }
+    if (records == NULL) {
+        return;
+    }
+
+    uint64_t stackid_and_flags = SGI_ALLOCATIONS_OFFSET_AND_FLAGS(uniqueStackIdentifier, type_flags);
+    uint64_t category_and_size = sgi_category_and_size_of_allocation(type_flags, size);
+    if (!sgi_allocation_records_insert(records, ptr, stackid_and_flags, category_and_size)) {
+        sgi_disable_stack_logging();
+    }
+}
+
+// returns the size of the removed record, 0 if not found. only the shard of `ptr` is locked.
+static uintptr_t sgi_record_deallocation(uint32_t type_flags, uintptr_t ptr) {
+    sgi_allocation_records *records = NULL;
+    sgi_allocations_record_raw *recording = __atomic_load_n(&sgi_recording, __ATOMIC_ACQUIRE);
+    if (recording) {
+        records = (type_flags & sgi_allocations_type_vm_deallocate) ? recording->vm_records : recording->malloc_records;
+    }
+    if (records == NULL) {
+        return 0;
+    }
+
+    sgi_splay_tree_node removed = sgi_allocation_records_delete(records, ptr);
+    if (removed.category_and_size > 0) {
+        return SGI_ALLOCATIONS_SIZE(removed.category_and_size);
+    }
+    return 0;
+}
+
+void sgi_get_uniquing_table_stats(sgi_uniquing_table_stats *out_stats) {
+    memset(out_stats, 0, sizeof(sgi_uniquing_table_stats));
+
+    // the lock keeps the table from being destroyed meanwhile.
+    sgi_memory_allocate_logging_lock();
+    if (sgi_recording != nullptr && sgi_recording->backtrace_records != nullptr) {
+        sgi_uniquing_table_get_stats(sgi_recording->backtrace_records, out_stats);
+    }
+    sgi_memory_allocate_logging_unlock();
+}
+
+void sgi_get_allocations_filter_stats(sgi_allocation_records_filter_stats *out_stats) {
+    memset(out_stats, 0, sizeof(sgi_allocation_records_filter_stats));
+    sgi_allocations_record_raw *recording = __atomic_load_n(&sgi_recording, __ATOMIC_ACQUIRE);
+    if (recording == nullptr) {
+        return;
+    }
+
+    sgi_allocation_records *records[] = {recording->malloc_records, recording->vm_records};
+    for (size_t i = 0; i < sizeof(records) / sizeof(records[0]); i++) {
+        if (records[i] == nullptr) {
+            continue;
+        }
+        sgi_allocation_records_filter_stats stats;
+        sgi_allocation_records_get_filter_stats(records[i], &stats);
+        out_stats->rejected_deletes += stats.rejected_deletes;
+        out_stats->passed_deletes += stats.passed_deletes;
+        out_stats->false_positives += stats.false_positives;
+    }
+}
+
+void sgi_set_allocation_category(vm_address_t ptr, const char *category) {
+    sgi_allocations_record_raw *recording = __atomic_load_n(&sgi_recording, __ATOMIC_ACQUIRE);
+    if (recording == nullptr) {
+        return;
+    }
+
+    // find record and set category.
+    bool found = false;
+    uint64_t category_id = sgi_category_table_intern(category_table, category);
+    if (recording->malloc_records != nullptr)
+        found = sgi_allocation_records_set_category(recording->malloc_records, ptr, category_id);
+
+    if (!found && recording->vm_records != nullptr) {
+        sgi_allocation_records_set_category(recording->vm_records, ptr, category_id);
+    }
+}
+
+typedef struct {
+    sgi_category_usage_enumerator enumerator;
+    void *context;
+} sgi_category_usage_context;
+
+static void sgi_enumerate_category_usage_entry(uint32_t category_id, const char *name, uint64_t size, uint32_t count, void *context) {
+    sgi_category_usage_context *usage_context = (sgi_category_usage_context *)context;
+    usage_context->enumerator(name, size, count, usage_context->context);
+}
+
+void sgi_enumerate_category_usage(sgi_category_usage_enumerator enumerator, void *context) {
+    if (sgi_recording == nullptr) {
+        return;
+    }
+    sgi_category_usage_context usage_context = {enumerator, context};
+    sgi_category_table_enumerate(category_table, sgi_enumerate_category_usage_entry, &usage_context);
+}
+
+void sgi_get_category_table_stats(sgi_category_table_stats *out_stats) {
+    sgi_category_table_get_stats(category_table, out_stats);
+}
+
+// MARK: - async recording
+
+static void sgi_apply_allocate_event_while_locked(const sgi_allocate_event *event, vm_address_t *frames) {
+    if (sgi_recording == NULL) {
+        return;
+    }
+
+    uint32_t type_flags = event->type_flags;
+    if (type_flags & (sgi_allocations_type_dealloc | sgi_allocations_type_vm_deallocate)) {
+        sgi_record_deallocation(type_flags, (uintptr_t)event->ptr);
+    } else if (type_flags & (sgi_allocations_type_alloc | sgi_allocations_type_vm_allocate)) {
+        uint64_t uniqueStackIdentifier = sgi_enter_frames_into_table_cached(frames, event->frames_count, true);
+        if (uniqueStackIdentifier != sgi_vm_invalid_stack_id) {
+            sgi_record_allocation(type_flags, (uintptr_t)event->ptr, (uintptr_t)event->size, uniqueStackIdentifier);
+        }
+    } else if (type_flags & sgi_allocations_type_generic) {
+        sgi_set_allocation_category((vm_address_t)event->ptr, (const char *)event->size);
+    }
+}
+
+void sgi_drain_memory_allocate_events(void) {
+    if (!sgi_allocations_async_recording) {
+        return;
+    }
+
+    // allocations made while applying (table expansion) must not be logged by this thread.
+    if (!sgi_logging_enter_current_thread()) {
+        return;
+    }
+
+    size_t applied = 0;
+    do {
+        sgi_memory_allocate_logging_lock();
+        applied = sgi_allocate_event_buffer_drain(SGI_ALLOCATIONS_DRAIN_BATCH_COUNT, sgi_apply_allocate_event_while_locked);
+        sgi_memory_allocate_logging_unlock();
+    } while (applied == SGI_ALLOCATIONS_DRAIN_BATCH_COUNT);
+
+    sgi_logging_leave_current_thread();
+}
+
+static void *sgi_drainer_thread_main(void *arg) {
+    pthread_setname_np("com.sogou.apm.allocations.drainer");
+    // allocations of the drainer itself are never recorded.
+    sgi_allocate_event_buffer_ignore_current_thread();
+
+    while (drainer_running) {
+        sgi_allocate_event_buffer_wait(SGI_ALLOCATIONS_DRAIN_INTERVAL_MS);
+        sgi_drain_memory_allocate_events();
+    }
+    return NULL;
+}
+
+static boolean_t sgi_start_drainer_thread(void) {
+    if (drainer_running) {
+        return true;
+    }
+
+    if (!sgi_allocate_event_buffer_setup(sgi_allocations_event_buffer_size)) {
+        return false;
+    }
+
+    drainer_running = true;
+    if (pthread_create(&drainer_thread, NULL, sgi_drainer_thread_main, NULL) != 0) {
+        SGIAPMMallocLog("[APM][Alloc] fail to create drainer thread.\n");
+        drainer_running = false;
+        drainer_thread = NULL;
+        return false;
+    }
+    return true;
+}
+
+static void sgi_stop_drainer_thread(void) {
+    if (!drainer_running) {
+        return;
+    }
+
+    drainer_running = false;
+    sgi_allocate_event_buffer_wakeup();
+    pthread_join(drainer_thread, NULL);
+    drainer_thread = NULL;
+}
+
+void sgi_enqueue_allocation_category(vm_address_t ptr, const char *category) {
+    sgi_allocate_event_buffer *buffer = sgi_allocate_event_buffer_begin();
+    if (buffer == NULL) {
+        sgi_allocate_event_buffer_drop_other_event();
+        return;
+    }
+    sgi_allocate_event_buffer_append(buffer, sgi_allocations_type_generic, ptr, (uint64_t)category, NULL, 0);
+    sgi_allocate_event_buffer_end(buffer);
+}
+
+// the hot path of async recording, no shared lock is taken. not inlined, the frames to skip count on its own frame.
+__attribute__((noinline)) static void sgi_allocate_logging_async(uint32_t type_flags, uintptr_t ptr, uintptr_t size, uint32_t num_hot_to_skip) {
+    if (!sgi_logging_enter_current_thread()) {
+        return;
+    }
+
+    sgi_allocate_event_buffer *buffer = sgi_allocate_event_buffer_begin();
+    if (buffer == NULL) {
+        sgi_logging_leave_current_thread();
+        return; // the thread is ignored
+    }
+
+    if (type_flags & (sgi_allocations_type_dealloc | sgi_allocations_type_vm_deallocate)) {
+        sgi_allocate_event_buffer_append(buffer, type_flags, ptr, size, NULL, 0);
+        sgi_allocate_event_buffer_end(buffer);
+        sgi_logging_leave_current_thread();
+        return;
+    }
+
+    if (size == 0) {
+        sgi_allocate_event_buffer_end(buffer);
+        sgi_logging_leave_current_thread();
+        return;
+    }
+
+    vm_address_t *frames = sgi_allocate_event_buffer_scratch_frames(buffer);
+    uint32_t count = sgi_stack_backtrace_of_current_thread(frames, sgi_max_stack_depth());
+    num_hot_to_skip += 2; // sgi_allocate_logging | the malloc_logger caller
+    size_t frames_count = sgi_trim_stack_frames(frames, count, num_hot_to_skip, frames);
+    if (frames_count > 0) {
+        sgi_allocate_event_buffer_append(buffer, type_flags, ptr, size, frames, (uint32_t)frames_count);
+    }
+    sgi_allocate_event_buffer_end(buffer);
+    sgi_logging_leave_current_thread();
+
+    if (frames_count > 0 && (type_flags & sgi_allocations_type_alloc) &&
+        chunk_malloc_detector_enable && chunk_malloc_detector_threshold_in_bytes < size && chunk_malloc_detector_block != NULL) {
+        // the scratch frames are those of the next event of this thread, an allocation in the block would overwrite them.
+        vm_address_t chunk_frames[SGI_ALLOCATIONS_MAX_STACK_SIZE];
+        memcpy(chunk_frames, frames, frames_count * sizeof(vm_address_t));
+        chunk_malloc_detector_block(size, chunk_frames, frames_count);
+    }
+}
+
+// MARK: - logger
+
 void sgi_allocate_logging(uint32_t type_flags, uintptr_t zone_ptr, uintptr_t arg2, uintptr_t arg3, uintptr_t return_val, uint32_t num_hot_to_skip) {
-    if (!sgi_memory_allocate_logging_enabled)
+    if (!sgi_memory_allocate_logging_enabled || !logging_reentrancy_key_created)
         return;
     
     if (type_flags & sgi_allocations_type_mapped_file_or_shared_mem) {
@@ -285,8 +1086,6 @@ void sgi_allocate_logging(uint32_t type_flags, uintptr_t zone_ptr, uintptr_t arg
 
     uintptr_t size = 0;
     uintptr_t ptr_arg = 0;
-    uint64_t stackid_and_flags = 0;
-    uint64_t category_and_size = 0;
 
 #if SGI_ALLOCATIONS_DEBUG
     static uint64_t malloc_size_counter = 0;
@@ -342,46 +1141,49 @@ void sgi_allocate_logging(uint32_t type_flags, uintptr_t zone_ptr, uintptr_t arg
 
     //    type_flags &= sgi_allocations_valid_type_flags;
 
-    vm_address_t self_thread = (vm_address_t)_os_tsd_get_direct(__TSD_THREAD_SELF);
-    if (thread_doing_logging == self_thread) {
+    if (sgi_allocations_sample_interval > 0 && (type_flags & (sgi_allocations_type_alloc | sgi_allocations_type_vm_allocate)) &&
+        !sgi_sample_current_allocation(size)) {
+        return;
+    }
+
+    if (sgi_allocations_async_recording) {
+        uintptr_t ptr = (type_flags & (sgi_allocations_type_dealloc | sgi_allocations_type_vm_deallocate)) ? ptr_arg : return_val;
+        sgi_allocate_logging_async(type_flags, ptr, size, num_hot_to_skip);
+        return;
+    }
+
+    if (!sgi_logging_enter_current_thread()) {
         // Prevent a thread from deadlocking against itself if vm_allocate() or malloc()
         // is called below here, from __prepare_to_log_stacks() or _prepare_to_log_stacks_stage2(),
         // or if we are logging an event and need to call __expand_uniquing_table() which calls
         // vm_allocate() to grow stack logging data structures.  Any such "administrative"
         // vm_allocate or malloc calls would attempt to recursively log those events.
+        // The flag is thread local, nested allocations bail out here without touching shared state.
         return;
     }
 
-    // lock and enter
-    sgi_memory_allocate_logging_lock();
-
-    thread_doing_logging = self_thread; // for preventing deadlock'ing on stack logging on a single thread
-
     uint64_t uniqueStackIdentifier = sgi_vm_invalid_stack_id;
 
+    vm_address_t frames[SGI_ALLOCATIONS_MAX_STACK_SIZE];
     // for single chunk malloc detector
-    vm_address_t frames_for_chunk_malloc[SGI_ALLOCATIONS_MAX_STACK_SIZE];
     size_t frames_count_for_chunk_malloc = 0;
 
-    if (type_flags & sgi_allocations_type_vm_deallocate) {
-        if (sgi_recording && sgi_recording->vm_records) {
-            sgi_splay_tree_node removed = sgi_splay_tree_delete(sgi_recording->vm_records, ptr_arg);
-            if (removed.category_and_size > 0) {
-                size = SGI_ALLOCATIONS_SIZE(removed.category_and_size);
-            }
-        }
-        goto out;
-    } else if (type_flags & sgi_allocations_type_dealloc) {
-        if (sgi_recording && sgi_recording->malloc_records) {
-            sgi_splay_tree_node removed = sgi_splay_tree_delete(sgi_recording->malloc_records, ptr_arg);
-            if (removed.category_and_size > 0) {
-                size = SGI_ALLOCATIONS_SIZE(removed.category_and_size);
-            }
+#if SGI_ALLOCATIONS_DEBUG
+    uint64_t hook_start_time = mach_absolute_time();
+    uint32_t hook_start_expansions = __atomic_load_n(&uniquing_table_expansions, __ATOMIC_RELAXED);
+#endif
+
+    if (type_flags & sgi_allocations_type_vm_deallocate || type_flags & sgi_allocations_type_dealloc) {
+        // frees only lock the records shard of the pointer, frees on different shards proceed in parallel.
+        // untracked pointers are rejected by the address filter of the records without any lock.
+        uintptr_t removed_size = sgi_record_deallocation(type_flags, ptr_arg);
+        if (removed_size > 0) {
+            size = removed_size;
         }
         goto out;
     }
 
-    // now actually begin
+    // now actually begin
 
     // since there could have been a fatal (to stack logging) error such as the log files not being created, check these variables before continuing
     if (!sgi_memory_allocate_logging_enabled) {
@@ -389,84 +1191,64 @@ void sgi_allocate_logging(uint32_t type_flags, uintptr_t zone_ptr, uintptr_t arg
     }
 
     if (((type_flags & sgi_allocations_type_vm_allocate) || (type_flags & sgi_allocations_type_alloc)) && size > 0) {
-        uniqueStackIdentifier = sgi_enter_stack_into_table_while_locked(self_thread, num_hot_to_skip, false, 1);
+        vm_address_t self_thread = (vm_address_t)_os_tsd_get_direct(__TSD_THREAD_SELF);
+
+        // the stack is gathered on this thread and entered without stack_logging_lock, only a full uniquing table locks it.
+        size_t frames_count = sgi_capture_stack_frames(self_thread, num_hot_to_skip, false, frames);
+        uniqueStackIdentifier = sgi_enter_frames_into_table_cached(frames, frames_count, false);
+
+        if (uniqueStackIdentifier != sgi_vm_invalid_stack_id && (type_flags & sgi_allocations_type_alloc)) {
+            // 此处若直接回调让外部处理，需要处理死锁问题。故此处延后到 sgi_malloc_unlock_stack_logging 锁结束后处理
+            if (chunk_malloc_detector_enable && chunk_malloc_detector_threshold_in_bytes < size && chunk_malloc_detector_block != NULL) {
+                frames_count_for_chunk_malloc = frames_count;
+            }
+        }
     }
 
     if (uniqueStackIdentifier == sgi_vm_invalid_stack_id) {
         goto out;
     }
 
-    // store ptr, size, & stack_id
-    stackid_and_flags = SGI_ALLOCATIONS_OFFSET_AND_FLAGS(uniqueStackIdentifier, type_flags);
-    if (type_flags & sgi_allocations_type_vm_allocate) {
-        uint32_t type = (type_flags & ~sgi_allocations_type_vm_allocate);
-        type = type >> 24;
-        const char *flag = "unknown";
-        if (type <= 99)
-            flag = vm_flags[type];
-        category_and_size = SGI_ALLOCATIONS_CATEGORY_AND_SIZE(flag, size);
-    } else {
-        category_and_size = SGI_ALLOCATIONS_CATEGORY_AND_SIZE(0, size);
-    }
-
-    if (type_flags & sgi_allocations_type_vm_allocate) {
-        if (!sgi_splay_tree_insert(sgi_recording->vm_records, return_val, stackid_and_flags, category_and_size)) {
-            sgi_recording->vm_records = sgi_expand_splay_tree(sgi_recording->vm_records);
-            if (sgi_recording->vm_records) {
-                sgi_splay_tree_insert(sgi_recording->vm_records, return_val, stackid_and_flags, category_and_size);
-            } else {
-                sgi_disable_stack_logging();
-            }
-        }
-    } else if (type_flags & sgi_allocations_type_alloc) {
-        if (!sgi_splay_tree_insert(sgi_recording->malloc_records, return_val, stackid_and_flags, category_and_size)) {
-            sgi_recording->malloc_records = sgi_expand_splay_tree(sgi_recording->malloc_records);
-            if (sgi_recording->malloc_records) {
-                sgi_splay_tree_insert(sgi_recording->malloc_records, return_val, stackid_and_flags, category_and_size);
-            } else {
-                sgi_disable_stack_logging();
-            }
-        }
-        // 此处若直接回调让外部处理，需要处理死锁问题。故此处延后到 sgi_malloc_unlock_stack_logging 锁结束后处理
-        if (chunk_malloc_detector_enable && chunk_malloc_detector_threshold_in_bytes < size && chunk_malloc_detector_block != NULL) {
-            memcpy(frames_for_chunk_malloc, current_frames, current_frames_count * sizeof(vm_address_t));
-            frames_count_for_chunk_malloc = current_frames_count;
-        }
-    }
+    sgi_record_allocation(type_flags, return_val, size, uniqueStackIdentifier);
 
 out:
 
 #if SGI_ALLOCATIONS_DEBUG
+    sgi_record_hook_latency(hook_start_time, hook_start_expansions);
+
+    // the hook runs on any thread, relaxed atomics keep the counters from losing updates.
     if (type_flags & sgi_allocations_type_alloc) {
         if (uniqueStackIdentifier != sgi_vm_invalid_stack_id)
-            malloc_size_counter += size;
-        alive_ptr_count++;
+            __atomic_fetch_add(&malloc_size_counter, size, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&alive_ptr_count, 1, __ATOMIC_RELAXED);
     } else if (type_flags & sgi_allocations_type_dealloc) {
-        malloc_size_counter -= size;
-        alive_ptr_count--;
+        __atomic_fetch_sub(&malloc_size_counter, size, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&alive_ptr_count, 1, __ATOMIC_RELAXED);
     } else if (type_flags & sgi_allocations_type_vm_allocate) {
-        vm_allocate_size_counter += size;
-        alive_ptr_count++;
+        __atomic_fetch_add(&vm_allocate_size_counter, size, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&alive_ptr_count, 1, __ATOMIC_RELAXED);
     } else if (type_flags & sgi_allocations_type_vm_deallocate) {
-        vm_allocate_size_counter -= size;
-        alive_ptr_count--;
+        __atomic_fetch_sub(&vm_allocate_size_counter, size, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&alive_ptr_count, 1, __ATOMIC_RELAXED);
     }
 
-    if (++count % 500000 == 0) {
+    uint64_t call_count = __atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+    if (call_count % 500000 == 0) {
         struct task_basic_info info;
         mach_msg_type_number_t size = (sizeof(task_basic_info_data_t) / sizeof(natural_t));
         task_info(mach_task_self(), TASK_BASIC_INFO, (task_info_t)&info, &size);
         int64_t memoryAppUsedInByte = info.resident_size;
 
-        SGIAPMMallocLog("malloc: %y, vm: %y, api: %y, alive_ptr: %d, call_count: %d\n", malloc_size_counter, vm_allocate_size_counter, memoryAppUsedInByte, alive_ptr_count, count);
+        SGIAPMMallocLog("malloc: %y, vm: %y, api: %y, alive_ptr: %d, call_count: %d\n", __atomic_load_n(&malloc_size_counter, __ATOMIC_RELAXED),
+            __atomic_load_n(&vm_allocate_size_counter, __ATOMIC_RELAXED), memoryAppUsedInByte, __atomic_load_n(&alive_ptr_count, __ATOMIC_RELAXED), call_count);
+        sgi_log_hook_latency();
     }
 
 #endif
 
-    thread_doing_logging = 0;
-    sgi_memory_allocate_logging_unlock();
+    sgi_logging_leave_current_thread();
 
     if (chunk_malloc_detector_enable && chunk_malloc_detector_threshold_in_bytes < size && chunk_malloc_detector_block != NULL && frames_count_for_chunk_malloc > 0) {
-        chunk_malloc_detector_block(size, frames_for_chunk_malloc, frames_count_for_chunk_malloc);
+        chunk_malloc_detector_block(size, frames, frames_count_for_chunk_malloc);
     }
 }
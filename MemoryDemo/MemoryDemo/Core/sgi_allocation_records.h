@@ -0,0 +1,115 @@
+//
+// sgi_allocation_records.h
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+
+#ifndef sgi_allocation_records_h
+#define sgi_allocation_records_h
+
+#include <mach/mach.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "sgi_address_filter.h"
+#include "sgi_category_table.h"
+#include "sgi_hash_table.h"
+#include "sgi_splay_tree.h"
+#include "sgi_stack_aggregates.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SGI_ALLOCATIONS_RECORDS_SHARD_COUNT 8 // power of 2, the live allocations are split by hashed address bits
+
+typedef enum {
+    sgi_allocation_records_backend_splay_tree = 0, /**< sgi_splay_tree */
+    sgi_allocation_records_backend_hash_table = 1, /**< sgi_hash_table, fewer cache misses per lookup */
+} sgi_allocation_records_backend;
+
+/*
+ Live allocation store.
+
+ The records are split into `SGI_ALLOCATIONS_RECORDS_SHARD_COUNT` shards by hashed address bits, every shard has its own
+ lock and its own splay tree (or hash table) mmaped to `<path>.<shard index>`. Operations on different shards never
+ contend, so frees on different threads proceed in parallel.
+
+ A lock free bloom filter of the inserted addresses is kept as well, deleting an address that was never inserted (e.g.
+ allocated before start, not sampled or without app frames) returns before taking any lock. The filter is rebuilt for
+ the new capacity (under `lock_all`) when a shard expands, so it keeps rejecting as the records grow.
+
+ The live bytes and allocations of every stack id are kept up to date in `<path>.stacks` (sgi_stack_aggregates), a
+ report can walk the stacks instead of all the live records.
+
+ The category of a record is an id of `categories` (sgi_category_table), shared by the malloc and vm records. The live
+ bytes and allocations of the categories are updated on insert, delete and set_category.
+ */
+typedef struct _sgi_allocation_records sgi_allocation_records;
+
+sgi_allocation_records *sgi_allocation_records_create(size_t entry_count, const char *path, sgi_allocation_records_backend backend, sgi_category_table *categories); /**< entry_count is the total of all shards, `categories` is not owned and may be NULL */
+void sgi_allocation_records_close(sgi_allocation_records *records); /**< close the mmap files, the struct itself is kept for in-flight callers */
+
+/*
+ The records a session left in the files of `path`, e.g. after the process was killed, for reports only: read-only
+ private mappings, nothing is written back. `backend` is the one the files were created with. The stacks file is used
+ if it adds up to the shards (checked with a scan of the records), otherwise reports scan the records. The category ids
+ resolve with the category strings file of the session, there is no category table. Release it with `open_release`,
+ never `close`. NULL if a shard can't be read.
+ */
+sgi_allocation_records *sgi_allocation_records_open(const char *path, sgi_allocation_records_backend backend);
+void sgi_allocation_records_open_release(sgi_allocation_records *records);
+
+/*
+ Each call locks the shard of `addr` only.
+ */
+bool sgi_allocation_records_insert(sgi_allocation_records *records, vm_address_t addr, uint64_t stackid_and_flags, uint64_t category_and_size);
+sgi_splay_tree_node sgi_allocation_records_delete(sgi_allocation_records *records, vm_address_t addr); /**< returns the removed record, zeroed if not found */
+bool sgi_allocation_records_set_category(sgi_allocation_records *records, vm_address_t addr, uint64_t category); /**< `category` is an id of the category table, returns false if not found */
+
+/*
+ Freeze all the shards, e.g. while generating report. Shard trees are only safe to read between these calls.
+ */
+void sgi_allocation_records_lock_all(sgi_allocation_records *records);
+void sgi_allocation_records_unlock_all(sgi_allocation_records *records);
+
+/*
+ A copy of the records taken with all the shards locked for the copy only, a report reads it while the records go on
+ changing. The read functions that need `lock_all` take a snapshot without locking. The category table is shared, its
+ names are never removed. With `stacks_only`, complete stacks are copied alone (all a report reads) and the shards of the
+ snapshot are empty. Release it with `snapshot_release`, never `close`. NULL on failure.
+ */
+sgi_allocation_records *sgi_allocation_records_snapshot(sgi_allocation_records *records, bool stacks_only);
+void sgi_allocation_records_snapshot_release(sgi_allocation_records *snapshot);
+
+typedef void (*sgi_allocation_records_enumerator)(vm_address_t addr, uint64_t stackid_and_flags, uint64_t category_and_size, void *context);
+
+typedef struct {
+    uint64_t rejected_deletes; /**< rejected by the address filter, no lock taken */
+    uint64_t passed_deletes;   /**< passed the address filter and looked up */
+    uint64_t false_positives;  /**< passed the address filter but not found */
+} sgi_allocation_records_filter_stats;
+
+void sgi_allocation_records_get_filter_stats(sgi_allocation_records *records, sgi_allocation_records_filter_stats *out_stats); /**< relaxed reads, not a snapshot */
+
+/*
+ The live bytes/allocations per stack id, needs `lock_all`. Returns false without enumerating if they are not available
+ (the stacks file failed or stopped growing), scan the records instead then.
+ The sizes are those of `sgi_allocation_records_aggregated_size`.
+ */
+bool sgi_allocation_records_enumerate_stacks(sgi_allocation_records *records, sgi_stack_aggregates_enumerator enumerator, void *context);
+uint64_t sgi_allocation_records_aggregated_size(sgi_allocation_records *records, uint64_t size); /**< a splay tree may round the sizes it keeps, the stacks are added the same rounded sizes */
+
+const char *sgi_allocation_records_category_name(sgi_allocation_records *records, uint64_t category); /**< name of a category id of the records, NULL if none */
+
+uint32_t sgi_allocation_records_shard_count(sgi_allocation_records *records);
+void sgi_allocation_records_enumerate_shard(sgi_allocation_records *records, uint32_t shard_index, sgi_allocation_records_enumerator enumerator, void *context); /**< live records only, needs `lock_all` */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* sgi_allocation_records_h */
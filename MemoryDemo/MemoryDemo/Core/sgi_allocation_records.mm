@@ -0,0 +1,523 @@
+//
+// sgi_allocation_records.mm
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+
+#include "sgi_allocation_records.h"
+
+#include <string.h>
+#include <sys/syslimits.h>
+
+#import "SGIAPMCommonDef.h"
+
+#include "sgi_inner_allocate.h"
+#include "sgi_locking.h"
+
+// MARK: - Constants/Globals
+
+#define SGI_ALLOCATIONS_RECORDS_MIN_SHARD_ENTRY_COUNT 1024
+
+typedef struct {
+    _malloc_lock_s lock;
+    sgi_allocation_records_backend backend;
+    sgi_splay_tree *tree;  // backend splay tree
+    sgi_hash_table *table; // backend hash table
+    uint64_t passed_deletes;  // shard locked
+    uint64_t false_positives; // shard locked
+    uint64_t rejected_deletes __attribute__((aligned(64))); // atomic, off the line of the lock
+} __attribute__((aligned(128))) sgi_allocation_records_shard; // one shard per cache line, locks never share a line
+
+struct _sgi_allocation_records {
+    sgi_allocation_records_shard shards[SGI_ALLOCATIONS_RECORDS_SHARD_COUNT];
+    sgi_address_filter *filter; // replaced under lock_all as the shards grow, never freed as it is read without lock. NULL if failed to create
+    size_t filter_capacity;     // records the filter was sized for, lock_all
+    sgi_allocation_records_backend backend;
+    sgi_stack_aggregates *stacks; // updated under the shard lock of the record, NULL if failed to create
+    sgi_category_table *categories; // not owned, updated under the shard lock of the record in the row of the shard, may be NULL
+};
+
+static inline sgi_allocation_records_shard *sgi_shard_of_address(sgi_allocation_records *records, vm_address_t addr) {
+    // the low 4 bits are always 0 for malloc, fibonacci hashing spreads the rest.
+    uint64_t hash = ((uint64_t)addr >> 4) * 0x9E3779B97F4A7C15ull;
+    return &records->shards[(hash >> 32) & (SGI_ALLOCATIONS_RECORDS_SHARD_COUNT - 1)];
+}
+
+static inline uint32_t sgi_shard_index(sgi_allocation_records *records, sgi_allocation_records_shard *shard) {
+    return (uint32_t)(shard - records->shards);
+}
+
+_Static_assert(SGI_CATEGORY_TABLE_SHARD_COUNT == SGI_ALLOCATIONS_RECORDS_SHARD_COUNT, "a row of category totals per shard");
+
+// MARK: - Backends, shard locked
+
+static bool sgi_shard_is_valid(sgi_allocation_records_shard *shard) {
+    return shard->backend == sgi_allocation_records_backend_hash_table ? shard->table != NULL : shard->tree != NULL;
+}
+
+// `out_expanded` is set when the backend had to be expanded.
+static bool sgi_shard_insert(sgi_allocation_records_shard *shard, vm_address_t addr, uint64_t stackid_and_flags, uint64_t category_and_size, bool *out_expanded) {
+    if (shard->backend == sgi_allocation_records_backend_hash_table) {
+        if (sgi_hash_table_insert(shard->table, addr, stackid_and_flags, category_and_size)) {
+            return true;
+        }
+        *out_expanded = true;
+        shard->table = sgi_expand_hash_table(shard->table);
+        return shard->table && sgi_hash_table_insert(shard->table, addr, stackid_and_flags, category_and_size);
+    }
+
+    if (sgi_splay_tree_insert(shard->tree, addr, stackid_and_flags, category_and_size)) {
+        return true;
+    }
+    *out_expanded = true;
+    shard->tree = sgi_expand_splay_tree(shard->tree);
+    return shard->tree && sgi_splay_tree_insert(shard->tree, addr, stackid_and_flags, category_and_size);
+}
+
+// entries the backend of the shard has room for.
+static size_t sgi_shard_capacity(sgi_allocation_records_shard *shard) {
+    if (shard->table) {
+        return (size_t)shard->table->bucket_count * SGI_HASH_TABLE_BUCKET_ENTRY_COUNT;
+    }
+    return shard->tree ? shard->tree->max_index : 0;
+}
+
+static bool sgi_shard_contains(sgi_allocation_records_shard *shard, vm_address_t addr) {
+    if (shard->backend == sgi_allocation_records_backend_hash_table) {
+        return sgi_hash_table_search(shard->table, addr) != NULL;
+    }
+    return sgi_splay_tree_search(shard->tree, addr, false) != 0;
+}
+
+static sgi_splay_tree_node sgi_shard_delete(sgi_allocation_records_shard *shard, vm_address_t addr) {
+    if (shard->backend == sgi_allocation_records_backend_splay_tree) {
+        return sgi_splay_tree_delete(shard->tree, addr);
+    }
+
+    // callers only look at the record fields, so the hash entry is returned as a node.
+    sgi_splay_tree_node removed;
+    memset(&removed, 0, sizeof(removed));
+    sgi_hash_table_entry entry = sgi_hash_table_delete(shard->table, addr);
+    if (entry.addr_cnt.cnt > 0) {
+        removed.addr_cnt.addr = addr;
+        removed.addr_cnt.cnt = entry.addr_cnt.cnt;
+        removed.category_and_size = entry.category_and_size;
+        removed.stackid_and_flags = entry.stackid_and_flags;
+    }
+    return removed;
+}
+
+// the outs are read before the change.
+static bool sgi_shard_set_category(sgi_allocation_records_shard *shard, vm_address_t addr, uint64_t category, uint64_t *out_stackid_and_flags, uint64_t *out_category_and_size) {
+    if (shard->backend == sgi_allocation_records_backend_splay_tree) {
+        return sgi_splay_tree_set_category(shard->tree, addr, category, out_stackid_and_flags, out_category_and_size);
+    }
+
+    sgi_hash_table_entry *entry = sgi_hash_table_search(shard->table, addr);
+    if (entry == NULL) {
+        return false;
+    }
+    *out_stackid_and_flags = entry->stackid_and_flags;
+    *out_category_and_size = entry->category_and_size;
+    size_t size = SGI_ALLOCATIONS_SIZE(entry->category_and_size);
+    entry->category_and_size = SGI_ALLOCATIONS_CATEGORY_AND_SIZE(category, size);
+    return true;
+}
+
+// the copy gets the backend of the shard, `snapshot` is zeroed.
+static bool sgi_shard_snapshot(sgi_allocation_records_shard *shard, sgi_allocation_records_shard *snapshot) {
+    _malloc_lock_init(&snapshot->lock);
+    snapshot->backend = shard->backend;
+    if (shard->table) {
+        snapshot->table = sgi_hash_table_snapshot(shard->table);
+        return snapshot->table != NULL;
+    }
+    if (shard->tree) {
+        snapshot->tree = sgi_splay_tree_snapshot(shard->tree);
+        return snapshot->tree != NULL;
+    }
+    return true;
+}
+
+static void sgi_shard_snapshot_release(sgi_allocation_records_shard *snapshot) {
+    sgi_hash_table_snapshot_release(snapshot->table);
+    sgi_splay_tree_snapshot_release(snapshot->tree);
+    snapshot->table = NULL;
+    snapshot->tree = NULL;
+}
+
+static void sgi_shard_close(sgi_allocation_records_shard *shard) {
+    if (shard->tree) {
+        sgi_splay_tree_close(shard->tree);
+        shard->tree = NULL;
+    }
+    if (shard->table) {
+        sgi_hash_table_close(shard->table);
+        shard->table = NULL;
+    }
+}
+
+// MARK: - Address filter
+
+static void sgi_add_record_to_filter(vm_address_t addr, uint64_t stackid_and_flags, uint64_t category_and_size, void *context) {
+    sgi_address_filter_add((sgi_address_filter *)context, addr);
+}
+
+// the filter is sized once, past that its counters fill up and saturate and it lets most deletes through. a shard
+// expanded, give the filter the capacity all the shards will have once they follow.
+static void sgi_allocation_records_grow_filter(sgi_allocation_records *records) {
+    sgi_allocation_records_lock_all(records);
+    size_t capacity = 0;
+    for (uint32_t i = 0; i < SGI_ALLOCATIONS_RECORDS_SHARD_COUNT; i++) {
+        size_t shard_capacity = sgi_shard_capacity(&records->shards[i]);
+        if (shard_capacity > capacity) {
+            capacity = shard_capacity;
+        }
+    }
+    capacity *= SGI_ALLOCATIONS_RECORDS_SHARD_COUNT;
+
+    sgi_address_filter *filter = NULL;
+    if (capacity > records->filter_capacity) {
+        filter = sgi_address_filter_create(capacity);
+    }
+    if (filter) {
+        // one add per live record, as the inserts do.
+        for (uint32_t i = 0; i < SGI_ALLOCATIONS_RECORDS_SHARD_COUNT; i++) {
+            sgi_allocation_records_enumerate_shard(records, i, sgi_add_record_to_filter, filter);
+        }
+        records->filter_capacity = capacity;
+        // release, deletes load it without a lock. the old one is not freed, deletes that loaded it may still read it.
+        __atomic_store_n(&records->filter, filter, __ATOMIC_RELEASE);
+    }
+    sgi_allocation_records_unlock_all(records);
+}
+
+// MARK: - Public
+
+sgi_allocation_records *sgi_allocation_records_create(size_t entry_count, const char *path, sgi_allocation_records_backend backend, sgi_category_table *categories) {
+    sgi_allocation_records *records = (sgi_allocation_records *)sgi_allocate_page(round_page(sizeof(sgi_allocation_records)));
+    if (records == NULL) {
+        SGIAPMMallocLog("[APM][Alloc] fail to allocate allocation records.\n");
+        return NULL;
+    }
+
+    size_t shard_entry_count = entry_count / SGI_ALLOCATIONS_RECORDS_SHARD_COUNT;
+    if (shard_entry_count < SGI_ALLOCATIONS_RECORDS_MIN_SHARD_ENTRY_COUNT) {
+        shard_entry_count = SGI_ALLOCATIONS_RECORDS_MIN_SHARD_ENTRY_COUNT;
+    }
+
+    for (uint32_t i = 0; i < SGI_ALLOCATIONS_RECORDS_SHARD_COUNT; i++) {
+        sgi_allocation_records_shard *shard = &records->shards[i];
+        _malloc_lock_init(&shard->lock);
+        shard->backend = backend;
+
+        char shard_path[PATH_MAX];
+        snprintf(shard_path, sizeof(shard_path), "%s.%u", path, i);
+        if (backend == sgi_allocation_records_backend_hash_table) {
+            shard->table = sgi_hash_table_create_on_mmapfile(shard_entry_count, shard_path);
+        } else {
+            shard->tree = sgi_splay_tree_create_on_mmapfile(shard_entry_count, shard_path);
+        }
+        if (!sgi_shard_is_valid(shard)) {
+            SGIAPMMallocLog("[APM][Alloc] fail to create records shard %s.\n", shard_path);
+        }
+    }
+
+    records->filter_capacity = entry_count;
+    records->filter = sgi_address_filter_create(records->filter_capacity);
+    records->categories = categories;
+
+    char stacks_path[PATH_MAX];
+    snprintf(stacks_path, sizeof(stacks_path), "%s.stacks", path);
+    records->backend = backend;
+    records->stacks = sgi_stack_aggregates_create(stacks_path, (uint32_t)entry_count);
+    if (records->stacks == NULL) {
+        SGIAPMMallocLog("[APM][Alloc] fail to create stack aggregates %s, reports scan the records.\n", stacks_path);
+    }
+    return records;
+}
+
+void sgi_allocation_records_close(sgi_allocation_records *records) {
+    if (records == NULL) {
+        return;
+    }
+
+    // the stacks are updated under any shard lock, close them with all the shards locked.
+    sgi_allocation_records_lock_all(records);
+    for (uint32_t i = 0; i < SGI_ALLOCATIONS_RECORDS_SHARD_COUNT; i++) {
+        sgi_shard_close(&records->shards[i]);
+    }
+    sgi_stack_aggregates_close(records->stacks);
+    records->stacks = NULL;
+    sgi_allocation_records_unlock_all(records);
+}
+
+typedef struct {
+    sgi_allocation_records *records;
+    uint64_t size;
+    uint64_t count;
+} sgi_allocation_records_totals;
+
+static void sgi_add_record_to_totals(vm_address_t addr, uint64_t stackid_and_flags, uint64_t category_and_size, void *context) {
+    sgi_allocation_records_totals *totals = (sgi_allocation_records_totals *)context;
+    totals->size += sgi_allocation_records_aggregated_size(totals->records, SGI_ALLOCATIONS_SIZE(category_and_size));
+    totals->count++;
+}
+
+static void sgi_add_stack_to_totals(uint64_t stackid_and_flags, uint64_t size, uint32_t count, uint64_t category, void *context) {
+    sgi_allocation_records_totals *totals = (sgi_allocation_records_totals *)context;
+    totals->size += size;
+    totals->count += count;
+}
+
+sgi_allocation_records *sgi_allocation_records_open(const char *path, sgi_allocation_records_backend backend) {
+    sgi_allocation_records *records = (sgi_allocation_records *)sgi_allocate_page(round_page(sizeof(sgi_allocation_records)));
+    if (records == NULL) {
+        SGIAPMMallocLog("[APM][Alloc] fail to allocate allocation records.\n");
+        return NULL;
+    }
+    records->backend = backend;
+
+    for (uint32_t i = 0; i < SGI_ALLOCATIONS_RECORDS_SHARD_COUNT; i++) {
+        sgi_allocation_records_shard *shard = &records->shards[i];
+        _malloc_lock_init(&shard->lock);
+        shard->backend = backend;
+
+        char shard_path[PATH_MAX];
+        snprintf(shard_path, sizeof(shard_path), "%s.%u", path, i);
+        if (backend == sgi_allocation_records_backend_hash_table) {
+            shard->table = sgi_hash_table_read_from_mmapfile(shard_path);
+        } else {
+            shard->tree = sgi_splay_tree_read_from_mmapfile(shard_path);
+        }
+        if (!sgi_shard_is_valid(shard)) {
+            SGIAPMMallocLog("[APM][Alloc] fail to open records shard %s.\n", shard_path);
+            sgi_allocation_records_open_release(records);
+            return NULL;
+        }
+    }
+
+    // the aggregates may have stopped growing in the session, only kept if they add up to the records.
+    char stacks_path[PATH_MAX];
+    snprintf(stacks_path, sizeof(stacks_path), "%s.stacks", path);
+    records->stacks = sgi_stack_aggregates_read_from_file(stacks_path);
+    if (records->stacks != NULL) {
+        sgi_allocation_records_totals scanned = {records, 0, 0};
+        sgi_allocation_records_totals aggregated = {records, 0, 0};
+        for (uint32_t i = 0; i < SGI_ALLOCATIONS_RECORDS_SHARD_COUNT; i++) {
+            sgi_allocation_records_enumerate_shard(records, i, sgi_add_record_to_totals, &scanned);
+        }
+        sgi_stack_aggregates_enumerate(records->stacks, sgi_add_stack_to_totals, &aggregated);
+        if (scanned.size != aggregated.size || scanned.count != aggregated.count) {
+            SGIAPMMallocLog("[APM][Alloc] stack aggregates %s don't match the records, reports scan the records.\n", stacks_path);
+            sgi_stack_aggregates_snapshot_release(records->stacks);
+            records->stacks = NULL;
+        }
+    }
+    return records;
+}
+
+void sgi_allocation_records_open_release(sgi_allocation_records *records) {
+    if (records == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < SGI_ALLOCATIONS_RECORDS_SHARD_COUNT; i++) {
+        sgi_shard_close(&records->shards[i]);
+    }
+    sgi_stack_aggregates_snapshot_release(records->stacks);
+    sgi_deallocate_pages(records, round_page(sizeof(sgi_allocation_records)));
+}
+
+bool sgi_allocation_records_insert(sgi_allocation_records *records, vm_address_t addr, uint64_t stackid_and_flags, uint64_t category_and_size) {
+    sgi_allocation_records_shard *shard = sgi_shard_of_address(records, addr);
+    bool result = false;
+
+    _malloc_lock_lock(&shard->lock);
+    // inserting an existing address only counts it once more in its record, the filter and the stacks only follow new
+    // records. the address filter rules out most new addresses without a lookup.
+    sgi_address_filter *filter = records->filter; // only replaced with all the shards locked
+    bool exists = false;
+    bool expanded = false;
+    if (sgi_shard_is_valid(shard)) {
+        exists = (filter || records->stacks || records->categories) && (filter == NULL || sgi_address_filter_may_contain(filter, addr)) && sgi_shard_contains(shard, addr);
+        result = sgi_shard_insert(shard, addr, stackid_and_flags, category_and_size, &expanded);
+    }
+    if (result && !exists) {
+        if (filter) {
+            sgi_address_filter_add(filter, addr);
+        }
+        uint64_t size = sgi_allocation_records_aggregated_size(records, SGI_ALLOCATIONS_SIZE(category_and_size));
+        sgi_stack_aggregates_add(records->stacks, stackid_and_flags, (int64_t)size, 1, SGI_ALLOCATIONS_CATEGORY(category_and_size));
+        sgi_category_table_add(records->categories, sgi_shard_index(records, shard), (uint32_t)SGI_ALLOCATIONS_CATEGORY(category_and_size), (int64_t)size, 1);
+    }
+    _malloc_lock_unlock(&shard->lock);
+
+    if (expanded && filter) {
+        sgi_allocation_records_grow_filter(records);
+    }
+    return result;
+}
+
+sgi_splay_tree_node sgi_allocation_records_delete(sgi_allocation_records *records, vm_address_t addr) {
+    sgi_allocation_records_shard *shard = sgi_shard_of_address(records, addr);
+    sgi_splay_tree_node removed;
+    memset(&removed, 0, sizeof(removed));
+
+    // a filter replaced meanwhile still holds every address it was given, it is never cleared.
+    sgi_address_filter *filter = __atomic_load_n(&records->filter, __ATOMIC_ACQUIRE);
+    if (filter && !sgi_address_filter_may_contain(filter, addr)) {
+        __atomic_fetch_add(&shard->rejected_deletes, 1, __ATOMIC_RELAXED);
+        return removed;
+    }
+
+    _malloc_lock_lock(&shard->lock);
+    if (sgi_shard_is_valid(shard)) {
+        removed = sgi_shard_delete(shard, addr);
+    }
+    shard->passed_deletes++;
+    if (removed.addr_cnt.cnt == 0) {
+        shard->false_positives++;
+    } else if (removed.addr_cnt.cnt == 1) {
+        if (records->filter) {
+            sgi_address_filter_remove(records->filter, addr);
+        }
+        uint64_t size = sgi_allocation_records_aggregated_size(records, SGI_ALLOCATIONS_SIZE(removed.category_and_size));
+        sgi_stack_aggregates_add(records->stacks, removed.stackid_and_flags, -(int64_t)size, -1, 0);
+        sgi_category_table_add(records->categories, sgi_shard_index(records, shard), (uint32_t)SGI_ALLOCATIONS_CATEGORY(removed.category_and_size), -(int64_t)size, -1);
+    }
+    _malloc_lock_unlock(&shard->lock);
+    return removed;
+}
+
+bool sgi_allocation_records_set_category(sgi_allocation_records *records, vm_address_t addr, uint64_t category) {
+    sgi_allocation_records_shard *shard = sgi_shard_of_address(records, addr);
+    bool found = false;
+
+    _malloc_lock_lock(&shard->lock);
+    uint64_t stackid_and_flags = 0;
+    uint64_t category_and_size = 0;
+    if (sgi_shard_is_valid(shard)) {
+        found = sgi_shard_set_category(shard, addr, category, &stackid_and_flags, &category_and_size);
+    }
+    if (found && category != 0) {
+        sgi_stack_aggregates_add(records->stacks, stackid_and_flags, 0, 0, category);
+    }
+    // the live bytes move to the new category.
+    uint64_t old_category = SGI_ALLOCATIONS_CATEGORY(category_and_size);
+    if (found && old_category != SGI_ALLOCATIONS_CATEGORY(category)) {
+        uint64_t size = sgi_allocation_records_aggregated_size(records, SGI_ALLOCATIONS_SIZE(category_and_size));
+        sgi_category_table_add(records->categories, sgi_shard_index(records, shard), (uint32_t)old_category, -(int64_t)size, -1);
+        sgi_category_table_add(records->categories, sgi_shard_index(records, shard), (uint32_t)SGI_ALLOCATIONS_CATEGORY(category), (int64_t)size, 1);
+    }
+    _malloc_lock_unlock(&shard->lock);
+    return found;
+}
+
+void sgi_allocation_records_lock_all(sgi_allocation_records *records) {
+    // always in shard order, `lock_all` callers never deadlock with each other.
+    for (uint32_t i = 0; i < SGI_ALLOCATIONS_RECORDS_SHARD_COUNT; i++) {
+        _malloc_lock_lock(&records->shards[i].lock);
+    }
+}
+
+void sgi_allocation_records_unlock_all(sgi_allocation_records *records) {
+    for (uint32_t i = SGI_ALLOCATIONS_RECORDS_SHARD_COUNT; i > 0; i--) {
+        _malloc_lock_unlock(&records->shards[i - 1].lock);
+    }
+}
+
+sgi_allocation_records *sgi_allocation_records_snapshot(sgi_allocation_records *records, bool stacks_only) {
+    sgi_allocation_records *snapshot = (sgi_allocation_records *)sgi_allocate_page(round_page(sizeof(sgi_allocation_records)));
+    if (snapshot == NULL) {
+        SGIAPMMallocLog("[APM][Alloc] fail to allocate records snapshot.\n");
+        return NULL;
+    }
+    snapshot->backend = records->backend;
+    snapshot->categories = records->categories;
+
+    // the stacks and the shards only change under shard locks, all locked they are consistent with each other.
+    bool copied = true;
+    sgi_allocation_records_lock_all(records);
+    if (sgi_stack_aggregates_is_complete(records->stacks)) {
+        snapshot->stacks = sgi_stack_aggregates_snapshot(records->stacks);
+    }
+    if (!stacks_only || snapshot->stacks == NULL) {
+        for (uint32_t i = 0; i < SGI_ALLOCATIONS_RECORDS_SHARD_COUNT && copied; i++) {
+            copied = sgi_shard_snapshot(&records->shards[i], &snapshot->shards[i]);
+        }
+    }
+    sgi_allocation_records_unlock_all(records);
+
+    if (!copied) {
+        SGIAPMMallocLog("[APM][Alloc] fail to copy records snapshot.\n");
+        sgi_allocation_records_snapshot_release(snapshot);
+        return NULL;
+    }
+    return snapshot;
+}
+
+void sgi_allocation_records_snapshot_release(sgi_allocation_records *snapshot) {
+    if (snapshot == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < SGI_ALLOCATIONS_RECORDS_SHARD_COUNT; i++) {
+        sgi_shard_snapshot_release(&snapshot->shards[i]);
+    }
+    sgi_stack_aggregates_snapshot_release(snapshot->stacks);
+    sgi_deallocate_pages(snapshot, round_page(sizeof(sgi_allocation_records)));
+}
+
+void sgi_allocation_records_get_filter_stats(sgi_allocation_records *records, sgi_allocation_records_filter_stats *out_stats) {
+    memset(out_stats, 0, sizeof(sgi_allocation_records_filter_stats));
+    for (uint32_t i = 0; i < SGI_ALLOCATIONS_RECORDS_SHARD_COUNT; i++) {
+        sgi_allocation_records_shard *shard = &records->shards[i];
+        out_stats->rejected_deletes += __atomic_load_n(&shard->rejected_deletes, __ATOMIC_RELAXED);
+        out_stats->passed_deletes += __atomic_load_n(&shard->passed_deletes, __ATOMIC_RELAXED);
+        out_stats->false_positives += __atomic_load_n(&shard->false_positives, __ATOMIC_RELAXED);
+    }
+}
+
+bool sgi_allocation_records_enumerate_stacks(sgi_allocation_records *records, sgi_stack_aggregates_enumerator enumerator, void *context) {
+    if (!sgi_stack_aggregates_is_complete(records->stacks)) {
+        return false;
+    }
+    sgi_stack_aggregates_enumerate(records->stacks, enumerator, context);
+    return true;
+}
+
+uint64_t sgi_allocation_records_aggregated_size(sgi_allocation_records *records, uint64_t size) {
+    return records->backend == sgi_allocation_records_backend_splay_tree ? sgi_splay_tree_stored_size(size) : size;
+}
+
+const char *sgi_allocation_records_category_name(sgi_allocation_records *records, uint64_t category) {
+    return sgi_category_table_name(records->categories, (uint32_t)category);
+}
+
+uint32_t sgi_allocation_records_shard_count(sgi_allocation_records *records) {
+    return SGI_ALLOCATIONS_RECORDS_SHARD_COUNT;
+}
+
+void sgi_allocation_records_enumerate_shard(sgi_allocation_records *records, uint32_t shard_index, sgi_allocation_records_enumerator enumerator, void *context) {
+    if (shard_index >= SGI_ALLOCATIONS_RECORDS_SHARD_COUNT) {
+        return;
+    }
+
+    sgi_allocation_records_shard *shard = &records->shards[shard_index];
+    if (shard->table) {
+        sgi_hash_table *table = shard->table;
+        for (uint32_t b = 0; b < table->bucket_count; b++) {
+            sgi_hash_table_bucket *bucket = &table->bucket[b];
+            for (uint32_t i = 0; i < SGI_HASH_TABLE_BUCKET_ENTRY_COUNT; i++) {
+                if (bucket->tags[i] != 0) {
+                    sgi_hash_table_entry *entry = &bucket->entry[i];
+                    enumerator((vm_address_t)entry->addr_cnt.addr << 4, entry->stackid_and_flags, entry->category_and_size, context);
+                }
+            }
+        }
+    } else if (shard->tree) {
+        sgi_splay_tree_enumerate(shard->tree, enumerator, context);
+    }
+}
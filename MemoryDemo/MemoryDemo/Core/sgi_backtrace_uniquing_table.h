@@ -12,6 +12,7 @@
 
 #include <mach/mach.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 
 #define SGI_ALLOCATIONS_DEBUG 0
@@ -39,10 +40,22 @@ extern "C" {
 #define SGI_VM_INITIAL_MAX_COLLIDE 20
 #define SGI_VM_DEFAULT_UNIQUING_PAGE_SIZE_WITH_SYS 1024   // memory cost: pages * vm_page_size(16386); default: 16MB
 #define SGI_VM_DEFAULT_UNIQUING_PAGE_SIZE_WITHOUT_SYS 256 // memory cost: pages * vm_page_size(16386); default: 4MB
+#define SGI_VM_MIXED_MAX_PROBES 64 // probe bound of the mixed hashing schemes, a full run triggers an expansion
+#define SGI_VM_IMAGE_RELATIVE_FLAG (1ull << 35) // set in the address of a node holding an offset into the images of the table
+#define SGI_VM_SLOT_ADDRESS_MASK ((1ull << 36) - 1) // the bits of a frame address a node holds
+#define SGI_VM_MAX_RETIRED_MAPPINGS 8 // mappings left behind by expansions that moved the table, one per move out of a reserved range (see sgi_mmap_reserve_size)
 
 
 const uint64_t sgi_vm_invalid_stack_id = (uint64_t)(-1ll);
 
+struct _sgi_dyld_image_info_;
+
+typedef enum {
+    sgi_uniquing_table_probing_modulo = 0,    /**< ((parent << 4) ^ (pc >> 2)) % size, stepping further on every collision, bounded by max_collide */
+    sgi_uniquing_table_probing_linear = 1,    /**< murmur finalizer of the node masked to a power of two, linear probing through cache lines */
+    sgi_uniquing_table_probing_quadratic = 2, /**< murmur finalizer of the node masked to a power of two, triangular probing */
+} sgi_uniquing_table_probing;
+
 
 // backtrace uniquing table chunks used in client-side stack log reading code,
 // in case we can't read the whole table in one mach_vm_read() call.
@@ -53,10 +66,12 @@ typedef struct _sgi_table_chunk_header {
     struct _sgi_table_chunk_header *next_table_chunk_header;
 } sgi_table_chunk_header_t;
 
-#pragma pack(push, 4)
+// not packed: `u.table` and the 64-bit statistics are accessed atomically, a 4-byte aligned 64-bit atomic is a library
+// call (and a -Watomic-alignment warning) on every access.
 typedef struct _sgi_backtrace_uniquing_table {
     FILE *mmap_fp;     // mmap file descriptor
     uint32_t fileSize; // mmap file size
+    uint64_t reservedSize; // virtual range reserved for in-place growth
     uint32_t numPages; // number of pages of the table
     uint32_t numNodes;
     uint32_t tableSize;
@@ -75,17 +90,40 @@ typedef struct _sgi_backtrace_uniquing_table {
         vm_address_t *table;                              // in "target" process;  allocated using vm_allocate()
         sgi_table_chunk_header_t *first_table_chunk_hdr; // in analysis process
     } u;
+    // inserters read numNodes, untouchableNodes, max_collide and the table pointer as one snapshot, odd while an
+    // expansion is writing them.
+    uint32_t geometrySeq;
+    // the mappings an expansion moved away from, inserters holding the old pointer may still be using them.
+    uint32_t retiredCount;
+    struct {
+        vm_address_t address;
+        uint64_t reservedSize;
+    } retired[SGI_VM_MAX_RETIRED_MAPPINGS];
+    uint32_t probing; // sgi_uniquing_table_probing
+    uint32_t expansions;
+    // statistics, updated with relaxed atomics when nodes are claimed, lookups of existing nodes are not counted.
+    // a claim only adds to the current generation and its probes, the other counters are updated by the expansions.
+    uint32_t maxProbeLength;   // of a claimed node
+    uint64_t previousNodesClaimed; // in the generations before the current one, added up by expansion
+    uint64_t activeNodesClaimed; // in the current generation, reset by expansion
+    uint64_t claimProbes;      // slots probed to claim the nodes
+    uint64_t insertFailures;   // frames that found no slot within the probe bound
+    uint64_t truncatedFrames;  // frames whose address was not stored verbatim, see `sgi_create_uniquing_table`
+    // image relative frames: the __TEXT ranges of the images follow the header, the nodes start at `nodesOffset`.
+    uint32_t imageCount;
+    uint32_t nodesOffset;
 } sgi_backtrace_uniquing_table;
-#pragma pack(pop)
 
 
 typedef vm_address_t sgi_slot_address;
 typedef uint32_t sgi_slot_parent;
 typedef uint32_t sgi_table_slot_index;
 
-#pragma pack(push, 4)
+// naturally aligned, the slots are claimed with an 8-byte compare-and-swap.
 typedef struct {
     union {
+        uint64_t value; // the whole slot, claimed with a compare-and-swap
+
         struct {
             uint32_t slot0;
             uint32_t slot1;
@@ -97,22 +135,56 @@ typedef struct {
         } normal_slot;
     };
 } sgi_table_slot_t;
-#pragma pack(pop)
 
 _Static_assert(sizeof(sgi_table_slot_t) == 8, "table_slot_t must be 64 bits");
+_Static_assert(__alignof__(sgi_table_slot_t) == 8, "table_slot_t must be 8 bytes aligned for its atomics");
+_Static_assert(__alignof__(sgi_backtrace_uniquing_table) == 8, "the table header must be 8 bytes aligned for its atomics");
+_Static_assert(offsetof(sgi_backtrace_uniquing_table, activeNodesClaimed) % 8 == 0 && offsetof(sgi_backtrace_uniquing_table, claimProbes) % 8 == 0 &&
+                   offsetof(sgi_backtrace_uniquing_table, insertFailures) % 8 == 0 && offsetof(sgi_backtrace_uniquing_table, truncatedFrames) % 8 == 0,
+               "the claim counters are 64-bit atomics");
 
 const sgi_slot_parent sgi_slot_no_parent_normal = 0xFFFFFFF; // 28 bits
 
-sgi_backtrace_uniquing_table *sgi_create_uniquing_table(const char *filepath, size_t default_page_size);
+/*
+ With `images`, a frame inside one of them is stored as SGI_VM_IMAGE_RELATIVE_FLAG | its offset into the concatenated
+ __TEXT ranges, instead of the absolute address truncated to 36 bits. Distinct pcs never share a node then, whatever
+ their address. The ranges are kept in the table file, `sgi_unwind_stack_from_table_index` returns absolute addresses
+ either way. Frames outside the images keep their low 36 bits as without images, except the rare one that would read
+ as an image offset (bit 35 set and the rest below the size of the ranges), that one is stored without bit 35.
+ A frame losing bits, either way, is counted in `truncated_frames`.
+ */
+sgi_backtrace_uniquing_table *sgi_create_uniquing_table(const char *filepath, size_t default_page_size, sgi_uniquing_table_probing probing, struct _sgi_dyld_image_info_ *images);
 
-sgi_backtrace_uniquing_table *sgi_read_uniquing_table_from(const char *filepath);
+sgi_backtrace_uniquing_table *sgi_read_uniquing_table_from(const char *filepath); /**< read-only, a private mapping of a table file left by a session, to unwind its stacks */
 
 void sgi_destroy_uniquing_table(sgi_backtrace_uniquing_table *table);
 
+/*
+ Not thread safe, expansions must be serialized by the caller. Inserters running on the old table at the same time
+ are fine, the old nodes stay in place and a moved mapping is only unmapped by `sgi_destroy_uniquing_table`.
+ */
 sgi_backtrace_uniquing_table *sgi_expand_uniquing_table(sgi_backtrace_uniquing_table *old_uniquing_table);
 
+/*
+ Thread safe, empty slots are claimed with a compare-and-swap and no lock is needed, also while another thread expands
+ the table. Returns 0 if the table is full, then expand it and enter the frames again.
+ */
 int sgi_enter_frames_in_table(sgi_backtrace_uniquing_table *uniquing_table, uint64_t *foundIndex, vm_address_t *frames, int32_t count);
 
+typedef struct {
+    double load_factor;           /**< claimed nodes of the current generation / its slots */
+    uint64_t nodes;               /**< claimed nodes of all generations */
+    uint64_t active_nodes;        /**< claimed nodes of the current generation */
+    uint64_t active_slots;        /**< slots of the current generation */
+    double mean_claim_probes;     /**< slots probed per claimed node */
+    uint32_t max_probe_length;    /**< longest probe run of a claimed node */
+    uint64_t insert_failures;     /**< frames that found no slot within the probe bound, each triggers an expansion */
+    uint64_t truncated_frames;    /**< frames entered with address bits a node does not hold, they unwind to another address */
+    uint32_t expansions;          /**< generations before the current one */
+} sgi_uniquing_table_stats;
+
+void sgi_uniquing_table_get_stats(sgi_backtrace_uniquing_table *uniquing_table, sgi_uniquing_table_stats *out_stats); /**< relaxed reads, not a snapshot */
+
 void sgi_add_new_slot(sgi_table_slot_t *table_slot, vm_address_t address, sgi_table_slot_index parent);
 
 void sgi_unwind_stack_from_table_index(sgi_backtrace_uniquing_table *uniquing_table,
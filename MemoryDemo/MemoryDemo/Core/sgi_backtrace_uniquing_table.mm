@@ -18,6 +18,7 @@
 #include <unistd.h>
 
 #import "SGIAPMCommonDef.h"
+#import "SGIDyldImagesUtil.h"
 
 #include "sgi_backtrace_uniquing_table.h"
 #include "sgi_file_utils.h"
@@ -29,9 +30,35 @@
 static const uint64_t max_table_size_lite = UINT32_MAX;
 //static const uint64_t max_table_size_normal = UINT64_MAX;
 
-sgi_backtrace_uniquing_table *_sgi_create_uniquing_table_with_fd(FILE *fp, size_t size);
+// __TEXT range of an image, `compact_begin` is its offset in the concatenated ranges of all the images.
+typedef struct {
+    uint64_t begin;
+    uint64_t end;
+    uint64_t compact_begin;
+} sgi_uniquing_table_image;
+
+// the nodes start on a cache line after the header and the images, 64-bit slots must be naturally aligned for the
+// compare-and-swap.
+static inline size_t _sgi_uniquing_table_nodes_offset(uint32_t imageCount) {
+    return (sizeof(sgi_backtrace_uniquing_table) + imageCount * sizeof(sgi_uniquing_table_image) + 63) & ~(size_t)63;
+}
+
+static inline sgi_uniquing_table_image *_sgi_uniquing_table_images(sgi_backtrace_uniquing_table *uniquing_table) {
+    return (sgi_uniquing_table_image *)(uniquing_table + 1);
+}
 
-sgi_backtrace_uniquing_table *sgi_create_uniquing_table(const char *filepath, size_t default_page_size) {
+// the fields inserters depend on, read as one snapshot.
+typedef struct {
+    vm_address_t *table;
+    uint32_t numNodes;
+    uint32_t untouchableNodes;
+    int32_t max_collide;
+    uint32_t mask; // the mixed hashing schemes use the largest power of two of the current generation
+} sgi_uniquing_table_geometry;
+
+sgi_backtrace_uniquing_table *_sgi_create_uniquing_table_with_fd(FILE *fp, size_t size, sgi_uniquing_table_probing probing, sgi_dyld_image_info *images);
+
+sgi_backtrace_uniquing_table *sgi_create_uniquing_table(const char *filepath, size_t default_page_size, sgi_uniquing_table_probing probing, sgi_dyld_image_info *images) {
     if (!sgi_is_file_exist(filepath)) {
         if (!sgi_create_file(filepath))
             return nullptr;
@@ -45,66 +72,164 @@ sgi_backtrace_uniquing_table *sgi_create_uniquing_table(const char *filepath, si
 
     SGIAPMMallocLog("create uniquing table, mmap to %s\n", filepath);
 
-    return _sgi_create_uniquing_table_with_fd(fp, default_page_size);
+    return _sgi_create_uniquing_table_with_fd(fp, default_page_size, probing, images);
 }
 
 sgi_backtrace_uniquing_table *sgi_read_uniquing_table_from(const char *filepath) {
     if (!sgi_is_file_exist(filepath))
         return nullptr;
 
-    FILE *fp = fopen(filepath, "rb+");
+    FILE *fp = fopen(filepath, "rb");
     if (fp == nullptr) {
         SGIAPMMallocLog("fail to open:%s, %s\n", filepath, strerror(errno));
         return nullptr;
     }
 
     size_t size = sgi_get_file_size(fileno(fp));
-    if (size <= 0)
+    if (size < sizeof(sgi_backtrace_uniquing_table)) {
+        fclose(fp);
         return nullptr;
+    }
 
-    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED, fileno(fp), 0);
-    if (ptr == MAP_FAILED)
+    // private, the header fields set below never reach the file.
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_FILE | MAP_PRIVATE, fileno(fp), 0);
+    if (ptr == MAP_FAILED) {
+        fclose(fp);
         return nullptr;
+    }
 
     sgi_backtrace_uniquing_table *utable = (sgi_backtrace_uniquing_table *)ptr;
+    if ((size_t)utable->nodesOffset + utable->tableSize > size) {
+        SGIAPMMallocLog("truncated uniquing table: %s\n", filepath);
+        munmap(ptr, size);
+        fclose(fp);
+        return nullptr;
+    }
     utable->mmap_fp = fp;
-    utable->u.table = (vm_address_t *)((char *)ptr + sizeof(sgi_backtrace_uniquing_table));
+    utable->reservedSize = size;
+    // the retired mappings are addresses of the writing process, not to be unmapped by `sgi_destroy_uniquing_table` here.
+    utable->retiredCount = 0;
+    utable->u.table = (vm_address_t *)((char *)ptr + utable->nodesOffset);
     utable->table_address = (uintptr_t)utable->u.table;
     return utable;
 }
 
-sgi_backtrace_uniquing_table *_sgi_create_uniquing_table_with_fd(FILE *fp, size_t numPages) {
-    size_t tableSize = (size_t)numPages * vm_page_size;
-    size_t fileSize = sizeof(sgi_backtrace_uniquing_table) + tableSize;
-
+static size_t _sgi_uniquing_table_file_size(size_t nodesOffset, size_t numPages) {
+    size_t fileSize = nodesOffset + (size_t)numPages * vm_page_size;
     if (fileSize < getpagesize() || (fileSize % getpagesize() != 0)) {
         fileSize = (fileSize / getpagesize() + 1) * getpagesize();
-        if (ftruncate(fileno(fp), fileSize) != 0) {
-            SGIAPMMallocLog("fail to truncate:%s, size:%zu\n", strerror(errno), fileSize);
+    }
+    return fileSize;
+}
+
+// the fields depending on the table size, `ptr` is the start of the mapping.
+static void _sgi_uniquing_table_set_pages(sgi_backtrace_uniquing_table *uniquing_table, void *ptr, size_t fileSize, size_t numPages) {
+    uniquing_table->fileSize = (uint32_t)fileSize;
+    uniquing_table->numPages = (uint32_t)numPages;
+    uniquing_table->tableSize = (uint32_t)(uniquing_table->numPages * vm_page_size);
+    uniquing_table->numNodes = (uint32_t)(((uniquing_table->tableSize / (sizeof(vm_address_t))) >> 1) << 1); // make sure it's even.
+    uniquing_table->u.table = (vm_address_t *)((char *)ptr + uniquing_table->nodesOffset);
+    uniquing_table->table_address = (uintptr_t)uniquing_table->u.table;
+}
+
+static void _sgi_uniquing_table_load_geometry(sgi_backtrace_uniquing_table *uniquing_table, sgi_uniquing_table_geometry *geometry) {
+    while (true) {
+        uint32_t seq = __atomic_load_n(&uniquing_table->geometrySeq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue; // an expansion is writing, it only updates a few fields
+        }
+        geometry->table = __atomic_load_n(&uniquing_table->u.table, __ATOMIC_RELAXED);
+        geometry->numNodes = __atomic_load_n(&uniquing_table->numNodes, __ATOMIC_RELAXED);
+        geometry->untouchableNodes = __atomic_load_n(&uniquing_table->untouchableNodes, __ATOMIC_RELAXED);
+        geometry->max_collide = __atomic_load_n(&uniquing_table->max_collide, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&uniquing_table->geometrySeq, __ATOMIC_RELAXED) == seq) {
+            uint32_t activeNodes = geometry->numNodes - geometry->untouchableNodes;
+            geometry->mask = (uint32_t)(0x80000000u >> __builtin_clz(activeNodes)) - 1;
+            return;
         }
     }
+}
+
+// the __TEXT ranges of `images` in address order, as long as the concatenated ranges fit below the flag bit.
+// the images are in load order, pick the next one by address each time, a few hundred images only cost that once per table.
+static uint32_t _sgi_uniquing_table_build_images(sgi_dyld_image_info *images, sgi_uniquing_table_image *out_images) {
+    if (images == NULL) {
+        return 0;
+    }
+
+    uint32_t count = 0;
+    uint64_t last_end = 0;
+    uint64_t compact_end = 0;
+    while (true) {
+        const sgi_dyld_image_item *next = NULL;
+        for (uint32_t i = 0; i < images->imageInfoCount; i++) {
+            const sgi_dyld_image_item *item = &images->allImageInfo[i];
+            // imageEndAddr is inclusive, overlapping images are skipped
+            if (item->imageBeginAddr < last_end || item->imageEndAddr < item->imageBeginAddr) {
+                continue;
+            }
+            if (next == NULL || item->imageBeginAddr < next->imageBeginAddr) {
+                next = item;
+            }
+        }
+        if (next == NULL) {
+            break;
+        }
+        uint64_t size = next->imageEndAddr + 1 - next->imageBeginAddr;
+        if (compact_end + size > SGI_VM_IMAGE_RELATIVE_FLAG) {
+            break;
+        }
+        if (out_images) {
+            out_images[count] = (sgi_uniquing_table_image){next->imageBeginAddr, next->imageEndAddr + 1, compact_end};
+        }
+        last_end = next->imageEndAddr + 1;
+        compact_end += size;
+        count++;
+    }
+    return count;
+}
+
+sgi_backtrace_uniquing_table *_sgi_create_uniquing_table_with_fd(FILE *fp, size_t numPages, sgi_uniquing_table_probing probing, sgi_dyld_image_info *images) {
+    size_t tableSize = (size_t)numPages * vm_page_size;
+    uint32_t imageCount = _sgi_uniquing_table_build_images(images, NULL);
+    size_t nodesOffset = _sgi_uniquing_table_nodes_offset(imageCount);
+    size_t fileSize = _sgi_uniquing_table_file_size(nodesOffset, numPages);
+
+    if (ftruncate(fileno(fp), fileSize) != 0) {
+        SGIAPMMallocLog("fail to truncate:%s, size:%zu\n", strerror(errno), fileSize);
+    }
 
     fseek(fp, 0, SEEK_SET);
 
-    void *ptr = mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED, fileno(fp), 0);
-    if (ptr == MAP_FAILED || ptr == MAP_FAILED) {
+    size_t reservedSize = sgi_mmap_reserve_size(fileSize);
+    void *ptr = sgi_mmap_reserve(fileno(fp), fileSize, reservedSize);
+    if (ptr == MAP_FAILED) {
         SGIAPMMallocLog("create uniquing_table, fail to mmap: %s\n", strerror(errno));
         return nullptr;
     }
 
+    // no bzero, the file is truncated on open and reads as zero, touching it would only raise the footprint.
     sgi_backtrace_uniquing_table *uniquing_table = (sgi_backtrace_uniquing_table *)ptr;
-    bzero(uniquing_table, fileSize);
     uniquing_table->mmap_fp = fp;
-    uniquing_table->fileSize = (uint32_t)fileSize;
-    uniquing_table->numPages = (uint32_t)numPages;
-    uniquing_table->tableSize = (uint32_t)(uniquing_table->numPages * vm_page_size);
-    uniquing_table->numNodes = (uint32_t)(((uniquing_table->tableSize / (sizeof(vm_address_t))) >> 1) << 1); // make sure it's even.
-    uniquing_table->u.table = (vm_address_t *)((char *)ptr + sizeof(sgi_backtrace_uniquing_table));
-    uniquing_table->table_address = (uintptr_t)uniquing_table->u.table;
+    uniquing_table->reservedSize = reservedSize;
+    uniquing_table->imageCount = _sgi_uniquing_table_build_images(images, _sgi_uniquing_table_images(uniquing_table));
+    uniquing_table->nodesOffset = (uint32_t)nodesOffset;
+    _sgi_uniquing_table_set_pages(uniquing_table, ptr, fileSize, numPages);
     uniquing_table->max_collide = SGI_VM_INITIAL_MAX_COLLIDE;
     uniquing_table->untouchableNodes = 0;
     uniquing_table->max_table_size = max_table_size_lite;
     uniquing_table->in_client_process = 0;
+    uniquing_table->geometrySeq = 0;
+    uniquing_table->retiredCount = 0;
+    uniquing_table->probing = probing;
+    uniquing_table->expansions = 0;
+    uniquing_table->maxProbeLength = 0;
+    uniquing_table->previousNodesClaimed = 0;
+    uniquing_table->activeNodesClaimed = 0;
+    uniquing_table->claimProbes = 0;
+    uniquing_table->insertFailures = 0;
+    uniquing_table->truncatedFrames = 0;
 
 #if SGI_ALLOCATIONS_DEBUG
     SGIAPMMallocLog("create_uniquing_table(): creating. page: %d*%d size: %lldKB == %lldMB, numnodes: %lld (%lld untouchable)\n",
@@ -120,7 +245,10 @@ void sgi_destroy_uniquing_table(sgi_backtrace_uniquing_table *table) {
     FILE *fp = 0;
     if (table != MAP_FAILED && table != nullptr) {
         fp = table->mmap_fp;
-        munmap(table, table->fileSize);
+        for (uint32_t i = 0; i < table->retiredCount; i++) {
+            sgi_munmap_reserved((void *)table->retired[i].address, (size_t)table->retired[i].reservedSize);
+        }
+        sgi_munmap_reserved(table, (size_t)table->reservedSize);
         table = nullptr;
     }
 
@@ -142,40 +270,51 @@ sgi_backtrace_uniquing_table *sgi_expand_uniquing_table(sgi_backtrace_uniquing_t
         return nullptr;
     }
 
-    uint32_t oldTableSize = old_uniquing_table->tableSize;
     uint32_t maxCollide = old_uniquing_table->max_collide + SGI_VM_COLLISION_GROWTH_RATE;
     uint32_t untouchableNodes = old_uniquing_table->numNodes;
 
-    malloc_zone_t *zone = malloc_create_zone(0, 0);
-    malloc_set_zone_name(zone, "backtrace_uniquing_table_tmp_zone");
-
 #if SGI_ALLOCATIONS_DEBUG
     SGIAPMMallocLog("expandUniquingTable(): expanded from nodes full: %lld of: %lld (~%2d%%); to nodes: %lld (inactive = %lld); unique "
         "bts: %lld\n",
         old_uniquing_table->nodesFull, old_uniquing_table->numNodes, (int)(((old_uniquing_table->nodesFull * 100.0) / (double)old_uniquing_table->numNodes) + 0.5),
         old_uniquing_table->numNodes, old_uniquing_table->untouchableNodes, old_uniquing_table->backtracesContained);
-    SGIAPMMallocLog("expandUniquingTable(): deallocate: %p; end: %p\n", oldTableSize, (void *)((uintptr_t)old_uniquing_table->u.table + (uintptr_t)oldTableSize));
 #endif
 
-    void *copy = (void *)zone->malloc(zone, oldTableSize);
-    memcpy(copy, old_uniquing_table->u.table, oldTableSize);
-    munmap(old_uniquing_table, old_uniquing_table->fileSize);
-
-    sgi_backtrace_uniquing_table *tmp_uniquing_table = _sgi_create_uniquing_table_with_fd(fp, newNumPages);
-
-    memcpy(tmp_uniquing_table->u.table, copy, oldTableSize);
-
-    zone->free(zone, copy);
-    copy = nullptr;
-    malloc_destroy_zone(zone);
-    zone = nullptr;
+    // the old nodes stay where they are, the file grows in place inside the reserved range and the new nodes read as zero.
+    size_t newFileSize = _sgi_uniquing_table_file_size(old_uniquing_table->nodesOffset, newNumPages);
+    size_t oldReservedSize = (size_t)old_uniquing_table->reservedSize;
+    if (newFileSize > oldReservedSize && old_uniquing_table->retiredCount == SGI_VM_MAX_RETIRED_MAPPINGS) {
+        SGIAPMMallocLog("[error] too many moves of uniquing table\n");
+        return nullptr;
+    }
 
-    if (tmp_uniquing_table == nullptr) {
+    // a moved table keeps the old mapping, inserters that loaded the old pointer may still be walking it.
+    size_t reservedSize = oldReservedSize;
+    void *ptr = sgi_mmap_grow_retaining(old_uniquing_table, fileno(fp), old_uniquing_table->fileSize, newFileSize, &reservedSize);
+    if (ptr == MAP_FAILED) {
+        SGIAPMMallocLog("expand uniquing_table, fail to mmap: %s\n", strerror(errno));
         return nullptr;
     }
 
+    // both mappings share the file, the header written through `ptr` is seen through the old pointer as well.
+    sgi_backtrace_uniquing_table *tmp_uniquing_table = (sgi_backtrace_uniquing_table *)ptr;
+    if (ptr != (void *)old_uniquing_table) {
+        tmp_uniquing_table->retired[tmp_uniquing_table->retiredCount].address = (vm_address_t)old_uniquing_table;
+        tmp_uniquing_table->retired[tmp_uniquing_table->retiredCount].reservedSize = oldReservedSize;
+        tmp_uniquing_table->retiredCount++;
+    }
+
+    uint32_t seq = tmp_uniquing_table->geometrySeq;
+    __atomic_store_n(&tmp_uniquing_table->geometrySeq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    tmp_uniquing_table->reservedSize = reservedSize;
+    _sgi_uniquing_table_set_pages(tmp_uniquing_table, ptr, newFileSize, newNumPages);
     tmp_uniquing_table->max_collide = maxCollide;
     tmp_uniquing_table->untouchableNodes = untouchableNodes;
+    tmp_uniquing_table->expansions++;
+    // the claims of inserters still on the old generation land in either counter, none is lost.
+    tmp_uniquing_table->previousNodesClaimed += __atomic_exchange_n(&tmp_uniquing_table->activeNodesClaimed, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&tmp_uniquing_table->geometrySeq, seq + 2, __ATOMIC_RELEASE);
 
 #if SGI_ALLOCATIONS_DEBUG
     SGIAPMMallocLog("expandUniquingTable(): allocate: %p; end: %p\n", tmp_uniquing_table->u.table,
@@ -186,11 +325,90 @@ sgi_backtrace_uniquing_table *sgi_expand_uniquing_table(sgi_backtrace_uniquing_t
     return tmp_uniquing_table;
 }
 
-void sgi_add_new_slot(sgi_table_slot_t *sgi_table_slot, vm_address_t address, sgi_table_slot_index parent) {
+static inline uint64_t _sgi_slot_value(vm_address_t address, sgi_table_slot_index parent) {
     sgi_table_slot_t new_slot;
+    new_slot.value = 0;
     new_slot.normal_slot.address = address;
     new_slot.normal_slot.parent = parent;
-    *sgi_table_slot = new_slot;
+    return new_slot.value;
+}
+
+void sgi_add_new_slot(sgi_table_slot_t *sgi_table_slot, vm_address_t address, sgi_table_slot_index parent) {
+    sgi_table_slot->value = _sgi_slot_value(address, parent);
+}
+
+// murmur3 fmix64 of the whole node (address and parent), nearby pcs spread over the table.
+static inline uint64_t _sgi_slot_hash(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdull;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ull;
+    value ^= value >> 33;
+    return value;
+}
+
+// the size of the concatenated ranges, image relative addresses are below SGI_VM_IMAGE_RELATIVE_FLAG | this.
+static inline uint64_t _sgi_uniquing_table_images_size(const sgi_uniquing_table_image *images, uint32_t imageCount) {
+    if (imageCount == 0) {
+        return 0;
+    }
+    const sgi_uniquing_table_image *last = &images[imageCount - 1];
+    return last->compact_begin + (last->end - last->begin);
+}
+
+// the image containing `pc`, or the absolute address if none does, as the node holds it. `truncated` is set when the
+// node can't hold `pc`: above 36 bits, or an absolute address that would decode as an image relative one.
+static inline vm_address_t _sgi_encode_frame(const sgi_uniquing_table_image *images, uint32_t imageCount, uint64_t imagesSize, vm_address_t pc, bool *truncated) {
+    vm_address_t address = pc & SGI_VM_SLOT_ADDRESS_MASK;
+    *truncated = address != pc;
+    if (imageCount == 0) {
+        return address;
+    }
+
+    const sgi_uniquing_table_image *base = images;
+    uint32_t count = imageCount;
+    while (count > 1) {
+        uint32_t half = count >> 1;
+        base = (base[half].begin <= pc) ? base + half : base;
+        count -= half;
+    }
+    if (pc < base->begin || pc >= base->end) {
+        if ((address & SGI_VM_IMAGE_RELATIVE_FLAG) != 0 && (address & (SGI_VM_IMAGE_RELATIVE_FLAG - 1)) < imagesSize) {
+            *truncated = true;
+            return address & (SGI_VM_IMAGE_RELATIVE_FLAG - 1);
+        }
+        return address;
+    }
+    *truncated = false;
+    return SGI_VM_IMAGE_RELATIVE_FLAG | (base->compact_begin + (pc - base->begin));
+}
+
+static inline vm_address_t _sgi_decode_frame(const sgi_uniquing_table_image *images, uint32_t imageCount, uint64_t imagesSize, vm_address_t address) {
+    if (imageCount == 0 || (address & SGI_VM_IMAGE_RELATIVE_FLAG) == 0) {
+        return address;
+    }
+
+    uint64_t offset = address & (SGI_VM_IMAGE_RELATIVE_FLAG - 1);
+    if (offset >= imagesSize) {
+        return address;
+    }
+    const sgi_uniquing_table_image *base = images;
+    uint32_t count = imageCount;
+    while (count > 1) {
+        uint32_t half = count >> 1;
+        base = (base[half].compact_begin <= offset) ? base + half : base;
+        count -= half;
+    }
+    return base->begin + (offset - base->compact_begin);
+}
+
+static void _sgi_uniquing_table_count_claim(sgi_backtrace_uniquing_table *uniquing_table, uint32_t probes) {
+    __atomic_fetch_add(&uniquing_table->activeNodesClaimed, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&uniquing_table->claimProbes, probes, __ATOMIC_RELAXED);
+    uint32_t maxProbeLength = __atomic_load_n(&uniquing_table->maxProbeLength, __ATOMIC_RELAXED);
+    while (probes > maxProbeLength &&
+           !__atomic_compare_exchange_n(&uniquing_table->maxProbeLength, &maxProbeLength, probes, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
 }
 
 int sgi_enter_frames_in_table(sgi_backtrace_uniquing_table *uniquing_table, uint64_t *foundIndex, vm_address_t *frames, int32_t count) {
@@ -199,12 +417,22 @@ int sgi_enter_frames_in_table(sgi_backtrace_uniquing_table *uniquing_table, uint
     // The hash values need to be the same size as the addresses (because we use the value -1), for clarity, define a new type
     typedef vm_address_t hash_index_t;
 
+    // an expansion may run meanwhile, probing the old geometry is still valid since its nodes are never moved.
+    // a stack entered there gets an id of its own, only costing a duplicate of the chain.
+    sgi_uniquing_table_geometry geometry;
+    _sgi_uniquing_table_load_geometry(uniquing_table, &geometry);
+
     hash_index_t uParent = sgi_slot_no_parent_normal;
-    hash_index_t modulus = (uniquing_table->numNodes - uniquing_table->untouchableNodes - 1);
+    hash_index_t modulus = (geometry.numNodes - geometry.untouchableNodes - 1);
 
     int32_t lcopy = count;
     int32_t returnVal = 1;
-    hash_index_t hash_multiplier = ((uniquing_table->numNodes - uniquing_table->untouchableNodes) / (uniquing_table->max_collide * 2 + 1));
+    hash_index_t hash_multiplier = ((geometry.numNodes - geometry.untouchableNodes) / (geometry.max_collide * 2 + 1));
+    uint32_t probing = uniquing_table->probing;
+    uint32_t imageCount = uniquing_table->imageCount;
+    const sgi_uniquing_table_image *images = _sgi_uniquing_table_images(uniquing_table);
+    uint64_t imagesSize = _sgi_uniquing_table_images_size(images, imageCount);
+    int32_t max_probes = probing == sgi_uniquing_table_probing_modulo ? geometry.max_collide : SGI_VM_MIXED_MAX_PROBES;
 
 #if SGI_ALLOCATIONS_DEBUG
     static int32_t total_frame_count = 0;
@@ -219,40 +447,62 @@ int sgi_enter_frames_in_table(sgi_backtrace_uniquing_table *uniquing_table, uint
 
 
     while (--lcopy >= 0) {
-        vm_address_t thisPC = frames[lcopy];
-        hash_index_t hash = uniquing_table->untouchableNodes + (((uParent << 4) ^ (thisPC >> 2)) % modulus);
-        int32_t collisions = uniquing_table->max_collide;
+        bool truncated;
+        vm_address_t thisPC = _sgi_encode_frame(images, imageCount, imagesSize, frames[lcopy], &truncated);
+        if (truncated) {
+            __atomic_fetch_add(&uniquing_table->truncatedFrames, 1, __ATOMIC_RELAXED);
+        }
+        uint64_t new_value = _sgi_slot_value(thisPC, (sgi_table_slot_index)uParent);
+        hash_index_t hash;
+        if (probing == sgi_uniquing_table_probing_modulo) {
+            hash = geometry.untouchableNodes + (((uParent << 4) ^ (thisPC >> 2)) % modulus);
+        } else {
+            hash = geometry.untouchableNodes + (_sgi_slot_hash(new_value) & geometry.mask);
+        }
+        int32_t collisions = max_probes;
 
         while (collisions--) {
-            sgi_table_slot_t *sgi_table_slot = (sgi_table_slot_t *)(uniquing_table->u.table + hash);
-
-            if (sgi_table_slot->slots.slot0 == 0 && sgi_table_slot->slots.slot1 == 0) {
-                sgi_add_new_slot(sgi_table_slot, thisPC, (sgi_table_slot_index)uParent);
-
+            sgi_table_slot_t *sgi_table_slot = (sgi_table_slot_t *)(geometry.table + hash);
+
+            // acquire, the parents of a node another thread entered are visible before the node.
+            sgi_table_slot_t slot;
+            slot.value = __atomic_load_n(&sgi_table_slot->value, __ATOMIC_ACQUIRE);
+            if (slot.value == 0) {
+                if (__atomic_compare_exchange_n(&sgi_table_slot->value, &slot.value, new_value, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    _sgi_uniquing_table_count_claim(uniquing_table, (uint32_t)(max_probes - collisions));
 #if SGI_ALLOCATIONS_DEBUG
-                unique_stacks = false;
-                new_slots_count++;
+                    unique_stacks = false;
+                    new_slots_count++;
 #endif
-                uParent = hash;
-                break;
+                    uParent = hash;
+                    break;
+                }
+                // another thread claimed the slot first, `slot` holds its node, maybe the same frame.
             }
 
-            sgi_slot_address address = (sgi_slot_address)sgi_table_slot->normal_slot.address;
-            sgi_slot_parent parent = sgi_table_slot->normal_slot.parent;
+            sgi_slot_address address = (sgi_slot_address)slot.normal_slot.address;
+            sgi_slot_parent parent = slot.normal_slot.parent;
 
             if (address == thisPC && parent == uParent) {
                 uParent = hash;
                 break;
             }
 
-            hash += collisions * hash_multiplier + 1;
+            if (probing == sgi_uniquing_table_probing_modulo) {
+                hash += collisions * hash_multiplier + 1;
 
-            if (hash >= uniquing_table->numNodes) {
-                hash -= (uniquing_table->numNodes - uniquing_table->untouchableNodes); // wrap around.
+                if (hash >= geometry.numNodes) {
+                    hash -= (geometry.numNodes - geometry.untouchableNodes); // wrap around.
+                }
+            } else {
+                // linear: +1, quadratic: +1, +2, +3... (triangular numbers visit every slot of a power of two)
+                hash_index_t step = probing == sgi_uniquing_table_probing_linear ? 1 : (hash_index_t)(max_probes - collisions);
+                hash = geometry.untouchableNodes + ((hash - geometry.untouchableNodes + step) & geometry.mask);
             }
         }
 
         if (collisions < 0) {
+            __atomic_fetch_add(&uniquing_table->insertFailures, 1, __ATOMIC_RELAXED);
             returnVal = 0;
             break;
         }
@@ -273,6 +523,22 @@ int sgi_enter_frames_in_table(sgi_backtrace_uniquing_table *uniquing_table, uint
     return returnVal;
 }
 
+void sgi_uniquing_table_get_stats(sgi_backtrace_uniquing_table *uniquing_table, sgi_uniquing_table_stats *out_stats) {
+    sgi_uniquing_table_geometry geometry;
+    _sgi_uniquing_table_load_geometry(uniquing_table, &geometry);
+
+    out_stats->active_nodes = __atomic_load_n(&uniquing_table->activeNodesClaimed, __ATOMIC_RELAXED);
+    out_stats->nodes = __atomic_load_n(&uniquing_table->previousNodesClaimed, __ATOMIC_RELAXED) + out_stats->active_nodes;
+    out_stats->active_slots = geometry.numNodes - geometry.untouchableNodes;
+    out_stats->load_factor = out_stats->active_slots ? (double)out_stats->active_nodes / out_stats->active_slots : 0;
+    uint64_t claimProbes = __atomic_load_n(&uniquing_table->claimProbes, __ATOMIC_RELAXED);
+    out_stats->mean_claim_probes = out_stats->nodes ? (double)claimProbes / out_stats->nodes : 0;
+    out_stats->max_probe_length = __atomic_load_n(&uniquing_table->maxProbeLength, __ATOMIC_RELAXED);
+    out_stats->insert_failures = __atomic_load_n(&uniquing_table->insertFailures, __ATOMIC_RELAXED);
+    out_stats->truncated_frames = __atomic_load_n(&uniquing_table->truncatedFrames, __ATOMIC_RELAXED);
+    out_stats->expansions = __atomic_load_n(&uniquing_table->expansions, __ATOMIC_RELAXED);
+}
+
 // MARK: -
 vm_address_t *sgi_get_node_from_uniquing_table(sgi_backtrace_uniquing_table *uniquing_table, uint64_t index_pos) {
     //    assert(uniquing_table->in_client_process);
@@ -309,6 +575,8 @@ void sgi_unwind_stack_from_table_index(sgi_backtrace_uniquing_table *uniquing_ta
     uint32_t *out_frames_count,
     uint32_t max_frames) {
     vm_address_t *node = sgi_get_node_from_uniquing_table(uniquing_table, index_pos);
+    const sgi_uniquing_table_image *images = _sgi_uniquing_table_images(uniquing_table);
+    uint64_t imagesSize = _sgi_uniquing_table_images_size(images, uniquing_table->imageCount);
     uint32_t foundFrames = 0;
     sgi_slot_parent end_parent = sgi_slot_no_parent_normal;
 
@@ -317,7 +585,7 @@ void sgi_unwind_stack_from_table_index(sgi_backtrace_uniquing_table *uniquing_ta
             sgi_table_slot_t *table_slot = (sgi_table_slot_t *)(node);
             sgi_slot_address address = (sgi_slot_address)table_slot->normal_slot.address;
 
-            out_frames_buffer[foundFrames++] = address;
+            out_frames_buffer[foundFrames++] = _sgi_decode_frame(images, uniquing_table->imageCount, imagesSize, address);
 
             sgi_slot_parent parent = table_slot->normal_slot.parent;
 
@@ -0,0 +1,47 @@
+//
+// sgi_category_strings.h
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+
+#ifndef sgi_category_strings_h
+#define sgi_category_strings_h
+
+#include <mach/mach.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Category names persisted next to the records, the category ids kept in the records resolve from the files alone (in
+ another process, on another host) instead of from class name pointers of the process that wrote them.
+
+ An mmaped file, a header followed by one entry per interned name: the id, the length and the NUL terminated name.
+ Entries are only appended, under a lock (names are interned rarely). The used size in the header is stored after the
+ entry, a reader never sees a partial entry. The same id may show up twice with the same name.
+ */
+typedef struct _sgi_category_strings sgi_category_strings;
+
+sgi_category_strings *sgi_category_strings_create(const char *path);
+void sgi_category_strings_close(sgi_category_strings *strings); /**< the struct itself is kept for in-flight callers */
+
+bool sgi_category_strings_append(sgi_category_strings *strings, uint32_t category_id, const char *name); /**< false if closed or the file could not grow */
+
+typedef void (*sgi_category_strings_enumerator)(uint32_t category_id, const char *name, void *context);
+
+/*
+ Reads a file written by sgi_category_strings, only the process opening it is needed. `name` is valid during the call.
+ Returns false if the file can't be read or isn't a category strings file.
+ */
+bool sgi_category_strings_read(const char *path, sgi_category_strings_enumerator enumerator, void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* sgi_category_strings_h */
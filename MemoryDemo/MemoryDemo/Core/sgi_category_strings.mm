@@ -0,0 +1,205 @@
+//
+// sgi_category_strings.mm
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+
+#include "sgi_category_strings.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#import "SGIAPMCommonDef.h"
+
+#include "sgi_file_utils.h"
+#include "sgi_inner_allocate.h"
+#include "sgi_locking.h"
+
+#define SGI_CATEGORY_STRINGS_MAGIC 0x43494753u // "SGIC"
+#define SGI_CATEGORY_STRINGS_VERSION 1
+#define SGI_CATEGORY_STRINGS_INITIAL_SIZE (64 * 1024)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t used_size; // atomic, bytes of complete entries after the header
+} sgi_category_strings_header;
+
+typedef struct {
+    uint32_t category_id;
+    uint32_t length; // of the name, followed by the name and its NUL, padded to 8 bytes
+} sgi_category_strings_entry;
+
+struct _sgi_category_strings {
+    _malloc_lock_s lock;
+    FILE *mmap_fp;
+    sgi_category_strings_header *header;
+    size_t mmap_size;
+    size_t reserved_size;
+};
+
+static inline size_t sgi_category_strings_entry_size(uint32_t length) {
+    return (sizeof(sgi_category_strings_entry) + length + 1 + 7) & ~(size_t)7;
+}
+
+sgi_category_strings *sgi_category_strings_create(const char *path) {
+    if (!sgi_is_file_exist(path)) {
+        if (!sgi_create_file(path)) {
+            return nullptr;
+        }
+    }
+
+    FILE *fp = fopen(path, "wb+");
+    if (fp == nullptr) {
+        SGIAPMMallocLog("fail to open:%s, %s\n", path, strerror(errno));
+        return nullptr;
+    }
+
+    size_t size = round_page(SGI_CATEGORY_STRINGS_INITIAL_SIZE);
+    if (ftruncate(fileno(fp), size) != 0) {
+        SGIAPMMallocLog("fail to truncate:%s, size:%zu\n", strerror(errno), size);
+        fclose(fp);
+        return nullptr;
+    }
+
+    size_t reserved_size = sgi_mmap_reserve_size(size);
+    void *ptr = sgi_mmap_reserve(fileno(fp), size, reserved_size);
+    if (ptr == MAP_FAILED) {
+        SGIAPMMallocLog("create category strings, fail to mmap: %s\n", strerror(errno));
+        fclose(fp);
+        return nullptr;
+    }
+
+    sgi_category_strings *strings = (sgi_category_strings *)sgi_allocate_page(round_page(sizeof(sgi_category_strings)));
+    if (strings == NULL) {
+        sgi_munmap_reserved(ptr, reserved_size);
+        fclose(fp);
+        return nullptr;
+    }
+
+    SGIAPMMallocLog("category strings mmap to %s\n", path);
+
+    // the file is truncated on open and reads as zero, no entry yet.
+    sgi_category_strings_header *header = (sgi_category_strings_header *)ptr;
+    header->magic = SGI_CATEGORY_STRINGS_MAGIC;
+    header->version = SGI_CATEGORY_STRINGS_VERSION;
+
+    _malloc_lock_init(&strings->lock);
+    strings->mmap_fp = fp;
+    strings->header = header;
+    strings->mmap_size = size;
+    strings->reserved_size = reserved_size;
+    return strings;
+}
+
+void sgi_category_strings_close(sgi_category_strings *strings) {
+    if (strings == NULL) {
+        return;
+    }
+
+    _malloc_lock_lock(&strings->lock);
+    if (strings->header != NULL) {
+        msync(strings->header, strings->mmap_size, MS_ASYNC);
+        sgi_munmap_reserved(strings->header, strings->reserved_size);
+        fclose(strings->mmap_fp);
+        strings->mmap_fp = NULL;
+        strings->header = NULL;
+    }
+    _malloc_lock_unlock(&strings->lock);
+}
+
+bool sgi_category_strings_append(sgi_category_strings *strings, uint32_t category_id, const char *name) {
+    if (strings == NULL || name == NULL) {
+        return false;
+    }
+
+    size_t length = strlen(name);
+    if (length >= UINT32_MAX - sizeof(sgi_category_strings_entry) - 8) {
+        return false;
+    }
+    size_t entry_size = sgi_category_strings_entry_size((uint32_t)length);
+
+    bool result = false;
+    _malloc_lock_lock(&strings->lock);
+    if (strings->header != NULL) {
+        size_t offset = sizeof(sgi_category_strings_header) + strings->header->used_size;
+        if (offset + entry_size > strings->mmap_size) {
+            size_t new_size = strings->mmap_size * 2;
+            while (new_size < offset + entry_size) {
+                new_size *= 2;
+            }
+            // only written under the lock, the old mapping can go.
+            void *ptr = sgi_mmap_grow(strings->header, fileno(strings->mmap_fp), strings->mmap_size, new_size, &strings->reserved_size);
+            if (ptr != MAP_FAILED) {
+                strings->header = (sgi_category_strings_header *)ptr;
+                strings->mmap_size = new_size;
+            }
+        }
+        if (offset + entry_size <= strings->mmap_size) {
+            sgi_category_strings_entry *entry = (sgi_category_strings_entry *)((char *)strings->header + offset);
+            entry->category_id = category_id;
+            entry->length = (uint32_t)length;
+            memcpy(entry + 1, name, length + 1);
+            // a reader of the shared file sees the entry before the size covering it.
+            __atomic_store_n(&strings->header->used_size, strings->header->used_size + entry_size, __ATOMIC_RELEASE);
+            result = true;
+        } else {
+            SGIAPMMallocLog("[APM][Alloc] fail to grow category strings, %s is not persisted.\n", name);
+        }
+    }
+    _malloc_lock_unlock(&strings->lock);
+    return result;
+}
+
+bool sgi_category_strings_read(const char *path, sgi_category_strings_enumerator enumerator, void *context) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        SGIAPMMallocLog("fail to open:%s, %s\n", path, strerror(errno));
+        return false;
+    }
+
+    size_t file_size = sgi_get_file_size(fd);
+    if (file_size < sizeof(sgi_category_strings_header)) {
+        close(fd);
+        return false;
+    }
+    void *ptr = mmap(NULL, file_size, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        SGIAPMMallocLog("read category strings, fail to mmap: %s\n", strerror(errno));
+        return false;
+    }
+
+    const sgi_category_strings_header *header = (const sgi_category_strings_header *)ptr;
+    if (header->magic != SGI_CATEGORY_STRINGS_MAGIC || header->version != SGI_CATEGORY_STRINGS_VERSION) {
+        munmap(ptr, file_size);
+        return false;
+    }
+
+    // the writer may be alive, the size is checked against the file as well.
+    size_t used_size = (size_t)__atomic_load_n(&header->used_size, __ATOMIC_ACQUIRE);
+    const char *begin = (const char *)(header + 1);
+    const char *end = begin + (used_size < file_size - sizeof(sgi_category_strings_header) ? used_size : file_size - sizeof(sgi_category_strings_header));
+    for (const char *cursor = begin; cursor + sizeof(sgi_category_strings_entry) <= end;) {
+        const sgi_category_strings_entry *entry = (const sgi_category_strings_entry *)cursor;
+        size_t entry_size = sgi_category_strings_entry_size(entry->length);
+        if (entry->length > (size_t)(end - cursor) || entry_size > (size_t)(end - cursor)) {
+            break;
+        }
+        const char *name = (const char *)(entry + 1);
+        if (name[entry->length] != '\0') {
+            break;
+        }
+        enumerator(entry->category_id, name, context);
+        cursor += entry_size;
+    }
+
+    munmap(ptr, file_size);
+    return true;
+}
@@ -0,0 +1,71 @@
+//
+// sgi_category_table.h
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+
+#ifndef sgi_category_table_h
+#define sgi_category_table_h
+
+#include <mach/mach.h>
+#include <stdbool.h>
+
+#include "sgi_category_strings.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SGI_CATEGORY_TABLE_NONE 0 // id of the allocations without category
+#define SGI_CATEGORY_TABLE_SHARD_COUNT 8 // power of 2, rows of totals, as many as the shards of the allocation records
+
+/*
+ Interned category names (class names, vm tags), lock free.
+
+ A name is keyed by its pointer, class names and vm tag names are never freed. The records keep the small id instead of
+ the pointer, and the live bytes/allocations of every category are kept up to date, so the memory used by each class
+ is read without walking the records. Fixed capacity, a name interned once the table is full gets SGI_CATEGORY_TABLE_NONE.
+ The names can be persisted with their ids to a sgi_category_strings file, the ids of the records resolve offline then.
+ */
+typedef struct _sgi_category_table sgi_category_table;
+
+sgi_category_table *sgi_category_table_create(uint32_t capacity);
+void sgi_category_table_destroy(sgi_category_table *table);
+
+uint32_t sgi_category_table_intern(sgi_category_table *table, const char *name); /**< SGI_CATEGORY_TABLE_NONE for NULL or if full */
+/*
+ Appends all the names interned so far and every name interned from now on to `strings`, NULL stops. `strings` is not
+ owned, it should stay open until replaced.
+ */
+void sgi_category_table_set_strings(sgi_category_table *table, sgi_category_strings *strings);
+
+const char *sgi_category_table_name(sgi_category_table *table, uint32_t category_id); /**< NULL for SGI_CATEGORY_TABLE_NONE or unknown ids */
+
+/*
+ Adds to the totals of `category_id` in the row of `shard` (masked to SGI_CATEGORY_TABLE_SHARD_COUNT), negative to
+ remove. The records add an allocation and remove it in the row of its shard, the writers of different shards never
+ share the cache line of a category, SGI_CATEGORY_TABLE_NONE included.
+ */
+void sgi_category_table_add(sgi_category_table *table, uint32_t shard, uint32_t category_id, int64_t size, int32_t count);
+void sgi_category_table_reset_totals(sgi_category_table *table); /**< writers should be stopped, the names are kept */
+
+typedef void (*sgi_category_table_enumerator)(uint32_t category_id, const char *name, uint64_t size, uint32_t count, void *context);
+
+void sgi_category_table_enumerate(sgi_category_table *table, sgi_category_table_enumerator enumerator, void *context); /**< categories with live allocations, SGI_CATEGORY_TABLE_NONE included, the rows of the shards summed up. relaxed reads, not a snapshot */
+
+typedef struct {
+    uint32_t categories;     /**< names interned */
+    uint32_t capacity;
+    uint64_t rejected_names; /**< interns that found the table full */
+} sgi_category_table_stats;
+
+void sgi_category_table_get_stats(sgi_category_table *table, sgi_category_table_stats *out_stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* sgi_category_table_h */
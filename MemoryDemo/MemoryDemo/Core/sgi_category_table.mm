@@ -0,0 +1,211 @@
+//
+// sgi_category_table.mm
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+
+#import "sgi_category_table.h"
+#import "sgi_inner_allocate.h"
+#import "SGIAPMCommonDef.h"
+
+#include <string.h>
+
+typedef struct {
+    const char *name; // atomic, set once
+} sgi_category_entry;
+
+typedef struct {
+    uint64_t size;  // live bytes
+    uint32_t count; // live allocations
+    uint32_t reserved;
+} sgi_category_totals;
+
+struct _sgi_category_table {
+    uint32_t mask;       // slots - 1, the id of a name is its slot + 1
+    uint32_t max_count;  // names kept under 3/4 of the slots so that probes stay short
+    uint32_t count;      // atomic
+    uint32_t totals_stride; // totals of a shard, every id from SGI_CATEGORY_TABLE_NONE, rounded up to a cache line
+    uint64_t rejected_names;
+    size_t memory_size;
+    sgi_category_strings *strings; // atomic, names persisted to
+    sgi_category_entry *entries;
+    // SGI_CATEGORY_TABLE_SHARD_COUNT rows of totals indexed by id, the writers of a shard of the records only touch
+    // their row: the live bytes of a category are no cache line every allocating thread updates.
+    sgi_category_totals *totals;
+};
+
+static inline uint32_t sgi_category_table_hash(const char *name) {
+    // fibonacci hashing of the pointer, names are at least 1-byte apart.
+    return (uint32_t)(((uint64_t)(uintptr_t)name * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+static inline sgi_category_totals *sgi_category_table_totals(sgi_category_table *table, uint32_t shard, uint32_t category_id) {
+    return &table->totals[(size_t)(shard & (SGI_CATEGORY_TABLE_SHARD_COUNT - 1)) * table->totals_stride + category_id];
+}
+
+sgi_category_table *sgi_category_table_create(uint32_t capacity) {
+    uint32_t slots = 16;
+    while (slots / 4 * 3 < capacity) {
+        slots <<= 1;
+    }
+
+    // a row per shard of the totals, on its own cache lines.
+    uint32_t totals_stride = (slots + 1 + 3) & ~3u;
+    size_t totals_offset = (sizeof(sgi_category_table) + (size_t)slots * sizeof(sgi_category_entry) + 63) & ~(size_t)63;
+    size_t memory_size = round_page(totals_offset + (size_t)SGI_CATEGORY_TABLE_SHARD_COUNT * totals_stride * sizeof(sgi_category_totals));
+    sgi_category_table *table = (sgi_category_table *)sgi_allocate_page(memory_size);
+    if (table == NULL) {
+        SGIAPMMallocLog("[APM][Alloc] fail to allocate category table.\n");
+        return NULL;
+    }
+
+    // pages are zero filled.
+    table->mask = slots - 1;
+    table->max_count = slots / 4 * 3;
+    table->totals_stride = totals_stride;
+    table->memory_size = memory_size;
+    table->entries = (sgi_category_entry *)(table + 1);
+    table->totals = (sgi_category_totals *)((char *)table + totals_offset);
+    return table;
+}
+
+void sgi_category_table_destroy(sgi_category_table *table) {
+    if (table) {
+        sgi_deallocate_pages(table, table->memory_size);
+    }
+}
+
+uint32_t sgi_category_table_intern(sgi_category_table *table, const char *name) {
+    if (table == NULL || name == NULL) {
+        return SGI_CATEGORY_TABLE_NONE;
+    }
+
+    uint32_t index = sgi_category_table_hash(name) & table->mask;
+    for (uint32_t probe = 0; probe <= table->mask; probe++, index = (index + 1) & table->mask) {
+        sgi_category_entry *entry = &table->entries[index];
+        const char *slot_name = __atomic_load_n(&entry->name, __ATOMIC_ACQUIRE);
+        if (slot_name == name) {
+            return index + 1;
+        }
+        if (slot_name != NULL) {
+            continue;
+        }
+
+        // reserve a name before taking an empty slot, a full table stops at `max_count`.
+        uint32_t count = __atomic_load_n(&table->count, __ATOMIC_RELAXED);
+        do {
+            if (count >= table->max_count) {
+                __atomic_fetch_add(&table->rejected_names, 1, __ATOMIC_RELAXED);
+                return SGI_CATEGORY_TABLE_NONE;
+            }
+        } while (!__atomic_compare_exchange_n(&table->count, &count, count + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+        // seq_cst, with the store of `strings`: either the name is appended here, or set_strings finds it.
+        if (__atomic_compare_exchange_n(&entry->name, &slot_name, name, false, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE)) {
+            sgi_category_strings *strings = __atomic_load_n(&table->strings, __ATOMIC_SEQ_CST);
+            if (strings != NULL) {
+                sgi_category_strings_append(strings, index + 1, name);
+            }
+            return index + 1;
+        }
+        // lost the slot, give the reservation back and go on probing from it.
+        __atomic_fetch_sub(&table->count, 1, __ATOMIC_RELAXED);
+        if (slot_name == name) {
+            return index + 1;
+        }
+    }
+    __atomic_fetch_add(&table->rejected_names, 1, __ATOMIC_RELAXED);
+    return SGI_CATEGORY_TABLE_NONE;
+}
+
+void sgi_category_table_set_strings(sgi_category_table *table, sgi_category_strings *strings) {
+    if (table == NULL) {
+        return;
+    }
+
+    __atomic_store_n(&table->strings, strings, __ATOMIC_SEQ_CST);
+    if (strings == NULL) {
+        return;
+    }
+    // names interned concurrently may be appended twice, with the same id.
+    for (uint32_t i = 0; i <= table->mask; i++) {
+        const char *name = __atomic_load_n(&table->entries[i].name, __ATOMIC_SEQ_CST);
+        if (name != NULL) {
+            sgi_category_strings_append(strings, i + 1, name);
+        }
+    }
+}
+
+const char *sgi_category_table_name(sgi_category_table *table, uint32_t category_id) {
+    if (table == NULL || category_id == SGI_CATEGORY_TABLE_NONE || category_id - 1 > table->mask) {
+        return NULL;
+    }
+    return __atomic_load_n(&table->entries[category_id - 1].name, __ATOMIC_ACQUIRE);
+}
+
+void sgi_category_table_add(sgi_category_table *table, uint32_t shard, uint32_t category_id, int64_t size, int32_t count) {
+    if (table == NULL || (category_id != SGI_CATEGORY_TABLE_NONE && category_id - 1 > table->mask)) {
+        return;
+    }
+    // still atomic, the malloc and the vm records share the table and have a shard `shard` each.
+    sgi_category_totals *totals = sgi_category_table_totals(table, shard, category_id);
+    __atomic_fetch_add(&totals->size, (uint64_t)size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&totals->count, (uint32_t)count, __ATOMIC_RELAXED);
+}
+
+// SGI_CATEGORY_TABLE_NONE, then the ids of the names interned: only those have totals, the rows of the other slots are
+// never touched and stay unmapped.
+static inline bool sgi_category_table_has_totals(sgi_category_table *table, uint32_t category_id) {
+    return category_id == SGI_CATEGORY_TABLE_NONE || __atomic_load_n(&table->entries[category_id - 1].name, __ATOMIC_ACQUIRE) != NULL;
+}
+
+void sgi_category_table_reset_totals(sgi_category_table *table) {
+    if (table == NULL) {
+        return;
+    }
+    for (uint32_t category_id = SGI_CATEGORY_TABLE_NONE; category_id <= table->mask + 1; category_id++) {
+        if (!sgi_category_table_has_totals(table, category_id)) {
+            continue;
+        }
+        for (uint32_t shard = 0; shard < SGI_CATEGORY_TABLE_SHARD_COUNT; shard++) {
+            sgi_category_totals *totals = sgi_category_table_totals(table, shard, category_id);
+            totals->size = 0;
+            totals->count = 0;
+        }
+    }
+}
+
+void sgi_category_table_enumerate(sgi_category_table *table, sgi_category_table_enumerator enumerator, void *context) {
+    if (table == NULL) {
+        return;
+    }
+    for (uint32_t category_id = SGI_CATEGORY_TABLE_NONE; category_id <= table->mask + 1; category_id++) {
+        if (!sgi_category_table_has_totals(table, category_id)) {
+            continue;
+        }
+        uint64_t size = 0;
+        uint32_t count = 0;
+        for (uint32_t shard = 0; shard < SGI_CATEGORY_TABLE_SHARD_COUNT; shard++) {
+            sgi_category_totals *totals = sgi_category_table_totals(table, shard, category_id);
+            size += __atomic_load_n(&totals->size, __ATOMIC_RELAXED);
+            count += __atomic_load_n(&totals->count, __ATOMIC_RELAXED);
+        }
+        if (count == 0) {
+            continue;
+        }
+        enumerator(category_id, sgi_category_table_name(table, category_id), size, count, context);
+    }
+}
+
+void sgi_category_table_get_stats(sgi_category_table *table, sgi_category_table_stats *out_stats) {
+    memset(out_stats, 0, sizeof(sgi_category_table_stats));
+    if (table == NULL) {
+        return;
+    }
+    out_stats->categories = __atomic_load_n(&table->count, __ATOMIC_RELAXED);
+    out_stats->capacity = table->max_count;
+    out_stats->rejected_names = __atomic_load_n(&table->rejected_names, __ATOMIC_RELAXED);
+}
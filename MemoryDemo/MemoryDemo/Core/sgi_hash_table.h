@@ -0,0 +1,83 @@
+//
+// sgi_hash_table.h
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+
+#ifndef sgi_hash_table_h
+#define sgi_hash_table_h
+
+#import <mach/mach.h>
+#import <stdbool.h>
+#import <stdio.h>
+#import <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Open-addressing hash table of live allocations, an alternative to `sgi_splay_tree` with the same kind of API.
+
+ Entries live in 128-byte (one arm64 cache line) buckets: 5 tag bytes, an overflow byte and 2 padding bytes, then 5
+ entries. A lookup usually touches a single bucket. Probing moves to the next bucket only if the bucket has overflowed
+ once (swiss-table style), and never further than the longest displacement of an insertion, so a delete simply clears
+ the tag, no tombstone is needed. The overflow marks outlive the entries that set them: once enough entries were
+ deleted, the table is rehashed in place to clear them.
+ */
+
+#define SGI_HASH_TABLE_BUCKET_ENTRY_COUNT 5
+
+typedef struct {
+    struct {
+        uint64_t addr : 44; // addr >> 4, allocations are 16 bytes aligned.
+        uint64_t cnt : 20;
+    } addr_cnt;
+    uint64_t category_and_size; // top 28 bits are the size.
+    uint64_t stackid_and_flags; // top 8 bits are actually the flags!
+} sgi_hash_table_entry;
+
+typedef struct {
+    uint8_t tags[SGI_HASH_TABLE_BUCKET_ENTRY_COUNT]; // 0 for empty, otherwise 0x80 | 7 bits of the hash
+    uint8_t overflow;                                // an insertion probed past this bucket
+    uint8_t reserved[2];
+    sgi_hash_table_entry entry[SGI_HASH_TABLE_BUCKET_ENTRY_COUNT];
+} sgi_hash_table_bucket;
+
+typedef struct _sgi_hash_table {
+    uint32_t bucket_count; // power of 2
+    uint32_t entry_count;  // live entries
+    uint32_t max_probe;    // buckets an insertion moved past its own at most, since the last rehash
+    uint32_t overflow_count;       // buckets marked overflowed
+    uint32_t deletes_since_rehash; // entries deleted since the marks were last cleared
+    FILE *mmap_fp;
+    size_t mmap_size;
+    sgi_hash_table_bucket *bucket;
+} sgi_hash_table;
+
+sgi_hash_table *sgi_hash_table_read_from_mmapfile(const char *path); /**< read-only, a private mapping of a file left by `create_on_mmapfile`, never expand it */
+
+sgi_hash_table *sgi_hash_table_create_on_mmapfile(size_t entry_count, const char *path);
+
+sgi_hash_table *sgi_expand_hash_table(sgi_hash_table *table);
+
+bool sgi_hash_table_insert(sgi_hash_table *table, uint64_t addr, uint64_t stackid_and_flags, uint64_t category_and_size); /**< false if the table needs expanding */
+
+sgi_hash_table_entry *sgi_hash_table_search(sgi_hash_table *table, vm_address_t addr);
+
+sgi_hash_table_entry sgi_hash_table_delete(sgi_hash_table *table, vm_address_t addr);
+
+void sgi_hash_table_close(sgi_hash_table *table);
+
+sgi_hash_table *sgi_hash_table_snapshot(sgi_hash_table *table); /**< copy of an mmaped table, to enumerate only. NULL on failure */
+void sgi_hash_table_snapshot_release(sgi_hash_table *snapshot);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* sgi_hash_table_h */
@@ -0,0 +1,354 @@
+//
+// sgi_hash_table.mm
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+
+#import "sgi_hash_table.h"
+#import <errno.h>
+#import <sys/mman.h>
+#import <unistd.h>
+#import "sgi_file_utils.h"
+#import "sgi_inner_allocate.h"
+#import "SGIAPMCommonDef.h"
+
+_Static_assert(sizeof(sgi_hash_table_bucket) == 128, "sgi_hash_table_bucket must fill a cache line");
+
+#define SGI_HASH_TABLE_HEADER_SIZE 128 // buckets start on a cache line
+#define SGI_HASH_TABLE_MAX_LOAD_PERCENT 80
+#define SGI_HASH_TABLE_MAX_BUCKET_COUNT (1u << 27)
+#define SGI_HASH_TABLE_REHASH_DELETE_PERCENT 50 // of the entries the buckets hold, deleted before the overflow marks are cleared
+
+// not the multiplier of the records shard hashing, the bucket bits must not be fixed within a shard.
+static inline uint64_t sgi_hash_table_hash(uint64_t addr) {
+    return (addr >> 4) * 0xFF51AFD7ED558CCDull;
+}
+
+// the low bits of a multiplicative hash keep the trailing zeros of page aligned addresses, take the bucket from the
+// high bits, below the tag bits.
+static inline uint32_t sgi_hash_table_bucket_index(uint64_t hash, uint32_t mask) {
+    return (uint32_t)(hash >> 30) & mask;
+}
+
+static inline uint8_t sgi_hash_table_tag(uint64_t hash) {
+    return (uint8_t)(0x80 | (hash >> 57));
+}
+
+static size_t mmap_size_of_hash_table_bucket_count(FILE *fp, size_t bucket_count) {
+    size_t size = SGI_HASH_TABLE_HEADER_SIZE + bucket_count * sizeof(sgi_hash_table_bucket);
+    if (size < getpagesize() || (size % getpagesize() != 0)) {
+        size = (size / getpagesize() + 1) * getpagesize();
+    }
+    if (ftruncate(fileno(fp), size) != 0) {
+        SGIAPMMallocLog("fail to truncate:%s, size:%zu\n", strerror(errno), size);
+    }
+    return size;
+}
+
+static uint32_t sgi_hash_table_bucket_count_for_entry_count(size_t entry_count) {
+    size_t min_bucket_count = entry_count * 100 / SGI_HASH_TABLE_MAX_LOAD_PERCENT / SGI_HASH_TABLE_BUCKET_ENTRY_COUNT + 1;
+    uint32_t bucket_count = 1;
+    while (bucket_count < min_bucket_count && bucket_count < SGI_HASH_TABLE_MAX_BUCKET_COUNT) {
+        bucket_count <<= 1;
+    }
+    return bucket_count;
+}
+
+sgi_hash_table *sgi_hash_table_read_from_mmapfile(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == nullptr) {
+        SGIAPMMallocLog("fail to open:%s, %s\n", path, strerror(errno));
+        return nullptr;
+    }
+
+    size_t size = sgi_get_file_size(fileno(fp));
+    if (size < SGI_HASH_TABLE_HEADER_SIZE) {
+        fclose(fp);
+        return nullptr;
+    }
+
+    // private, the header fields set below never reach the file.
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_FILE | MAP_PRIVATE, fileno(fp), 0);
+    if (ptr == MAP_FAILED) {
+        SGIAPMMallocLog("fail to open:%s\n", strerror(errno));
+        fclose(fp);
+        return nullptr;
+    }
+
+    sgi_hash_table *table = (sgi_hash_table *)ptr;
+    if (SGI_HASH_TABLE_HEADER_SIZE + (size_t)table->bucket_count * sizeof(sgi_hash_table_bucket) > size) {
+        SGIAPMMallocLog("truncated hash table: %s\n", path);
+        munmap(ptr, size);
+        fclose(fp);
+        return nullptr;
+    }
+    table->mmap_fp = fp;
+    table->mmap_size = size;
+    table->bucket = (sgi_hash_table_bucket *)((char *)ptr + SGI_HASH_TABLE_HEADER_SIZE);
+    return table;
+}
+
+sgi_hash_table *sgi_hash_table_create_on_mmapfile(size_t entry_count, const char *path) {
+    if (!sgi_is_file_exist(path)) {
+        if (!sgi_create_file(path)) {
+            return nullptr;
+        }
+    }
+
+    FILE *fp = fopen(path, "wb+");
+    if (fp == nullptr) {
+        SGIAPMMallocLog("fail to open:%s, %s\n", path, strerror(errno));
+        return nullptr;
+    }
+
+    uint32_t bucket_count = sgi_hash_table_bucket_count_for_entry_count(entry_count);
+    size_t size = mmap_size_of_hash_table_bucket_count(fp, bucket_count);
+
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED, fileno(fp), 0);
+    if (ptr == MAP_FAILED) {
+        SGIAPMMallocLog("create hash table, fail to mmap: %s\n", strerror(errno));
+        return nullptr;
+    }
+
+    SGIAPMMallocLog("hash table mmap to %s\n", path);
+
+    sgi_hash_table *table = (sgi_hash_table *)ptr;
+    bzero(table, size);
+    table->bucket_count = bucket_count;
+    table->mmap_fp = fp;
+    table->mmap_size = size;
+    table->bucket = (sgi_hash_table_bucket *)((char *)ptr + SGI_HASH_TABLE_HEADER_SIZE);
+    return table;
+}
+
+// no duplicate check, the table has room.
+static void sgi_hash_table_place(sgi_hash_table *table, uint64_t hash, const sgi_hash_table_entry *entry) {
+    uint32_t mask = table->bucket_count - 1;
+    uint32_t bucket_index = sgi_hash_table_bucket_index(hash, mask);
+    for (uint32_t probe = 0;; probe++) {
+        sgi_hash_table_bucket *bucket = &table->bucket[bucket_index];
+        for (uint32_t i = 0; i < SGI_HASH_TABLE_BUCKET_ENTRY_COUNT; i++) {
+            if (bucket->tags[i] == 0) {
+                bucket->tags[i] = sgi_hash_table_tag(hash);
+                bucket->entry[i] = *entry;
+                table->entry_count++;
+                if (probe > table->max_probe) {
+                    table->max_probe = probe;
+                }
+                return;
+            }
+        }
+        if (!bucket->overflow) {
+            bucket->overflow = 1;
+            table->overflow_count++;
+        }
+        bucket_index = (bucket_index + 1) & mask;
+    }
+}
+
+// places the entries again in the same buckets, the overflow marks and the longest probe are those of the live entries.
+static void sgi_hash_table_rehash(sgi_hash_table *table) {
+    table->deletes_since_rehash = 0;
+
+    size_t buckets_size = table->bucket_count * sizeof(sgi_hash_table_bucket);
+    sgi_hash_table_bucket *copy = (sgi_hash_table_bucket *)sgi_malloc(buckets_size);
+    if (copy == nullptr) {
+        return; // tried again after as many deletes
+    }
+    memcpy(copy, table->bucket, buckets_size);
+    memset(table->bucket, 0, buckets_size);
+    table->entry_count = 0;
+    table->max_probe = 0;
+    table->overflow_count = 0;
+
+    for (uint32_t b = 0; b < table->bucket_count; b++) {
+        for (uint32_t i = 0; i < SGI_HASH_TABLE_BUCKET_ENTRY_COUNT; i++) {
+            if (copy[b].tags[i] != 0) {
+                const sgi_hash_table_entry *entry = &copy[b].entry[i];
+                sgi_hash_table_place(table, sgi_hash_table_hash((uint64_t)entry->addr_cnt.addr << 4), entry);
+            }
+        }
+    }
+
+    sgi_free(copy);
+}
+
+sgi_hash_table *sgi_expand_hash_table(sgi_hash_table *table) {
+    FILE *fp = table->mmap_fp;
+    uint32_t old_bucket_count = table->bucket_count;
+    size_t old_size = table->mmap_size;
+
+    // only grow when the live entries need it, otherwise rehashing clears the overflow marks.
+    uint32_t new_bucket_count = sgi_hash_table_bucket_count_for_entry_count((size_t)table->entry_count * 2);
+    if (new_bucket_count < old_bucket_count) {
+        new_bucket_count = old_bucket_count;
+    }
+
+    SGIAPMMallocLog("will expand hash table, buckets from:%u to: %u\n", old_bucket_count, new_bucket_count);
+
+    if (new_bucket_count > SGI_HASH_TABLE_MAX_BUCKET_COUNT) {
+        SGIAPMMallocLog("bucket count: %u, out of limit\n", new_bucket_count);
+        return nullptr;
+    }
+
+    size_t buckets_size = old_bucket_count * sizeof(sgi_hash_table_bucket);
+    sgi_hash_table_bucket *copy = (sgi_hash_table_bucket *)sgi_malloc(buckets_size);
+    if (copy == nullptr) {
+        return nullptr;
+    }
+    memcpy(copy, table->bucket, buckets_size);
+    munmap(table, old_size);
+
+    size_t new_size = mmap_size_of_hash_table_bucket_count(fp, new_bucket_count);
+
+    fseek(fp, 0, SEEK_SET);
+
+    void *new_mmapptr = mmap(nullptr, new_size, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED, fileno(fp), 0);
+    if (new_mmapptr == nullptr || new_mmapptr == MAP_FAILED) {
+        SGIAPMMallocLog("expand hash table, fail to mmap: %s\n", strerror(errno));
+        sgi_free(copy);
+        return nullptr;
+    }
+
+    memset(new_mmapptr, '\0', new_size);
+
+    sgi_hash_table *new_table = (sgi_hash_table *)new_mmapptr;
+    new_table->bucket_count = new_bucket_count;
+    new_table->entry_count = 0;
+    new_table->max_probe = 0;
+    new_table->overflow_count = 0;
+    new_table->deletes_since_rehash = 0;
+    new_table->mmap_fp = fp;
+    new_table->mmap_size = new_size;
+    new_table->bucket = (sgi_hash_table_bucket *)((char *)new_mmapptr + SGI_HASH_TABLE_HEADER_SIZE);
+
+    for (uint32_t b = 0; b < old_bucket_count; b++) {
+        for (uint32_t i = 0; i < SGI_HASH_TABLE_BUCKET_ENTRY_COUNT; i++) {
+            if (copy[b].tags[i] != 0) {
+                const sgi_hash_table_entry *entry = &copy[b].entry[i];
+                sgi_hash_table_place(new_table, sgi_hash_table_hash((uint64_t)entry->addr_cnt.addr << 4), entry);
+            }
+        }
+    }
+
+    sgi_free(copy);
+
+    SGIAPMMallocLog("expand mmap file size: %y -> %y, bucket_count: %u\n", old_size, new_size, new_bucket_count);
+    return new_table;
+}
+
+sgi_hash_table_entry *sgi_hash_table_search(sgi_hash_table *table, vm_address_t addr) {
+    uint64_t hash = sgi_hash_table_hash(addr);
+    uint8_t tag = sgi_hash_table_tag(hash);
+    uint64_t key = (uint64_t)addr >> 4;
+    uint32_t mask = table->bucket_count - 1;
+    uint32_t bucket_index = sgi_hash_table_bucket_index(hash, mask);
+
+    for (uint32_t probe = 0; probe <= table->max_probe; probe++) {
+        sgi_hash_table_bucket *bucket = &table->bucket[bucket_index];
+        for (uint32_t i = 0; i < SGI_HASH_TABLE_BUCKET_ENTRY_COUNT; i++) {
+            if (bucket->tags[i] == tag && bucket->entry[i].addr_cnt.addr == key) {
+                return &bucket->entry[i];
+            }
+        }
+        if (!bucket->overflow) {
+            break;
+        }
+        bucket_index = (bucket_index + 1) & mask;
+    }
+    return nullptr;
+}
+
+bool sgi_hash_table_insert(sgi_hash_table *table, uint64_t addr, uint64_t stackid_and_flags, uint64_t category_and_size) {
+    sgi_hash_table_entry *exist = sgi_hash_table_search(table, addr);
+    if (exist) {
+        exist->addr_cnt.cnt++;
+        if (exist->addr_cnt.cnt == 0) {
+            exist->addr_cnt.cnt--; // saturate, a wrapped count would free the entry too early
+        }
+        return true;
+    }
+
+    if ((uint64_t)(table->entry_count + 1) * 100 > (uint64_t)table->bucket_count * SGI_HASH_TABLE_BUCKET_ENTRY_COUNT * SGI_HASH_TABLE_MAX_LOAD_PERCENT) {
+        return false;
+    }
+
+    sgi_hash_table_entry entry;
+    entry.addr_cnt.addr = addr >> 4;
+    entry.addr_cnt.cnt = 1;
+    entry.category_and_size = category_and_size;
+    entry.stackid_and_flags = stackid_and_flags;
+    sgi_hash_table_place(table, sgi_hash_table_hash(addr), &entry);
+    return true;
+}
+
+sgi_hash_table_entry sgi_hash_table_delete(sgi_hash_table *table, vm_address_t addr) {
+    sgi_hash_table_entry removed;
+    memset(&removed, 0, sizeof(removed));
+
+    sgi_hash_table_entry *entry = sgi_hash_table_search(table, addr);
+    if (entry == nullptr) {
+        return removed;
+    }
+
+    removed = *entry;
+    if (entry->addr_cnt.cnt > 1) {
+        entry->addr_cnt.cnt--;
+        return removed;
+    }
+
+    // the entry index inside its bucket gives the tag to clear
+    sgi_hash_table_bucket *bucket = &table->bucket[((char *)entry - (char *)table->bucket) / sizeof(sgi_hash_table_bucket)];
+    uint32_t i = (uint32_t)(entry - bucket->entry);
+    bucket->tags[i] = 0;
+    memset(entry, 0, sizeof(sgi_hash_table_entry));
+    table->entry_count--;
+
+    // below the load limit nothing else clears the marks, and every miss follows them.
+    table->deletes_since_rehash++;
+    if (table->overflow_count > 0 &&
+        (uint64_t)table->deletes_since_rehash * 100 >= (uint64_t)table->bucket_count * SGI_HASH_TABLE_BUCKET_ENTRY_COUNT * SGI_HASH_TABLE_REHASH_DELETE_PERCENT) {
+        sgi_hash_table_rehash(table);
+    }
+    return removed;
+}
+
+sgi_hash_table *sgi_hash_table_snapshot(sgi_hash_table *table) {
+    if (table == nullptr || table->mmap_fp == nullptr) {
+        return nullptr;
+    }
+
+    // the entries are spread over all the buckets, the whole mapping is copied.
+    sgi_hash_table *snapshot = (sgi_hash_table *)sgi_copy_pages(table, table->mmap_size);
+    if (snapshot == nullptr) {
+        return nullptr;
+    }
+    snapshot->mmap_fp = nullptr;
+    snapshot->bucket = (sgi_hash_table_bucket *)((char *)snapshot + SGI_HASH_TABLE_HEADER_SIZE);
+    return snapshot;
+}
+
+void sgi_hash_table_snapshot_release(sgi_hash_table *snapshot) {
+    if (snapshot != nullptr) {
+        sgi_deallocate_pages(snapshot, snapshot->mmap_size);
+    }
+}
+
+void sgi_hash_table_close(sgi_hash_table *table) {
+    FILE *fp = 0;
+    if (table != MAP_FAILED && table != nullptr) {
+        msync(table, table->mmap_size, MS_ASYNC);
+
+        fp = table->mmap_fp;
+        munmap(table, table->mmap_size);
+        table = nullptr;
+    }
+
+    if (fp != nullptr) {
+        fclose(fp);
+        fp = nullptr;
+    }
+}
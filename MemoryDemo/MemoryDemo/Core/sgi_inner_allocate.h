@@ -24,6 +24,7 @@ void sgi_setup_alloc_malloc_zone(malloc_zone_t *zone);
 
 void *sgi_allocate_page(uint64_t memSize);
 int sgi_deallocate_pages(void *memPointer, uint64_t memSize);
+void *sgi_copy_pages(const void *memPointer, uint64_t memSize); /**< private copy of whole pages (vm_copy, copy on write where the kernel can), free with sgi_deallocate_pages. NULL on failure */
 
 void *sgi_malloc(size_t size);
 void *sgi_realloc(void *ptr, size_t size);
@@ -29,6 +29,19 @@ int sgi_deallocate_pages(void *memPointer, uint64_t memSize) {
     return vm_deallocate(mach_task_self(), (vm_address_t)(uintptr_t)memPointer, (vm_size_t)memSize);
 }
 
+void *sgi_copy_pages(const void *memPointer, uint64_t memSize) {
+    void *copiedMem = sgi_allocate_page(memSize);
+    if (copiedMem == NULL) {
+        return NULL;
+    }
+    if (vm_copy(mach_task_self(), (vm_address_t)(uintptr_t)memPointer, (vm_size_t)memSize, (vm_address_t)(uintptr_t)copiedMem) != KERN_SUCCESS) {
+        SGIAPMMallocLog("[error] copy_pages(): fail to copy %llu bytes\n", memSize);
+        sgi_deallocate_pages(copiedMem, memSize);
+        return NULL;
+    }
+    return copiedMem;
+}
+
 void *sgi_malloc(size_t size) {
     return mem_zone->malloc(mem_zone, size);
 }
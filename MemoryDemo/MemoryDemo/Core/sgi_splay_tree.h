@@ -61,17 +61,59 @@ typedef struct _sgi_splay_tree_node {
     uint64_t stackid_and_flags; // top 8 bits are actually the flags!
 } sgi_splay_tree_node;
 
+// MARK: - Wide Node
+
+#define SGI_SPLAY_TREE_VERSION_NARROW 0 // sgi_splay_tree_node, 21-bit indices
+#define SGI_SPLAY_TREE_VERSION_WIDE 1   // sgi_splay_tree_wide_node, 32-bit indices
+
+#define SGI_SPLAY_TREE_NARROW_MAX_NODE_COUNT 2097152 // 2^21
+
+// 20 bits size class: exact below 64KB, 16 significant bits above.
+#define SGI_SPLAY_TREE_SIZE_CLASS_MANTISSA_BITS 16
+#define SGI_SPLAY_TREE_SIZE_CLASS_DECODE(size_class) \
+    ((uint64_t)((size_class) & ((1u << SGI_SPLAY_TREE_SIZE_CLASS_MANTISSA_BITS) - 1)) << ((size_class) >> SGI_SPLAY_TREE_SIZE_CLASS_MANTISSA_BITS))
+
+/*
+ Used once a tree outgrows 2^21 nodes. 32-bit indices in 32 bytes (the narrow node takes 40 with bitfield padding),
+ the fields of `stackid_and_flags` and `category_and_size` are stored separately and rebuilt on read.
+ */
+typedef struct _sgi_splay_tree_wide_node {
+    struct {
+        uint32_t parent;
+        uint32_t left;
+        uint32_t right;
+    } index;
+    uint32_t stackid; // offset in uniquing table, which has 32-bit node count.
+    struct {
+        uint64_t addr : 40; // addr >> 4, malloc pointers are 16 bytes aligned.
+        uint64_t cnt : 16;
+        uint64_t flags : 8;
+    } addr_cnt;
+    struct {
+        uint64_t category : 36;
+        uint64_t user_tag : 8;
+        uint64_t size_class : 20;
+    } category_size;
+} sgi_splay_tree_wide_node;
+
 typedef struct _sgi_splay_tree {
     uint32_t root_index;
     uint32_t node_index;
     uint32_t max_index;
+    uint32_t version; // SGI_SPLAY_TREE_VERSION_*, was padding before, so older files read as narrow.
     FILE *mmap_fp;
     size_t mmap_size;
     uint32_t nextInsertIndex;
-    sgi_splay_tree_node *node;
+    uint32_t mmap_reserve_pages; // virtual range reserved for in-place growth, in getpagesize() pages
+    union {
+        sgi_splay_tree_node *node;           // SGI_SPLAY_TREE_VERSION_NARROW
+        sgi_splay_tree_wide_node *wide_node; // SGI_SPLAY_TREE_VERSION_WIDE
+    };
 } sgi_splay_tree;
 
-sgi_splay_tree *sgi_splay_tree_read_from_mmapfile(const char *path);
+typedef void (*sgi_splay_tree_enumerator)(vm_address_t addr, uint64_t stackid_and_flags, uint64_t category_and_size, void *context);
+
+sgi_splay_tree *sgi_splay_tree_read_from_mmapfile(const char *path); /**< read-only, a private mapping of a file left by `create_on_mmapfile`, never expand it */
 
 sgi_splay_tree *sgi_splay_tree_create_on_mmapfile(size_t entry_count, const char *path);
 
@@ -83,10 +125,19 @@ bool sgi_splay_tree_insert(sgi_splay_tree *tree, uint64_t addr, uint64_t stackid
 
 uint32_t sgi_splay_tree_search(sgi_splay_tree *tree, vm_address_t addr, bool splay);
 
-sgi_splay_tree_node sgi_splay_tree_delete(sgi_splay_tree *tree, vm_address_t addr);
+sgi_splay_tree_node sgi_splay_tree_delete(sgi_splay_tree *tree, vm_address_t addr); /**< a wide node is returned repacked into the narrow layout */
+
+bool sgi_splay_tree_set_category(sgi_splay_tree *tree, vm_address_t addr, uint64_t category, uint64_t *out_stackid_and_flags, uint64_t *out_category_and_size); /**< returns false if not found. the outs are read before the change and may be NULL */
+
+uint64_t sgi_splay_tree_stored_size(uint64_t size); /**< the size a record keeps once the tree is wide, sizes from 64KB up lose their low bits */
+
+void sgi_splay_tree_enumerate(sgi_splay_tree *tree, sgi_splay_tree_enumerator enumerator, void *context); /**< live nodes of either format */
 
 void sgi_splay_tree_close(sgi_splay_tree *tree);
 
+sgi_splay_tree *sgi_splay_tree_snapshot(sgi_splay_tree *tree); /**< copy of an mmaped tree up to its last used node, to enumerate only. NULL on failure */
+void sgi_splay_tree_snapshot_release(sgi_splay_tree *snapshot);
+
 
 #ifdef __cplusplus
 }
@@ -16,6 +16,8 @@
 #import "SGIAPMCommonDef.h"
 
 
+// MARK: - Nodes
+
 sgi_splay_tree_node sgi_splay_node_init(uint64_t addr, uint64_t stackid_and_flags, uint64_t category_and_size, uint64_t parent) {
     sgi_splay_tree_node node;
     node.addr_cnt.addr = addr;
@@ -28,31 +30,155 @@ sgi_splay_tree_node sgi_splay_node_init(uint64_t addr, uint64_t stackid_and_flag
     return node;
 }
 
+static inline uint32_t sgi_splay_tree_size_class(uint64_t size) {
+    if (size < (1ull << SGI_SPLAY_TREE_SIZE_CLASS_MANTISSA_BITS)) {
+        return (uint32_t)size;
+    }
+    // keep the top 16 bits, sizes are at most 28 bits so the shift fits in 4 bits.
+    uint32_t shift = 64 - __builtin_clzll(size) - SGI_SPLAY_TREE_SIZE_CLASS_MANTISSA_BITS;
+    return (shift << SGI_SPLAY_TREE_SIZE_CLASS_MANTISSA_BITS) | (uint32_t)(size >> shift);
+}
+
+sgi_splay_tree_wide_node sgi_splay_wide_node_init(uint64_t addr, uint64_t stackid_and_flags, uint64_t category_and_size, uint64_t parent) {
+    sgi_splay_tree_wide_node node;
+    node.index.parent = (uint32_t)parent;
+    node.index.left = 0;
+    node.index.right = 0;
+    node.stackid = (uint32_t)SGI_ALLOCATIONS_OFFSET(stackid_and_flags);
+    node.addr_cnt.addr = addr >> 4;
+    node.addr_cnt.cnt = 1;
+    node.addr_cnt.flags = SGI_ALLOCATIONS_FLAGS(stackid_and_flags);
+    node.category_size.category = SGI_ALLOCATIONS_CATEGORY(category_and_size);
+    node.category_size.user_tag = (stackid_and_flags >> 48) & 0xFF;
+    node.category_size.size_class = sgi_splay_tree_size_class(SGI_ALLOCATIONS_SIZE(category_and_size));
+    return node;
+}
+
+static inline void sgi_splay_node_assign(sgi_splay_tree_node &node, uint64_t addr, uint64_t stackid_and_flags, uint64_t category_and_size, uint32_t parent) {
+    node = sgi_splay_node_init(addr, stackid_and_flags, category_and_size, parent);
+}
+
+static inline void sgi_splay_node_assign(sgi_splay_tree_wide_node &node, uint64_t addr, uint64_t stackid_and_flags, uint64_t category_and_size, uint32_t parent) {
+    node = sgi_splay_wide_node_init(addr, stackid_and_flags, category_and_size, parent);
+}
+
+// the value compared with `addr_cnt.addr`
+static inline uint64_t sgi_splay_node_key(const sgi_splay_tree_node *, vm_address_t addr) {
+    return addr;
+}
+
+static inline uint64_t sgi_splay_node_key(const sgi_splay_tree_wide_node *, vm_address_t addr) {
+    return addr >> 4;
+}
+
+static inline vm_address_t sgi_splay_node_address(const sgi_splay_tree_node &node) {
+    return node.addr_cnt.addr;
+}
+
+static inline vm_address_t sgi_splay_node_address(const sgi_splay_tree_wide_node &node) {
+    return (vm_address_t)node.addr_cnt.addr << 4;
+}
+
+static inline uint64_t sgi_splay_node_stackid_and_flags(const sgi_splay_tree_node &node) {
+    return node.stackid_and_flags;
+}
+
+static inline uint64_t sgi_splay_node_stackid_and_flags(const sgi_splay_tree_wide_node &node) {
+    return (uint64_t)node.stackid | ((uint64_t)node.category_size.user_tag << 48) | ((uint64_t)node.addr_cnt.flags << SGI_ALLOCATIONS_FLAGS_SHIFT);
+}
+
+static inline uint64_t sgi_splay_node_category_and_size(const sgi_splay_tree_node &node) {
+    return node.category_and_size;
+}
+
+static inline uint64_t sgi_splay_node_category_and_size(const sgi_splay_tree_wide_node &node) {
+    return SGI_ALLOCATIONS_CATEGORY_AND_SIZE(node.category_size.category, SGI_SPLAY_TREE_SIZE_CLASS_DECODE(node.category_size.size_class));
+}
+
+static inline void sgi_splay_node_set_category(sgi_splay_tree_node &node, uint64_t category) {
+    size_t size = SGI_ALLOCATIONS_SIZE(node.category_and_size);
+    node.category_and_size = SGI_ALLOCATIONS_CATEGORY_AND_SIZE(category, size);
+}
+
+static inline void sgi_splay_node_set_category(sgi_splay_tree_wide_node &node, uint64_t category) {
+    node.category_size.category = SGI_ALLOCATIONS_CATEGORY(category);
+}
+
+static inline void sgi_splay_node_clear(sgi_splay_tree_node &node) {
+    node.addr_cnt.addr = 0;
+    node.addr_cnt.cnt = 0;
+    node.category_and_size = 0;
+}
+
+static inline void sgi_splay_node_clear(sgi_splay_tree_wide_node &node) {
+    node.addr_cnt.addr = 0;
+    node.addr_cnt.cnt = 0;
+    node.category_size.category = 0;
+    node.category_size.size_class = 0;
+}
+
+static size_t sgi_splay_tree_node_size(uint32_t version) {
+    return version == SGI_SPLAY_TREE_VERSION_WIDE ? sizeof(sgi_splay_tree_wide_node) : sizeof(sgi_splay_tree_node);
+}
+
+// in place: a wide node is smaller, wide_node[i] only overlaps node[i] and the nodes before it.
+static void sgi_splay_tree_widen_nodes(sgi_splay_tree *tree, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        sgi_splay_tree_node node = tree->node[i];
+        sgi_splay_tree_wide_node wide_node = sgi_splay_wide_node_init(node.addr_cnt.addr, node.stackid_and_flags, node.category_and_size, node.index.parent);
+        wide_node.index.left = node.index.left;
+        wide_node.index.right = node.index.right;
+        wide_node.addr_cnt.cnt = node.addr_cnt.cnt > 0xFFFF ? 0xFFFF : node.addr_cnt.cnt;
+        tree->wide_node[i] = wide_node;
+    }
+    bzero(&tree->wide_node[count], (size_t)count * (sizeof(sgi_splay_tree_node) - sizeof(sgi_splay_tree_wide_node)));
+}
+
+// MARK: - MMAP
+
 sgi_splay_tree *sgi_splay_tree_read_from_mmapfile(const char *path) {
-    FILE *fp = fopen(path, "rb+");
+    FILE *fp = fopen(path, "rb");
     if (fp == nullptr) {
         SGIAPMMallocLog("fail to open:%s, %s\n", path, strerror(errno));
         return nullptr;
     }
 
     size_t size = sgi_get_file_size(fileno(fp));
-    if (size <= 0)
+    if (size < sizeof(sgi_splay_tree)) {
+        fclose(fp);
         return nullptr;
+    }
 
-    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED, fileno(fp), 0);
+    // private, the header fields set below never reach the file.
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_FILE | MAP_PRIVATE, fileno(fp), 0);
     if (ptr == MAP_FAILED) {
         SGIAPMMallocLog("fail to open:%s\n", strerror(errno));
+        fclose(fp);
         return nullptr;
     }
 
     sgi_splay_tree *tree = (sgi_splay_tree *)ptr;
+    if (tree->version > SGI_SPLAY_TREE_VERSION_WIDE) {
+        SGIAPMMallocLog("unknown splay tree version: %u, %s\n", tree->version, path);
+        munmap(ptr, size);
+        fclose(fp);
+        return nullptr;
+    }
+    if (sizeof(sgi_splay_tree) + (size_t)tree->max_index * sgi_splay_tree_node_size(tree->version) > size) {
+        SGIAPMMallocLog("truncated splay tree: %s\n", path);
+        munmap(ptr, size);
+        fclose(fp);
+        return nullptr;
+    }
     tree->mmap_fp = fp;
+    tree->mmap_size = size;
+    tree->mmap_reserve_pages = (uint32_t)(size / getpagesize());
     tree->node = (sgi_splay_tree_node *)((char *)ptr + sizeof(sgi_splay_tree));
     return tree;
 }
 
-size_t mmap_size_of_splay_tree_node_count(FILE *fp, size_t node_count) {
-    size_t size = (sizeof(sgi_splay_tree) + node_count * sizeof(sgi_splay_tree_node));
+size_t mmap_size_of_splay_tree_node_count(FILE *fp, size_t node_count, size_t node_size) {
+    size_t size = (sizeof(sgi_splay_tree) + node_count * node_size);
     if (size < getpagesize() || (size % getpagesize() != 0)) {
         size = (size / getpagesize() + 1) * getpagesize();
         if (ftruncate(fileno(fp), size) != 0) {
@@ -75,9 +201,11 @@ sgi_splay_tree *sgi_splay_tree_create_on_mmapfile(size_t entry_count, const char
         return nullptr;
     }
 
-    size_t size = mmap_size_of_splay_tree_node_count(fp, entry_count);
+    uint32_t version = entry_count > SGI_SPLAY_TREE_NARROW_MAX_NODE_COUNT ? SGI_SPLAY_TREE_VERSION_WIDE : SGI_SPLAY_TREE_VERSION_NARROW;
+    size_t size = mmap_size_of_splay_tree_node_count(fp, entry_count, sgi_splay_tree_node_size(version));
 
-    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED, fileno(fp), 0);
+    size_t reserve_size = sgi_mmap_reserve_size(size);
+    void *ptr = sgi_mmap_reserve(fileno(fp), size, reserve_size);
     if (ptr == MAP_FAILED) {
         SGIAPMMallocLog("create splay tree, fail to mmap: %s\n", strerror(errno));
         return nullptr;
@@ -85,77 +213,83 @@ sgi_splay_tree *sgi_splay_tree_create_on_mmapfile(size_t entry_count, const char
 
     SGIAPMMallocLog("splay tree mmap to %s\n", path);
 
+    // no bzero, the file is truncated on open and reads as zero.
     sgi_splay_tree *tree = (sgi_splay_tree *)ptr;
-    bzero(tree, size);
     tree->max_index = (uint32_t)entry_count;
+    tree->version = version;
     tree->mmap_fp = fp;
     tree->mmap_size = size;
+    tree->mmap_reserve_pages = (uint32_t)(reserve_size / getpagesize());
     tree->node = (sgi_splay_tree_node *)((char *)ptr + sizeof(sgi_splay_tree));
     return tree;
 }
 
 sgi_splay_tree *sgi_expand_splay_tree(sgi_splay_tree *tree) {
     FILE *fp = tree->mmap_fp;
-    size_t old_size = mmap_size_of_splay_tree_node_count(fp, tree->max_index);
-    size_t new_node_count = tree->max_index * 2;
-    size_t new_size = mmap_size_of_splay_tree_node_count(fp, new_node_count);
-
-    SGIAPMMallocLog("will expand splay_tree, from:%y to: %y\n", old_size, new_size);
-
-    if (new_node_count > 2097152) {
-        SGIAPMMallocLog("node count: %d, out of limit (2^21), if really need, change sgi_splay_tree_node structure first.\n", new_node_count);
-        return nullptr;
+    uint32_t old_version = tree->version;
+    size_t old_node_count = tree->max_index;
+    size_t old_size = tree->mmap_size;
+    size_t new_node_count = old_node_count * 2;
+    if (new_node_count > UINT32_MAX) {
+        new_node_count = UINT32_MAX;
     }
 
-    void *copy = (void *)sgi_malloc(old_size);
-    memcpy(copy, tree, old_size);
-    munmap(tree, old_size);
-
-    // if extend size fail, rollback to old state.
-    if (ftruncate(fileno(fp), new_size) != 0) {
-        SGIAPMMallocLog("fail to truncate to mmap file size %y\n", new_size);
-        sgi_free(copy);
+    if (new_node_count <= old_node_count) {
+        SGIAPMMallocLog("node count: %zu, out of limit (2^32).\n", old_node_count);
         return nullptr;
     }
 
-    fseek(fp, 0, SEEK_SET);
+    // 21-bit indices can't address the new nodes, switch to the wide format.
+    uint32_t new_version = new_node_count > SGI_SPLAY_TREE_NARROW_MAX_NODE_COUNT ? SGI_SPLAY_TREE_VERSION_WIDE : old_version;
+    size_t new_size = mmap_size_of_splay_tree_node_count(fp, new_node_count, sgi_splay_tree_node_size(new_version));
 
-    void *new_mmapptr = mmap(nullptr, new_size, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED, fileno(fp), 0);
-    if (new_mmapptr == nullptr || new_mmapptr == MAP_FAILED) {
+    SGIAPMMallocLog("will expand splay_tree, from:%y to: %y\n", old_size, new_size);
+
+    // grows in place inside the reserved range, the new nodes are zero from the file extension.
+    size_t reserve_size = (size_t)tree->mmap_reserve_pages * getpagesize();
+    void *new_mmapptr = sgi_mmap_grow(tree, fileno(fp), old_size, new_size, &reserve_size);
+    if (new_mmapptr == MAP_FAILED) {
         SGIAPMMallocLog("expand splay tree, fail to mmap: %s\n", strerror(errno));
-        sgi_free(copy);
         return nullptr;
     }
 
-    memset(new_mmapptr, '\0', new_size);
-    memcpy(new_mmapptr, copy, old_size);
-
-    sgi_free(copy);
-
     sgi_splay_tree *new_tree = (sgi_splay_tree *)new_mmapptr;
+    new_tree->node = (sgi_splay_tree_node *)((char *)new_mmapptr + sizeof(sgi_splay_tree));
+    if (new_version != old_version) {
+        sgi_splay_tree_widen_nodes(new_tree, (uint32_t)old_node_count);
+        SGIAPMMallocLog("splay tree switches to wide nodes, node_count: %zu\n", new_node_count);
+    }
+
     new_tree->max_index = (uint32_t)new_node_count;
+    new_tree->version = new_version;
     new_tree->mmap_size = new_size;
-    new_tree->node = (sgi_splay_tree_node *)((char *)new_mmapptr + sizeof(sgi_splay_tree));
-    SGIAPMMallocLog("expand mmap file size: %y -> %y, node_count: %d\n", old_size, new_size, new_node_count);
+    new_tree->mmap_reserve_pages = (uint32_t)(reserve_size / getpagesize());
+    SGIAPMMallocLog("expand mmap file size: %y -> %y, node_count: %zu\n", old_size, new_size, new_node_count);
     return new_tree;
 }
 
 sgi_splay_tree *sgi_splay_tree_create(size_t entry_count) {
     sgi_splay_tree *tree = (sgi_splay_tree *)sgi_malloc(sizeof(sgi_splay_tree));
     tree->max_index = (uint32_t)entry_count;
+    tree->version = entry_count > SGI_SPLAY_TREE_NARROW_MAX_NODE_COUNT ? SGI_SPLAY_TREE_VERSION_WIDE : SGI_SPLAY_TREE_VERSION_NARROW;
     tree->root_index = 0;
     tree->node_index = 0;
     tree->mmap_size = 0;
+    tree->mmap_reserve_pages = 0;
     tree->nextInsertIndex = 0;
-    tree->node = (sgi_splay_tree_node *)sgi_malloc(entry_count * sizeof(sgi_splay_tree_node));
+    tree->node = (sgi_splay_tree_node *)sgi_malloc(entry_count * sgi_splay_tree_node_size(tree->version));
     return tree;
 }
 
-uint32_t sgi_splay_tree_relation(sgi_splay_tree_node *node, uint32_t nodeIndex) {
+// MARK: - Splay, both node formats
+
+template <typename Node>
+static uint32_t sgi_splay_tree_relation(Node *node, uint32_t nodeIndex) {
     return nodeIndex == node[node[nodeIndex].index.parent].index.right;
 }
 
-void sgi_splay_tree_rotate(sgi_splay_tree_node *node, uint32_t nodeIndex) {
+template <typename Node>
+static void sgi_splay_tree_rotate(Node *node, uint32_t nodeIndex) {
     uint32_t parent = node[nodeIndex].index.parent;
     uint32_t grand = node[parent].index.parent;
     uint32_t cur = (nodeIndex == node[parent].index.right ? node[nodeIndex].index.left : node[nodeIndex].index.right);
@@ -181,137 +315,258 @@ void sgi_splay_tree_rotate(sgi_splay_tree_node *node, uint32_t nodeIndex) {
     }
 }
 
-void sgi_splay_tree_splay(sgi_splay_tree *tree, uint32_t nodeIndex, uint32_t tmpIndex) {
-    while (tree->node[nodeIndex].index.parent != tmpIndex) {
-        if (tree->node[tree->node[nodeIndex].index.parent].index.parent != tmpIndex) {
-            if (sgi_splay_tree_relation(tree->node, nodeIndex) == sgi_splay_tree_relation(tree->node, tree->node[nodeIndex].index.parent)) {
-                sgi_splay_tree_rotate(tree->node, tree->node[nodeIndex].index.parent);
+template <typename Node>
+static void sgi_splay_tree_splay(sgi_splay_tree *tree, Node *node, uint32_t nodeIndex, uint32_t tmpIndex) {
+    while (node[nodeIndex].index.parent != tmpIndex) {
+        if (node[node[nodeIndex].index.parent].index.parent != tmpIndex) {
+            if (sgi_splay_tree_relation(node, nodeIndex) == sgi_splay_tree_relation(node, node[nodeIndex].index.parent)) {
+                sgi_splay_tree_rotate(node, node[nodeIndex].index.parent);
             } else {
-                sgi_splay_tree_rotate(tree->node, nodeIndex);
+                sgi_splay_tree_rotate(node, nodeIndex);
             }
         }
-        sgi_splay_tree_rotate(tree->node, nodeIndex);
+        sgi_splay_tree_rotate(node, nodeIndex);
     }
     if (!tmpIndex) {
         tree->root_index = nodeIndex;
     }
 }
 
-uint32_t sgi_splay_tree_search(sgi_splay_tree *tree, vm_address_t addr, bool splay) {
+template <typename Node>
+static uint32_t sgi_splay_tree_search_nodes(sgi_splay_tree *tree, Node *node, vm_address_t addr, bool splay) {
     if (!tree->root_index) {
         return 0;
     }
+    uint64_t key = sgi_splay_node_key(node, addr);
     uint32_t idx = tree->root_index;
     while (idx) {
-        if (addr == tree->node[idx].addr_cnt.addr) {
+        if (key == node[idx].addr_cnt.addr) {
             if (splay) {
-                sgi_splay_tree_splay(tree, idx, 0);
+                sgi_splay_tree_splay(tree, node, idx, 0);
             }
             return idx;
-        } else if (addr < tree->node[idx].addr_cnt.addr) {
-            idx = tree->node[idx].index.left;
-        } else if (addr > tree->node[idx].addr_cnt.addr) {
-            idx = tree->node[idx].index.right;
+        } else if (key < node[idx].addr_cnt.addr) {
+            idx = node[idx].index.left;
+        } else {
+            idx = node[idx].index.right;
         }
     }
     return 0;
 }
 
-bool sgi_splay_tree_insert(sgi_splay_tree *tree, uint64_t addr, uint64_t stackid_and_flags, uint64_t category_and_size) {
-    if (!tree->root_index) {
-        tree->root_index = ++tree->node_index;
-        tree->node[tree->root_index] = sgi_splay_node_init(addr, stackid_and_flags, category_and_size, 0);
-        return true;
+// returns 0 if the tree is full
+template <typename Node>
+static uint32_t sgi_splay_tree_new_node_index(sgi_splay_tree *tree, Node *node) {
+    // 复用之前已经删除的内存空间
+    if (tree->nextInsertIndex && tree->nextInsertIndex <= tree->node_index) {
+        uint32_t idx = tree->nextInsertIndex;
+        tree->nextInsertIndex = node[idx].index.parent;
+        return idx;
+    }
+    // node[0] is the null node, the last usable one is node[max_index - 1].
+    if (tree->node_index + 1 >= tree->max_index) {
+        return 0;
     }
+    return ++tree->node_index;
+}
 
-    if (tree->node_index >= tree->max_index) {
-        return false;
+template <typename Node>
+static bool sgi_splay_tree_insert_nodes(sgi_splay_tree *tree, Node *node, uint64_t addr, uint64_t stackid_and_flags, uint64_t category_and_size) {
+    if (!tree->root_index) {
+        // the tree may become empty many times (e.g. a small shard), reuse the deleted nodes as well.
+        uint32_t idx = sgi_splay_tree_new_node_index(tree, node);
+        if (!idx) {
+            return false;
+        }
+        tree->root_index = idx;
+        sgi_splay_node_assign(node[idx], addr, stackid_and_flags, category_and_size, 0);
+        return true;
     }
 
+    uint64_t key = sgi_splay_node_key(node, addr);
     uint32_t idx = tree->root_index, parent = 0;
-    while (idx && addr != tree->node[idx].addr_cnt.addr) {
+    while (idx && key != node[idx].addr_cnt.addr) {
         parent = idx;
-        idx = (addr < tree->node[idx].addr_cnt.addr ? tree->node[idx].index.left : tree->node[idx].index.right);
+        idx = (key < node[idx].addr_cnt.addr ? node[idx].index.left : node[idx].index.right);
     }
 
     if (idx) {
-        tree->node[idx].addr_cnt.cnt++;
+        node[idx].addr_cnt.cnt++;
+        if (node[idx].addr_cnt.cnt == 0) {
+            node[idx].addr_cnt.cnt--; // saturate, a wrapped count would free the node too early
+        }
     } else {
-        // 复用之前已经删除的内存空间
-        if (tree->nextInsertIndex && tree->nextInsertIndex <= tree->node_index) {
-            idx = tree->node[tree->nextInsertIndex].addr_cnt.cnt;
-            tree->nextInsertIndex = tree->node[tree->nextInsertIndex].index.parent;
-            tree->node[idx] = sgi_splay_node_init(addr, stackid_and_flags, category_and_size, parent);
-        } else {
-            idx = ++tree->node_index;
-            tree->node[idx] = sgi_splay_node_init(addr, stackid_and_flags, category_and_size, parent);
+        idx = sgi_splay_tree_new_node_index(tree, node);
+        if (!idx) {
+            return false;
         }
-        if (tree->node[idx].addr_cnt.addr < tree->node[parent].addr_cnt.addr) {
-            tree->node[parent].index.left = idx;
+        sgi_splay_node_assign(node[idx], addr, stackid_and_flags, category_and_size, parent);
+        if (node[idx].addr_cnt.addr < node[parent].addr_cnt.addr) {
+            node[parent].index.left = idx;
         } else {
-            tree->node[parent].index.right = idx;
+            node[parent].index.right = idx;
         }
     }
 
     // 插入后是否需要 Splay 操作
-    sgi_splay_tree_splay(tree, idx, 0);
+    sgi_splay_tree_splay(tree, node, idx, 0);
     tree->root_index = idx;
     return true;
 }
 
-sgi_splay_tree_node sgi_splay_tree_delete(sgi_splay_tree *tree, vm_address_t addr) {
-    uint32_t idx = sgi_splay_tree_search(tree, addr, tree);
+template <typename Node>
+static Node sgi_splay_tree_delete_nodes(sgi_splay_tree *tree, Node *node, vm_address_t addr) {
+    uint32_t idx = sgi_splay_tree_search_nodes(tree, node, addr, true);
     if (!idx) {
-        sgi_splay_tree_node empty_node = {
-            .index.parent = 0,
-            .index.right = 0,
-            .index.left = 0,
-            .index.extra = 0,
-            .addr_cnt.addr = 0,
-            .addr_cnt.cnt = 0,
-            .category_and_size = 0,
-            .stackid_and_flags = 0,
-        };
+        Node empty_node;
+        memset(&empty_node, 0, sizeof(empty_node));
         return empty_node;
     }
 
-    sgi_splay_tree_node removedNode = tree->node[idx];
-
-    sgi_splay_tree_splay(tree, idx, 0);
+    Node removedNode = node[idx];
 
-    if (tree->node[idx].addr_cnt.cnt > 1) {
-        tree->node[idx].addr_cnt.cnt--;
+    if (node[idx].addr_cnt.cnt > 1) {
+        node[idx].addr_cnt.cnt--;
         return removedNode;
     }
-    if (!tree->node[idx].index.left || !tree->node[idx].index.right) {
-        tree->root_index = tree->node[idx].index.left + tree->node[idx].index.right;
+    if (!node[idx].index.left || !node[idx].index.right) {
+        tree->root_index = node[idx].index.left + node[idx].index.right;
     } else {
-        uint32_t temp = tree->node[idx].index.right;
-        while (tree->node[temp].index.left) {
-            temp = tree->node[temp].index.left;
+        uint32_t temp = node[idx].index.right;
+        while (node[temp].index.left) {
+            temp = node[temp].index.left;
         }
-        sgi_splay_tree_splay(tree, temp, idx);
-        tree->node[temp].index.left = tree->node[idx].index.left;
-        tree->node[tree->node[temp].index.left].index.parent = temp;
+        sgi_splay_tree_splay(tree, node, temp, idx);
+        node[temp].index.left = node[idx].index.left;
+        node[node[temp].index.left].index.parent = temp;
         tree->root_index = temp;
     }
-    tree->node[tree->root_index].index.parent = 0;
-    tree->node[idx].addr_cnt.addr = 0;
-    tree->node[idx].category_and_size = 0;
-    tree->node[idx].addr_cnt.cnt = idx;
-    tree->node[idx].index.parent = tree->nextInsertIndex;
+    node[tree->root_index].index.parent = 0;
+    // free list: linked by `index.parent`, stackid is kept so readers skip on the cleared address.
+    sgi_splay_node_clear(node[idx]);
+    node[idx].index.parent = tree->nextInsertIndex;
     tree->nextInsertIndex = idx;
 
     return removedNode;
 }
 
+template <typename Node>
+static void sgi_splay_tree_enumerate_nodes(sgi_splay_tree *tree, Node *node, sgi_splay_tree_enumerator enumerator, void *context) {
+    for (uint32_t i = 1; i <= tree->node_index; i++) {
+        // addr is cleared when the node goes back to the free list
+        if (node[i].addr_cnt.addr == 0) {
+            continue;
+        }
+        uint64_t stackid_and_flags = sgi_splay_node_stackid_and_flags(node[i]);
+        if (stackid_and_flags == 0) {
+            continue;
+        }
+        enumerator(sgi_splay_node_address(node[i]), stackid_and_flags, sgi_splay_node_category_and_size(node[i]), context);
+    }
+}
+
+// MARK: - Public
+
+bool sgi_splay_tree_insert(sgi_splay_tree *tree, uint64_t addr, uint64_t stackid_and_flags, uint64_t category_and_size) {
+    if (tree->version == SGI_SPLAY_TREE_VERSION_WIDE) {
+        return sgi_splay_tree_insert_nodes(tree, tree->wide_node, addr, stackid_and_flags, category_and_size);
+    }
+    return sgi_splay_tree_insert_nodes(tree, tree->node, addr, stackid_and_flags, category_and_size);
+}
+
+uint32_t sgi_splay_tree_search(sgi_splay_tree *tree, vm_address_t addr, bool splay) {
+    if (tree->version == SGI_SPLAY_TREE_VERSION_WIDE) {
+        return sgi_splay_tree_search_nodes(tree, tree->wide_node, addr, splay);
+    }
+    return sgi_splay_tree_search_nodes(tree, tree->node, addr, splay);
+}
+
+sgi_splay_tree_node sgi_splay_tree_delete(sgi_splay_tree *tree, vm_address_t addr) {
+    if (tree->version != SGI_SPLAY_TREE_VERSION_WIDE) {
+        return sgi_splay_tree_delete_nodes(tree, tree->node, addr);
+    }
+
+    sgi_splay_tree_wide_node removed = sgi_splay_tree_delete_nodes(tree, tree->wide_node, addr);
+    sgi_splay_tree_node node;
+    memset(&node, 0, sizeof(node));
+    if (removed.addr_cnt.addr != 0) {
+        node = sgi_splay_node_init(addr, sgi_splay_node_stackid_and_flags(removed), sgi_splay_node_category_and_size(removed), 0);
+        node.addr_cnt.cnt = removed.addr_cnt.cnt;
+    }
+    return node;
+}
+
+template <typename Node>
+static void sgi_splay_tree_set_node_category(Node &node, uint64_t category, uint64_t *out_stackid_and_flags, uint64_t *out_category_and_size) {
+    if (out_stackid_and_flags) {
+        *out_stackid_and_flags = sgi_splay_node_stackid_and_flags(node);
+    }
+    if (out_category_and_size) {
+        *out_category_and_size = sgi_splay_node_category_and_size(node);
+    }
+    sgi_splay_node_set_category(node, category);
+}
+
+bool sgi_splay_tree_set_category(sgi_splay_tree *tree, vm_address_t addr, uint64_t category, uint64_t *out_stackid_and_flags, uint64_t *out_category_and_size) {
+    uint32_t idx = sgi_splay_tree_search(tree, addr, false);
+    if (idx == 0) {
+        return false;
+    }
+    if (tree->version == SGI_SPLAY_TREE_VERSION_WIDE) {
+        sgi_splay_tree_set_node_category(tree->wide_node[idx], category, out_stackid_and_flags, out_category_and_size);
+    } else {
+        sgi_splay_tree_set_node_category(tree->node[idx], category, out_stackid_and_flags, out_category_and_size);
+    }
+    return true;
+}
+
+uint64_t sgi_splay_tree_stored_size(uint64_t size) {
+    return SGI_SPLAY_TREE_SIZE_CLASS_DECODE(sgi_splay_tree_size_class(size));
+}
+
+void sgi_splay_tree_enumerate(sgi_splay_tree *tree, sgi_splay_tree_enumerator enumerator, void *context) {
+    if (tree->version == SGI_SPLAY_TREE_VERSION_WIDE) {
+        sgi_splay_tree_enumerate_nodes(tree, tree->wide_node, enumerator, context);
+    } else {
+        sgi_splay_tree_enumerate_nodes(tree, tree->node, enumerator, context);
+    }
+}
+
+sgi_splay_tree *sgi_splay_tree_snapshot(sgi_splay_tree *tree) {
+    if (tree == nullptr || tree->mmap_fp == nullptr) {
+        return nullptr;
+    }
+
+    // the nodes follow the header in the mapping, the ones after `node_index` were never used.
+    size_t nodes_offset = (char *)tree->node - (char *)tree;
+    size_t size = round_page(nodes_offset + ((size_t)tree->node_index + 1) * sgi_splay_tree_node_size(tree->version));
+    if (size > tree->mmap_size) {
+        size = tree->mmap_size;
+    }
+    sgi_splay_tree *snapshot = (sgi_splay_tree *)sgi_copy_pages(tree, size);
+    if (snapshot == nullptr) {
+        return nullptr;
+    }
+    snapshot->mmap_fp = nullptr;
+    snapshot->mmap_size = size;
+    snapshot->mmap_reserve_pages = 0;
+    snapshot->node = (sgi_splay_tree_node *)((char *)snapshot + nodes_offset);
+    return snapshot;
+}
+
+void sgi_splay_tree_snapshot_release(sgi_splay_tree *snapshot) {
+    if (snapshot != nullptr) {
+        sgi_deallocate_pages(snapshot, snapshot->mmap_size);
+    }
+}
+
 void sgi_splay_tree_close(sgi_splay_tree *tree) {
     FILE *fp = 0;
     if (tree != MAP_FAILED && tree != nullptr) {
         msync(tree, tree->mmap_size, MS_ASYNC);
 
         fp = tree->mmap_fp;
-        munmap(tree, tree->mmap_size);
+        sgi_munmap_reserved(tree, (size_t)tree->mmap_reserve_pages * getpagesize());
         tree = nullptr;
     }
 
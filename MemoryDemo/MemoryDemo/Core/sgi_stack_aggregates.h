@@ -0,0 +1,63 @@
+//
+// sgi_stack_aggregates.h
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+
+#ifndef sgi_stack_aggregates_h
+#define sgi_stack_aggregates_h
+
+#include <mach/mach.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Live bytes and allocations per stack id, kept up to date on every insert/delete of the allocation records.
+
+ An mmaped file array indexed by stack id, grown in place (see sgi_mmap_grow) when a bigger stack id shows up. The
+ stacks ever added are chained through their entries, a report walks the stacks instead of the live allocations.
+ Updates are atomic, concurrent writers only need to be stopped to read a consistent state.
+ */
+typedef struct _sgi_stack_aggregates sgi_stack_aggregates;
+
+sgi_stack_aggregates *sgi_stack_aggregates_create(const char *path, uint32_t capacity); /**< capacity in stack ids, grown as needed */
+void sgi_stack_aggregates_close(sgi_stack_aggregates *aggregates); /**< writers should be stopped, the struct itself is kept */
+
+/*
+ Adds `size` bytes and `count` allocations (negative to remove them) to the stack of `stackid_and_flags`, an added
+ allocation also sets the flags of the stack. The category of the stack is the smallest non zero `category` added,
+ it stays once its allocations are removed: the smallest category of the live allocations, as a scan of the records
+ finds it, as long as one allocation of that category is live.
+ Returns false if the stack could not be stored, the aggregates are incomplete from then on.
+ */
+bool sgi_stack_aggregates_add(sgi_stack_aggregates *aggregates, uint64_t stackid_and_flags, int64_t size, int32_t count, uint64_t category);
+bool sgi_stack_aggregates_is_complete(sgi_stack_aggregates *aggregates);
+
+typedef void (*sgi_stack_aggregates_enumerator)(uint64_t stackid_and_flags, uint64_t size, uint32_t count, uint64_t category, void *context);
+
+/*
+ A copy of the live stacks to enumerate while the writers go on, taken with the writers stopped. Only the stacks are
+ copied, in enumeration order, not the array indexed by stack id. NULL on failure.
+ */
+sgi_stack_aggregates *sgi_stack_aggregates_snapshot(sgi_stack_aggregates *aggregates);
+void sgi_stack_aggregates_snapshot_release(sgi_stack_aggregates *snapshot);
+
+/*
+ The live stacks of a file left by `create`, read-only into a snapshot (release it with `snapshot_release`). Whether the
+ aggregates were complete is not in the file, check them against the records. NULL on failure.
+ */
+sgi_stack_aggregates *sgi_stack_aggregates_read_from_file(const char *path);
+
+void sgi_stack_aggregates_enumerate(sgi_stack_aggregates *aggregates, sgi_stack_aggregates_enumerator enumerator, void *context); /**< stacks with live allocations, most recently added first. writers should be stopped */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* sgi_stack_aggregates_h */
@@ -0,0 +1,332 @@
+//
+// sgi_stack_aggregates.mm
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+
+#include "sgi_stack_aggregates.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#import "SGIAPMCommonDef.h"
+
+#include "sgi_file_utils.h"
+#include "sgi_inner_allocate.h"
+#include "sgi_locking.h"
+#include "sgi_splay_tree.h"
+
+#define SGI_STACK_AGGREGATES_MAX_RETIRED_MAPPINGS 8 // mappings left behind by moving growths, one per move out of a reserved range (see sgi_mmap_reserve_size)
+#define SGI_STACK_AGGREGATES_LAST 0xFFFFFFFFu       // `next` of the first stack added
+
+typedef struct {
+    uint64_t size;              // live bytes
+    uint32_t count;             // live allocations
+    uint32_t next;              // stack id + 1 of the stack added before, 0 if not chained yet
+    uint64_t stackid_and_flags; // of the last allocation added
+    uint64_t category;          // smallest category id attached to an allocation of the stack, 0 if none
+} sgi_stack_aggregate;
+
+struct _sgi_stack_aggregates {
+    _malloc_lock_s lock; // growth only
+    FILE *mmap_fp;
+    sgi_stack_aggregate *entries; // atomic, published before `capacity`
+    uint32_t capacity;            // atomic
+    uint32_t head;                // atomic, stack id + 1 of the last stack added, 0 if none
+    uint32_t chained_count;       // atomic, stacks in the chain
+    size_t mmap_size;
+    size_t reserved_size;
+    bool incomplete;
+    uint32_t retired_count;
+    struct {
+        void *address;
+        size_t reserved_size;
+    } retired[SGI_STACK_AGGREGATES_MAX_RETIRED_MAPPINGS];
+};
+
+static inline size_t sgi_stack_aggregates_mmap_size(uint64_t capacity) {
+    return round_page(capacity * sizeof(sgi_stack_aggregate));
+}
+
+sgi_stack_aggregates *sgi_stack_aggregates_create(const char *path, uint32_t capacity) {
+    if (!sgi_is_file_exist(path)) {
+        if (!sgi_create_file(path)) {
+            return nullptr;
+        }
+    }
+
+    FILE *fp = fopen(path, "wb+");
+    if (fp == nullptr) {
+        SGIAPMMallocLog("fail to open:%s, %s\n", path, strerror(errno));
+        return nullptr;
+    }
+
+    size_t size = sgi_stack_aggregates_mmap_size(capacity > 0 ? capacity : 1);
+    if (ftruncate(fileno(fp), size) != 0) {
+        SGIAPMMallocLog("fail to truncate:%s, size:%zu\n", strerror(errno), size);
+        fclose(fp);
+        return nullptr;
+    }
+
+    // no bzero, the file is truncated on open and reads as zero.
+    size_t reserved_size = sgi_mmap_reserve_size(size);
+    void *ptr = sgi_mmap_reserve(fileno(fp), size, reserved_size);
+    if (ptr == MAP_FAILED) {
+        SGIAPMMallocLog("create stack aggregates, fail to mmap: %s\n", strerror(errno));
+        fclose(fp);
+        return nullptr;
+    }
+
+    sgi_stack_aggregates *aggregates = (sgi_stack_aggregates *)sgi_allocate_page(round_page(sizeof(sgi_stack_aggregates)));
+    if (aggregates == NULL) {
+        sgi_munmap_reserved(ptr, reserved_size);
+        fclose(fp);
+        return nullptr;
+    }
+
+    SGIAPMMallocLog("stack aggregates mmap to %s\n", path);
+
+    _malloc_lock_init(&aggregates->lock);
+    aggregates->mmap_fp = fp;
+    aggregates->entries = (sgi_stack_aggregate *)ptr;
+    aggregates->capacity = (uint32_t)(size / sizeof(sgi_stack_aggregate));
+    aggregates->mmap_size = size;
+    aggregates->reserved_size = reserved_size;
+    return aggregates;
+}
+
+void sgi_stack_aggregates_close(sgi_stack_aggregates *aggregates) {
+    if (aggregates == NULL || aggregates->entries == NULL) {
+        return;
+    }
+
+    msync(aggregates->entries, aggregates->mmap_size, MS_ASYNC);
+    sgi_munmap_reserved(aggregates->entries, aggregates->reserved_size);
+    for (uint32_t i = 0; i < aggregates->retired_count; i++) {
+        sgi_munmap_reserved(aggregates->retired[i].address, aggregates->retired[i].reserved_size);
+    }
+    aggregates->retired_count = 0;
+    fclose(aggregates->mmap_fp);
+    aggregates->mmap_fp = NULL;
+
+    __atomic_store_n(&aggregates->capacity, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&aggregates->entries, NULL, __ATOMIC_RELEASE);
+}
+
+// grows the array to hold `stack_id`. writers still using a moved mapping keep writing to the same shared file pages,
+// so the old mapping is only retired, not unmapped.
+static bool sgi_stack_aggregates_grow(sgi_stack_aggregates *aggregates, uint64_t stack_id) {
+    bool result = false;
+    _malloc_lock_lock(&aggregates->lock);
+
+    uint32_t capacity = aggregates->capacity;
+    if (stack_id < capacity) {
+        result = true;
+    } else if (aggregates->entries != NULL && !aggregates->incomplete) {
+        uint64_t new_capacity = (uint64_t)capacity * 2;
+        if (new_capacity <= stack_id) {
+            new_capacity = stack_id + 1;
+        }
+        size_t new_size = sgi_stack_aggregates_mmap_size(new_capacity);
+        size_t old_reserved_size = aggregates->reserved_size;
+        if (new_size > old_reserved_size && aggregates->retired_count == SGI_STACK_AGGREGATES_MAX_RETIRED_MAPPINGS) {
+            SGIAPMMallocLog("[error] too many moves of stack aggregates\n");
+        } else {
+            void *old_entries = aggregates->entries;
+            void *ptr = sgi_mmap_grow_retaining(old_entries, fileno(aggregates->mmap_fp), aggregates->mmap_size, new_size, &aggregates->reserved_size);
+            if (ptr != MAP_FAILED) {
+                if (ptr != old_entries) {
+                    aggregates->retired[aggregates->retired_count].address = old_entries;
+                    aggregates->retired[aggregates->retired_count].reserved_size = old_reserved_size;
+                    aggregates->retired_count++;
+                }
+                aggregates->mmap_size = new_size;
+                __atomic_store_n(&aggregates->entries, (sgi_stack_aggregate *)ptr, __ATOMIC_RELEASE);
+                __atomic_store_n(&aggregates->capacity, (uint32_t)(new_size / sizeof(sgi_stack_aggregate)), __ATOMIC_RELEASE);
+                result = true;
+            }
+        }
+    }
+
+    if (!result) {
+        aggregates->incomplete = true;
+    }
+    _malloc_lock_unlock(&aggregates->lock);
+    return result;
+}
+
+bool sgi_stack_aggregates_add(sgi_stack_aggregates *aggregates, uint64_t stackid_and_flags, int64_t size, int32_t count, uint64_t category) {
+    uint64_t stack_id = SGI_ALLOCATIONS_OFFSET(stackid_and_flags);
+    if (aggregates == NULL) {
+        return false;
+    }
+    if (stack_id >= SGI_STACK_AGGREGATES_LAST - 1) {
+        __atomic_store_n(&aggregates->incomplete, true, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    if (stack_id >= __atomic_load_n(&aggregates->capacity, __ATOMIC_ACQUIRE) && !sgi_stack_aggregates_grow(aggregates, stack_id)) {
+        return false;
+    }
+    sgi_stack_aggregate *entries = __atomic_load_n(&aggregates->entries, __ATOMIC_ACQUIRE);
+    if (entries == NULL) {
+        return false;
+    }
+
+    sgi_stack_aggregate *entry = &entries[stack_id];
+    __atomic_fetch_add(&entry->size, (uint64_t)size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&entry->count, (uint32_t)count, __ATOMIC_RELAXED);
+    if (count > 0) {
+        __atomic_store_n(&entry->stackid_and_flags, stackid_and_flags, __ATOMIC_RELAXED);
+    }
+    // the smallest id wins, as in a scan of the records: the result does not depend on the order of the allocations.
+    uint64_t entry_category = __atomic_load_n(&entry->category, __ATOMIC_RELAXED);
+    while (category != 0 && (entry_category == 0 || category < entry_category) &&
+           !__atomic_compare_exchange_n(&entry->category, &entry_category, category, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+
+    // chain a new stack, only once: entries are never unchained, so the head never sees an entry twice (no ABA).
+    uint32_t unchained = 0;
+    if (__atomic_load_n(&entry->next, __ATOMIC_RELAXED) == 0 &&
+        __atomic_compare_exchange_n(&entry->next, &unchained, SGI_STACK_AGGREGATES_LAST, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        uint32_t head = __atomic_load_n(&aggregates->head, __ATOMIC_RELAXED);
+        do {
+            __atomic_store_n(&entry->next, head != 0 ? head : SGI_STACK_AGGREGATES_LAST, __ATOMIC_RELAXED);
+        } while (!__atomic_compare_exchange_n(&aggregates->head, &head, (uint32_t)stack_id + 1, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        __atomic_fetch_add(&aggregates->chained_count, 1, __ATOMIC_RELAXED);
+    }
+    return true;
+}
+
+bool sgi_stack_aggregates_is_complete(sgi_stack_aggregates *aggregates) {
+    return aggregates != NULL && aggregates->entries != NULL && !__atomic_load_n(&aggregates->incomplete, __ATOMIC_RELAXED);
+}
+
+sgi_stack_aggregates *sgi_stack_aggregates_snapshot(sgi_stack_aggregates *aggregates) {
+    if (aggregates == NULL || aggregates->entries == NULL) {
+        return NULL;
+    }
+
+    sgi_stack_aggregates *snapshot = (sgi_stack_aggregates *)sgi_allocate_page(round_page(sizeof(sgi_stack_aggregates)));
+    if (snapshot == NULL) {
+        return NULL;
+    }
+    // the array is sized for every stack id, only the live stacks are copied: packed in chain order and chained to the
+    // next one, so the snapshot enumerates the same way. one walk, every step is a cache miss.
+    uint32_t chained_count = aggregates->chained_count;
+    size_t size = sgi_stack_aggregates_mmap_size(chained_count > 0 ? chained_count : 1);
+    sgi_stack_aggregate *entries = (sgi_stack_aggregate *)sgi_allocate_page(size);
+    if (entries == NULL) {
+        sgi_deallocate_pages(snapshot, round_page(sizeof(sgi_stack_aggregates)));
+        return NULL;
+    }
+
+    uint32_t live_count = 0;
+    for (uint32_t next = aggregates->head; next != 0 && next != SGI_STACK_AGGREGATES_LAST && live_count < chained_count; next = aggregates->entries[next - 1].next) {
+        const sgi_stack_aggregate *entry = &aggregates->entries[next - 1];
+        if (entry->count > 0) {
+            entries[live_count] = *entry;
+            entries[live_count].next = live_count + 2;
+            live_count++;
+        }
+    }
+    if (live_count > 0) {
+        entries[live_count - 1].next = SGI_STACK_AGGREGATES_LAST;
+    }
+
+    // not mmaped to a file, never grown.
+    _malloc_lock_init(&snapshot->lock);
+    snapshot->entries = entries;
+    snapshot->capacity = live_count;
+    snapshot->head = live_count > 0 ? 1 : 0;
+    snapshot->mmap_size = size;
+    snapshot->incomplete = aggregates->incomplete;
+    return snapshot;
+}
+
+sgi_stack_aggregates *sgi_stack_aggregates_read_from_file(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == nullptr) {
+        SGIAPMMallocLog("fail to open:%s, %s\n", path, strerror(errno));
+        return nullptr;
+    }
+
+    size_t file_size = sgi_get_file_size(fileno(fp));
+    uint64_t capacity = file_size / sizeof(sgi_stack_aggregate);
+    if (capacity == 0 || capacity > UINT32_MAX) {
+        fclose(fp);
+        return nullptr;
+    }
+    const sgi_stack_aggregate *file_entries = (const sgi_stack_aggregate *)mmap(nullptr, file_size, PROT_READ, MAP_FILE | MAP_PRIVATE, fileno(fp), 0);
+    fclose(fp);
+    if (file_entries == MAP_FAILED) {
+        SGIAPMMallocLog("read stack aggregates, fail to mmap: %s\n", strerror(errno));
+        return nullptr;
+    }
+
+    // the head of the chain was not in the file, the live stacks are packed in stack id order instead.
+    uint32_t live_count = 0;
+    for (uint64_t i = 0; i < capacity; i++) {
+        live_count += file_entries[i].count > 0;
+    }
+
+    sgi_stack_aggregates *snapshot = (sgi_stack_aggregates *)sgi_allocate_page(round_page(sizeof(sgi_stack_aggregates)));
+    size_t size = sgi_stack_aggregates_mmap_size(live_count > 0 ? live_count : 1);
+    sgi_stack_aggregate *entries = snapshot != NULL ? (sgi_stack_aggregate *)sgi_allocate_page(size) : NULL;
+    if (entries == NULL) {
+        if (snapshot != NULL) {
+            sgi_deallocate_pages(snapshot, round_page(sizeof(sgi_stack_aggregates)));
+        }
+        munmap((void *)file_entries, file_size);
+        return NULL;
+    }
+
+    uint32_t index = 0;
+    for (uint64_t i = 0; i < capacity && index < live_count; i++) {
+        if (file_entries[i].count > 0) {
+            entries[index] = file_entries[i];
+            entries[index].next = index + 2;
+            index++;
+        }
+    }
+    if (live_count > 0) {
+        entries[live_count - 1].next = SGI_STACK_AGGREGATES_LAST;
+    }
+    munmap((void *)file_entries, file_size);
+
+    _malloc_lock_init(&snapshot->lock);
+    snapshot->entries = entries;
+    snapshot->capacity = live_count;
+    snapshot->head = live_count > 0 ? 1 : 0;
+    snapshot->chained_count = live_count;
+    snapshot->mmap_size = size;
+    return snapshot;
+}
+
+void sgi_stack_aggregates_snapshot_release(sgi_stack_aggregates *snapshot) {
+    if (snapshot == NULL) {
+        return;
+    }
+    sgi_deallocate_pages(snapshot->entries, snapshot->mmap_size);
+    sgi_deallocate_pages(snapshot, round_page(sizeof(sgi_stack_aggregates)));
+}
+
+void sgi_stack_aggregates_enumerate(sgi_stack_aggregates *aggregates, sgi_stack_aggregates_enumerator enumerator, void *context) {
+    if (aggregates == NULL || aggregates->entries == NULL) {
+        return;
+    }
+
+    uint32_t next = __atomic_load_n(&aggregates->head, __ATOMIC_ACQUIRE);
+    while (next != 0 && next != SGI_STACK_AGGREGATES_LAST) {
+        sgi_stack_aggregate *entry = &aggregates->entries[next - 1];
+        if (entry->count > 0) {
+            enumerator(entry->stackid_and_flags, entry->size, entry->count, entry->category, context);
+        }
+        next = entry->next;
+    }
+}
@@ -9,21 +9,55 @@
 
 #import <Foundation/Foundation.h>
 #import "SGIDyldImagesUtil.h"
-#import "sgi_splay_tree.h"
+#import "sgi_allocation_records.h"
 #import "sgi_backtrace_uniquing_table.h"
 
 NS_ASSUME_NONNULL_BEGIN
 
 @interface SGIAPMAllocRecordReader : NSObject
 
-- (instancetype)initWithMallocRecord:(sgi_splay_tree *)mallocRecord
-                            vmRecord:(sgi_splay_tree *)vmRecord
+- (instancetype)initWithMallocRecord:(sgi_allocation_records *)mallocRecord
+                            vmRecord:(sgi_allocation_records *)vmRecord
                           stackTable:(sgi_backtrace_uniquing_table *)stackTable
                      dyld_image_info:(sgi_dyld_image_info *)dyld_image_info
                 collectionStackFrame:(BOOL)collectionStackFrame;
 
+/// a reader of the records a previous session left in `directory` (its `sgi_records_cache_dir`), e.g. after the app was
+/// killed. the records, the stacks and the category names are opened read-only from the files, nothing is recorded
+/// or frozen. `backend` and `sampleInterval` are those the session recorded with, the frames are named with the images
+/// of the current process. nil if the malloc records or the stacks can't be opened.
+- (nullable instancetype)initWithRecordsDirectory:(NSString *)directory
+                                          backend:(sgi_allocation_records_backend)backend
+                                   sampleInterval:(uint64_t)sampleInterval;
+
+/// copy the records (locked for the copy only) and generate the report from the copy while the app goes on, instead of
+/// suspending all the other threads for the whole report. default NO.
+@property (nonatomic, assign) BOOL snapshotRecords;
+
+/// of the last `generateReport` in microseconds: the whole report, and how long recording was stopped in it (the other
+/// threads suspended, or the records locked for the copy).
+@property (nonatomic, assign, readonly) uint64_t lastReportDuration;
+@property (nonatomic, assign, readonly) uint64_t lastStoppedDuration;
+
 - (NSDictionary *)generateReport;
 
+/// the same report with only the `categories` largest categories and their `stacksPerCategory` largest stacks (0 for
+/// all), the categories and stacks of fewer than `minSize` bytes or `minCount` allocations dropped. only what is kept
+/// is ranked, cheaper than `generateReport` when the limits are small. the totals are those of all the records.
+- (NSDictionary *)generateTopReportWithCategories:(uint32_t)categories
+                                stacksPerCategory:(uint32_t)stacksPerCategory
+                                          minSize:(uint32_t)minSize
+                                         minCount:(uint32_t)minCount;
+
+/// stream the same report as JSON to `path` instead of building it in memory, the memory used stays bounded whatever
+/// the number of categories and stacks. `withFrames` writes the frame addresses of every stack as well, no
+/// `generateStackFrameReportWithStackID:` per stack afterwards. returns NO if the file could not be written.
+- (BOOL)writeReportToFile:(NSString *)path withFrames:(BOOL)withFrames;
+
+/// compare the live bytes/allocations and the category kept per stack with a full scan of the records, the mismatches
+/// are logged.
+- (BOOL)checkStackAggregates;
+
 - (NSArray *)generateStackFrameReportWithStackID:(NSNumber *)stackID;
 
 @end
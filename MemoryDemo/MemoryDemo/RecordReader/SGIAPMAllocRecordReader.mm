@@ -14,19 +14,40 @@
 #import "sgi_allocate_logging.h"
 #import "sgi_allocate_record_output.h"
 #import "sgi_allocate_record_reader.h"
+#import "sgi_report_workers.h"
+#import "sgi_report_writer.h"
 
+#import <errno.h>
+#import <fcntl.h>
 #import <list>
+#import <string.h>
+#import <unistd.h>
+#import <mach/mach_time.h>
 
 
 using namespace SGIAPMAlloc;
 
+static uint64_t sgi_elapsed_microseconds(uint64_t start_time) {
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    return (mach_absolute_time() - start_time) * timebase.numer / timebase.denom / 1000;
+}
+
 @interface SGIAPMAllocRecordReader ()
 
-@property (nonatomic, assign) sgi_splay_tree *mallocRecord;
-@property (nonatomic, assign) sgi_splay_tree *vmRecord;
+@property (nonatomic, assign) sgi_allocation_records *mallocRecord;
+@property (nonatomic, assign) sgi_allocation_records *vmRecord;
 @property (nonatomic, assign) sgi_backtrace_uniquing_table *stackTable;
 @property (nonatomic, assign) sgi_dyld_image_info *dyld_image_info;
 @property (nonatomic, assign) BOOL collectionStackFrame;
+@property (nonatomic, assign) sgi_report_workers *reportWorkers;
+
+// records opened from the files of a previous session, owned by the reader.
+@property (nonatomic, assign) BOOL openedRecords;
+@property (nonatomic, assign) uint64_t openedSampleInterval;
+@property (nonatomic, copy) NSString *categoryStringsPath;
 
 @end
 
@@ -35,8 +56,8 @@ using namespace SGIAPMAlloc;
 
 #pragma mark - public methods
 
-- (instancetype)initWithMallocRecord:(sgi_splay_tree *)mallocRecord
-                            vmRecord:(sgi_splay_tree *)vmRecord
+- (instancetype)initWithMallocRecord:(sgi_allocation_records *)mallocRecord
+                            vmRecord:(sgi_allocation_records *)vmRecord
                           stackTable:(sgi_backtrace_uniquing_table *)stackTable
                      dyld_image_info:(sgi_dyld_image_info *)dyld_image_info
                 collectionStackFrame:(BOOL)collectionStackFrame {
@@ -46,43 +67,108 @@ using namespace SGIAPMAlloc;
         _stackTable = stackTable;
         _dyld_image_info = dyld_image_info;
         _collectionStackFrame = collectionStackFrame;
+
+        // spawned before the freeze, a thread created while the others are suspended could block on their locks.
+        [self createReportWorkers];
     }
     return self;
 }
 
-- (NSDictionary *)generateReport {
-    bool loggingRunning = sgi_memory_allocate_logging_enabled;
-    if (loggingRunning) {
-        sgi_memory_allocate_logging_lock();
-        sgi_memory_allocate_logging_enabled = false;
-    }
-    
-    sgi_suspend_all_child_threads();
+- (instancetype)initWithRecordsDirectory:(NSString *)directory
+                                 backend:(sgi_allocation_records_backend)backend
+                          sampleInterval:(uint64_t)sampleInterval {
+    if ((self = [super init])) {
+        _openedRecords = YES;
+        _openedSampleInterval = sampleInterval;
+        _mallocRecord = sgi_allocation_records_open([directory stringByAppendingPathComponent:@(sgi_malloc_records_filename)].fileSystemRepresentation, backend);
+        _vmRecord = sgi_allocation_records_open([directory stringByAppendingPathComponent:@(sgi_vm_records_filename)].fileSystemRepresentation, backend);
+        _stackTable = sgi_read_uniquing_table_from([directory stringByAppendingPathComponent:@(sgi_stacks_records_filename)].fileSystemRepresentation);
+        _categoryStringsPath = [directory stringByAppendingPathComponent:@(sgi_category_strings_filename)];
+        if (_mallocRecord == NULL || _stackTable == NULL) {
+            SGIAPMMallocLog("[APM][Alloc] fail to open the records in %s\n", directory.fileSystemRepresentation);
+            return nil;
+        }
 
-    // generate malloc report
-    NSDictionary *mallocReportDict = nil;
-    if (self.mallocRecord) {
-        mallocReportDict = [self generateFromMemoryRecords:self.mallocRecord];
+        [self createReportWorkers];
     }
+    return self;
+}
 
-    // generate vm report
-    NSDictionary *vmReportDict = nil;
-    if (self.vmRecord) {
-        vmReportDict = [self generateFromMemoryRecords:self.vmRecord];
-    }
+- (NSDictionary *)generateReport {
+    return [self generateTopReportWithCategories:0 stacksPerCategory:0 minSize:0 minCount:0];
+}
+
+- (NSDictionary *)generateTopReportWithCategories:(uint32_t)categories
+                                stacksPerCategory:(uint32_t)stacksPerCategory
+                                          minSize:(uint32_t)minSize
+                                         minCount:(uint32_t)minCount {
+    AllocateRecords::TopLimits limits = {categories, stacksPerCategory, minSize, minCount};
+    __block NSDictionary *mallocReportDict = nil;
+    __block NSDictionary *vmReportDict = nil;
+    [self reportRecords:^(sgi_allocation_records *mallocRecord, sgi_allocation_records *vmRecord) {
+        // generate malloc report
+        if (mallocRecord) {
+            mallocReportDict = [self generateFromMemoryRecords:mallocRecord limits:limits];
+        }
+
+        // generate vm report
+        if (vmRecord) {
+            vmReportDict = [self generateFromMemoryRecords:vmRecord limits:limits];
+        }
+    }];
 
-    sgi_resume_all_child_threads();
-    
-    if (loggingRunning) {
-        sgi_memory_allocate_logging_enabled = true;
-        sgi_memory_allocate_logging_unlock();
-    }
-    
     return @{@"malloc_report" : mallocReportDict ? mallocReportDict : @{},
              @"vm_report" : vmReportDict ? vmReportDict : @{}
     };
 }
 
+- (BOOL)writeReportToFile:(NSString *)path withFrames:(BOOL)withFrames
+{
+    // opened before the records are frozen, nothing below allocates per category or stack.
+    int fd = open(path.fileSystemRepresentation, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        SGIAPMMallocLog("[APM][Alloc] fail to open report %s: %s\n", path.fileSystemRepresentation, strerror(errno));
+        return NO;
+    }
+
+    JSONReportWriter writer(fd);
+    JSONReportWriter *writerPtr = &writer;
+    [self reportRecords:^(sgi_allocation_records *mallocRecord, sgi_allocation_records *vmRecord) {
+        if (mallocRecord) {
+            [self writeFromMemoryRecords:mallocRecord name:"malloc_report" writer:writerPtr withFrames:withFrames];
+        }
+        if (vmRecord) {
+            [self writeFromMemoryRecords:vmRecord name:"vm_report" writer:writerPtr withFrames:withFrames];
+        }
+    }];
+    bool written = writer.finish();
+    close(fd);
+    return written;
+}
+
+- (BOOL)checkStackAggregates
+{
+    BOOL loggingRunning = [self freezeRecords];
+
+    BOOL consistent = YES;
+    sgi_allocation_records *rawRecords[] = {self.mallocRecord, self.vmRecord};
+    for (uint32_t i = 0; i < sizeof(rawRecords) / sizeof(rawRecords[0]); i++) {
+        if (rawRecords[i] == NULL) {
+            continue;
+        }
+        AllocateRecords allocateRecords(rawRecords[i], self.dyld_image_info);
+        AllocateRecords::StackAggregatesCheck check;
+        if (allocateRecords.checkStackAggregates(&check)) {
+            SGIAPMMallocLog("[APM][Alloc] %s stack aggregates: %u stacks, %u mismatched, %u with another category, %u with a removed category, scanned %llu bytes in %u allocations, aggregated %llu bytes in %u allocations\n",
+                            i == 0 ? "malloc" : "vm", check.stacks, check.mismatched_stacks, check.mismatched_categories, check.stale_categories, check.scanned_size, check.scanned_count, check.aggregated_size, check.aggregated_count);
+            consistent = consistent && check.mismatched_stacks == 0 && check.mismatched_categories == 0;
+        }
+    }
+
+    [self unfreezeRecords:loggingRunning];
+    return consistent;
+}
+
 - (NSArray *)generateStackFrameReportWithStackID:(NSNumber *)stackID
 {
     if (stackID == nil) {
@@ -97,6 +183,10 @@ using namespace SGIAPMAlloc;
     NSMutableArray *frameArr = [NSMutableArray array];
     for (uint32_t i = 0; i < frame_count; i++) {
         vm_address_t addr = frames[i];
+        if (SGI_ALLOCATIONS_IS_RECURSION_FRAME(addr)) {
+            [frameArr addObject:[NSString stringWithFormat:@"(%u frames above repeated %u times)", SGI_ALLOCATIONS_RECURSION_FRAME_PERIOD(addr), SGI_ALLOCATIONS_RECURSION_FRAME_COUNT(addr)]];
+            continue;
+        }
         
         NSString *transformString = [self transformToStackFrameAddressInfoWithAddress:addr];
         if (transformString) {
@@ -110,9 +200,144 @@ using namespace SGIAPMAlloc;
 
 #pragma mark - private methods
 
-- (NSDictionary *)generateFromMemoryRecords:(sgi_splay_tree *)rawRecords {
+- (void)createReportWorkers {
+    uint32_t processorCount = (uint32_t)[NSProcessInfo processInfo].activeProcessorCount;
+    uint32_t shardCount = SGI_ALLOCATIONS_RECORDS_SHARD_COUNT;
+    uint32_t workerCount = MIN(processorCount, shardCount);
+    if (workerCount > 1) {
+        _reportWorkers = sgi_report_workers_create(workerCount - 1);
+    }
+}
+
+// of the running session, or the one the opened records were logged with.
+- (uint64_t)sampleInterval {
+    return self.openedRecords ? self.openedSampleInterval : sgi_allocations_sample_interval;
+}
 
-    AllocateRecords allocateRecords(rawRecords, self.dyld_image_info);
+// the category ids of opened records resolve with the strings file of their session.
+- (void)loadCategoryNamesInto:(AllocateRecords &)allocateRecords {
+    if (self.categoryStringsPath && !allocateRecords.loadCategoryNames(self.categoryStringsPath.fileSystemRepresentation)) {
+        SGIAPMMallocLog("[APM][Alloc] fail to read category names %s\n", self.categoryStringsPath.fileSystemRepresentation);
+    }
+}
+
+// runs `report` on the records frozen or on a snapshot of them, and times it.
+- (void)reportRecords:(void (^)(sgi_allocation_records *mallocRecord, sgi_allocation_records *vmRecord))report {
+    uint64_t startTime = mach_absolute_time();
+    uint64_t stoppedDuration = 0;
+
+    // a snapshot that could not be taken falls back to freezing. opened records never change, nothing to copy.
+    if (self.openedRecords || !self.snapshotRecords || ![self reportSnapshot:report stoppedDuration:&stoppedDuration]) {
+        [self reportFrozenRecords:report stoppedDuration:&stoppedDuration];
+    }
+
+    _lastReportDuration = sgi_elapsed_microseconds(startTime);
+    _lastStoppedDuration = stoppedDuration;
+    SGIAPMMallocLog("[APM][Alloc] report in %llu us, recording stopped for %llu us\n", _lastReportDuration, _lastStoppedDuration);
+}
+
+// the other threads suspended during the whole report.
+- (void)reportFrozenRecords:(void (^)(sgi_allocation_records *mallocRecord, sgi_allocation_records *vmRecord))report
+            stoppedDuration:(uint64_t *)outStoppedDuration {
+    uint64_t stopTime = mach_absolute_time();
+    BOOL loggingRunning = [self freezeRecords];
+    report(self.mallocRecord, self.vmRecord);
+    [self unfreezeRecords:loggingRunning];
+    *outStoppedDuration = sgi_elapsed_microseconds(stopTime);
+}
+
+// recording only stopped while the records are copied, NO if a copy failed.
+- (BOOL)reportSnapshot:(void (^)(sgi_allocation_records *mallocRecord, sgi_allocation_records *vmRecord))report
+       stoppedDuration:(uint64_t *)outStoppedDuration {
+    // async recording, make the records up to date before copying them.
+    sgi_drain_memory_allocate_events();
+
+    // the shards are locked during the copy, an allocation of this thread recorded meanwhile would wait for them forever.
+    // the report itself is not recorded either, as with a freeze.
+    sgi_memory_allocate_logging_ignore_current_thread_begin();
+
+    uint64_t stoppedDuration = 0;
+    sgi_allocation_records *mallocSnapshot = NULL;
+    sgi_allocation_records *vmSnapshot = NULL;
+    if (self.mallocRecord) {
+        uint64_t stopTime = mach_absolute_time();
+        mallocSnapshot = sgi_allocation_records_snapshot(self.mallocRecord, true);
+        stoppedDuration += sgi_elapsed_microseconds(stopTime);
+    }
+    if (self.vmRecord) {
+        uint64_t stopTime = mach_absolute_time();
+        vmSnapshot = sgi_allocation_records_snapshot(self.vmRecord, true);
+        stoppedDuration += sgi_elapsed_microseconds(stopTime);
+    }
+
+    BOOL copied = (self.mallocRecord == NULL || mallocSnapshot) && (self.vmRecord == NULL || vmSnapshot);
+    if (copied) {
+        report(mallocSnapshot, vmSnapshot);
+    }
+
+    sgi_allocation_records_snapshot_release(vmSnapshot);
+    sgi_allocation_records_snapshot_release(mallocSnapshot);
+    sgi_memory_allocate_logging_ignore_current_thread_end();
+
+    *outStoppedDuration = stoppedDuration;
+    return copied;
+}
+
+// returns whether logging was running, pass it to `unfreezeRecords:`.
+- (BOOL)freezeRecords {
+    if (self.openedRecords) {
+        return NO;
+    }
+
+    // async recording, make the records up to date before freezing.
+    sgi_drain_memory_allocate_events();
+
+    bool loggingRunning = sgi_memory_allocate_logging_enabled;
+    if (loggingRunning) {
+        sgi_memory_allocate_logging_lock();
+        sgi_memory_allocate_logging_enabled = false;
+    }
+
+    // frees only hold the shard locks, freeze the shards before suspending so no thread is stopped in the middle of an update.
+    if (self.mallocRecord) {
+        sgi_allocation_records_lock_all(self.mallocRecord);
+    }
+    if (self.vmRecord) {
+        sgi_allocation_records_lock_all(self.vmRecord);
+    }
+
+    // the report workers scan the records, leave them running.
+    thread_t workerThreads[SGI_REPORT_WORKERS_MAX_COUNT];
+    uint32_t workerThreadCount = sgi_report_workers_threads(self.reportWorkers, workerThreads, SGI_REPORT_WORKERS_MAX_COUNT);
+    sgi_suspend_all_child_threads_except(workerThreads, workerThreadCount);
+    return loggingRunning;
+}
+
+- (void)unfreezeRecords:(BOOL)loggingRunning {
+    if (self.openedRecords) {
+        return;
+    }
+
+    sgi_resume_all_child_threads();
+
+    if (self.vmRecord) {
+        sgi_allocation_records_unlock_all(self.vmRecord);
+    }
+    if (self.mallocRecord) {
+        sgi_allocation_records_unlock_all(self.mallocRecord);
+    }
+    
+    if (loggingRunning) {
+        sgi_memory_allocate_logging_enabled = true;
+        sgi_memory_allocate_logging_unlock();
+    }
+}
+
+- (NSDictionary *)generateFromMemoryRecords:(sgi_allocation_records *)rawRecords limits:(AllocateRecords::TopLimits)limits {
+
+    AllocateRecords allocateRecords(rawRecords, self.dyld_image_info, [self sampleInterval], self.reportWorkers);
+    allocateRecords.setTopLimits(limits);
+    [self loadCategoryNamesInto:allocateRecords];
     allocateRecords.parseAndGroupingRawRecords();
 
     RecordOutput output(allocateRecords, self.stackTable, self.dyld_image_info, self.collectionStackFrame);
@@ -121,6 +346,16 @@ using namespace SGIAPMAlloc;
     return dict ? dict : @{};
 }
 
+- (void)writeFromMemoryRecords:(sgi_allocation_records *)rawRecords name:(const char *)name writer:(JSONReportWriter *)writer withFrames:(BOOL)withFrames {
+
+    AllocateRecords allocateRecords(rawRecords, self.dyld_image_info, [self sampleInterval], self.reportWorkers);
+    [self loadCategoryNamesInto:allocateRecords];
+    allocateRecords.parseAndGroupingRawRecords();
+
+    RecordOutput output(allocateRecords, self.stackTable, self.dyld_image_info, self.collectionStackFrame);
+    output.writeReport(*writer, name, 0, withFrames);
+}
+
 - (NSString *)transformToStackFrameAddressInfoWithAddress:(vm_address_t)address
 {
     NSString *title = nil;
@@ -139,6 +374,13 @@ using namespace SGIAPMAlloc;
 
 - (void)dealloc
 {
+    sgi_report_workers_destroy(_reportWorkers);
+    _reportWorkers = NULL;
+    if (_openedRecords) {
+        sgi_allocation_records_open_release(_mallocRecord);
+        sgi_allocation_records_open_release(_vmRecord);
+        sgi_destroy_uniquing_table(_stackTable);
+    }
     _dyld_image_info = NULL;
     _mallocRecord = NULL;
     _vmRecord = NULL;
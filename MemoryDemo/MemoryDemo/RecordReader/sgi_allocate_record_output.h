@@ -12,6 +12,7 @@
 
 #include <stdio.h>
 #include "sgi_allocate_record_reader.h"
+#include "sgi_report_writer.h"
 
 #import <Foundation/Foundation.h>
 
@@ -29,8 +30,17 @@ class RecordOutput
 
     ~RecordOutput();
     
+    /**
+     The report as dictionaries, built by a `ReportWriter` as well: every category and stack is kept in memory.
+     */
     NSDictionary *flushReportToDictionary(uint32_t thresholdInBytes);
 
+    /**
+     Streams the report to `writer` while iterating the categories, under `name`. `withFrames` writes the frames of every
+     stack too, the report needs no lookup by stack id afterwards.
+     */
+    void writeReport(ReportWriter &writer, const char *name, uint32_t thresholdInBytes, bool withFrames = false);
+
   private:
     AllocateRecords *_allocationRecords = NULL;
     sgi_backtrace_uniquing_table *_stackRecords = NULL;
@@ -16,6 +16,68 @@
 
 using namespace SGIAPMAlloc;
 
+// MARK: - dictionary writer
+
+namespace {
+
+class DictionaryReportWriter : public ReportWriter
+{
+  public:
+    void beginReport(const char *name, const AllocateRecords &records) {
+        _categories = [NSMutableArray array];
+        _report = @{
+            @"sample_interval" : @(records.sampleInterval()),
+            @"total_size" : @(records.recordSize()),
+            @"allocate_record_count" : @(records.allocateRecordCount()),
+            @"stack_record_count" : @(records.stackRecordCount()),
+            @"category_record_count" : @(records.categoryRecordCount()),
+            @"categories" : _categories,
+        };
+    }
+
+    void beginCategory(const AllocateRecords::InCategory &category) {
+        _category = [NSMutableDictionary dictionary];
+        _category[@"size"] = @(category.size);
+        _category[@"record_count"] = @(category.count);
+        _category[@"stack_id_count"] = @(category.totalStackCount);
+
+        // names come from the category table (or its strings file), no raw class name pointer.
+        NSString *categoryName = category.name != NULL ? [NSString stringWithUTF8String:category.name] : nil;
+        _category[@"name"] = categoryName ?: @"";
+
+        _stacks = [NSMutableArray array];
+        _category[@"stacks"] = _stacks;
+    }
+
+    void writeStack(const AllocateRecords::InStackId &stack, const vm_address_t *frames, uint32_t frameCount) {
+        NSMutableDictionary *stackDict = [NSMutableDictionary dictionary];
+        stackDict[@"size"] = @(stack.size);
+        stackDict[@"count"] = @(stack.count);
+        stackDict[@"stack_id"] = @(stack.stack_id);
+        [_stacks addObject:stackDict];
+    }
+
+    void endCategory(void) {
+        [_categories addObject:_category];
+        _category = nil;
+        _stacks = nil;
+    }
+
+    void endReport(void) {}
+
+    NSDictionary *report(void) const {
+        return _report;
+    }
+
+  private:
+    NSDictionary *_report = nil;
+    NSMutableArray *_categories = nil;
+    NSMutableDictionary *_category = nil;
+    NSMutableArray *_stacks = nil;
+};
+
+} // namespace
+
 // MARK: - public
 
 RecordOutput::~RecordOutput() {
@@ -23,58 +85,38 @@ RecordOutput::~RecordOutput() {
 }
 
 NSDictionary * RecordOutput::flushReportToDictionary(uint32_t thresholdInBytes) {
-    AllocateRecords::InCategory *log = _allocationRecords->firstRecordInCategory();
-    if (log == NULL) {
+    if (_allocationRecords->firstRecordInCategory() == NULL) {
         return nil;
     }
-    
-    NSMutableArray *categories = [NSMutableArray array];
-    
-    do {
-        NSMutableDictionary *category = [NSMutableDictionary dictionary];
-        category[@"size"] = @(log->size);
-        category[@"record_count"] = @(log->count);
-        category[@"stack_id_count"] = @(log->stacks->size());
-        
-        uint64_t categoryPtr = (uint64_t)log->name;
-        char *categoryName = (char *)categoryPtr;
-        if (categoryName != NULL && strnlen(categoryName, 10) != 0 && categoryName[0] > '?') {
-            category[@"name"] = [NSString stringWithUTF8String:categoryName];
-        } else {
-            category[@"name"] = @"";
+
+    DictionaryReportWriter writer;
+    writeReport(writer, "", thresholdInBytes);
+    return writer.report();
+}
+
+void RecordOutput::writeReport(ReportWriter &writer, const char *name, uint32_t thresholdInBytes, bool withFrames) {
+    writer.beginReport(name, *_allocationRecords);
+
+    vm_address_t frames[SGI_ALLOCATIONS_MAX_STACK_SIZE];
+    for (AllocateRecords::InCategory *log = _allocationRecords->firstRecordInCategory(); log != NULL; log = _allocationRecords->nextRecordInCategory()) {
+        if (log->size < thresholdInBytes && log->count < _categoryElementCountThreshold) {
+            continue;
         }
-        
-        NSMutableArray *stackArr = [NSMutableArray array];
 
-        std::list<AllocateRecords::InStackId *> *stacks = log->stacks;
-        for (auto sit = stacks->begin(); sit != stacks->end(); ++sit) {
-            AllocateRecords::InStackId *stack = *sit;
+        writer.beginCategory(*log);
+        for (uint32_t i = 0; i < log->stackCount; ++i) {
+            AllocateRecords::InStackId *stack = &log->stacks[i];
             if (stack->size < thresholdInBytes)
                 break;
 
-            NSMutableDictionary *stackDict = [NSMutableDictionary dictionary];
-            stackDict[@"size"] = @(stack->size);
-            stackDict[@"count"] = @(stack->count);
-            stackDict[@"stack_id"] = @(stack->stack_id);
-            
-            [stackArr addObject:stackDict];
-        }
-        category[@"stacks"] = stackArr;
-        
-        if (log->size >= thresholdInBytes || log->count >= _categoryElementCountThreshold) {
-            [categories addObject:category];
+            uint32_t frameCount = 0;
+            if (withFrames && _stackRecords != NULL) {
+                sgi_unwind_stack_from_table_index(_stackRecords, stack->stack_id, frames, &frameCount, SGI_ALLOCATIONS_MAX_STACK_SIZE);
+            }
+            writer.writeStack(*stack, withFrames ? frames : NULL, frameCount);
         }
+        writer.endCategory();
+    }
 
-        log = _allocationRecords->nextRecordInCategory();
-        
-    } while (log != NULL);
-    
-    NSDictionary *report = @{
-        @"total_size" : @(_allocationRecords->recordSize()),
-        @"allocate_record_count" : @(_allocationRecords->allocateRecordCount()),
-        @"stack_record_count" : @(_allocationRecords->stackRecordCount()),
-        @"category_record_count" : @(_allocationRecords->categoryRecordCount()),
-        @"categories" : categories ?: @[],
-    };
-    return report;
+    writer.endReport();
 }
@@ -10,12 +10,13 @@
 #ifndef sgi_record_reader_h
 #define sgi_record_reader_h
 
-#include <list>
 #include <mach/mach.h>
 #include <stdio.h>
+#include <string>
 #include <vector>
 
 #include "sgi_allocate_logging.h"
+#include "sgi_report_workers.h"
 
 namespace SGIAPMAlloc {
 
@@ -35,46 +36,109 @@ class AllocateRecords
          Group allocation records by category
          */
     typedef struct {
-        const char *name;               /**< category name */
-        uint32_t size;                  /**< total size of memory allocate under this category */
-        uint32_t count;                 /**< total count of memory pointers allocate under this category */
-        std::list<InStackId *> *stacks; /**< all the stacks that allocate memory under this category */
+        const char *name;     /**< category name */
+        uint32_t size;        /**< total size of memory allocate under this category */
+        uint32_t count;       /**< total count of memory pointers allocate under this category */
+        InStackId *stacks;    /**< the stacks kept (`TopLimits`) that allocate memory under this category, largest first. owned by the AllocateRecords */
+        uint32_t stackCount;  /**< number of `stacks` */
+        uint32_t totalStackCount; /**< number of stacks under this category, kept or not */
     } InCategory;
 
+    /**
+     The part of the grouping kept by `parseAndGroupingRawRecords`, only that part is ordered. The totals are those of
+     all the records whatever the limits.
+     */
+    typedef struct {
+        uint32_t categories;        /**< the largest categories kept, 0 for all */
+        uint32_t stacksPerCategory; /**< the largest stacks kept per category, 0 for all */
+        uint32_t minSize;           /**< categories and stacks of fewer bytes are dropped */
+        uint32_t minCount;          /**< categories and stacks of fewer allocations are dropped */
+    } TopLimits;
+
+    /**
+     Result of `checkStackAggregates`
+     */
+    typedef struct {
+        uint32_t stacks;            /**< stacks with live allocations, in the scan or in the aggregates */
+        uint32_t mismatched_stacks; /**< stacks whose aggregated size or count differs from the scan */
+        uint32_t mismatched_categories; /**< live stacks whose aggregated category differs from the smallest scanned one, while live */
+        uint32_t stale_categories;      /**< live stacks whose aggregated category has no live allocation left, not a mismatch */
+        uint64_t scanned_size;
+        uint64_t aggregated_size;
+        uint32_t scanned_count;
+        uint32_t aggregated_count;
+    } StackAggregatesCheck;
+
   public:
-    AllocateRecords(sgi_splay_tree *rawRecords, sgi_dyld_image_info *dyld_image_info)
+    /**
+     `sampleInterval` is the mean bytes between sampled allocations the raw records were logged with, 0 if not
+     sampling. Sampled records are scaled by the inverse of their sampling probability.
+     A full scan of the records is split by shard across `workers` (not owned) and the calling thread, if any.
+     */
+    AllocateRecords(sgi_allocation_records *rawRecords, sgi_dyld_image_info *dyld_image_info, uint64_t sampleInterval = 0, sgi_report_workers *workers = NULL)
         : _rawRecords(rawRecords)
-        , _dyld_image_info(dyld_image_info) {}
+        , _dyld_image_info(dyld_image_info)
+        , _sampleInterval(sampleInterval)
+        , _workers(workers) {}
     ~AllocateRecords();
 
     /**
-     Read the raw records and group it by Category & StackId
+     Read the raw records and group it by Category & StackId.
+     The live bytes/allocations kept per stack id are read if available (O(stacks)), all the records are scanned otherwise.
      */
     void parseAndGroupingRawRecords(void);
 
+    /**
+     Resolve the category ids of the raw records from a category strings file (`sgi_category_strings_filename`) instead
+     of the category table of the running process, e.g. for the files of another process. Call before parsing.
+     Returns false if the file can't be read, the running process names are used then.
+     */
+    bool loadCategoryNames(const char *categoryStringsPath);
+
+    /**
+     Keep only the top of the grouping, e.g. the 10 largest categories with their 5 largest stacks. Call before
+     parsing, everything is kept by default.
+     */
+    void setTopLimits(const TopLimits &limits);
+
+    /**
+     Compare the live bytes/allocations and the category kept per stack id with a full scan of the records, mismatches
+     are logged. A stack keeps the category of its removed allocations: the aggregated category is only compared while
+     one of its allocations is live, the others are counted in `stale_categories`. Unscaled when sampling. Returns false
+     if the raw records have no stack aggregates.
+     */
+    bool checkStackAggregates(StackAggregatesCheck *outCheck);
+
     InCategory *firstRecordInCategory(void);
     InCategory *nextRecordInCategory(void);
     void resetInCategoryIterator(void);
 
+    uint64_t sampleInterval() const;
     uint64_t recordSize() const;
     uint32_t allocateRecordCount() const;
     uint32_t stackRecordCount() const;
-    uint32_t categoryRecordCount() const;
+    uint32_t categoryRecordCount() const; /**< before the `TopLimits` */
 
   private:
     void freeFormedRecords(void);
 
-    sgi_splay_tree *_rawRecords = NULL;
+    sgi_allocation_records *_rawRecords = NULL;
     sgi_dyld_image_info *_dyld_image_info = NULL;
-    std::list<InCategory *> *_formedRecords = NULL;
+    uint64_t _sampleInterval = 0;
+    sgi_report_workers *_workers = NULL;
+    std::vector<InCategory> _formedCategories; /**< largest first */
+    std::vector<InStackId> _formedStacks;      /**< the stacks of every category, contiguous */
+    std::vector<std::string> _categoryNames; /**< by category id, empty if unknown */
+    TopLimits _topLimits = {0, 0, 0, 0};
+    bool _hasCategoryNames = false;
 
     uint64_t _recordSize = 0;
     uint32_t _allocateRecordCount = 0;
     uint32_t _stackRecordCount = 0;
     uint32_t _categoryRecordCount = 0;
 
-    const std::list<InCategory *>::const_iterator kNullIterator;
-    std::list<InCategory *>::const_iterator _recordIterator = kNullIterator;
+    static const size_t kNullIterator = SIZE_MAX;
+    size_t _recordIterator = kNullIterator;
 
   private:
     AllocateRecords(const AllocateRecords &);
@@ -11,9 +11,11 @@
 #include "sgi_backtrace_uniquing_table.h"
 
 #import "SGIDyldImagesUtil.h"
+#import "SGIAPMCommonDef.h"
 
-#include <list>
+#include <algorithm>
 #include <map>
+#include <math.h>
 
 using namespace SGIAPMAlloc;
 
@@ -23,167 +25,293 @@ const char *SGI_LOGGING_CATEGORY_VMALLOCATE = "unknown_vmallocate";
 const char *SGI_LOGGING_CATEGORY_MMAP = "unknown_mmap/shared_mem";
 const char *SGI_LOGGING_CATEGORY_UNKNOWN = "unknown";
 
-typedef struct _sgi_allocate_record {
-    uint64_t stack_id;
+// the allocations of a stack, keyed by stack id.
+typedef struct {
     uint32_t size;
     uint32_t count;
-    void *category;
-    uint32_t flag;
+    uint32_t category;      /**< smallest category id seen for the stack, 0 if none, as in the stack aggregates */
+    uint8_t flag;           /**< of the first allocation seen */
+    uint8_t first_shard;    /**< shard of the first allocation seen, partial scans are merged in shard order */
+} sgi_allocate_record;
 
-    bool operator()(const _sgi_allocate_record &lhs, const _sgi_allocate_record &rhs) const {
-        return lhs.stack_id == rhs.stack_id;
+// MARK: - flat hash map
+
+/*
+ Open addressing (linear probing) map of 64-bit keys (but UINT64_MAX) to values kept in the slots, a single array: one
+ cache miss per lookup, no node per entry. Used instead of std::map while the report is generated with the app frozen.
+ */
+template <typename Value>
+class sgi_flat_hash_map
+{
+  public:
+    explicit sgi_flat_hash_map(size_t expected_count) {
+        size_t capacity = 16;
+        while (capacity / 4 * 3 < expected_count) {
+            capacity <<= 1;
+        }
+        _slots.resize(capacity);
+        _mask = capacity - 1;
     }
-} sgi_allocate_record;
 
-static bool sgi_compare_vm_stack_log_report_item(const AllocateRecords::InCategory *first, const AllocateRecords::InCategory *second) {
-    return first->size > second->size;
-}
+    // the value of `key`, value initialized if it's new. valid until the next insert.
+    Value &find_or_insert(uint64_t key, bool *inserted) {
+        if (_count >= _slots.size() / 4 * 3) {
+            grow();
+        }
+        size_t index = hash(key) & _mask;
+        while (true) {
+            slot &s = _slots[index];
+            if (s.key_plus_one == 0) {
+                s.key_plus_one = key + 1;
+                _count++;
+                *inserted = true;
+                return s.value;
+            }
+            if (s.key_plus_one == key + 1) {
+                *inserted = false;
+                return s.value;
+            }
+            index = (index + 1) & _mask;
+        }
+    }
+
+    size_t size() const {
+        return _count;
+    }
+
+    // `enumerator(key, value)` for every entry, in slot order.
+    template <typename Enumerator>
+    void enumerate(Enumerator enumerator) const {
+        for (const slot &s : _slots) {
+            if (s.key_plus_one != 0) {
+                enumerator(s.key_plus_one - 1, s.value);
+            }
+        }
+    }
+
+  private:
+    typedef struct {
+        uint64_t key_plus_one; /**< 0 if empty */
+        Value value;
+    } slot;
+
+    static inline size_t hash(uint64_t key) {
+        return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    void grow() {
+        std::vector<slot> old_slots(_slots.size() * 2);
+        old_slots.swap(_slots);
+        _mask = _slots.size() - 1;
+        for (const slot &s : old_slots) {
+            if (s.key_plus_one == 0) {
+                continue;
+            }
+            size_t index = hash(s.key_plus_one - 1) & _mask;
+            while (_slots[index].key_plus_one != 0) {
+                index = (index + 1) & _mask;
+            }
+            _slots[index] = s;
+        }
+    }
+
+    std::vector<slot> _slots;
+    size_t _mask = 0;
+    size_t _count = 0;
+};
+
+typedef sgi_flat_hash_map<sgi_allocate_record> sgi_stack_map; /**< by stack id */
 
+// `size` and `count` are already scaled when sampling.
 static void merge_record_into_stacks(
     uint64_t stackid_and_flags,
-    uint64_t category_and_size,
-    std::map<uint64_t, sgi_allocate_record *> &stack_map) {
+    uint64_t category,
+    uint32_t size,
+    uint32_t count,
+    uint8_t shard,
+    sgi_stack_map &stack_map) {
 
     uint64_t stackid = SGI_ALLOCATIONS_OFFSET(stackid_and_flags);
-    uint32_t flag = SGI_ALLOCATIONS_FLAGS(stackid_and_flags);
-    uint32_t size = SGI_ALLOCATIONS_SIZE(category_and_size);
-    void *category = (void *)SGI_ALLOCATIONS_CATEGORY(category_and_size);
-
-    auto m_stackid_item = stack_map.find(stackid);
-    if (m_stackid_item != stack_map.end()) {
-        sgi_allocate_record *log = m_stackid_item->second;
-        log->size += size;
-        log->count++;
-        if (log->category == NULL && category != NULL) {
-            log->category = category;
-        }
+    bool inserted = false;
+    sgi_allocate_record &log = stack_map.find_or_insert(stackid, &inserted);
+    if (inserted) {
+        log = {size, count, (uint32_t)category, (uint8_t)SGI_ALLOCATIONS_FLAGS(stackid_and_flags), shard};
     } else {
-        sgi_allocate_record *log = new sgi_allocate_record;
-        log->stack_id = stackid;
-        log->flag = flag;
-        log->size = size;
-        log->category = category;
-        log->count = 1;
-        stack_map[stackid] = log;
+        log.size += size;
+        log.count += count;
+        if (category != 0 && (log.category == 0 || category < log.category)) {
+            log.category = (uint32_t)category;
+        }
     }
 }
 
-static void merge_stacks_into_categories(
-    std::map<uint64_t, sgi_allocate_record *> &stack_map,
-    std::map<uint64_t, std::list<sgi_allocate_record *> *> &category_map) {
-
-    for (auto i = stack_map.begin(); i != stack_map.end(); ++i) {
-        uint64_t category_id = (uint64_t)i->second->category;
-        if (i->second->flag & sgi_allocations_type_vm_allocate) {
-            if (i->second->flag & sgi_allocations_type_mapped_file_or_shared_mem) {
-                printf("mdm1-*\n");
-            } else {
-                printf("mdm-*2\n");
-            }
+// adds the stacks of a partial scan, the flag of the lowest shard and the smallest category win: the result is that of
+// one scan of the shards in order, whatever shards the partial scans took.
+static void merge_partial_stacks(const sgi_stack_map &partial, sgi_stack_map &stack_map) {
+    partial.enumerate([&stack_map](uint64_t stackid, const sgi_allocate_record &other) {
+        bool inserted = false;
+        sgi_allocate_record &log = stack_map.find_or_insert(stackid, &inserted);
+        if (inserted) {
+            log = other;
+            return;
         }
-        if (category_id == 0) {
-            if (i->second->flag & sgi_allocations_type_alloc) {
-                category_id = (uint64_t)SGI_LOGGING_CATEGORY_MALLOC;
-            } else if (i->second->flag & sgi_allocations_type_vm_allocate) {
-                category_id = (uint64_t)SGI_LOGGING_CATEGORY_VMALLOCATE;
-            } else if (i->second->flag & sgi_allocations_type_mapped_file_or_shared_mem) {
-                category_id = (uint64_t)SGI_LOGGING_CATEGORY_MMAP;
-            } else {
-                category_id = (uint64_t)SGI_LOGGING_CATEGORY_UNKNOWN;
-            }
+        log.size += other.size;
+        log.count += other.count;
+        if (other.first_shard < log.first_shard) {
+            log.flag = other.flag;
+            log.first_shard = other.first_shard;
         }
-        auto category = category_map.find(category_id);
-        if (category != category_map.end()) {
-            std::list<sgi_allocate_record *> *item = category->second;
-            item->__emplace_back(i->second);
-        } else {
-            std::list<sgi_allocate_record *> *item = new std::list<sgi_allocate_record *>;
-            item->__emplace_back(i->second);
-            category_map[category_id] = item;
+        if (other.category != 0 && (log.category == 0 || other.category < log.category)) {
+            log.category = other.category;
         }
-    }
+    });
 }
 
-static void free_category_and_stackid_groups(
-    std::map<uint64_t, std::list<sgi_allocate_record *> *> &log_map_by_category,
-    std::map<uint64_t, sgi_allocate_record *> &log_map_by_stackid) {
-    for (auto mit = std::begin(log_map_by_category); mit != std::end(log_map_by_category); ++mit) {
-        std::list<sgi_allocate_record *> *logs = mit->second;
-        logs->clear();
-        delete logs;
-        logs = nullptr;
+// the names are resolved once per stack, not per record.
+static const char *category_name_of_stack(const sgi_allocate_record &log, sgi_allocation_records *raw_records, const std::vector<std::string> *category_names) {
+    const char *name = NULL;
+    if (log.category == 0) {
+    } else if (category_names == NULL) {
+        name = sgi_allocation_records_category_name(raw_records, log.category);
+    } else if (log.category < category_names->size() && !(*category_names)[log.category].empty()) {
+        name = (*category_names)[log.category].c_str();
+    }
+    if (name != NULL) {
+        return name;
     }
 
-    log_map_by_category.clear();
-
-    for (auto it = log_map_by_stackid.begin(); it != log_map_by_stackid.end(); ++it) {
-        sgi_allocate_record *item = it->second;
-        delete item;
+    if (log.flag & sgi_allocations_type_alloc) {
+        return SGI_LOGGING_CATEGORY_MALLOC;
+    } else if (log.flag & sgi_allocations_type_vm_allocate) {
+        return SGI_LOGGING_CATEGORY_VMALLOCATE;
+    } else if (log.flag & sgi_allocations_type_mapped_file_or_shared_mem) {
+        return SGI_LOGGING_CATEGORY_MMAP;
+    } else {
+        return SGI_LOGGING_CATEGORY_UNKNOWN;
     }
-    log_map_by_stackid.clear();
 }
 
-static bool sgi_compare_vm_stack_log_report_item_stack(const AllocateRecords::InStackId *first, const AllocateRecords::InStackId *second) {
-    return first->size > second->size;
+// largest first, then by stack id.
+static bool stack_ranks_before(const AllocateRecords::InStackId &lhs, const AllocateRecords::InStackId &rhs) {
+    return lhs.size != rhs.size ? lhs.size > rhs.size : lhs.stack_id < rhs.stack_id;
 }
 
-static void generate_report_from_category_groups(
-    std::map<uint64_t, std::list<sgi_allocate_record *> *> &log_map_by_category,
-    sgi_dyld_image_info *dyld_image_info,
-    std::list<AllocateRecords::InCategory *> *out_report) {
-    for (auto mit = std::begin(log_map_by_category); mit != std::end(log_map_by_category); ++mit) {
-        int64_t category = mit->first;
-        std::list<sgi_allocate_record *> *logs = mit->second;
-
-        std::list<AllocateRecords::InStackId *> *stacks = new std::list<AllocateRecords::InStackId *>;
-        uint64_t category_size = 0;
-        uint64_t object_count = 0;
-        for (auto lit = logs->begin(); lit != logs->end(); ++lit) {
-            sgi_allocate_record *log = (*lit);
-            category_size += log->size;
-            object_count += log->count;
-
-            AllocateRecords::InStackId *stack = new AllocateRecords::InStackId;
-            stack->size = log->size;
-            stack->count = log->count;
-            stack->stack_id = log->stack_id;
-            stacks->__emplace_back(stack);
-        }
-
-        stacks->sort(sgi_compare_vm_stack_log_report_item_stack);
-
-        AllocateRecords::InCategory *item = new AllocateRecords::InCategory;
-        if ((char *)category == NULL) {
-            item->name = "";
-        } else {
-            item->name = (char *)category;
-        }
-        item->size = (uint32_t)category_size;
-        item->count = (uint32_t)object_count;
-        item->stacks = stacks;
+// largest first, then by name pointer.
+static bool category_ranks_before(const AllocateRecords::InCategory &lhs, const AllocateRecords::InCategory &rhs) {
+    return lhs.size != rhs.size ? lhs.size > rhs.size : (uintptr_t)lhs.name < (uintptr_t)rhs.name;
+}
 
-        out_report->__emplace_back(item);
+// the `limit` first of [begin, end) in order, the rest left unordered. 0 for all. returns how many are ordered.
+template <typename T, typename Compare>
+static size_t select_top(T *begin, T *end, uint32_t limit, Compare ranks_before) {
+    size_t count = end - begin;
+    if (limit == 0 || limit >= count) {
+        std::sort(begin, end, ranks_before);
+        return count;
     }
+    std::nth_element(begin, begin + limit, end, ranks_before);
+    std::sort(begin, begin + limit, ranks_before);
+    return limit;
 }
 
-static void sgi_allocations_free_log_report(std::list<AllocateRecords::InCategory *> *report) {
-    for (auto it = report->begin(); it != report->end(); ++it) {
-        AllocateRecords::InCategory *item = *it;
-        for (auto iti = item->stacks->begin(); iti != item->stacks->end(); ++iti) {
-            delete (*iti);
-            *iti = nullptr;
+/*
+ Groups the stacks by category name into `out_categories`, with the kept stacks of every category contiguous in
+ `out_stacks`. Categories and the stacks of a category are ordered by size, largest first (then by name pointer/stack
+ id). `category_names` are those of a category strings file, NULL for the running process.
+ Only the top of `limits` is ordered and kept: the categories and stacks under the minimums are dropped while the
+ totals are summed, the largest are selected (nth_element) among the rest and only those sorted, the stacks of the
+ dropped categories are never placed. Returns the number of categories before the limits.
+ */
+static uint32_t group_stacks_into_categories(
+    const sgi_stack_map &stack_map,
+    sgi_allocation_records *raw_records,
+    const std::vector<std::string> *category_names,
+    const AllocateRecords::TopLimits &limits,
+    std::vector<AllocateRecords::InCategory> &out_categories,
+    std::vector<AllocateRecords::InStackId> &out_stacks) {
+
+    // the totals of every category, and the stacks over the minimums with their category.
+    sgi_flat_hash_map<uint32_t> category_index(64);
+    std::vector<AllocateRecords::InCategory> categories;
+    std::vector<uint64_t> category_sizes;
+    std::vector<uint64_t> category_counts;
+    std::vector<std::pair<uint32_t, AllocateRecords::InStackId>> stacks;
+    if (limits.minSize == 0 && limits.minCount == 0) {
+        stacks.reserve(stack_map.size());
+    }
+    stack_map.enumerate([&](uint64_t stack_id, const sgi_allocate_record &log) {
+        const char *name = category_name_of_stack(log, raw_records, category_names);
+        bool inserted = false;
+        uint32_t &index = category_index.find_or_insert((uint64_t)name, &inserted);
+        if (inserted) {
+            index = (uint32_t)categories.size();
+            categories.push_back({name, 0, 0, NULL, 0, 0});
+            category_sizes.push_back(0);
+            category_counts.push_back(0);
         }
-        item->stacks->clear();
-        delete item->stacks;
-        item->stacks = nullptr;
+        category_sizes[index] += log.size;
+        category_counts[index] += log.count;
+        categories[index].totalStackCount++;
+        if (log.size >= limits.minSize && log.count >= limits.minCount) {
+            stacks.push_back({index, {log.size, log.count, stack_id}});
+        }
+    });
+
+    // the categories kept, in order.
+    std::vector<uint32_t> order;
+    for (uint32_t c = 0; c < categories.size(); ++c) {
+        categories[c].size = (uint32_t)category_sizes[c];
+        categories[c].count = (uint32_t)category_counts[c];
+        if (categories[c].size >= limits.minSize && categories[c].count >= limits.minCount) {
+            order.push_back(c);
+        }
+    }
+    size_t kept = select_top(order.data(), order.data() + order.size(), limits.categories, [&categories](uint32_t lhs, uint32_t rhs) {
+        return category_ranks_before(categories[lhs], categories[rhs]);
+    });
+    out_categories.resize(kept);
+    std::vector<uint32_t> kept_index(categories.size(), UINT32_MAX);
+    for (size_t k = 0; k < kept; ++k) {
+        out_categories[k] = categories[order[k]];
+        kept_index[order[k]] = (uint32_t)k;
+    }
 
-        delete item;
-        item = nullptr;
+    // the stacks of the kept categories placed by category, then the top of every category selected in place and packed.
+    std::vector<uint32_t> offsets(kept + 1, 0);
+    for (const auto &stack : stacks) {
+        uint32_t k = kept_index[stack.first];
+        if (k != UINT32_MAX) {
+            offsets[k + 1]++;
+        }
     }
+    for (size_t k = 0; k < kept; ++k) {
+        offsets[k + 1] += offsets[k];
+    }
+    out_stacks.resize(offsets[kept]);
+    std::vector<uint32_t> cursors(offsets.begin(), offsets.end() - 1);
+    for (const auto &stack : stacks) {
+        uint32_t k = kept_index[stack.first];
+        if (k != UINT32_MAX) {
+            out_stacks[cursors[k]++] = stack.second;
+        }
+    }
+    uint32_t packed = 0;
+    for (size_t k = 0; k < kept; ++k) {
+        AllocateRecords::InStackId *begin = out_stacks.data() + offsets[k];
+        size_t count = select_top(begin, out_stacks.data() + offsets[k + 1], limits.stacksPerCategory, stack_ranks_before);
+        std::copy(begin, begin + count, out_stacks.data() + packed);
+        out_categories[k].stackCount = (uint32_t)count;
+        packed += (uint32_t)count;
+    }
+    out_stacks.resize(packed);
 
-    report->clear();
-    delete report;
-    report = nullptr;
+    // the stacks don't move anymore.
+    uint32_t offset = 0;
+    for (AllocateRecords::InCategory &category : out_categories) {
+        category.stacks = out_stacks.data() + offset;
+        offset += category.stackCount;
+    }
+    return (uint32_t)categories.size();
 }
 
 // MARK: - public
@@ -194,64 +322,202 @@ AllocateRecords::~AllocateRecords() {
 }
 
 void AllocateRecords::freeFormedRecords(void) {
-    if (_formedRecords == NULL)
-        return;
+    std::vector<InCategory>().swap(_formedCategories);
+    std::vector<InStackId>().swap(_formedStacks);
+    resetInCategoryIterator();
+}
+
+typedef struct {
+    sgi_allocation_records *raw_records;
+    const std::vector<std::string> *category_names; /**< loaded from a category strings file, NULL for the running process */
+    sgi_stack_map *stack_map;
+    uint64_t record_size;
+    uint32_t record_count;
+    uint64_t sample_interval;
+    uint8_t shard; /**< being scanned */
+} sgi_raw_records_parse_context;
+
+// `count` allocations of `size` bytes in total. an allocation of `alloc_size` bytes is sampled with probability
+// 1 - e^(-alloc_size/interval), weight it by the inverse. the allocations of a stack aggregate are weighted by their mean size.
+static void sgi_parse_allocations(uint64_t stackid_and_flags, uint64_t category, uint64_t size, uint32_t count, sgi_raw_records_parse_context *parse_context) {
+    double scaled_size = size, scaled_count = count;
+    if (parse_context->sample_interval > 0 && size > 0) {
+        double weight = 1.0 / -expm1(-((double)size / count) / (double)parse_context->sample_interval);
+        scaled_size = llround(size * weight);
+        scaled_count = llround(count * weight);
+    }
+    uint32_t report_size = scaled_size > UINT32_MAX ? UINT32_MAX : (uint32_t)scaled_size;
+    uint32_t report_count = scaled_count > UINT32_MAX ? UINT32_MAX : (uint32_t)scaled_count;
+
+    merge_record_into_stacks(stackid_and_flags, category, report_size, report_count, parse_context->shard, *parse_context->stack_map);
 
-    sgi_allocations_free_log_report(_formedRecords);
-    _formedRecords = NULL;
+    parse_context->record_size += report_size;
+    parse_context->record_count += report_count;
+}
+
+static void sgi_parse_raw_record(vm_address_t addr, uint64_t stackid_and_flags, uint64_t category_and_size, void *context) {
+    sgi_parse_allocations(stackid_and_flags, SGI_ALLOCATIONS_CATEGORY(category_and_size), SGI_ALLOCATIONS_SIZE(category_and_size), 1, (sgi_raw_records_parse_context *)context);
+}
+
+static void sgi_parse_stack_aggregate(uint64_t stackid_and_flags, uint64_t size, uint32_t count, uint64_t category, void *context) {
+    sgi_parse_allocations(stackid_and_flags, category, size, count, (sgi_raw_records_parse_context *)context);
+}
+
+// a shard scanned by a worker into its own stacks, `context` is the parse context of every worker.
+static void sgi_parse_shard_task(uint32_t shard, uint32_t worker_index, void *context) {
+    sgi_raw_records_parse_context *parse_context = &((sgi_raw_records_parse_context *)context)[worker_index];
+    parse_context->shard = (uint8_t)shard;
+    sgi_allocation_records_enumerate_shard(parse_context->raw_records, shard, sgi_parse_raw_record, parse_context);
 }
 
 void AllocateRecords::parseAndGroupingRawRecords(void) {
     if (_rawRecords == nil)
         return;
 
-    std::list<AllocateRecords::InCategory *> *formedRecord = new std::list<AllocateRecords::InCategory *>();
-
+    freeFormedRecords();
     _recordSize = 0;
     _allocateRecordCount = 0;
 
     // 合并同一调用堆栈的不同内存分配记录
-    std::map<uint64_t, sgi_allocate_record *> log_map_by_stackid;
-    std::map<uint64_t, std::list<sgi_allocate_record *> *> log_map_by_category;
-
-    for (uint32_t i = 0; i < _rawRecords->max_index; ++i) {
-        sgi_splay_tree_node node = _rawRecords->node[i];
-
-        if (node.stackid_and_flags == 0)
-            continue;
+    sgi_stack_map stack_map(4096);
+
+    sgi_raw_records_parse_context context = {_rawRecords, _hasCategoryNames ? &_categoryNames : NULL, &stack_map, 0, 0, _sampleInterval, 0};
+    if (!sgi_allocation_records_enumerate_stacks(_rawRecords, sgi_parse_stack_aggregate, &context)) {
+        // all the records are scanned, a shard per task: the workers scan into their own stacks, merged at the end.
+        uint32_t worker_count = 1 + sgi_report_workers_count(_workers);
+        std::vector<sgi_stack_map> partial_maps(worker_count - 1, sgi_stack_map(4096));
+        std::vector<sgi_raw_records_parse_context> contexts(worker_count, context);
+        for (uint32_t i = 1; i < worker_count; ++i) {
+            contexts[i].stack_map = &partial_maps[i - 1];
+        }
+        sgi_report_workers_run(_workers, sgi_allocation_records_shard_count(_rawRecords), sgi_parse_shard_task, contexts.data());
+
+        context.record_size = contexts[0].record_size;
+        context.record_count = contexts[0].record_count;
+        for (uint32_t i = 1; i < worker_count; ++i) {
+            context.record_size += contexts[i].record_size;
+            context.record_count += contexts[i].record_count;
+            merge_partial_stacks(partial_maps[i - 1], stack_map);
+        }
+    }
+    _recordSize = context.record_size;
+    _allocateRecordCount = context.record_count;
 
-        uint32_t size = SGI_ALLOCATIONS_SIZE(node.category_and_size);
+    // 按 category 分组, 生成 report 数据结构
+    _categoryRecordCount = group_stacks_into_categories(stack_map, _rawRecords, context.category_names, _topLimits, _formedCategories, _formedStacks);
+    _stackRecordCount = (uint32_t)stack_map.size();
+}
 
-        merge_record_into_stacks(node.stackid_and_flags, node.category_and_size, log_map_by_stackid);
+void AllocateRecords::setTopLimits(const TopLimits &limits) {
+    _topLimits = limits;
+}
 
-        _recordSize += size;
-        _allocateRecordCount += 1;
+static void sgi_load_category_name(uint32_t category_id, const char *name, void *context) {
+    std::vector<std::string> *names = (std::vector<std::string> *)context;
+    if (category_id >= names->size()) {
+        names->resize(category_id + 1);
     }
+    (*names)[category_id] = name;
+}
 
-    // group by category_id
-    merge_stacks_into_categories(log_map_by_stackid, log_map_by_category);
+bool AllocateRecords::loadCategoryNames(const char *categoryStringsPath) {
+    std::vector<std::string> names;
+    if (!sgi_category_strings_read(categoryStringsPath, sgi_load_category_name, &names)) {
+        return false;
+    }
+    _categoryNames.swap(names);
+    _hasCategoryNames = true;
+    return true;
+}
 
-    _stackRecordCount = (uint32_t)log_map_by_stackid.size();
-    _categoryRecordCount = (uint32_t)log_map_by_category.size();
+// MARK: - stack aggregates check
+
+typedef struct {
+    uint64_t scanned_size;
+    uint64_t aggregated_size;
+    uint32_t scanned_count;
+    uint32_t aggregated_count;
+    uint64_t scanned_category; // smallest, 0 if none
+    uint64_t aggregated_category;
+    bool aggregated_category_live; // a scanned allocation carries `aggregated_category`
+} sgi_stack_aggregates_check_item;
+
+typedef struct {
+    sgi_allocation_records *raw_records;
+    std::map<uint64_t, sgi_stack_aggregates_check_item> *stacks;
+} sgi_stack_aggregates_check_context;
+
+static void sgi_check_raw_record(vm_address_t addr, uint64_t stackid_and_flags, uint64_t category_and_size, void *context) {
+    sgi_stack_aggregates_check_context *check_context = (sgi_stack_aggregates_check_context *)context;
+    sgi_stack_aggregates_check_item &item = (*check_context->stacks)[SGI_ALLOCATIONS_OFFSET(stackid_and_flags)];
+    item.scanned_size += sgi_allocation_records_aggregated_size(check_context->raw_records, SGI_ALLOCATIONS_SIZE(category_and_size));
+    item.scanned_count++;
+    uint64_t category = SGI_ALLOCATIONS_CATEGORY(category_and_size);
+    if (category != 0 && (item.scanned_category == 0 || category < item.scanned_category)) {
+        item.scanned_category = category;
+    }
+    // the aggregates are enumerated before the records.
+    if (category != 0 && category == item.aggregated_category) {
+        item.aggregated_category_live = true;
+    }
+}
 
-    // 生成 report 数据结构
-    generate_report_from_category_groups(log_map_by_category, _dyld_image_info, formedRecord);
+static void sgi_check_stack_aggregate(uint64_t stackid_and_flags, uint64_t size, uint32_t count, uint64_t category, void *context) {
+    sgi_stack_aggregates_check_context *check_context = (sgi_stack_aggregates_check_context *)context;
+    sgi_stack_aggregates_check_item &item = (*check_context->stacks)[SGI_ALLOCATIONS_OFFSET(stackid_and_flags)];
+    item.aggregated_size += size;
+    item.aggregated_count += count;
+    item.aggregated_category = category;
+}
 
-    // free data
-    free_category_and_stackid_groups(log_map_by_category, log_map_by_stackid);
+bool AllocateRecords::checkStackAggregates(StackAggregatesCheck *outCheck) {
+    memset(outCheck, 0, sizeof(StackAggregatesCheck));
+    if (_rawRecords == nil)
+        return false;
 
-    formedRecord->sort(sgi_compare_vm_stack_log_report_item);
-    _formedRecords = formedRecord;
+    std::map<uint64_t, sgi_stack_aggregates_check_item> stacks;
+    sgi_stack_aggregates_check_context context = {_rawRecords, &stacks};
+    if (!sgi_allocation_records_enumerate_stacks(_rawRecords, sgi_check_stack_aggregate, &context)) {
+        return false;
+    }
+    for (uint32_t shard = 0; shard < sgi_allocation_records_shard_count(_rawRecords); ++shard) {
+        sgi_allocation_records_enumerate_shard(_rawRecords, shard, sgi_check_raw_record, &context);
+    }
 
-    resetInCategoryIterator();
+    for (auto it = stacks.begin(); it != stacks.end(); ++it) {
+        const sgi_stack_aggregates_check_item &item = it->second;
+        outCheck->stacks++;
+        outCheck->scanned_size += item.scanned_size;
+        outCheck->aggregated_size += item.aggregated_size;
+        outCheck->scanned_count += item.scanned_count;
+        outCheck->aggregated_count += item.aggregated_count;
+        if (item.scanned_size != item.aggregated_size || item.scanned_count != item.aggregated_count) {
+            if (outCheck->mismatched_stacks++ < 16) {
+                SGIAPMMallocLog("[APM][Alloc] stack %llu: scanned %llu bytes in %u allocations, aggregated %llu bytes in %u allocations\n",
+                                it->first, item.scanned_size, item.scanned_count, item.aggregated_size, item.aggregated_count);
+            }
+        }
+        // the aggregates keep the smallest category a stack ever had, the scan sees the live allocations only: they agree
+        // while an allocation of the aggregated category is live. a stack whose allocations of that category are all
+        // removed keeps it, counted apart.
+        if (item.scanned_count != 0 && item.scanned_category != item.aggregated_category) {
+            if (item.aggregated_category != 0 && !item.aggregated_category_live) {
+                outCheck->stale_categories++;
+            } else if (outCheck->mismatched_categories++ < 16) {
+                SGIAPMMallocLog("[APM][Alloc] stack %llu: scanned category %llu, aggregated category %llu\n",
+                                it->first, item.scanned_category, item.aggregated_category);
+            }
+        }
+    }
+    return true;
 }
 
 AllocateRecords::InCategory *AllocateRecords::firstRecordInCategory() {
-    if (_formedRecords == NULL)
+    if (_formedCategories.empty())
         return NULL;
 
-    _recordIterator = _formedRecords->begin();
-    return *_recordIterator;
+    _recordIterator = 0;
+    return &_formedCategories[_recordIterator];
 }
 
 AllocateRecords::InCategory *AllocateRecords::nextRecordInCategory() {
@@ -260,18 +526,22 @@ AllocateRecords::InCategory *AllocateRecords::nextRecordInCategory() {
     }
 
     _recordIterator++;
-    if (_recordIterator == _formedRecords->end()) {
+    if (_recordIterator >= _formedCategories.size()) {
         resetInCategoryIterator();
         return NULL;
     }
 
-    return *_recordIterator;
+    return &_formedCategories[_recordIterator];
 }
 
 void AllocateRecords::resetInCategoryIterator() {
     _recordIterator = kNullIterator;
 }
 
+uint64_t AllocateRecords::sampleInterval() const {
+    return _sampleInterval;
+}
+
 uint64_t AllocateRecords::recordSize() const {
     return _recordSize;
 }
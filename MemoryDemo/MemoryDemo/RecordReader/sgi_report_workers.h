@@ -0,0 +1,48 @@
+//
+// sgi_report_workers.h
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+
+#ifndef sgi_report_workers_h
+#define sgi_report_workers_h
+
+#include <mach/mach.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SGI_REPORT_WORKERS_MAX_COUNT 8 // threads spawned at most, one per records shard
+
+/*
+ Threads spawned before the records are frozen, and left running by the freeze, that scan the records with the caller.
+
+ The threads wait on a condition between runs. A run hands out `task_count` task indices, the calling thread takes tasks
+ as well (worker index 0), the spawned threads are worker 1...count.
+ */
+typedef struct _sgi_report_workers sgi_report_workers;
+
+sgi_report_workers *sgi_report_workers_create(uint32_t count); /**< `count` spawned threads, at most SGI_REPORT_WORKERS_MAX_COUNT. NULL on failure */
+void sgi_report_workers_destroy(sgi_report_workers *workers);
+
+uint32_t sgi_report_workers_count(sgi_report_workers *workers); /**< spawned threads, 0 for NULL */
+uint32_t sgi_report_workers_threads(sgi_report_workers *workers, thread_t *out_threads, uint32_t max_count); /**< the threads to leave running while frozen */
+
+typedef void (*sgi_report_task)(uint32_t task_index, uint32_t worker_index, void *context);
+
+/*
+ Runs `task` for every task index in [0, task_count), on the spawned threads and the calling one, and returns when all
+ are done. Every worker takes the task indices in increasing order. NULL `workers` runs them all on the calling thread.
+ */
+void sgi_report_workers_run(sgi_report_workers *workers, uint32_t task_count, sgi_report_task task, void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* sgi_report_workers_h */
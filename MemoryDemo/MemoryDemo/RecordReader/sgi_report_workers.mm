@@ -0,0 +1,167 @@
+//
+// sgi_report_workers.mm
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+
+#include "sgi_report_workers.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#import "SGIAPMCommonDef.h"
+
+#include "sgi_allocate_logging.h"
+#include "sgi_inner_allocate.h"
+
+typedef struct {
+    sgi_report_workers *workers;
+    uint32_t worker_index;
+} sgi_report_worker_arg;
+
+struct _sgi_report_workers {
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond; // a run started, or stopping
+    pthread_cond_t done_cond;  // the last busy worker finished
+    uint32_t count;
+    pthread_t threads[SGI_REPORT_WORKERS_MAX_COUNT];
+    thread_t mach_threads[SGI_REPORT_WORKERS_MAX_COUNT];
+    sgi_report_worker_arg args[SGI_REPORT_WORKERS_MAX_COUNT];
+    uint64_t generation; // of the current run
+    bool stopping;
+
+    // current run
+    sgi_report_task task;
+    void *context;
+    uint32_t task_count;
+    uint32_t next_task; // atomic
+    uint32_t busy_count;
+};
+
+static void sgi_report_workers_take_tasks(sgi_report_workers *workers, uint32_t worker_index) {
+    uint32_t task_index;
+    while ((task_index = __atomic_fetch_add(&workers->next_task, 1, __ATOMIC_RELAXED)) < workers->task_count) {
+        workers->task(task_index, worker_index, workers->context);
+    }
+}
+
+static void *sgi_report_worker_main(void *arg) {
+    sgi_report_worker_arg *worker_arg = (sgi_report_worker_arg *)arg;
+    pthread_setname_np("com.sogou.apm.allocations.report");
+    // the workers may scan a snapshot while the logging goes on, their own allocations are never recorded.
+    sgi_memory_allocate_logging_ignore_current_thread_begin();
+
+    sgi_report_workers *workers = worker_arg->workers;
+    uint64_t generation = 0;
+    pthread_mutex_lock(&workers->mutex);
+    while (true) {
+        while (workers->generation == generation && !workers->stopping) {
+            pthread_cond_wait(&workers->start_cond, &workers->mutex);
+        }
+        if (workers->stopping) {
+            break;
+        }
+        generation = workers->generation;
+        pthread_mutex_unlock(&workers->mutex);
+
+        sgi_report_workers_take_tasks(workers, worker_arg->worker_index);
+
+        pthread_mutex_lock(&workers->mutex);
+        if (--workers->busy_count == 0) {
+            pthread_cond_signal(&workers->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&workers->mutex);
+    return NULL;
+}
+
+sgi_report_workers *sgi_report_workers_create(uint32_t count) {
+    if (count > SGI_REPORT_WORKERS_MAX_COUNT) {
+        count = SGI_REPORT_WORKERS_MAX_COUNT;
+    }
+
+    sgi_report_workers *workers = (sgi_report_workers *)sgi_allocate_page(round_page(sizeof(sgi_report_workers)));
+    if (workers == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&workers->mutex, NULL);
+    pthread_cond_init(&workers->start_cond, NULL);
+    pthread_cond_init(&workers->done_cond, NULL);
+
+    for (uint32_t i = 0; i < count; i++) {
+        sgi_report_worker_arg *arg = &workers->args[i];
+        arg->workers = workers;
+        arg->worker_index = i + 1;
+        if (pthread_create(&workers->threads[i], NULL, sgi_report_worker_main, arg) != 0) {
+            SGIAPMMallocLog("[APM][Alloc] fail to create report worker %u.\n", i);
+            break;
+        }
+        workers->mach_threads[i] = pthread_mach_thread_np(workers->threads[i]);
+        workers->count++;
+    }
+    return workers;
+}
+
+void sgi_report_workers_destroy(sgi_report_workers *workers) {
+    if (workers == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&workers->mutex);
+    workers->stopping = true;
+    pthread_cond_broadcast(&workers->start_cond);
+    pthread_mutex_unlock(&workers->mutex);
+    for (uint32_t i = 0; i < workers->count; i++) {
+        pthread_join(workers->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&workers->done_cond);
+    pthread_cond_destroy(&workers->start_cond);
+    pthread_mutex_destroy(&workers->mutex);
+    sgi_deallocate_pages(workers, round_page(sizeof(sgi_report_workers)));
+}
+
+uint32_t sgi_report_workers_count(sgi_report_workers *workers) {
+    return workers ? workers->count : 0;
+}
+
+uint32_t sgi_report_workers_threads(sgi_report_workers *workers, thread_t *out_threads, uint32_t max_count) {
+    uint32_t count = sgi_report_workers_count(workers);
+    if (count > max_count) {
+        count = max_count;
+    }
+    if (count > 0) {
+        memcpy(out_threads, workers->mach_threads, count * sizeof(thread_t));
+    }
+    return count;
+}
+
+void sgi_report_workers_run(sgi_report_workers *workers, uint32_t task_count, sgi_report_task task, void *context) {
+    if (workers == NULL || workers->count == 0) {
+        for (uint32_t i = 0; i < task_count; i++) {
+            task(i, 0, context);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&workers->mutex);
+    workers->task = task;
+    workers->context = context;
+    workers->task_count = task_count;
+    workers->next_task = 0;
+    workers->busy_count = workers->count;
+    workers->generation++;
+    pthread_cond_broadcast(&workers->start_cond);
+    pthread_mutex_unlock(&workers->mutex);
+
+    sgi_report_workers_take_tasks(workers, 0);
+
+    pthread_mutex_lock(&workers->mutex);
+    while (workers->busy_count > 0) {
+        pthread_cond_wait(&workers->done_cond, &workers->mutex);
+    }
+    pthread_mutex_unlock(&workers->mutex);
+}
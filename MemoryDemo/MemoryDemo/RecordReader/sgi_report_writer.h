@@ -0,0 +1,81 @@
+//
+// sgi_report_writer.h
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+
+#ifndef sgi_report_writer_h
+#define sgi_report_writer_h
+
+#include <mach/mach.h>
+#include <stdio.h>
+
+#include "sgi_allocate_record_reader.h"
+
+#define SGI_REPORT_WRITER_BUFFER_SIZE (64 * 1024) // bytes buffered before a write to the file
+
+namespace SGIAPMAlloc {
+
+/**
+ Receives a report while `RecordOutput` iterates the categories, nothing has to be kept per category or stack.
+ Called as: (beginReport (beginCategory writeStack* endCategory)* endReport)*
+ */
+class ReportWriter
+{
+  public:
+    virtual ~ReportWriter() {}
+
+    virtual void beginReport(const char *name, const AllocateRecords &records) = 0; /**< `name` of the report, e.g. "malloc_report" */
+    virtual void beginCategory(const AllocateRecords::InCategory &category) = 0;
+    virtual void writeStack(const AllocateRecords::InStackId &stack, const vm_address_t *frames, uint32_t frameCount) = 0; /**< `frames` NULL if not asked for */
+    virtual void endCategory(void) = 0;
+    virtual void endReport(void) = 0;
+};
+
+/**
+ Streams the reports as one JSON object, the keys of `RecordOutput::flushReportToDictionary` under the name of every
+ report. Only a fixed buffer (SGI_REPORT_WRITER_BUFFER_SIZE) is used whatever the size of the reports, it is written
+ to `fd` when full. Frames are strings: "0x<address>", or the repeat of a collapsed recursion.
+ */
+class JSONReportWriter : public ReportWriter
+{
+  public:
+    JSONReportWriter(int fd); /**< `fd` is not owned */
+    ~JSONReportWriter();
+
+    void beginReport(const char *name, const AllocateRecords &records);
+    void beginCategory(const AllocateRecords::InCategory &category);
+    void writeStack(const AllocateRecords::InStackId &stack, const vm_address_t *frames, uint32_t frameCount);
+    void endCategory(void);
+    void endReport(void);
+
+    bool finish(void); /**< closes the object and writes the rest of the buffer, false if any write failed */
+
+  private:
+    void append(const char *bytes, size_t length);
+    void appendLiteral(const char *literal);
+    void appendUInt(uint64_t value);
+    void appendString(const char *string);
+    void appendHexString(uint64_t value); /**< "0x..." */
+    void appendKeyUInt(const char *key, uint64_t value, bool first = false);
+    void flushBuffer(void);
+
+    int _fd = -1;
+    char *_buffer = NULL;
+    size_t _used = 0;
+    bool _failed = false;
+    bool _firstReport = true;
+    bool _firstCategory = true;
+    bool _firstStack = true;
+
+  private:
+    JSONReportWriter(const JSONReportWriter &);
+    JSONReportWriter &operator=(const JSONReportWriter &);
+};
+
+} // namespace SGIAPMAlloc
+
+#endif /* sgi_report_writer_h */
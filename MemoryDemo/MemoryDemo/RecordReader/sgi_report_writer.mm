@@ -0,0 +1,196 @@
+//
+// sgi_report_writer.mm
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+
+#include "sgi_report_writer.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#import "SGIAPMCommonDef.h"
+
+#include "sgi_inner_allocate.h"
+
+using namespace SGIAPMAlloc;
+
+// MARK: - JSONReportWriter
+
+JSONReportWriter::JSONReportWriter(int fd)
+    : _fd(fd) {
+    // pages, not malloc: the buffer is neither recorded nor left to the allocator once the report is written.
+    _buffer = (char *)sgi_allocate_page(round_page(SGI_REPORT_WRITER_BUFFER_SIZE));
+    _failed = _buffer == NULL;
+    appendLiteral("{");
+}
+
+JSONReportWriter::~JSONReportWriter() {
+    if (_buffer != NULL) {
+        sgi_deallocate_pages(_buffer, round_page(SGI_REPORT_WRITER_BUFFER_SIZE));
+        _buffer = NULL;
+    }
+}
+
+void JSONReportWriter::beginReport(const char *name, const AllocateRecords &records) {
+    appendLiteral(_firstReport ? "" : ",");
+    appendString(name);
+    appendLiteral(":{");
+    appendKeyUInt("sample_interval", records.sampleInterval(), true);
+    appendKeyUInt("total_size", records.recordSize());
+    appendKeyUInt("allocate_record_count", records.allocateRecordCount());
+    appendKeyUInt("stack_record_count", records.stackRecordCount());
+    appendKeyUInt("category_record_count", records.categoryRecordCount());
+    appendLiteral(",\"categories\":[");
+    _firstReport = false;
+    _firstCategory = true;
+}
+
+void JSONReportWriter::beginCategory(const AllocateRecords::InCategory &category) {
+    appendLiteral(_firstCategory ? "{" : ",{");
+    appendLiteral("\"name\":");
+    appendString(category.name != NULL ? category.name : "");
+    appendKeyUInt("size", category.size);
+    appendKeyUInt("record_count", category.count);
+    appendKeyUInt("stack_id_count", category.totalStackCount);
+    appendLiteral(",\"stacks\":[");
+    _firstCategory = false;
+    _firstStack = true;
+}
+
+void JSONReportWriter::writeStack(const AllocateRecords::InStackId &stack, const vm_address_t *frames, uint32_t frameCount) {
+    appendLiteral(_firstStack ? "{" : ",{");
+    appendKeyUInt("size", stack.size, true);
+    appendKeyUInt("count", stack.count);
+    appendKeyUInt("stack_id", stack.stack_id);
+    if (frames != NULL) {
+        appendLiteral(",\"frames\":[");
+        for (uint32_t i = 0; i < frameCount; i++) {
+            vm_address_t addr = frames[i];
+            appendLiteral(i == 0 ? "" : ",");
+            if (SGI_ALLOCATIONS_IS_RECURSION_FRAME(addr)) {
+                char frame[64];
+                snprintf(frame, sizeof(frame), "(%u frames above repeated %u times)", SGI_ALLOCATIONS_RECURSION_FRAME_PERIOD(addr), SGI_ALLOCATIONS_RECURSION_FRAME_COUNT(addr));
+                appendString(frame);
+            } else {
+                appendHexString(addr);
+            }
+        }
+        appendLiteral("]");
+    }
+    appendLiteral("}");
+    _firstStack = false;
+}
+
+void JSONReportWriter::endCategory(void) {
+    appendLiteral("]}");
+}
+
+void JSONReportWriter::endReport(void) {
+    appendLiteral("]}");
+}
+
+bool JSONReportWriter::finish(void) {
+    appendLiteral("}");
+    flushBuffer();
+    return !_failed;
+}
+
+// MARK: - buffer
+
+void JSONReportWriter::append(const char *bytes, size_t length) {
+    if (_failed) {
+        return;
+    }
+    while (length > 0) {
+        if (_used == SGI_REPORT_WRITER_BUFFER_SIZE) {
+            flushBuffer();
+            if (_failed) {
+                return;
+            }
+        }
+        size_t copied = SGI_REPORT_WRITER_BUFFER_SIZE - _used;
+        if (copied > length) {
+            copied = length;
+        }
+        memcpy(_buffer + _used, bytes, copied);
+        _used += copied;
+        bytes += copied;
+        length -= copied;
+    }
+}
+
+void JSONReportWriter::appendLiteral(const char *literal) {
+    append(literal, strlen(literal));
+}
+
+// no snprintf, a report writes a few numbers per stack.
+void JSONReportWriter::appendUInt(uint64_t value) {
+    char digits[20];
+    char *cursor = digits + sizeof(digits);
+    do {
+        *--cursor = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    append(cursor, digits + sizeof(digits) - cursor);
+}
+
+void JSONReportWriter::appendHexString(uint64_t value) {
+    char digits[20];
+    char *cursor = digits + sizeof(digits);
+    *--cursor = '"';
+    do {
+        *--cursor = "0123456789abcdef"[value & 0xF];
+        value >>= 4;
+    } while (value != 0);
+    *--cursor = 'x';
+    *--cursor = '0';
+    *--cursor = '"';
+    append(cursor, digits + sizeof(digits) - cursor);
+}
+
+void JSONReportWriter::appendString(const char *string) {
+    appendLiteral("\"");
+    const char *run = string;
+    for (const char *cursor = string; *cursor != '\0'; cursor++) {
+        unsigned char c = (unsigned char)*cursor;
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        append(run, cursor - run);
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), c == '"' || c == '\\' ? "\\%c" : "\\u%04x", c);
+        appendLiteral(escaped);
+        run = cursor + 1;
+    }
+    appendLiteral(run);
+    appendLiteral("\"");
+}
+
+void JSONReportWriter::appendKeyUInt(const char *key, uint64_t value, bool first) {
+    appendLiteral(first ? "\"" : ",\"");
+    appendLiteral(key);
+    appendLiteral("\":");
+    appendUInt(value);
+}
+
+void JSONReportWriter::flushBuffer(void) {
+    size_t written = 0;
+    while (!_failed && written < _used) {
+        ssize_t result = write(_fd, _buffer + written, _used - written);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            SGIAPMMallocLog("[APM][Alloc] fail to write report: %s\n", strerror(errno));
+            _failed = true;
+            break;
+        }
+        written += (size_t)result;
+    }
+    _used = 0;
+}
@@ -44,6 +44,9 @@ typedef struct _sgi_dyld_image_info_ {
     vm_address_t images_begin;
     vm_address_t images_end;
     sgi_sys_dyld_image_info *sys_dyld_image_info;
+
+    vm_address_t *sys_bounds;   //系统库地址区间的边界，升序排列 [begin0, end0 + 1, begin1, end1 + 1, ...]，由 sys_dyld_image_info 生成
+    uint32_t sys_bound_count;
 } sgi_dyld_image_info;
 
 
@@ -86,6 +86,61 @@ void sgi_sys_dyld_image_info_clear(sgi_sys_dyld_image_info *&sys_dyld_image_info
     }
 }
 
+static int sgi_sys_dyld_image_info_compare(const void *a, const void *b) {
+    vm_address_t begin_a = (*(sgi_sys_dyld_image_info **)a)->addr_begin;
+    vm_address_t begin_b = (*(sgi_sys_dyld_image_info **)b)->addr_begin;
+    return begin_a < begin_b ? -1 : (begin_a > begin_b ? 1 : 0);
+}
+
+// 由系统库链表生成有序的区间边界数组，重叠或相邻的区间合并，供 sgi_dyld_check_in_sys_libraries 二分查找
+static void sgi_sys_dyld_image_info_build_bounds(sgi_dyld_image_info *dyld_image_info) {
+    if (dyld_image_info->sys_bounds) {
+        free(dyld_image_info->sys_bounds);
+        dyld_image_info->sys_bounds = NULL;
+    }
+    dyld_image_info->sys_bound_count = 0;
+
+    uint32_t count = 0;
+    for (sgi_sys_dyld_image_info *node = dyld_image_info->sys_dyld_image_info; node; node = node->prev) {
+        count++;
+    }
+    if (count == 0) {
+        return;
+    }
+
+    sgi_sys_dyld_image_info **nodes = (sgi_sys_dyld_image_info **)malloc(count * sizeof(sgi_sys_dyld_image_info *));
+    vm_address_t *bounds = (vm_address_t *)malloc(count * 2 * sizeof(vm_address_t));
+    if (nodes == NULL || bounds == NULL) {
+        free(nodes);
+        free(bounds);
+        return;
+    }
+
+    uint32_t i = 0;
+    for (sgi_sys_dyld_image_info *node = dyld_image_info->sys_dyld_image_info; node; node = node->prev) {
+        nodes[i++] = node;
+    }
+    qsort(nodes, count, sizeof(sgi_sys_dyld_image_info *), sgi_sys_dyld_image_info_compare);
+
+    uint32_t bound_count = 0;
+    for (i = 0; i < count; i++) {
+        vm_address_t begin = nodes[i]->addr_begin;
+        vm_address_t end = nodes[i]->addr_end + 1; // addr_end 为闭区间
+        if (bound_count > 0 && begin <= bounds[bound_count - 1]) {
+            if (end > bounds[bound_count - 1]) {
+                bounds[bound_count - 1] = end;
+            }
+        } else {
+            bounds[bound_count++] = begin;
+            bounds[bound_count++] = end;
+        }
+    }
+    free(nodes);
+
+    dyld_image_info->sys_bounds = bounds;
+    dyld_image_info->sys_bound_count = bound_count;
+}
+
 #pragma mark - sgi_dyld_image_info
 
 sgi_dyld_image_info * sgi_dyld_image_info_create(size_t dyldImageCount) {
@@ -95,6 +150,8 @@ sgi_dyld_image_info * sgi_dyld_image_info_create(size_t dyldImageCount) {
     info->images_begin = 0;
     info->images_end = 0;
     info->sys_dyld_image_info = NULL;
+    info->sys_bounds = NULL;
+    info->sys_bound_count = 0;
     return info;
 }
 
@@ -104,6 +161,9 @@ void sgi_dyld_image_info_clear(sgi_dyld_image_info *&dyld_image_info) {
             free(dyld_image_info->allImageInfo);
         }
         sgi_sys_dyld_image_info_clear(dyld_image_info->sys_dyld_image_info);
+        if (dyld_image_info->sys_bounds) {
+            free(dyld_image_info->sys_bounds);
+        }
         free(dyld_image_info);
         dyld_image_info = NULL;
         sgi_current_app_uuid = NULL;
@@ -317,6 +377,7 @@ void sgi_dyld_load_current_dyld_image_info() {
         }
         lastImageIsSys = is_sys;
     }
+    sgi_sys_dyld_image_info_build_bounds(sgi_current_dyld_image_info);
 }
 
 void sgi_dyld_clear_current_dyld_image_info() {
@@ -535,6 +596,7 @@ sgi_dyld_image_info * sgi_dyld_load_dyld_image_info(const char *filePath)
         return NULL;
     }
     dyld_image_info->sys_dyld_image_info = sys_dyld_image_info;
+    sgi_sys_dyld_image_info_build_bounds(dyld_image_info);
     
     return dyld_image_info;
 }
@@ -563,17 +625,21 @@ bool sgi_dyld_check_in_sys_libraries(sgi_dyld_image_info *dyld_image_info, vm_ad
         return false;
     }
     
-    sgi_sys_dyld_image_info *node = dyld_image_info->sys_dyld_image_info;
-    bool isIn = false;
-    while (node) {
-        if (address >= node->addr_begin &&
-            address <= node->addr_end) {
-            isIn = true;
-            break;
-        }
-        node = node->prev;
+    const vm_address_t *bounds = dyld_image_info->sys_bounds;
+    uint32_t count = dyld_image_info->sys_bound_count;
+    if (count == 0) {
+        return false;
+    }
+
+    // 无分支二分：统计 <= address 的边界个数，奇数即落在某个系统库区间内
+    const vm_address_t *base = bounds;
+    while (count > 1) {
+        uint32_t half = count >> 1;
+        base = (base[half] <= address) ? base + half : base;
+        count -= half;
     }
-    return isIn;
+    size_t position = (base - bounds) + (*base <= address);
+    return (position & 1) != 0;
 }
 
 bool sgi_dyld_check_in_all_Libraries(sgi_dyld_image_info *dyld_image_info, vm_address_t address) {
@@ -23,6 +23,25 @@ bool sgi_create_file(const char *filepath);
 
 size_t sgi_get_file_size(int fd);
 
+// MARK: - Growable mmap
+
+#define SGI_MMAP_RESERVE_FACTOR 16                   // virtual range reserved for a growable mapping, in multiples of its size
+#define SGI_MMAP_MAX_RESERVE_SIZE (64 * 1024 * 1024) // ceiling of SGI_MMAP_RESERVE_FACTOR, past it a range is twice the size
+
+/*
+ Shared mapping of a file inside a reserved virtual range. Growing extends the file and maps the new tail in place,
+ the pointer stays valid and nothing is copied. Only when the reserved range runs out, the whole file is mapped again
+ into a bigger range (`sgi_mmap_reserve_size` of the new size), still without copying since the data lives in the file.
+ The ranges are capped: the address space of an iOS process is too small for large multiples of big files.
+
+ Return MAP_FAILED on failure, like mmap.
+ */
+size_t sgi_mmap_reserve_size(size_t size); /**< range to reserve for a mapping of `size` bytes */
+void *sgi_mmap_reserve(int fd, size_t size, size_t reserve_size); /**< maps [0, size) of fd, the file should be at least size long */
+void *sgi_mmap_grow(void *ptr, int fd, size_t old_size, size_t new_size, size_t *reserve_size); /**< the old mapping is kept on failure */
+void *sgi_mmap_grow_retaining(void *ptr, int fd, size_t old_size, size_t new_size, size_t *reserve_size); /**< same, but a moved mapping leaves the old range mapped for concurrent readers, the caller unmaps it later */
+void sgi_munmap_reserved(void *ptr, size_t reserve_size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -12,8 +12,11 @@
 
 #import "SGIAPMCommonDef.h"
 
+#include <errno.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 
 bool sgi_is_file_exist(const char *filepath) {
@@ -62,3 +65,76 @@ size_t sgi_get_file_size(int fd) {
 
     return (size_t)st.st_size;
 }
+
+// MARK: - Growable mmap
+
+size_t sgi_mmap_reserve_size(size_t size) {
+    size_t reserve_size = size * SGI_MMAP_RESERVE_FACTOR;
+    if (reserve_size > SGI_MMAP_MAX_RESERVE_SIZE) {
+        reserve_size = SGI_MMAP_MAX_RESERVE_SIZE;
+    }
+    if (reserve_size < size * 2) {
+        reserve_size = size * 2;
+    }
+    return reserve_size;
+}
+
+void *sgi_mmap_reserve(int fd, size_t size, size_t reserve_size) {
+    if (reserve_size < size) {
+        reserve_size = size;
+    }
+
+    void *base = mmap(nullptr, reserve_size, PROT_NONE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (base == MAP_FAILED) {
+        SGIAPMMallocLog("fail to reserve %zu bytes: %s\n", reserve_size, strerror(errno));
+        return MAP_FAILED;
+    }
+
+    void *ptr = mmap(base, size, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED | MAP_FIXED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        SGIAPMMallocLog("fail to mmap into reserved range: %s\n", strerror(errno));
+        munmap(base, reserve_size);
+        return MAP_FAILED;
+    }
+    return ptr;
+}
+
+static void *_sgi_mmap_grow(void *ptr, int fd, size_t old_size, size_t new_size, size_t *reserve_size, bool unmap_old) {
+    if (ftruncate(fd, new_size) != 0) {
+        SGIAPMMallocLog("fail to truncate:%s, size:%zu\n", strerror(errno), new_size);
+        return MAP_FAILED;
+    }
+
+    if (new_size <= *reserve_size) {
+        // the tail replaces part of our own PROT_NONE reservation, the new file range reads as zero.
+        void *tail = mmap((char *)ptr + old_size, new_size - old_size, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED | MAP_FIXED, fd, old_size);
+        if (tail == MAP_FAILED) {
+            SGIAPMMallocLog("fail to mmap tail: %s\n", strerror(errno));
+            return MAP_FAILED;
+        }
+        return ptr;
+    }
+
+    size_t new_reserve_size = sgi_mmap_reserve_size(new_size);
+    void *new_ptr = sgi_mmap_reserve(fd, new_size, new_reserve_size);
+    if (new_ptr == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    if (unmap_old) {
+        munmap(ptr, *reserve_size);
+    }
+    *reserve_size = new_reserve_size;
+    return new_ptr;
+}
+
+void *sgi_mmap_grow(void *ptr, int fd, size_t old_size, size_t new_size, size_t *reserve_size) {
+    return _sgi_mmap_grow(ptr, fd, old_size, new_size, reserve_size, true);
+}
+
+void *sgi_mmap_grow_retaining(void *ptr, int fd, size_t old_size, size_t new_size, size_t *reserve_size) {
+    return _sgi_mmap_grow(ptr, fd, old_size, new_size, reserve_size, false);
+}
+
+void sgi_munmap_reserved(void *ptr, size_t reserve_size) {
+    munmap(ptr, reserve_size);
+}
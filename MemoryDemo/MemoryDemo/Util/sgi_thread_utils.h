@@ -10,6 +10,7 @@
 #ifndef sgi_thread_utils_h
 #define sgi_thread_utils_h
 
+#include <mach/mach.h>
 #include <stdbool.h>
 #include <stdio.h>
 
@@ -20,6 +21,7 @@ extern "C" {
 
 
 bool sgi_suspend_all_child_threads(void);
+bool sgi_suspend_all_child_threads_except(const thread_t *excluded_threads, uint32_t excluded_count); // 挂起除当前线程与 excluded_threads 之外的所有线程
 bool sgi_resume_all_child_threads(void);
 
 
@@ -22,20 +22,38 @@
 static thread_act_array_t thread_list;
 static mach_msg_type_number_t thread_count;
 
+static bool sgi_is_excluded_thread(thread_t thread, const thread_t *excluded_threads, uint32_t excluded_count) {
+    if (thread == mach_thread_self()) {
+        return true;
+    }
+    for (uint32_t i = 0; i < excluded_count; i++) {
+        if (thread == excluded_threads[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
 bool sgi_suspend_all_child_threads(void) {
+    return sgi_suspend_all_child_threads_except(NULL, 0);
+}
+
+bool sgi_suspend_all_child_threads_except(const thread_t *excluded_threads, uint32_t excluded_count) {
     kern_return_t ret = task_threads(mach_task_self(), &thread_list, &thread_count);
     if (ret != KERN_SUCCESS)
         return false;
 
     for (mach_msg_type_number_t i = 0; i < thread_count; i++) {
         thread_t thread = thread_list[i];
-        if (thread == mach_thread_self()) {
+        if (sgi_is_excluded_thread(thread, excluded_threads, excluded_count)) {
+            thread_list[i] = MACH_PORT_NULL; // 不挂起, 也不恢复
+            mach_port_deallocate(mach_task_self(), thread);
             continue;
         }
         if (KERN_SUCCESS != thread_suspend(thread)) {
             for (mach_msg_type_number_t j = 0; j < i; j++) {
                 thread_t pre_thread = thread_list[j];
-                if (pre_thread == mach_thread_self()) {
+                if (pre_thread == MACH_PORT_NULL) {
                     continue;
                 }
                 thread_resume(pre_thread);
@@ -53,7 +71,7 @@ bool sgi_suspend_all_child_threads(void) {
 bool sgi_resume_all_child_threads(void) {
     for (mach_msg_type_number_t i = 0; i < thread_count; i++) {
         thread_t thread = thread_list[i];
-        if (thread == mach_thread_self()) {
+        if (thread == MACH_PORT_NULL) {
             continue;
         }
         if (thread_resume(thread) != KERN_SUCCESS) {
@@ -0,0 +1,138 @@
+//
+// category_table_totals_test.cpp
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+// two records share a category table, as the malloc and vm records do, their shards add to the same rows of totals.
+// threads insert, tag and remove allocations of both, most of them uncategorized. the totals the table enumerates,
+// summed up over the rows, must be those of a scan of the records. a reset clears them.
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <random>
+#include <thread>
+#include <vector>
+#include "sgi_allocate_logging.h"
+#include "sgi_allocation_records.h"
+#include "sgi_category_table.h"
+#include "sgi_inner_allocate.h"
+
+static const int kThreadCount = 8;
+static const int kOperationsPerThread = 200000;
+static const uint32_t kLivePerThread = 2000;
+static const uint32_t kCategoryCount = 8;
+static const uint32_t kCategoryIdCount = 64; // ids are slots of the table + 1, a table of 16 names has 32 slots
+
+typedef struct {
+    uint64_t size[kCategoryIdCount];
+    uint64_t count[kCategoryIdCount];
+} category_usage;
+
+static category_usage scanned;
+static category_usage enumerated;
+static sgi_allocation_records *scanned_records;
+
+static void scan_record(vm_address_t addr, uint64_t stackid_and_flags, uint64_t category_and_size, void *context) {
+    uint64_t category = SGI_ALLOCATIONS_CATEGORY(category_and_size);
+    scanned.size[category] += sgi_allocation_records_aggregated_size(scanned_records, SGI_ALLOCATIONS_SIZE(category_and_size));
+    scanned.count[category]++;
+}
+
+static void enumerate_category(uint32_t category_id, const char *name, uint64_t size, uint32_t count, void *context) {
+    enumerated.size[category_id] += size;
+    enumerated.count[category_id] += count;
+}
+
+int main() {
+    sgi_setup_alloc_malloc_zone(malloc_create_zone(0, 0));
+    sgi_category_table *categories = sgi_category_table_create(kCategoryCount * 2);
+    uint32_t category_ids[kCategoryCount];
+    static char names[kCategoryCount][32];
+    for (uint32_t c = 0; c < kCategoryCount; c++) {
+        snprintf(names[c], sizeof(names[c]), "Category%u", c);
+        category_ids[c] = sgi_category_table_intern(categories, names[c]);
+    }
+
+    sgi_allocation_records *records[2];
+    for (int r = 0; r < 2; r++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/sgi_category_table_totals%d", getenv("SGI_TEST_RECORDS_DIR"), r);
+        records[r] = sgi_allocation_records_create(kThreadCount * kLivePerThread * 2, path, (sgi_allocation_records_backend)r, categories);
+        if (records[r] == NULL) {
+            printf("fail to create the records\n");
+            return 1;
+        }
+    }
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreadCount; t++) {
+        threads.emplace_back([t, &records, &category_ids] {
+            std::mt19937_64 rng(t + 1);
+            for (int i = 0; i < kOperationsPerThread; i++) {
+                sgi_allocation_records *r = records[rng() % 2];
+                vm_address_t addr = 0x10000000ull + ((vm_address_t)t << 24) + (rng() % kLivePerThread) * 64;
+                uint64_t operation = rng() % 8;
+                if (operation < 3) {
+                    sgi_allocation_records_delete(r, addr);
+                } else if (operation == 3) {
+                    sgi_allocation_records_set_category(r, addr, category_ids[rng() % kCategoryCount]);
+                } else {
+                    // three out of four uncategorized, they all add to the totals of SGI_CATEGORY_TABLE_NONE.
+                    uint64_t category = rng() % 4 == 0 ? category_ids[rng() % kCategoryCount] : SGI_CATEGORY_TABLE_NONE;
+                    sgi_allocation_records_delete(r, addr);
+                    sgi_allocation_records_insert(r, addr, 1 | ((uint64_t)sgi_allocations_type_alloc << 56),
+                                                  SGI_ALLOCATIONS_CATEGORY_AND_SIZE(category, 16 + rng() % 1024));
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    memset(&scanned, 0, sizeof(scanned));
+    for (int r = 0; r < 2; r++) {
+        scanned_records = records[r];
+        sgi_allocation_records_lock_all(records[r]);
+        for (uint32_t shard = 0; shard < sgi_allocation_records_shard_count(records[r]); shard++) {
+            sgi_allocation_records_enumerate_shard(records[r], shard, scan_record, NULL);
+        }
+        sgi_allocation_records_unlock_all(records[r]);
+    }
+    memset(&enumerated, 0, sizeof(enumerated));
+    sgi_category_table_enumerate(categories, enumerate_category, NULL);
+
+    uint32_t wrong = 0;
+    uint64_t live = 0;
+    for (uint32_t c = 0; c < kCategoryIdCount; c++) {
+        live += scanned.count[c];
+        if (scanned.size[c] != enumerated.size[c] || scanned.count[c] != enumerated.count[c]) {
+            printf("  category %u: scanned %llu bytes in %llu allocations, enumerated %llu bytes in %llu allocations\n", c,
+                   (unsigned long long)scanned.size[c], (unsigned long long)scanned.count[c], (unsigned long long)enumerated.size[c],
+                   (unsigned long long)enumerated.count[c]);
+            wrong++;
+        }
+    }
+    printf("%d threads, %llu live allocations, %llu uncategorized: %u categories with other totals\n", kThreadCount,
+           (unsigned long long)live, (unsigned long long)scanned.count[SGI_CATEGORY_TABLE_NONE], wrong);
+
+    sgi_category_table_reset_totals(categories);
+    memset(&enumerated, 0, sizeof(enumerated));
+    sgi_category_table_enumerate(categories, enumerate_category, NULL);
+    uint64_t after_reset = 0;
+    for (uint32_t c = 0; c < kCategoryIdCount; c++) {
+        after_reset += enumerated.count[c];
+    }
+    printf("after a reset: %llu allocations in the totals\n", (unsigned long long)after_reset);
+
+    for (int r = 0; r < 2; r++) {
+        sgi_allocation_records_close(records[r]);
+    }
+    bool passed = wrong == 0 && live > 0 && after_reset == 0;
+    printf(passed ? "OK\n" : "FAILED\n");
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,15 @@
+//
+// SGIAPMCommonDef.h
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+// stands for Util/SGIAPMCommonDef.h, the tests print their own results.
+#pragma once
+
+#include <stdio.h>
+
+#define SGIAPMMallocLog(FORMAT, ...)
+#define SGIAPMLog(FORMAT, ...)
@@ -0,0 +1,47 @@
+//
+// SGIDyldImagesUtil.h
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+// stands for Util/SGIDyldImagesUtil.h: no images are loaded, every address is an app address unless a test says
+// otherwise through `sgi_host_is_sys_address`.
+#pragma once
+
+#include <dlfcn.h>
+#include <mach/mach.h>
+
+typedef struct _sgi_dyld_image_item_ {
+    const char *name;
+    const char *path;
+    const char *uuid;
+    uint64_t headerAddr;
+    uint64_t imageBeginAddr;
+    uint64_t imageEndAddr;
+    uint64_t imageVMAddr;
+    uint64_t imageVMSize;
+    uint64_t imageSlide;
+    uint64_t linkeditBase;
+    uint64_t symtabAddr;
+} sgi_dyld_image_item;
+
+typedef struct _sgi_sys_dyld_image_info_ {
+    vm_address_t addr_begin;
+    vm_address_t addr_end;
+    struct _sgi_sys_dyld_image_info_ *prev;
+} sgi_sys_dyld_image_info;
+
+typedef struct _sgi_dyld_image_info_ {
+    sgi_dyld_image_item *allImageInfo;
+    uint32_t imageInfoCount;
+    vm_address_t images_begin;
+    vm_address_t images_end;
+    sgi_sys_dyld_image_info *sys_dyld_image_info;
+} sgi_dyld_image_info;
+
+extern sgi_dyld_image_info *sgi_current_dyld_image_info;
+extern bool (*sgi_host_is_sys_address)(vm_address_t address);
+
+bool sgi_dyld_check_in_sys_libraries(sgi_dyld_image_info *dyld_image_info, vm_address_t address);
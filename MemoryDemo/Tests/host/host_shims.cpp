@@ -0,0 +1,132 @@
+//
+// host_shims.cpp
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+// the non-inline parts of the host shims, and the helpers of Util the core links against.
+#include <errno.h>
+#include <fcntl.h>
+#include <mach/mach.h>
+#include <malloc/malloc.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include "SGIDyldImagesUtil.h"
+#include "sgi_locking.h"
+
+__thread void *sgi_host_tsd[SGI_HOST_TSD_SLOT_COUNT];
+
+// linux hands out pthread key 0 first, which is the thread-self slot of the tsd. keep it from the core.
+static pthread_key_t sgi_host_reserved_key = [] {
+    pthread_key_t key;
+    pthread_key_create(&key, NULL);
+    return key;
+}();
+
+sgi_dyld_image_info *sgi_current_dyld_image_info = NULL;
+bool (*sgi_host_is_sys_address)(vm_address_t address) = NULL;
+
+bool sgi_dyld_check_in_sys_libraries(sgi_dyld_image_info *dyld_image_info, vm_address_t address) {
+    return sgi_host_is_sys_address ? sgi_host_is_sys_address(address) : false;
+}
+
+// MARK: - zones
+
+static void *sgi_host_zone_malloc(malloc_zone_t *zone, size_t size) {
+    return malloc(size);
+}
+
+static void *sgi_host_zone_realloc(malloc_zone_t *zone, void *ptr, size_t size) {
+    return realloc(ptr, size);
+}
+
+static void sgi_host_zone_free(malloc_zone_t *zone, void *ptr) {
+    free(ptr);
+}
+
+malloc_zone_t *malloc_create_zone(size_t start_size, unsigned flags) {
+    malloc_zone_t *zone = new malloc_zone_t;
+    zone->malloc = sgi_host_zone_malloc;
+    zone->realloc = sgi_host_zone_realloc;
+    zone->free = sgi_host_zone_free;
+    return zone;
+}
+
+void malloc_set_zone_name(malloc_zone_t *zone, const char *name) {
+}
+
+void malloc_destroy_zone(malloc_zone_t *zone) {
+    delete zone;
+}
+
+// MARK: - semaphores, a port is an index of `sgi_host_semaphores`
+
+#define SGI_HOST_SEMAPHORE_COUNT 64
+static sem_t *sgi_host_semaphores[SGI_HOST_SEMAPHORE_COUNT];
+static semaphore_t sgi_host_semaphore_count = 1;
+
+kern_return_t semaphore_create(task_t task, semaphore_t *semaphore, int policy, int value) {
+    semaphore_t index = __atomic_fetch_add(&sgi_host_semaphore_count, 1, __ATOMIC_RELAXED);
+    if (index >= SGI_HOST_SEMAPHORE_COUNT) {
+        return 1;
+    }
+    sem_t *sem = new sem_t;
+    sem_init(sem, 0, value);
+    sgi_host_semaphores[index] = sem;
+    *semaphore = index;
+    return KERN_SUCCESS;
+}
+
+kern_return_t semaphore_destroy(task_t task, semaphore_t semaphore) {
+    return KERN_SUCCESS;
+}
+
+kern_return_t semaphore_signal(semaphore_t semaphore) {
+    sem_post(sgi_host_semaphores[semaphore]);
+    return KERN_SUCCESS;
+}
+
+kern_return_t semaphore_wait(semaphore_t semaphore) {
+    sem_wait(sgi_host_semaphores[semaphore]);
+    return KERN_SUCCESS;
+}
+
+kern_return_t semaphore_timedwait(semaphore_t semaphore, mach_timespec_t timeout) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += timeout.tv_nsec;
+    deadline.tv_sec += timeout.tv_sec + deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    return sem_timedwait(sgi_host_semaphores[semaphore], &deadline) == 0 ? KERN_SUCCESS : KERN_OPERATION_TIMED_OUT;
+}
+
+// MARK: - Util/sgi_file_utils
+
+extern "C" {
+
+bool sgi_is_file_exist(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
+bool sgi_create_file(const char *path) {
+    int fd = open(path, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+size_t sgi_get_file_size(int fd) {
+    struct stat st;
+    if (fstat(fd, &st)) {
+        return 0;
+    }
+    return st.st_size;
+}
+
+}
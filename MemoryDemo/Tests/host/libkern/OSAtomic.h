@@ -0,0 +1,9 @@
+//
+// OSAtomic.h
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+#pragma once
@@ -0,0 +1,115 @@
+//
+// mach.h
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+// the subset of mach used by the core, on top of posix. memory calls map to mmap/munmap/memcpy.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef uintptr_t vm_address_t;
+typedef uintptr_t vm_size_t;
+typedef uintptr_t mach_vm_address_t;
+typedef unsigned int mach_port_t;
+typedef mach_port_t thread_t;
+typedef mach_port_t task_t;
+typedef mach_port_t semaphore_t;
+typedef mach_port_t *thread_act_array_t;
+typedef unsigned int mach_msg_type_number_t;
+typedef int kern_return_t;
+typedef int boolean_t;
+typedef int vm_prot_t;
+typedef int vm_inherit_t;
+typedef unsigned int natural_t;
+
+#define KERN_SUCCESS 0
+#define KERN_OPERATION_TIMED_OUT 49
+#define VM_FLAGS_ANYWHERE 1
+#define VM_FLAGS_FIXED 0
+#define VM_FLAGS_OVERWRITE 0x4000
+#define VM_FLAGS_ALIAS_MASK 0xFF000000
+#define VM_MAKE_TAG(t) ((t) << 24)
+#define VM_PROT_READ 1
+#define VM_PROT_WRITE 2
+#define VM_PROT_DEFAULT 3
+#define VM_INHERIT_NONE 2
+#define SYNC_POLICY_FIFO 0
+
+static const vm_size_t vm_page_size = 16384;
+#define round_page(x) (((vm_size_t)(x) + 16383) & ~(vm_size_t)16383)
+
+static inline mach_port_t mach_task_self(void) { return 1; }
+static inline mach_port_t mach_thread_self(void) { return 2; }
+
+static inline kern_return_t vm_allocate(mach_port_t, vm_address_t *address, vm_size_t size, int) {
+    void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (p == MAP_FAILED) {
+        return 1;
+    }
+    *address = (vm_address_t)p;
+    return KERN_SUCCESS;
+}
+
+static inline kern_return_t vm_deallocate(mach_port_t, vm_address_t address, vm_size_t size) {
+    return munmap((void *)address, size);
+}
+
+static inline kern_return_t vm_copy(mach_port_t, vm_address_t src, vm_size_t size, vm_address_t dst) {
+    memcpy((void *)dst, (void *)src, size);
+    return KERN_SUCCESS;
+}
+
+static inline kern_return_t vm_read_overwrite(mach_port_t, vm_address_t src, vm_size_t size, vm_address_t dst, vm_size_t *out_size) {
+    memcpy((void *)dst, (void *)src, size);
+    *out_size = size;
+    return KERN_SUCCESS;
+}
+
+// no remapping on the host, callers fall back to copying.
+static inline kern_return_t vm_remap(mach_port_t, vm_address_t *, vm_size_t, vm_address_t, int, mach_port_t, vm_address_t, boolean_t, vm_prot_t *, vm_prot_t *, vm_inherit_t) {
+    return 1;
+}
+
+typedef struct {
+    int tv_sec;
+    int tv_nsec;
+} mach_timespec_t;
+
+kern_return_t semaphore_create(task_t task, semaphore_t *semaphore, int policy, int value);
+kern_return_t semaphore_destroy(task_t task, semaphore_t semaphore);
+kern_return_t semaphore_signal(semaphore_t semaphore);
+kern_return_t semaphore_wait(semaphore_t semaphore);
+kern_return_t semaphore_timedwait(semaphore_t semaphore, mach_timespec_t timeout);
+kern_return_t task_threads(task_t task, thread_act_array_t *threads, mach_msg_type_number_t *count);
+kern_return_t thread_suspend(thread_t thread);
+kern_return_t thread_resume(thread_t thread);
+kern_return_t mach_port_deallocate(task_t task, mach_port_t port);
+
+struct task_basic_info {
+    vm_size_t resident_size;
+};
+typedef struct task_basic_info task_basic_info_data_t;
+typedef int *task_info_t;
+#define TASK_BASIC_INFO 5
+kern_return_t task_info(task_t task, int flavor, task_info_t info, mach_msg_type_number_t *count);
+
+typedef struct {
+    uint64_t phys_footprint;
+    uint64_t resident_size;
+} task_vm_info_data_t;
+#define TASK_VM_INFO 22
+#define TASK_VM_INFO_COUNT 2
+
+typedef int clock_res_t;
+#define NSEC_PER_MSEC 1000000ull
+#define NSEC_PER_SEC 1000000000ull
@@ -0,0 +1,30 @@
+//
+// mach_time.h
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+typedef struct {
+    uint32_t numer;
+    uint32_t denom;
+} mach_timebase_info_data_t;
+
+// nanoseconds, the timebase is 1/1.
+static inline uint64_t mach_absolute_time(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static inline int mach_timebase_info(mach_timebase_info_data_t *info) {
+    info->numer = 1;
+    info->denom = 1;
+    return 0;
+}
@@ -0,0 +1,10 @@
+//
+// mach_types.h
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+#pragma once
+#include <mach/mach.h>
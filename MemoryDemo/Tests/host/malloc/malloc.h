@@ -0,0 +1,25 @@
+//
+// malloc.h
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+// zones forward to the host malloc.
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct _malloc_zone_t {
+    void *(*malloc)(struct _malloc_zone_t *zone, size_t size);
+    void *(*realloc)(struct _malloc_zone_t *zone, void *ptr, size_t size);
+    void (*free)(struct _malloc_zone_t *zone, void *ptr);
+} malloc_zone_t;
+
+malloc_zone_t *malloc_create_zone(size_t start_size, unsigned flags);
+void malloc_set_zone_name(malloc_zone_t *zone, const char *name);
+void malloc_destroy_zone(malloc_zone_t *zone);
+
+#define malloc_printf printf
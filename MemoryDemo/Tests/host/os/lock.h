@@ -0,0 +1,12 @@
+//
+// lock.h
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+#pragma once
+
+typedef int os_unfair_lock;
+#define OS_UNFAIR_LOCK_INIT 0
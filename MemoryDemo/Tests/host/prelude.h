@@ -0,0 +1,52 @@
+//
+// prelude.h
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+// included before every source of the host build: the darwin only pthread calls and C11 spellings the core uses.
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define _Static_assert static_assert
+#define pthread_setname_np(name) ((void)0)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline void *pthread_get_stackaddr_np(pthread_t thread) {
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+    pthread_getattr_np(thread, &attr);
+    pthread_attr_getstack(&attr, &addr, &size);
+    pthread_attr_destroy(&attr);
+    return (char *)addr + size;
+}
+
+static inline size_t pthread_get_stacksize_np(pthread_t thread) {
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+    pthread_getattr_np(thread, &attr);
+    pthread_attr_getstack(&attr, &addr, &size);
+    pthread_attr_destroy(&attr);
+    return size;
+}
+
+static inline unsigned pthread_mach_thread_np(pthread_t thread) {
+    return (unsigned)(uintptr_t)thread;
+}
+
+// the stack walker of the host build, see run_host_tests.sh.
+int backtrace(void **frames, int size);
+
+#ifdef __cplusplus
+}
+#endif
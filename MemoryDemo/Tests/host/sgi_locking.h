@@ -0,0 +1,50 @@
+//
+// sgi_locking.h
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+// stands for Core/sgi_locking.h. the tsd slots are thread locals, slot 0 is the thread itself as on darwin.
+#ifndef sgi_locking_h
+#define sgi_locking_h
+
+#include <pthread.h>
+#include <stdint.h>
+
+typedef pthread_mutex_t _malloc_lock_s;
+#define _MALLOC_LOCK_INIT PTHREAD_MUTEX_INITIALIZER
+
+static inline void _malloc_lock_init(_malloc_lock_s *lock) {
+    pthread_mutex_init(lock, NULL);
+}
+
+static inline int _malloc_lock_lock(_malloc_lock_s *lock) {
+    return pthread_mutex_lock(lock);
+}
+
+static inline int _malloc_lock_trylock(_malloc_lock_s *lock) {
+    return pthread_mutex_trylock(lock);
+}
+
+static inline int _malloc_lock_unlock(_malloc_lock_s *lock) {
+    return pthread_mutex_unlock(lock);
+}
+
+#define SGI_HOST_TSD_SLOT_COUNT 512
+extern __thread void *sgi_host_tsd[SGI_HOST_TSD_SLOT_COUNT];
+
+static inline void *_os_tsd_get_direct(unsigned long slot) {
+    if (slot == 0) {
+        return (void *)pthread_self();
+    }
+    return sgi_host_tsd[slot];
+}
+
+static inline int _os_tsd_set_direct(unsigned long slot, void *value) {
+    sgi_host_tsd[slot] = value;
+    return 0;
+}
+
+#endif /* sgi_locking_h */
@@ -0,0 +1,201 @@
+//
+// reentrancy_guard_test.cpp
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+// the hook keeps a per-thread reentrancy guard in a tsd slot. the stack walker below allocates and frees from inside
+// the hook, as a real one may: the nested calls must come back at once, without being recorded, without walking again
+// and without blocking the other threads. a thread parked inside the hook must not keep the others from recording, and
+// `ignore_current_thread_begin/end` only mutes the calling thread. run with sync and async recording.
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "sgi_allocate_event_buffer.h"
+#include "sgi_allocate_logging.h"
+
+static const int kThreadCount = 8;
+static const int kAllocationsPerThread = 20000;
+static const int kLivePerThread = 100;
+static const uintptr_t kNestedBase = 0xF00000000ull; // addresses only the nested calls use
+
+static __thread bool walking;
+static __thread int thread_index;
+static __thread uintptr_t live_outer_address; // an address of this thread that is recorded and not freed yet
+static __thread uintptr_t nested_count;
+static std::atomic<uint64_t> walks;
+static std::atomic<uint64_t> nested_walks;
+
+// parking: thread 0 waits inside its walker until thread 1 recorded its allocations.
+static std::atomic<bool> park_thread;
+static std::atomic<bool> parked;
+static std::atomic<bool> unpark;
+
+extern "C" int backtrace(void **frames, int size) {
+    if (walking) {
+        nested_walks++;
+    }
+    walking = true;
+    walks++;
+
+    uintptr_t nested = kNestedBase + ((uintptr_t)thread_index << 24) + (nested_count++ % 4096) * 16;
+    sgi_allocate_logging(sgi_allocations_type_alloc, 0, 24, 0, nested, 0);
+    sgi_allocate_logging(sgi_allocations_type_dealloc, 0, nested, 0, 0, 0);
+    if (live_outer_address) {
+        sgi_allocate_logging(sgi_allocations_type_dealloc, 0, live_outer_address, 0, 0, 0); // must not free it
+    }
+    if (park_thread && thread_index == 0) {
+        parked = true;
+        while (!unpark) {
+            std::this_thread::yield();
+        }
+    }
+
+    int count = 0;
+    for (int k = 0; k < 10 && count < size; k++) {
+        frames[count++] = (void *)(uintptr_t)(0x100000000ull + k * 0x40 + (k == 6 ? (thread_index % 4) * 4 : 0));
+    }
+    walking = false;
+    return count;
+}
+
+static uintptr_t address_of(int t, int i) {
+    return ((uintptr_t)(t + 1) << 28) + (uintptr_t)i * 16 + 0x10;
+}
+
+static void count_record(vm_address_t addr, uint64_t stackid_and_flags, uint64_t category_and_size, void *context) {
+    uint64_t *counts = (uint64_t *)context;
+    counts[addr >= kNestedBase ? 1 : 0]++;
+}
+
+// live records, and the ones of nested calls among them.
+static void count_records(uint64_t *out_live, uint64_t *out_nested) {
+    sgi_drain_memory_allocate_events();
+    uint64_t counts[2] = {0, 0};
+    for (uint32_t shard = 0; shard < sgi_allocation_records_shard_count(sgi_recording->malloc_records); shard++) {
+        sgi_allocation_records_enumerate_shard(sgi_recording->malloc_records, shard, count_record, counts);
+    }
+    *out_live = counts[0] + counts[1];
+    *out_nested = counts[1];
+}
+
+static void allocate(int t, int first, int count) {
+    thread_index = t;
+    for (int i = first; i < first + count; i++) {
+        uintptr_t p = address_of(t, i);
+        sgi_allocate_logging(sgi_allocations_type_alloc, 0, 32, 0, p, 0);
+        if (live_outer_address) {
+            sgi_allocate_logging(sgi_allocations_type_dealloc, 0, live_outer_address, 0, 0, 0);
+        }
+        live_outer_address = p;
+    }
+    live_outer_address = 0;
+}
+
+static bool check(const char *step, uint64_t expected_live) {
+    uint64_t live = 0, nested = 0;
+    count_records(&live, &nested);
+    bool passed = live == expected_live && nested == 0 && nested_walks == 0;
+    printf("%s: %llu live (expected %llu), %llu nested recorded, %llu of %llu walks nested%s\n", step, (unsigned long long)live,
+           (unsigned long long)expected_live, (unsigned long long)nested, (unsigned long long)nested_walks.load(),
+           (unsigned long long)walks.load(), passed ? "" : " FAILED");
+    return passed;
+}
+
+static bool run(bool async) {
+    sgi_allocations_async_recording = async;
+    sgi_allocations_event_buffer_size = 8 * 1024 * 1024;
+    snprintf(sgi_records_cache_dir, sizeof(sgi_records_cache_dir), "%s/sgi_reentrancy_guard", getenv("SGI_TEST_RECORDS_DIR"));
+    mkdir(sgi_records_cache_dir, 0755);
+    if (!sgi_prepare_memory_allocate_logging()) {
+        printf("fail to prepare the logging\n");
+        return false;
+    }
+    sgi_memory_allocate_logging_enabled = true;
+    walks = 0;
+    nested_walks = 0;
+    bool passed = true;
+    const char *mode = async ? "async" : "sync";
+
+    // every hook reenters, each thread keeps its last allocation live.
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreadCount; t++) {
+        threads.emplace_back([t] {
+            allocate(t, 0, kAllocationsPerThread);
+            for (int i = 0; i < kLivePerThread; i++) {
+                sgi_allocate_logging(sgi_allocations_type_alloc, 0, 32, 0, address_of(t, kAllocationsPerThread + i), 0);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    char step[64];
+    snprintf(step, sizeof(step), "%s, nested calls", mode);
+    uint64_t expected_live = kThreadCount * (1 + kLivePerThread);
+    passed &= check(step, expected_live);
+
+    // thread 0 stays inside the hook while thread 1 records. with async recording the events of thread 1 are queued, the
+    // drainer applies them in order once thread 0 is done.
+    sgi_allocate_event_buffer_stats stats;
+    sgi_allocate_event_buffer_get_stats(&stats);
+    uint64_t enqueued_before = stats.enqueued_events;
+    park_thread = true;
+    parked = false;
+    unpark = false;
+    std::thread parked_thread([] { allocate(0, 100000, 1); });
+    while (!parked) {
+        std::this_thread::yield();
+    }
+    std::thread other_thread([] { allocate(1, 100000, 1000); });
+    other_thread.join();
+    uint64_t recorded = 0, nested = 0;
+    if (async) {
+        sgi_allocate_event_buffer_get_stats(&stats);
+        recorded = stats.enqueued_events - enqueued_before;
+    } else {
+        count_records(&recorded, &nested);
+        recorded -= expected_live;
+    }
+    unpark = true;
+    parked_thread.join();
+    park_thread = false;
+    // sync: the last allocation of thread 1 is live. async: its 1000 allocations and 999 frees are queued.
+    uint64_t expected_recorded = async ? 1999 : 1;
+    printf("%s, while a thread is parked in the hook: %llu %s (expected %llu)\n", mode, (unsigned long long)recorded,
+           async ? "events queued" : "new live", (unsigned long long)expected_recorded);
+    passed &= recorded == expected_recorded;
+    snprintf(step, sizeof(step), "%s, after the parked thread", mode);
+    passed &= check(step, expected_live + 1 + 1);
+
+    // an ignored thread records nothing, the others go on.
+    std::thread ignored_thread([] {
+        sgi_memory_allocate_logging_ignore_current_thread_begin();
+        allocate(2, 200000, 1000);
+        sgi_memory_allocate_logging_ignore_current_thread_end();
+        allocate(2, 300000, 1);
+    });
+    std::thread recorded_thread([] { allocate(3, 200000, 1); });
+    ignored_thread.join();
+    recorded_thread.join();
+    snprintf(step, sizeof(step), "%s, an ignored thread", mode);
+    passed &= check(step, expected_live + 2 + 2);
+
+    sgi_memory_allocate_logging_enabled = false;
+    sgi_clear_memory_allocate_logging();
+    return passed;
+}
+
+int main() {
+    bool passed = run(false);
+    passed &= run(true);
+    printf(passed ? "OK\n" : "FAILED\n");
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,79 @@
+#!/bin/bash
+#
+# run_host_tests.sh
+# SGIAPMAllocPlugin
+#
+# Builds the allocation monitor core and the record reader on a non-apple host (linux, gcc or clang) against the shims
+# in host/ and runs the tests of this directory, or the ones named on the command line:
+#
+#   MemoryDemo/Tests/run_host_tests.sh [uniquing_table_concurrency_test ...]
+#
+# The core is copied to a scratch directory ($SGI_TEST_BUILD_DIR, /tmp/sgi_host_tests by default) and adjusted there:
+#  - blocks `(^...)` become plain function pointers,
+#  - the stack walker is backtrace(3), the tests provide their own to feed known frames,
+#  - only the growable mmap part of Util/sgi_file_utils.mm is built, the file helpers are in host/host_shims.cpp.
+# The records and tables are mmaped under $SGI_TEST_RECORDS_DIR (/dev/shm if it exists).
+
+set -e
+
+TESTS_DIR="$(cd "$(dirname "$0")" && pwd)"
+SRC_DIR="$TESTS_DIR/../MemoryDemo"
+BUILD_DIR="${SGI_TEST_BUILD_DIR:-/tmp/sgi_host_tests}"
+CXX="${CXX:-c++}"
+CXXFLAGS="${CXXFLAGS:--O2 -g} -std=gnu++14 -w -Dnil=nullptr"
+if [ -z "$SGI_TEST_RECORDS_DIR" ]; then
+    SGI_TEST_RECORDS_DIR=/tmp
+    [ -d /dev/shm ] && SGI_TEST_RECORDS_DIR=/dev/shm
+fi
+export SGI_TEST_RECORDS_DIR
+
+rm -rf "$BUILD_DIR"
+mkdir -p "$BUILD_DIR/obj"
+cp -r "$SRC_DIR/Core" "$SRC_DIR/Util" "$SRC_DIR/RecordReader" "$BUILD_DIR/"
+cd "$BUILD_DIR"
+
+find Core Util RecordReader \( -name '*.h' -o -name '*.mm' \) | xargs sed -i \
+    -e 's/(\^/(*/g' \
+    -e 's/__emplace_back/emplace_back/g' \
+    -e '/^ *\.\(index\|addr_cnt\)\.[a-z]* = 0,$/d'
+cp "$TESTS_DIR/host/sgi_locking.h" Core/sgi_locking.h
+sed -i 's/sgi_stack_backtrace_of_current_thread(\([a-z_]*\), /backtrace((void **)\1, (int)/' Core/sgi_allocate_logging.mm
+{
+    printf '#include "sgi_file_utils.h"\n#include "SGIAPMCommonDef.h"\n#include <errno.h>\n#include <string.h>\n#include <sys/mman.h>\n#include <unistd.h>\n'
+    sed -n '/MARK: - Growable mmap/,$p' Util/sgi_file_utils.mm
+} > Core/sgi_mmap_growable.mm
+
+compile() {
+    "$CXX" $CXXFLAGS -c -x c++ -include "$TESTS_DIR/host/prelude.h" -I"$TESTS_DIR/host" -ICore -IUtil -IRecordReader "$1" -o "$2"
+}
+
+CORE_SOURCES="sgi_allocate_logging sgi_allocate_event_buffer sgi_allocation_records sgi_address_filter sgi_backtrace_uniquing_table
+    sgi_category_strings sgi_category_table sgi_hash_table sgi_inner_allocate sgi_mmap_growable sgi_splay_tree sgi_stack_aggregates"
+objects=""
+for source in $CORE_SOURCES; do
+    compile "Core/$source.mm" "obj/$source.o"
+    objects="$objects obj/$source.o"
+done
+for source in sgi_allocate_record_reader sgi_report_workers sgi_report_writer; do
+    compile "RecordReader/$source.mm" "obj/$source.o"
+    objects="$objects obj/$source.o"
+done
+compile "$TESTS_DIR/host/host_shims.cpp" obj/host_shims.o
+ar rcs libsgi_core.a $objects obj/host_shims.o
+
+tests="$*"
+if [ -z "$tests" ]; then
+    tests=$(cd "$TESTS_DIR" && ls *_test.cpp | sed 's/\.cpp$//')
+fi
+
+failed=0
+for test in $tests; do
+    compile "$TESTS_DIR/$test.cpp" "obj/$test.o"
+    "$CXX" $CXXFLAGS -o "$test" "obj/$test.o" libsgi_core.a -lpthread
+    echo "== $test"
+    if ! "./$test"; then
+        echo "FAILED: $test"
+        failed=1
+    fi
+done
+exit $failed
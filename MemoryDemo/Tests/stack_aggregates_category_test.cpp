@@ -0,0 +1,104 @@
+//
+// stack_aggregates_category_test.cpp
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+// allocations of many stacks are inserted with a category or none, tagged later with other categories and partly
+// removed, the allocations of the smallest category of some stacks all of them. `checkStackAggregates` must find no
+// mismatch: a stack keeping the category of its removed allocations is stale, not mismatched. both backends.
+
+#include <limits.h>
+#include <stdio.h>
+#include <random>
+#include "sgi_allocate_logging.h"
+#include "sgi_allocate_record_reader.h"
+#include "sgi_allocation_records.h"
+#include "sgi_category_table.h"
+#include "sgi_inner_allocate.h"
+
+static const uint32_t kStackCount = 1000;
+static const uint32_t kAllocationsPerStack = 8;
+static const uint32_t kCategoryCount = 16;
+
+static vm_address_t address_of(uint32_t stack, uint32_t i) {
+    return 0x10000000ull + ((vm_address_t)stack * kAllocationsPerStack + i) * 64;
+}
+
+static bool run(sgi_allocation_records_backend backend) {
+    sgi_category_table *categories = sgi_category_table_create(64);
+    uint32_t category_ids[kCategoryCount];
+    for (uint32_t c = 0; c < kCategoryCount; c++) {
+        char name[32];
+        snprintf(name, sizeof(name), "Category%u", c);
+        category_ids[c] = sgi_category_table_intern(categories, name);
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/sgi_stack_aggregates_category%d", getenv("SGI_TEST_RECORDS_DIR"), (int)backend);
+    sgi_allocation_records *records = sgi_allocation_records_create(kStackCount * kAllocationsPerStack * 2, path, backend, categories);
+    if (records == NULL) {
+        printf("backend %d: fail to create the records\n", (int)backend);
+        return false;
+    }
+
+    // the category of every allocation, 0 if none, and whether it is live.
+    static uint64_t category_of[kStackCount + 1][kAllocationsPerStack];
+    static bool live[kStackCount + 1][kAllocationsPerStack];
+    std::mt19937_64 rng(17);
+    // alloc: a third of the allocations start without a category.
+    for (uint32_t stack = 1; stack <= kStackCount; stack++) {
+        uint64_t stackid_and_flags = stack | ((uint64_t)sgi_allocations_type_alloc << 56);
+        for (uint32_t i = 0; i < kAllocationsPerStack; i++) {
+            category_of[stack][i] = rng() % 3 == 0 ? 0 : category_ids[rng() % kCategoryCount];
+            live[stack][i] = sgi_allocation_records_insert(records, address_of(stack, i), stackid_and_flags,
+                                                           SGI_ALLOCATIONS_CATEGORY_AND_SIZE(category_of[stack][i], 16 + rng() % 512));
+        }
+    }
+    // tag: some allocations get another category, smaller or not.
+    for (uint32_t stack = 1; stack <= kStackCount; stack++) {
+        for (uint32_t i = 0; i < kAllocationsPerStack; i++) {
+            uint64_t category = category_ids[rng() % kCategoryCount];
+            if (rng() % 4 == 0 && sgi_allocation_records_set_category(records, address_of(stack, i), category)) {
+                category_of[stack][i] = category;
+            }
+        }
+    }
+    // free: a few allocations of every stack, and on every other stack all the allocations of its smallest category.
+    uint32_t removed = 0;
+    for (uint32_t stack = 1; stack <= kStackCount; stack++) {
+        uint64_t smallest = 0;
+        for (uint32_t i = 0; i < kAllocationsPerStack; i++) {
+            if (live[stack][i] && category_of[stack][i] != 0 && (smallest == 0 || category_of[stack][i] < smallest)) {
+                smallest = category_of[stack][i];
+            }
+        }
+        for (uint32_t i = 0; i < kAllocationsPerStack; i++) {
+            bool free_it = rng() % 5 == 0 || (stack % 2 == 1 && smallest != 0 && category_of[stack][i] == smallest);
+            if (live[stack][i] && free_it && sgi_allocation_records_delete(records, address_of(stack, i)).addr_cnt.cnt != 0) {
+                live[stack][i] = false;
+                removed++;
+            }
+        }
+    }
+
+    sgi_allocation_records_lock_all(records);
+    SGIAPMAlloc::AllocateRecords allocateRecords(records, NULL);
+    SGIAPMAlloc::AllocateRecords::StackAggregatesCheck check;
+    bool checked = allocateRecords.checkStackAggregates(&check);
+    sgi_allocation_records_unlock_all(records);
+    printf("backend %d: %u removed, %u stacks, %u mismatched, %u with another category, %u with a removed category\n", (int)backend,
+           removed, check.stacks, check.mismatched_stacks, check.mismatched_categories, check.stale_categories);
+    sgi_allocation_records_close(records);
+    return checked && check.stacks > 0 && check.mismatched_stacks == 0 && check.mismatched_categories == 0 && check.stale_categories > 0;
+}
+
+int main() {
+    sgi_setup_alloc_malloc_zone(malloc_create_zone(0, 0));
+    bool passed = run(sgi_allocation_records_backend_splay_tree);
+    passed &= run(sgi_allocation_records_backend_hash_table);
+    printf(passed ? "OK\n" : "FAILED\n");
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,109 @@
+//
+// stack_capture_policy_test.cpp
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+// the capture policy keeps the hottest app frames and always the coldest frame, also when the stack ends in recursion:
+// then the last frame before the recursion frame is the coldest one, kept with the recursion frame following it.
+// the counters of the shortened stacks are added up per thread, a thread adds them every few hundred stacks.
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+#include "sgi_allocate_logging.h"
+
+static const uint32_t kMaxFrameCount = 64;
+static const int kThreadCount = 2;
+static const int kStacksPerThread = 256; // one flush of the counters of a thread
+
+// hot to cold: the two frames of the hook, four app frames, then (x, y) three times.
+static const vm_address_t walked_frames[] = {
+    0x100000000ull, 0x100000004ull,
+    0x100001000ull, 0x100002000ull, 0x100003000ull, 0x100004000ull,
+    0x100005000ull, 0x100006000ull, 0x100005000ull, 0x100006000ull, 0x100005000ull, 0x100006000ull,
+};
+static const uint32_t walked_frame_count = sizeof(walked_frames) / sizeof(walked_frames[0]);
+
+// the two hottest app frames, the coldest frame and the recursion frame it ends.
+static const vm_address_t expected_frames[] = {
+    0x100001000ull, 0x100002000ull, 0x100006000ull, SGI_ALLOCATIONS_RECURSION_FRAME(2, 3),
+};
+static const uint32_t expected_frame_count = sizeof(expected_frames) / sizeof(expected_frames[0]);
+
+extern "C" int backtrace(void **frames, int size) {
+    int count = 0;
+    for (uint32_t i = 0; i < walked_frame_count && count < size; i++) {
+        frames[count++] = (void *)walked_frames[i];
+    }
+    return count;
+}
+
+static void find_stack(vm_address_t addr, uint64_t stackid_and_flags, uint64_t category_and_size, void *context) {
+    *(uint64_t *)context = SGI_ALLOCATIONS_OFFSET(stackid_and_flags);
+}
+
+int main() {
+    snprintf(sgi_records_cache_dir, sizeof(sgi_records_cache_dir), "%s/sgi_stack_capture_policy", getenv("SGI_TEST_RECORDS_DIR"));
+    mkdir(sgi_records_cache_dir, 0755);
+    sgi_allocations_stack_capture_policy = (sgi_stack_capture_policy){2, 0, 2};
+    if (!sgi_prepare_memory_allocate_logging()) {
+        printf("fail to prepare the logging\n");
+        return 1;
+    }
+    sgi_memory_allocate_logging_enabled = true;
+
+    sgi_stack_capture_stats before;
+    sgi_get_stack_capture_stats(&before);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreadCount; t++) {
+        threads.emplace_back([t] {
+            for (int i = 0; i < kStacksPerThread; i++) {
+                uintptr_t p = ((uintptr_t)(t + 1) << 28) + (uintptr_t)i * 16;
+                sgi_allocate_logging(sgi_allocations_type_alloc, 0, 32, 0, p, 0);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    uint64_t stack_id = sgi_vm_invalid_stack_id;
+    for (uint32_t shard = 0; shard < sgi_allocation_records_shard_count(sgi_recording->malloc_records); shard++) {
+        sgi_allocation_records_enumerate_shard(sgi_recording->malloc_records, shard, find_stack, &stack_id);
+    }
+    vm_address_t frames[kMaxFrameCount];
+    uint32_t frame_count = 0;
+    if (stack_id != sgi_vm_invalid_stack_id) {
+        sgi_unwind_stack_from_table_index(sgi_recording->backtrace_records, stack_id, frames, &frame_count, kMaxFrameCount);
+    }
+    bool frames_passed = frame_count == expected_frame_count && memcmp(frames, expected_frames, sizeof(expected_frames)) == 0;
+    printf("recorded stack:");
+    for (uint32_t i = 0; i < frame_count; i++) {
+        printf(" %#llx", (unsigned long long)frames[i]);
+    }
+    printf(" (%s)\n", frames_passed ? "the expected frames" : "FAILED");
+
+    // per stack: a3, a4 and x dropped, 10 frames collapsed to 7.
+    sgi_stack_capture_stats after;
+    sgi_get_stack_capture_stats(&after);
+    uint64_t stacks = kThreadCount * kStacksPerThread;
+    uint64_t shortened = after.stacks_shortened - before.stacks_shortened;
+    uint64_t app_dropped = after.app_frames_dropped - before.app_frames_dropped;
+    uint64_t recursion_saved = after.recursion_frames_saved - before.recursion_frames_saved;
+    bool stats_passed = shortened == stacks && app_dropped == stacks * 3 && recursion_saved == stacks * 3;
+    printf("stats: %llu stacks shortened, %llu app frames dropped, %llu recursion frames saved (expected %llu, %llu, %llu)\n",
+           (unsigned long long)shortened, (unsigned long long)app_dropped, (unsigned long long)recursion_saved,
+           (unsigned long long)stacks, (unsigned long long)stacks * 3, (unsigned long long)stacks * 3);
+
+    sgi_memory_allocate_logging_enabled = false;
+    sgi_clear_memory_allocate_logging();
+    bool passed = frames_passed && stats_passed;
+    printf(passed ? "OK\n" : "FAILED\n");
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,143 @@
+//
+// uniquing_table_concurrency_test.cpp
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+// threads enter overlapping stacks into a tiny uniquing table without a lock, as sgi_enter_frames_into_table_lock_free
+// does. a full table is expanded under a lock meanwhile, the mapping moves at times. every id returned must unwind to
+// the frames it was entered with, right away and once all the threads are done.
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "sgi_backtrace_uniquing_table.h"
+#include "sgi_inner_allocate.h"
+
+static const int kThreadCount = 8;
+static const int kStacksPerThread = 100000;
+static const int kStackPoolSize = 60000;
+static const uint32_t kMaxFrameCount = 64;
+
+static std::atomic<sgi_backtrace_uniquing_table *> table;
+static std::mutex expand_lock;
+static std::atomic<int> expansions;
+static std::atomic<int> moves;
+static std::atomic<int> failures;
+
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    return x ^ (x >> 33);
+}
+
+// the frames of stack `k`, cold frames are shared by many stacks so the table has parents to race on.
+static uint32_t stack_of(int k, vm_address_t *frames) {
+    uint32_t count = 8 + (uint32_t)(mix(k) % 23);
+    for (uint32_t d = 0; d < count; d++) {
+        int shift = d < 12 ? 12 - d : 0;
+        frames[count - 1 - d] = 0x100000000ull + 4 * (mix(((uint64_t)d << 40) ^ (uint64_t)(k >> shift)) & 0xFFFFFFF);
+    }
+    return count;
+}
+
+static uint64_t enter(vm_address_t *frames, uint32_t count) {
+    uint64_t stack_id = 0;
+    if (sgi_enter_frames_in_table(table.load(), &stack_id, frames, count)) {
+        return stack_id;
+    }
+
+    std::lock_guard<std::mutex> guard(expand_lock);
+    sgi_backtrace_uniquing_table *current = table.load();
+    if (sgi_enter_frames_in_table(current, &stack_id, frames, count)) {
+        return stack_id; // expanded by another thread meanwhile
+    }
+    sgi_backtrace_uniquing_table *expanded = sgi_expand_uniquing_table(current);
+    assert(expanded != NULL);
+    expansions++;
+    if (expanded != current) {
+        moves++;
+    }
+    table.store(expanded);
+    bool entered = sgi_enter_frames_in_table(expanded, &stack_id, frames, count);
+    assert(entered);
+    return stack_id;
+}
+
+static bool unwinds_to(uint64_t stack_id, int k) {
+    vm_address_t frames[kMaxFrameCount];
+    vm_address_t unwound[kMaxFrameCount];
+    uint32_t unwound_count = 0;
+    uint32_t count = stack_of(k, frames);
+    sgi_unwind_stack_from_table_index(table.load(), stack_id, unwound, &unwound_count, kMaxFrameCount);
+    return unwound_count == count && memcmp(frames, unwound, count * sizeof(vm_address_t)) == 0;
+}
+
+static std::vector<std::pair<int, uint64_t>> entered[kThreadCount];
+
+static void worker(int t) {
+    vm_address_t frames[kMaxFrameCount];
+    for (int i = 0; i < kStacksPerThread; i++) {
+        int k = (int)(mix(t * 0x1000000ull + i) % kStackPoolSize);
+        uint64_t stack_id = enter(frames, stack_of(k, frames));
+        if (!unwinds_to(stack_id, k)) {
+            failures++;
+        }
+        entered[t].push_back(std::make_pair(k, stack_id));
+    }
+}
+
+static bool run(sgi_uniquing_table_probing probing) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/sgi_uniquing_table_concurrency", getenv("SGI_TEST_RECORDS_DIR"));
+    table = sgi_create_uniquing_table(path, 2, probing, NULL);
+    if (table.load() == NULL) {
+        printf("probing %d: fail to create the table\n", (int)probing);
+        return false;
+    }
+    expansions = 0;
+    moves = 0;
+    failures = 0;
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreadCount; t++) {
+        entered[t].clear();
+        threads.emplace_back(worker, t);
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    for (int t = 0; t < kThreadCount; t++) {
+        for (auto &stack : entered[t]) {
+            if (!unwinds_to(stack.second, stack.first)) {
+                failures++;
+            }
+        }
+    }
+    printf("probing %d: %d threads entered %d stacks, %d expansions (%d moves), %d wrong ids\n", (int)probing, kThreadCount,
+           kThreadCount * kStacksPerThread, expansions.load(), moves.load(), failures.load());
+    sgi_destroy_uniquing_table(table.load());
+    return failures == 0 && expansions > 0;
+}
+
+int main() {
+    sgi_setup_alloc_malloc_zone(malloc_create_zone(0, 0));
+    bool passed = true;
+    passed &= run(sgi_uniquing_table_probing_modulo);
+    passed &= run(sgi_uniquing_table_probing_linear);
+    passed &= run(sgi_uniquing_table_probing_quadratic);
+    printf(passed ? "OK\n" : "FAILED\n");
+    return passed ? 0 : 1;
+}
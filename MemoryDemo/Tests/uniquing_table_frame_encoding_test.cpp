@@ -0,0 +1,101 @@
+//
+// uniquing_table_frame_encoding_test.cpp
+// SGIAPMAllocPlugin
+//
+// Created by mademao on 2020/6/2.
+// Copyright © 2020 Sogou. All rights reserved.
+//
+
+// frames entered into a table with and without image relative addresses. a frame a node can hold unwinds to itself,
+// also one outside the images with bit 35 set. the ones a node can't hold unwind to their stored bits and are counted
+// in the table stats. entering a stack twice gives the same id either way.
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sgi_backtrace_uniquing_table.h"
+#include "sgi_inner_allocate.h"
+#include "SGIDyldImagesUtil.h"
+
+static const uint32_t kMaxFrameCount = 64;
+
+typedef struct {
+    vm_address_t pc;
+    vm_address_t unwound_with_images;    // what the frame unwinds to with the images below
+    vm_address_t unwound_without_images; // and in a table without images
+} frame_case;
+
+// images: [0x1A0000000, 0x1A1000000) and [0x1B0000000, 0x1B0800000), 24MB of concatenated ranges.
+static const frame_case frame_cases[] = {
+    {0x1A0000100ull, 0x1A0000100ull, 0x1A0000100ull},     // in the first image
+    {0x1B07FFFFCull, 0x1B07FFFFCull, 0x1B07FFFFCull},     // at the end of the second image
+    {0x280004000ull, 0x280004000ull, 0x280004000ull},     // outside the images, below bit 35
+    {0x900000010ull, 0x900000010ull, 0x900000010ull},     // outside the images, bit 35 set, kept verbatim
+    {0xFC0000020ull, 0xFC0000020ull, 0xFC0000020ull},     // outside the images, the top of 36 bits
+    {0x800000040ull, 0x000000040ull, 0x800000040ull},     // would read as an image offset, truncated with images only
+    {0x1000000080ull, 0x000000080ull, 0x000000080ull},    // above 36 bits, truncated either way
+};
+static const uint32_t frame_case_count = sizeof(frame_cases) / sizeof(frame_cases[0]);
+
+static bool run(bool with_images) {
+    sgi_dyld_image_item items[2];
+    memset(items, 0, sizeof(items));
+    items[0].imageBeginAddr = 0x1A0000000ull;
+    items[0].imageEndAddr = 0x1A1000000ull - 1; // inclusive
+    items[1].imageBeginAddr = 0x1B0000000ull;
+    items[1].imageEndAddr = 0x1B0800000ull - 1;
+    sgi_dyld_image_info images;
+    memset(&images, 0, sizeof(images));
+    images.allImageInfo = items;
+    images.imageInfoCount = 2;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/sgi_uniquing_table_frame_encoding", getenv("SGI_TEST_RECORDS_DIR"));
+    sgi_backtrace_uniquing_table *table = sgi_create_uniquing_table(path, 4, sgi_uniquing_table_probing_quadratic, with_images ? &images : NULL);
+    if (table == NULL) {
+        printf("fail to create the table\n");
+        return false;
+    }
+
+    vm_address_t frames[kMaxFrameCount];
+    for (uint32_t i = 0; i < frame_case_count; i++) {
+        frames[i] = frame_cases[i].pc;
+    }
+    uint64_t first_id = 0;
+    uint64_t second_id = 0;
+    bool entered = sgi_enter_frames_in_table(table, &first_id, frames, frame_case_count) &&
+                   sgi_enter_frames_in_table(table, &second_id, frames, frame_case_count);
+
+    vm_address_t unwound[kMaxFrameCount];
+    uint32_t unwound_count = 0;
+    sgi_unwind_stack_from_table_index(table, first_id, unwound, &unwound_count, kMaxFrameCount);
+    uint32_t wrong = 0;
+    for (uint32_t i = 0; i < frame_case_count; i++) {
+        vm_address_t expected = with_images ? frame_cases[i].unwound_with_images : frame_cases[i].unwound_without_images;
+        if (i >= unwound_count || unwound[i] != expected) {
+            printf("  frame %#llx unwinds to %#llx, expected %#llx\n", (unsigned long long)frame_cases[i].pc,
+                   (unsigned long long)(i < unwound_count ? unwound[i] : 0), (unsigned long long)expected);
+            wrong++;
+        }
+    }
+
+    sgi_uniquing_table_stats stats;
+    sgi_uniquing_table_get_stats(table, &stats);
+    uint64_t expected_truncated = with_images ? 4 : 2; // two frames each time the stack is entered
+    printf("%s: %u of %u frames wrong, %llu truncated (expected %llu), ids %s\n", with_images ? "with images" : "without images",
+           wrong, frame_case_count, (unsigned long long)stats.truncated_frames, (unsigned long long)expected_truncated,
+           first_id == second_id ? "equal" : "differ");
+    sgi_destroy_uniquing_table(table);
+    return entered && unwound_count == frame_case_count && wrong == 0 && stats.truncated_frames == expected_truncated &&
+           first_id == second_id;
+}
+
+int main() {
+    sgi_setup_alloc_malloc_zone(malloc_create_zone(0, 0));
+    bool passed = true;
+    passed &= run(true);
+    passed &= run(false);
+    printf(passed ? "OK\n" : "FAILED\n");
+    return passed ? 0 : 1;
+}